@@ -1,3 +1,180 @@
-fn main() {
-    println!("Hello, world!");
+use std::path::PathBuf;
+use std::process::ExitCode;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use vigilant_canine_proto::{Alert, Client, Metrics, Request, Response, DEFAULT_SOCKET_PATH};
+
+const USAGE: &str = "usage: vigilant-canine-cli [--socket PATH] <status | alerts [COUNT] [--since AGE] | metrics | reload>
+  AGE is a number with a unit: 90s, 30m, 12h, 7d";
+const DEFAULT_ALERT_COUNT: u32 = 20;
+
+fn main() -> ExitCode {
+    let mut args = std::env::args().skip(1).peekable();
+    let mut socket = PathBuf::from(DEFAULT_SOCKET_PATH);
+    if args.peek().map(String::as_str) == Some("--socket") {
+        args.next();
+        match args.next() {
+            Some(path) => socket = PathBuf::from(path),
+            None => return usage(),
+        }
+    }
+    let request = match args.next().as_deref() {
+        Some("status") if args.peek().is_none() => Request::Status,
+        Some("reload") if args.peek().is_none() => Request::Reload,
+        Some("metrics") if args.peek().is_none() => Request::Metrics,
+        Some("alerts") => {
+            let (mut limit, mut since) = (DEFAULT_ALERT_COUNT, None);
+            while let Some(arg) = args.next() {
+                let parsed = match arg.as_str() {
+                    "--since" => args.next().and_then(|age| parse_age(&age)).map(|age| since = Some(age)),
+                    count => count.parse().ok().map(|count| limit = count),
+                };
+                if parsed.is_none() {
+                    return usage();
+                }
+            }
+            match since {
+                Some(age) => {
+                    let now_ms = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |now| now.as_millis() as u64);
+                    Request::AlertsSince { since_ms: now_ms.saturating_sub(age.saturating_mul(1000)), limit }
+                }
+                None => Request::RecentAlerts { limit },
+            }
+        }
+        _ => return usage(),
+    };
+
+    let response = Client::connect(&socket).and_then(|mut client| client.request(&request));
+    match response {
+        Ok(Response::Status(status)) => {
+            println!("version:   {}", status.version);
+            println!("uptime:    {}", format_duration(status.uptime_secs));
+            println!("baseline:  {} files", status.baseline_files);
+            println!("rules:     {}", status.rules);
+            println!("blocking:  {}", if status.blocking { "enabled" } else { "disabled" });
+            println!("alerts:    {}", status.alerts);
+            println!("exposure:  {} listening, {} connected", status.listeners, status.connections);
+        }
+        Ok(Response::Alerts { alerts, limit }) => {
+            // Oldest first, so the newest ends up next to the prompt.
+            for alert in alerts.iter().rev() {
+                print_alert(alert);
+            }
+            let requested = match request {
+                Request::RecentAlerts { limit } | Request::AlertsSince { limit, .. } => limit,
+                _ => limit,
+            };
+            if limit < requested && alerts.len() == limit as usize {
+                eprintln!("vigilant-canine-cli: only the newest {limit} alerts; the daemon sends no more at a time");
+            }
+        }
+        Ok(Response::Reloading) => println!("reloading rules and reputation lists"),
+        Ok(Response::Metrics(metrics)) => print_metrics(&metrics),
+        Ok(Response::Error(message)) => {
+            eprintln!("vigilant-canine-cli: daemon: {message}");
+            return ExitCode::FAILURE;
+        }
+        Err(err) => {
+            eprintln!("vigilant-canine-cli: {}: {err}", socket.display());
+            return ExitCode::FAILURE;
+        }
+    }
+    ExitCode::SUCCESS
+}
+
+fn usage() -> ExitCode {
+    eprintln!("{USAGE}");
+    ExitCode::FAILURE
+}
+
+fn print_alert(alert: &Alert) {
+    let time = format_time(alert.time_ms / 1000);
+    let repeats = match alert.count {
+        1 => String::new(),
+        count => format!(" ({count} times until {})", format_time(alert.last_ms / 1000)),
+    };
+    match alert.addr {
+        Some(addr) => println!("{time} {:<8} {:<24} {} (from {addr}){repeats}", alert.severity, alert.source, alert.message),
+        None => println!("{time} {:<8} {:<24} {}{repeats}", alert.severity, alert.source, alert.message),
+    }
+}
+
+fn print_metrics(metrics: &Metrics) {
+    let secs = |us: u64| us as f64 / 1e6;
+    println!("uptime:    {}", format_duration(metrics.uptime_secs));
+    println!("cpu:       {:.1}s user, {:.1}s system", secs(metrics.cpu_user_us), secs(metrics.cpu_system_us));
+    println!("memory:    {} KiB peak", metrics.max_rss_kib);
+    println!("wakeups:   {}", metrics.wakeups);
+    for counter in &metrics.counters {
+        println!("{:<10} {}", format!("{}:", counter.name), counter.value);
+    }
+    // Counts and totals of the stages are estimated from a sample of the items.
+    println!();
+    println!("{:<12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}", "stage", "items", "total", "p50", "p90", "p99", "max");
+    for stage in &metrics.stages {
+        println!(
+            "{:<12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}",
+            stage.name,
+            stage.count,
+            format_nanos(stage.sum),
+            format_nanos(stage.p50),
+            format_nanos(stage.p90),
+            format_nanos(stage.p99),
+            format_nanos(stage.max)
+        );
+    }
+    println!();
+    println!("{:<12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}", "queue", "wakeups", "items", "p50", "p90", "p99", "max");
+    for queue in &metrics.queues {
+        println!(
+            "{:<12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}",
+            queue.name, queue.count, queue.sum, queue.p50, queue.p90, queue.p99, queue.max
+        );
+    }
+}
+
+fn format_nanos(nanos: u64) -> String {
+    match nanos {
+        0..=9_999 => format!("{nanos}ns"),
+        10_000..=9_999_999 => format!("{}us", nanos / 1_000),
+        10_000_000..=9_999_999_999 => format!("{}ms", nanos / 1_000_000),
+        _ => format!("{}s", nanos / 1_000_000_000),
+    }
+}
+
+/// Parses an age such as `30m` into seconds.
+fn parse_age(age: &str) -> Option<u64> {
+    let unit = match age.as_bytes().last()? {
+        b's' => 1,
+        b'm' => 60,
+        b'h' => 3600,
+        b'd' => 86400,
+        _ => return None,
+    };
+    age[..age.len() - 1].parse::<u64>().ok()?.checked_mul(unit)
+}
+
+fn format_duration(secs: u64) -> String {
+    let (days, hours, minutes) = (secs / 86400, secs / 3600 % 24, secs / 60 % 60);
+    if days > 0 {
+        format!("{days}d {hours}h {minutes}m")
+    } else {
+        format!("{hours}h {minutes}m {}s", secs % 60)
+    }
+}
+
+/// Formats Unix time as a UTC timestamp.
+fn format_time(secs: u64) -> String {
+    // Days to civil date, after Howard Hinnant's `civil_from_days`.
+    let days = (secs / 86400) as i64 + 719_468;
+    let era = days.div_euclid(146_097);
+    let day_of_era = days.rem_euclid(146_097);
+    let year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146_096) / 365;
+    let day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    let mp = (5 * day_of_year + 2) / 153;
+    let day = day_of_year - (153 * mp + 2) / 5 + 1;
+    let month = if mp < 10 { mp + 3 } else { mp - 9 };
+    let year = year_of_era + era * 400 + (month <= 2) as i64;
+    let time = secs % 86400;
+    format!("{year:04}-{month:02}-{day:02} {:02}:{:02}:{:02}", time / 3600, time / 60 % 60, time % 60)
 }
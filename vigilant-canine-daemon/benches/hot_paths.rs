@@ -0,0 +1,326 @@
+//! Benchmarks of the daemon's hot paths, checked against recorded numbers.
+//!
+//! `cargo bench` runs every benchmark and compares its median time per iteration with
+//! `benches/baseline.txt`, failing if one got slower than its tolerance allows.
+//! `cargo bench --bench hot_paths -- --save-baseline` records the current numbers instead; do
+//! that on the machine the comparisons will run on, as the numbers mean nothing elsewhere. Any
+//! other argument runs only the benchmarks whose names contain it.
+//!
+//! Each benchmark is run in batches sized to take about `BATCH_TIME`, and the median batch is
+//! reported, which keeps a stray page fault or preemption from moving the result.
+
+use std::fs;
+use std::hint::black_box;
+use std::net::{IpAddr, Ipv4Addr};
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{mpsc, Arc};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use vigilant_canine_daemon::detect::reputation::Reputation;
+use vigilant_canine_daemon::fim::baseline::{Baseline, BaselineBuilder, Entry, FileMeta};
+use vigilant_canine_daemon::fim::hash::{digest_path, HashAlgo};
+use vigilant_canine_daemon::ipc::Server;
+use vigilant_canine_daemon::logs::syslog;
+use vigilant_canine_daemon::reactor::{Reactor, Token};
+use vigilant_canine_daemon::store::{EventStore, StoreConfig};
+use vigilant_canine_daemon::timer::TimerWheel;
+use vigilant_canine_proto::{Alert, Client, Request, Response, Severity, Status};
+use vigilant_canine_rules::{RuleSet, DEFAULT_RULES};
+
+const BASELINE: &str = concat!(env!("CARGO_MANIFEST_DIR"), "/benches/baseline.txt");
+const BATCH_TIME: Duration = Duration::from_millis(20);
+const BATCHES: usize = 15;
+/// How much slower than recorded a benchmark may get, unless its baseline line says otherwise.
+const DEFAULT_TOLERANCE: f64 = 0.25;
+
+const AUTH_LINE: &[u8] = b"Oct 15 23:45:41 host sshd[4242]: Failed password for invalid user admin from 203.0.113.7 port 52314 ssh2";
+const OTHER_LINE: &[u8] = b"Oct 15 23:45:41 host systemd[1]: Started session-42.scope - Session 42 of User alice.";
+
+fn main() -> ExitCode {
+    let args: Vec<String> = std::env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let save = args.iter().any(|arg| arg == "--save-baseline");
+    let filters: Vec<&str> = args.iter().filter(|arg| !arg.starts_with("--")).map(String::as_str).collect();
+    let dir = std::env::temp_dir().join(format!("vigilant-canine-bench-{}", std::process::id()));
+    fs::create_dir_all(&dir).expect("cannot create scratch directory");
+
+    let mut bench = Bench { filters, results: Vec::new() };
+    log_lines(&mut bench);
+    hashing(&mut bench, &dir);
+    baseline_lookup(&mut bench, &dir);
+    event_store(&mut bench, &dir);
+    reputation(&mut bench, &dir);
+    timers(&mut bench);
+    ipc(&mut bench, &dir);
+    let _ = fs::remove_dir_all(&dir);
+
+    if save {
+        return match save_baseline(&bench.results) {
+            Ok(()) => {
+                println!("saved {} results to {BASELINE}", bench.results.len());
+                ExitCode::SUCCESS
+            }
+            Err(err) => {
+                eprintln!("cannot save {BASELINE}: {err}");
+                ExitCode::FAILURE
+            }
+        };
+    }
+    compare(&bench.results)
+}
+
+struct Bench<'a> {
+    filters: Vec<&'a str>,
+    /// (name, median nanoseconds per iteration)
+    results: Vec<(&'static str, f64)>,
+}
+
+impl Bench<'_> {
+    fn wants(&self, name: &str) -> bool {
+        self.filters.is_empty() || self.filters.iter().any(|filter| name.contains(filter))
+    }
+
+    fn run<F: FnMut()>(&mut self, name: &'static str, mut iteration: F) {
+        if !self.wants(name) {
+            return;
+        }
+        // Double the batch until it takes long enough to time reliably.
+        let mut iterations = 1u64;
+        loop {
+            let start = Instant::now();
+            (0..iterations).for_each(|_| iteration());
+            if start.elapsed() >= BATCH_TIME / 4 || iterations >= 1 << 30 {
+                break;
+            }
+            iterations *= 2;
+        }
+        let mut batches: Vec<f64> = (0..BATCHES)
+            .map(|_| {
+                let start = Instant::now();
+                (0..iterations).for_each(|_| iteration());
+                start.elapsed().as_nanos() as f64 / iterations as f64
+            })
+            .collect();
+        batches.sort_by(f64::total_cmp);
+        let median = batches[BATCHES / 2];
+        println!("{name:<28} {:>12} /iter", format_ns(median));
+        self.results.push((name, median));
+    }
+}
+
+fn log_lines(bench: &mut Bench) {
+    bench.run("syslog_split", || {
+        black_box(syslog::split(black_box(AUTH_LINE)));
+    });
+    let rules = vigilant_canine_rules::parse(DEFAULT_RULES).and_then(RuleSet::compile).expect("default rules compile");
+    let mut scanner = rules.scanner();
+    let mut matches = Vec::new();
+    for (name, line) in [("rules_scan_match", AUTH_LINE), ("rules_scan_miss", OTHER_LINE)] {
+        let (program, message) = syslog::split(line);
+        bench.run(name, || {
+            rules.scan(&mut scanner, program, black_box(message), &mut matches);
+            matches.clear();
+        });
+    }
+}
+
+fn hashing(bench: &mut Bench, dir: &Path) {
+    let path = dir.join("hash-64k");
+    fs::write(&path, (0..64 * 1024).map(|i| (i * 7 % 251) as u8).collect::<Vec<u8>>()).expect("cannot write scratch file");
+    let meta = fs::symlink_metadata(&path).expect("cannot stat scratch file");
+    bench.run("hash_64k_sha256", || {
+        black_box(digest_path(&path, &meta, HashAlgo::Sha256).expect("cannot hash scratch file"));
+    });
+}
+
+fn baseline_lookup(bench: &mut Bench, dir: &Path) {
+    if !bench.wants("baseline_get") {
+        return;
+    }
+    const FILES: usize = 100_000;
+    let file_path = |i: usize| PathBuf::from(format!("/usr/lib/package-{}/lib/file-{i}.so", i % 997));
+    let mut builder = BaselineBuilder::new().digest_algo(HashAlgo::Sha256.id());
+    for i in 0..FILES {
+        builder.push(Entry { path: file_path(i), meta: FileMeta::default(), digest: [i as u8; 32] });
+    }
+    let path = dir.join("baseline");
+    builder.write(&path).expect("cannot write baseline");
+    let baseline = Baseline::open(&path).expect("cannot open baseline");
+    let lookups: Vec<PathBuf> = (0..1024).map(|i| file_path(i * 7919 % FILES)).collect();
+    let mut next = 0;
+    bench.run("baseline_get", || {
+        black_box(baseline.get(&lookups[next % lookups.len()]));
+        next += 1;
+    });
+}
+
+fn event_store(bench: &mut Bench, dir: &Path) {
+    if !bench.wants("store_") {
+        return;
+    }
+    let mut store = EventStore::open(&dir.join("events"), StoreConfig::default()).expect("cannot open event store");
+    let alert = |time_ms| {
+        let addr = Some(IpAddr::V4(Ipv4Addr::new(203, 0, 113, 7)));
+        Alert::new(time_ms, Severity::Low, "sshd-failed-password".into(), addr, String::from_utf8_lossy(AUTH_LINE).into_owned())
+    };
+    let mut time_ms = 1_700_000_000_000;
+    bench.run("store_append", || {
+        time_ms += 1;
+        store.append(&alert(time_ms)).expect("cannot append alert");
+    });
+    let mut out = Vec::new();
+    bench.run("store_query_recent_20", || {
+        store.query(0, 20, &mut out).expect("cannot query alerts");
+        out.clear();
+    });
+}
+
+fn reputation(bench: &mut Bench, dir: &Path) {
+    if !bench.wants("reputation_") {
+        return;
+    }
+    let lists = dir.join("reputation");
+    fs::create_dir_all(&lists).expect("cannot create list directory");
+    let mut state = 0x9e37_79b9_u32;
+    let mut random = move || {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        state
+    };
+    let mut text = String::new();
+    let mut listed = Vec::new();
+    for i in 0..1_000_000 {
+        let addr = Ipv4Addr::from(random());
+        text.push_str(&format!("{addr}{}\n", if i % 10 == 0 { "/28" } else { "" }));
+        listed.push(IpAddr::V4(addr));
+    }
+    fs::write(lists.join("list.netset"), text).expect("cannot write list");
+    let reputation = Reputation::load(&lists, &dir.join("reputation.compiled")).expect("cannot compile lists");
+    let unlisted: Vec<IpAddr> = (0..4096).map(|_| IpAddr::V4(Ipv4Addr::from(random()))).collect();
+    let mut next = 0;
+    bench.run("reputation_lookup_unlisted", || {
+        black_box(reputation.contains(unlisted[next % unlisted.len()]));
+        next += 1;
+    });
+    bench.run("reputation_lookup_listed", || {
+        black_box(reputation.contains(listed[next % listed.len()]));
+        next += 7919;
+    });
+}
+
+fn timers(bench: &mut Bench) {
+    let mut wheel = TimerWheel::new(Duration::from_millis(1)).expect("cannot create timer wheel");
+    let mut key = 0u32;
+    bench.run("timer_schedule_cancel", || {
+        key = key.wrapping_add(1);
+        wheel.schedule(key % 64, Duration::from_millis(u64::from(key % 10_000)));
+        wheel.cancel((key + 32) % 64);
+    });
+}
+
+/// A status request over the socket to a server running on its own thread, as the CLI does it.
+fn ipc(bench: &mut Bench, dir: &Path) {
+    if !bench.wants("ipc_") {
+        return;
+    }
+    let path = dir.join("socket");
+    let stop = Arc::new(AtomicBool::new(false));
+    let (bound, ready) = mpsc::channel();
+    let server = {
+        let (path, stop) = (path.clone(), Arc::clone(&stop));
+        thread::spawn(move || {
+            let mut reactor = Reactor::new().expect("cannot create reactor");
+            let mut server = Server::bind(&path, &reactor, Token(0)).expect("cannot bind socket");
+            bound.send(()).expect("benchmark went away");
+            let mut tokens = Vec::new();
+            while !stop.load(Ordering::Relaxed) {
+                tokens.clear();
+                reactor.wait(Some(Duration::from_millis(50)), &mut tokens).expect("cannot wait for events");
+                for &token in &tokens {
+                    server.dispatch(&reactor, token, |_, out| Response::Status(status()).encode(out));
+                }
+            }
+        })
+    };
+    ready.recv().expect("server thread failed");
+    let mut client = Client::connect(&path).expect("cannot connect");
+    bench.run("ipc_status_round_trip", || {
+        black_box(client.request(&Request::Status).expect("request failed"));
+    });
+    stop.store(true, Ordering::Relaxed);
+    server.join().expect("server thread panicked");
+}
+
+fn status() -> Status {
+    Status {
+        version: env!("CARGO_PKG_VERSION").into(),
+        uptime_secs: 1,
+        baseline_files: 1,
+        rules: 1,
+        blocking: false,
+        alerts: 0,
+        listeners: 0,
+        connections: 0,
+    }
+}
+
+/// Checks the results against the recorded baseline. Benchmarks without a recorded number only
+/// get reported.
+fn compare(results: &[(&str, f64)]) -> ExitCode {
+    let baseline = match fs::read_to_string(BASELINE) {
+        Ok(text) => text,
+        Err(err) => {
+            eprintln!("cannot read {BASELINE}: {err}; run with --save-baseline to record one");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut regressions = 0;
+    for line in baseline.lines().map(str::trim).filter(|line| !line.is_empty() && !line.starts_with('#')) {
+        let mut fields = line.split_whitespace();
+        let (Some(name), Some(Ok(recorded))) = (fields.next(), fields.next().map(str::parse::<f64>)) else {
+            eprintln!("malformed baseline line: {line}");
+            return ExitCode::FAILURE;
+        };
+        let tolerance = fields.next().and_then(|percent| percent.strip_suffix('%')?.parse::<f64>().ok()).map_or(DEFAULT_TOLERANCE, |percent| percent / 100.0);
+        let Some(&(_, measured)) = results.iter().find(|(result, _)| *result == name) else {
+            continue;
+        };
+        let change = measured / recorded - 1.0;
+        if change > tolerance {
+            println!("REGRESSION {name}: {} /iter, recorded {} (+{:.0}%, allowed +{:.0}%)", format_ns(measured), format_ns(recorded), change * 100.0, tolerance * 100.0);
+            regressions += 1;
+        }
+    }
+    if regressions > 0 {
+        return ExitCode::FAILURE;
+    }
+    println!("no regressions against {BASELINE}");
+    ExitCode::SUCCESS
+}
+
+/// Rewrites the recorded numbers, keeping comments and the tolerances already set.
+fn save_baseline(results: &[(&str, f64)]) -> std::io::Result<()> {
+    let old = fs::read_to_string(BASELINE).unwrap_or_default();
+    let mut text: String = old.lines().take_while(|line| line.starts_with('#') || line.trim().is_empty()).map(|line| format!("{line}\n")).collect();
+    for (name, measured) in results {
+        let tolerance = old
+            .lines()
+            .map(|line| line.split_whitespace().collect::<Vec<_>>())
+            .find(|fields| fields.first() == Some(name))
+            .and_then(|fields| fields.get(2).map(|tolerance| format!(" {tolerance}")))
+            .unwrap_or_default();
+        text.push_str(&format!("{name} {measured:.1}{tolerance}\n"));
+    }
+    fs::write(BASELINE, text)
+}
+
+fn format_ns(ns: f64) -> String {
+    match ns {
+        ns if ns >= 1_000_000.0 => format!("{:.2} ms", ns / 1_000_000.0),
+        ns if ns >= 1_000.0 => format!("{:.2} µs", ns / 1_000.0),
+        ns => format!("{ns:.1} ns"),
+    }
+}
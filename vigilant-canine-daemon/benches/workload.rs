@@ -0,0 +1,448 @@
+//! Synthetic load for a running daemon, to find the event rate at which it falls behind.
+//!
+//! Point it at a daemon running in a sandbox (a mount namespace with its own `/etc`, `/var/log`
+//! and `/run`), never at a production host: it writes failed logins into the auth log and churns
+//! files under a watched root.
+//!
+//! ```text
+//! cargo bench -p vigilant-canine-daemon --bench workload -- --auth 5000 --files 100 --ramp
+//! ```
+//!
+//! Rates are events per second:
+//! - `--auth`: sshd failed-password lines appended to `--log`, from a pool of addresses in
+//!   198.18.0.0/15 small enough that brute-force detection fires too.
+//! - `--files`: files created, rewritten and removed in `--dir`, which has to be under one of
+//!   the roots the daemon watches.
+//! - `--execs`: runs of `/bin/true`, for the exec monitor.
+//! - `--sockets`: localhost listeners opened and connected to; the last few stay open long
+//!   enough for the listener scans to see them.
+//!
+//! How far behind the daemon is comes from the auth lines: each batch of them ends in a root
+//! login carrying the number of the batch's last line, and the newest of those in the alert
+//! history tells which line the daemon got to. Root logins are high severity, so the daemon never
+//! sheds them however many failed logins it does not record, and each comes from an address of
+//! its own, so none is collapsed into a count of repeats either. A thread of its own
+//! asks, so a daemon slow to answer does not slow down the load. One line a second is written for
+//! that whatever `--auth` says, so the daemon has to be following `--log` rather than the
+//! journal (in the sandbox, bind-mount `/dev/null` over libsystemd). With `--ramp`, every rate doubles after each step of `--duration`
+//! until the daemon ends a step more than `MAX_LAG` behind or cannot catch up afterwards.
+
+use std::collections::VecDeque;
+use std::fmt::Write as _;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::net::{Ipv4Addr, Ipv6Addr, TcpListener, TcpStream};
+use std::path::PathBuf;
+use std::process::{Child, Command, ExitCode, Stdio};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use vigilant_canine_proto::{Client, Request, Response, DEFAULT_SOCKET_PATH};
+
+const USAGE: &str = "usage: workload [--socket PATH] [--log PATH] [--dir PATH] [--duration SECS] [--ramp]
+                [--auth RATE] [--files RATE] [--execs RATE] [--sockets RATE]
+  RATE is events per second";
+const DEFAULT_LOG: &str = "/var/log/auth.log";
+const DEFAULT_DIR: &str = "/etc/vigilant-canine-workload";
+const DEFAULT_DURATION: Duration = Duration::from_secs(10);
+const TICK: Duration = Duration::from_millis(10);
+const OBSERVE_INTERVAL: Duration = Duration::from_millis(100);
+const REPORT_INTERVAL: Duration = Duration::from_secs(1);
+/// How far behind the daemon may be at the end of a step and still count as keeping up.
+const MAX_LAG: Duration = Duration::from_secs(2);
+/// How long the daemon gets to catch up after a step.
+const DRAIN_TIMEOUT: Duration = Duration::from_secs(30);
+/// Enough recent alerts that brute-force and file alerts in between do not hide the newest line.
+const RECENT_ALERTS: u32 = 256;
+/// Ends the root login lines, followed by a line number.
+const MARKER: &str = " workload ";
+const ADDRESSES: u64 = 4096;
+const FILE_SLOTS: u64 = 64;
+const OPEN_LISTENERS: usize = 32;
+
+#[derive(Debug, Clone, Copy, Default)]
+struct Rates {
+    auth: f64,
+    files: f64,
+    execs: f64,
+    sockets: f64,
+}
+
+impl Rates {
+    fn scaled(self, factor: f64) -> Rates {
+        Rates { auth: self.auth * factor, files: self.files * factor, execs: self.execs * factor, sockets: self.sockets * factor }
+    }
+}
+
+struct Options {
+    socket: PathBuf,
+    log: PathBuf,
+    dir: PathBuf,
+    duration: Duration,
+    ramp: bool,
+    rates: Rates,
+}
+
+fn main() -> ExitCode {
+    let Some(options) = parse_args() else {
+        eprintln!("{USAGE}");
+        return ExitCode::FAILURE;
+    };
+    let daemon = match Client::connect(&options.socket) {
+        Ok(client) => Observer::start(client, options.socket.clone()),
+        Err(err) => {
+            eprintln!("workload: {}: {err}", options.socket.display());
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut load = match Load::open(&options) {
+        Ok(load) => load,
+        Err(err) => {
+            eprintln!("workload: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let mut kept_up = None;
+    let mut rates = options.rates;
+    let result = loop {
+        println!(
+            "step: {:.0} auth lines, {:.0} file changes, {:.0} execs, {:.0} sockets per second",
+            rates.auth, rates.files, rates.execs, rates.sockets
+        );
+        let behind = match load.run(&daemon, rates, options.duration) {
+            Ok(lag) if lag > MAX_LAG => Some(format!("{:.1}s behind at the end of the step", lag.as_secs_f64())),
+            Ok(_) => match load.drain(&daemon) {
+                Ok(Some(drained)) => {
+                    println!("caught up {:.1}s after the step", drained.as_secs_f64());
+                    None
+                }
+                Ok(None) => Some(format!("still behind {}s after the step", DRAIN_TIMEOUT.as_secs())),
+                Err(err) => break Err(err),
+            },
+            Err(err) => break Err(err),
+        };
+        if let Some(behind) = behind {
+            println!("fell behind: {behind}");
+            break Ok(false);
+        }
+        kept_up = Some(rates);
+        if !options.ramp {
+            break Ok(true);
+        }
+        rates = rates.scaled(2.0);
+    };
+    load.close(&options);
+    daemon.stop();
+
+    match result {
+        Ok(done) => {
+            if let (true, Some(rates)) = (options.ramp, kept_up) {
+                println!(
+                    "kept up with {:.0} auth lines, {:.0} file changes, {:.0} execs, {:.0} sockets per second",
+                    rates.auth, rates.files, rates.execs, rates.sockets
+                );
+            }
+            // Ramping always ends with the daemon behind; that is the point.
+            if done || options.ramp {
+                ExitCode::SUCCESS
+            } else {
+                ExitCode::FAILURE
+            }
+        }
+        Err(err) => {
+            eprintln!("workload: {err}");
+            ExitCode::FAILURE
+        }
+    }
+}
+
+fn parse_args() -> Option<Options> {
+    let mut options = Options {
+        socket: PathBuf::from(DEFAULT_SOCKET_PATH),
+        log: PathBuf::from(DEFAULT_LOG),
+        dir: PathBuf::from(DEFAULT_DIR),
+        duration: DEFAULT_DURATION,
+        ramp: false,
+        rates: Rates::default(),
+    };
+    // Cargo passes `--bench` to every bench target.
+    let mut args = std::env::args().skip(1).filter(|arg| arg != "--bench");
+    while let Some(arg) = args.next() {
+        if arg == "--ramp" {
+            options.ramp = true;
+            continue;
+        }
+        let value = args.next()?;
+        match arg.as_str() {
+            "--socket" => options.socket = PathBuf::from(value),
+            "--log" => options.log = PathBuf::from(value),
+            "--dir" => options.dir = PathBuf::from(value),
+            "--duration" => options.duration = Duration::from_secs(value.parse().ok().filter(|&secs| secs > 0)?),
+            "--auth" => options.rates.auth = parse_rate(&value)?,
+            "--files" => options.rates.files = parse_rate(&value)?,
+            "--execs" => options.rates.execs = parse_rate(&value)?,
+            "--sockets" => options.rates.sockets = parse_rate(&value)?,
+            _ => return None,
+        }
+    }
+    Some(options)
+}
+
+fn parse_rate(rate: &str) -> Option<f64> {
+    rate.parse().ok().filter(|rate: &f64| rate.is_finite() && *rate >= 0.0)
+}
+
+/// The generators and what they have done so far.
+struct Load {
+    log: File,
+    dir: PathBuf,
+    text: String,
+    lines: u64,
+    /// The last line of each batch the daemon has not been seen to finish yet, with the time the
+    /// batch was written.
+    pending: VecDeque<(u64, Instant)>,
+    file_changes: u64,
+    children: Vec<Child>,
+    sockets: VecDeque<(TcpListener, TcpStream)>,
+}
+
+impl Load {
+    fn open(options: &Options) -> io::Result<Load> {
+        let log = OpenOptions::new().create(true).append(true).open(&options.log)?;
+        fs::create_dir_all(&options.dir)?;
+        Ok(Load {
+            log,
+            dir: options.dir.clone(),
+            text: String::new(),
+            lines: 0,
+            pending: VecDeque::new(),
+            file_changes: 0,
+            children: Vec::new(),
+            sockets: VecDeque::new(),
+        })
+    }
+
+    fn close(mut self, options: &Options) {
+        for mut child in self.children.drain(..) {
+            let _ = child.wait();
+        }
+        let _ = fs::remove_dir_all(&options.dir);
+    }
+
+    /// Generates load at `rates` for `duration`, reporting every second what was generated and
+    /// how far behind the daemon is. Returns how far behind it was at the end.
+    fn run(&mut self, daemon: &Observer, rates: Rates, duration: Duration) -> io::Result<Duration> {
+        let start = Instant::now();
+        // Totals for the step, and the totals at the last report.
+        let mut done = [0u64; 4];
+        let mut reported = [0u64; 4];
+        let mut alerts = daemon.seen()?.alerts;
+        let mut next_report = start + REPORT_INTERVAL;
+        while start.elapsed() < duration {
+            let elapsed = start.elapsed().as_secs_f64();
+            let targets = [rates.auth.max(1.0), rates.files, rates.execs, rates.sockets];
+            let due: Vec<u64> = targets.iter().zip(&done).map(|(rate, &done)| ((rate * elapsed) as u64).saturating_sub(done)).collect();
+            self.auth(due[0])?;
+            self.files(due[1])?;
+            self.execs(due[2])?;
+            self.sockets(due[3])?;
+            done.iter_mut().zip(&due).for_each(|(done, due)| *done += due);
+
+            if Instant::now() >= next_report {
+                let seen = daemon.seen()?;
+                let rate = |i: usize| done[i] - reported[i];
+                println!(
+                    "{:>5.1}s  auth {:>7}/s  files {:>6}/s  execs {:>5}/s  sockets {:>5}/s  alerts {:>7}/s  lag {:.2}s",
+                    start.elapsed().as_secs_f64(),
+                    rate(0),
+                    rate(1),
+                    rate(2),
+                    rate(3),
+                    seen.alerts.saturating_sub(alerts),
+                    self.lag(&seen).as_secs_f64()
+                );
+                reported = done;
+                alerts = seen.alerts;
+                next_report += REPORT_INTERVAL;
+            }
+            thread::sleep(TICK);
+        }
+        Ok(self.lag(&daemon.seen()?))
+    }
+
+    /// Waits for the daemon to process every line written so far. Returns how long that took, or
+    /// `None` if it did not within `DRAIN_TIMEOUT`.
+    fn drain(&mut self, daemon: &Observer) -> io::Result<Option<Duration>> {
+        let start = Instant::now();
+        while start.elapsed() < DRAIN_TIMEOUT {
+            self.lag(&daemon.seen()?);
+            if self.pending.is_empty() {
+                return Ok(Some(start.elapsed()));
+            }
+            thread::sleep(OBSERVE_INTERVAL);
+        }
+        Ok(None)
+    }
+
+    /// How long ago the oldest line the daemon has not got to was written.
+    fn lag(&mut self, seen: &Seen) -> Duration {
+        if let Some(newest) = seen.newest_line {
+            while self.pending.front().is_some_and(|&(last, _)| last <= newest) {
+                self.pending.pop_front();
+            }
+        }
+        self.pending.front().map_or(Duration::ZERO, |(_, written)| written.elapsed())
+    }
+
+    fn auth(&mut self, count: u64) -> io::Result<()> {
+        if count == 0 {
+            return Ok(());
+        }
+        self.text.clear();
+        for line in self.lines..self.lines + count {
+            let addr = Ipv4Addr::from(u32::from(Ipv4Addr::new(198, 18, 0, 0)) + (line % ADDRESSES) as u32);
+            let _ = writeln!(
+                self.text,
+                "Jan  1 00:00:00 workload sshd[{}]: Failed password for invalid user workload{line} from {addr} port {} ssh2",
+                1000 + line % 30_000,
+                1024 + line % 60_000
+            );
+        }
+        self.lines += count;
+        let last = self.lines - 1;
+        let addr = Ipv6Addr::new(0x2001, 0xdb8, 0, 0, 0, 0, (last >> 16) as u16, last as u16);
+        let _ = writeln!(self.text, "Jan  1 00:00:00 workload sshd[1]: Accepted publickey for root from {addr} port 22 ssh2{MARKER}{last}");
+        self.pending.push_back((last, Instant::now()));
+        // One write, so the daemon never sees half a line.
+        self.log.write_all(self.text.as_bytes())
+    }
+
+    fn files(&mut self, count: u64) -> io::Result<()> {
+        for change in self.file_changes..self.file_changes + count {
+            let path = self.dir.join(format!("file-{}", change % FILE_SLOTS));
+            match change / FILE_SLOTS % 3 {
+                0 => fs::write(&path, change.to_le_bytes())?,
+                1 => OpenOptions::new().append(true).open(&path)?.write_all(b"changed\n")?,
+                _ => fs::remove_file(&path)?,
+            }
+        }
+        self.file_changes += count;
+        Ok(())
+    }
+
+    fn execs(&mut self, count: u64) -> io::Result<()> {
+        // The previous tick's have long finished; reaping them keeps the process table small.
+        for mut child in self.children.drain(..) {
+            child.wait()?;
+        }
+        for _ in 0..count {
+            self.children.push(Command::new("/bin/true").stdin(Stdio::null()).spawn()?);
+        }
+        Ok(())
+    }
+
+    fn sockets(&mut self, count: u64) -> io::Result<()> {
+        for _ in 0..count {
+            let listener = TcpListener::bind((Ipv4Addr::LOCALHOST, 0))?;
+            let stream = TcpStream::connect(listener.local_addr()?)?;
+            if self.sockets.len() == OPEN_LISTENERS {
+                self.sockets.pop_front();
+            }
+            self.sockets.push_back((listener, stream));
+        }
+        Ok(())
+    }
+}
+
+/// What the daemon was last seen to have done.
+#[derive(Debug, Clone, Copy, Default)]
+struct Seen {
+    /// The newest generated line the daemon is known to have handled.
+    newest_line: Option<u64>,
+    /// Alerts raised since it started.
+    alerts: u64,
+}
+
+/// Asks the daemon what it has done every `OBSERVE_INTERVAL`, on a thread of its own.
+struct Observer {
+    seen: Arc<Mutex<io::Result<Seen>>>,
+    stop: Arc<AtomicBool>,
+    thread: thread::JoinHandle<()>,
+}
+
+impl Observer {
+    fn start(client: Client, socket: PathBuf) -> Observer {
+        let seen = Arc::new(Mutex::new(Ok(Seen::default())));
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread = {
+            let (seen, stop) = (Arc::clone(&seen), Arc::clone(&stop));
+            thread::spawn(move || {
+                let mut client = Some(client);
+                while !stop.load(Ordering::Relaxed) {
+                    let daemon = match client.as_mut() {
+                        Some(daemon) => daemon,
+                        None => match Client::connect(&socket) {
+                            Ok(daemon) => client.insert(daemon),
+                            Err(err) => {
+                                *seen.lock().unwrap() = Err(err);
+                                return;
+                            }
+                        },
+                    };
+                    let previous = seen.lock().unwrap().as_ref().map_or_else(|_| Seen::default(), |seen| *seen);
+                    match observe(daemon, previous) {
+                        Ok(now) => *seen.lock().unwrap() = Ok(now),
+                        // A daemon too busy to answer in time is simply far behind; the answer
+                        // would arrive on the stream later, so start over on a new one.
+                        Err(err) if matches!(err.kind(), io::ErrorKind::WouldBlock | io::ErrorKind::TimedOut) => client = None,
+                        Err(err) => {
+                            *seen.lock().unwrap() = Err(err);
+                            return;
+                        }
+                    }
+                    thread::sleep(OBSERVE_INTERVAL);
+                }
+            })
+        };
+        Observer { seen, stop, thread }
+    }
+
+    fn seen(&self) -> io::Result<Seen> {
+        match &*self.seen.lock().unwrap() {
+            Ok(seen) => Ok(*seen),
+            Err(err) => Err(io::Error::new(err.kind(), format!("daemon: {err}"))),
+        }
+    }
+
+    fn stop(self) {
+        self.stop.store(true, Ordering::Relaxed);
+        let _ = self.thread.join();
+    }
+}
+
+fn observe(daemon: &mut Client, previous: Seen) -> io::Result<Seen> {
+    let newest_line = match daemon.request(&Request::RecentAlerts { limit: RECENT_ALERTS })? {
+        // Newest first.
+        Response::Alerts { alerts, .. } => alerts.iter().find_map(|alert| line_number(&alert.message)).or(previous.newest_line),
+        response => return Err(unexpected(response)),
+    };
+    match daemon.request(&Request::Status)? {
+        Response::Status(status) => Ok(Seen { newest_line, alerts: status.alerts }),
+        response => Err(unexpected(response)),
+    }
+}
+
+fn unexpected(response: Response) -> io::Error {
+    match response {
+        Response::Error(message) => io::Error::other(message),
+        _ => io::Error::new(io::ErrorKind::InvalidData, "unexpected response"),
+    }
+}
+
+/// The line number in a root login line, from the message of the alert raised for it.
+fn line_number(message: &str) -> Option<u64> {
+    message.rsplit_once(MARKER)?.1.parse().ok()
+}
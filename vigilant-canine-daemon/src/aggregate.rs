@@ -0,0 +1,200 @@
+//! Collapsing repeated alerts.
+//!
+//! One scanner can raise the same alert a hundred thousand times, each a record to store and
+//! a line for whoever is watching. Alerts are identical when they have the same source and
+//! severity and involve the same remote address, or, when there is no address, carry the same
+//! message. The first of them is recorded as usual, so nothing is reported late, and opens a
+//! window; the repeats raised within it are only counted, and when it closes they go into the
+//! history as one record with their count and first and last times. The next repeat after
+//! that is recorded again and opens a new window. When a first alert is admitted here but then
+//! not recorded, because the load shedder turned it away, it is [carried](Aggregator::carry)
+//! into the window's record, so that it is still reported once the window closes. Groups are bounded: once `capacity` windows
+//! are open, alerts that would open another are recorded one by one, as before.
+
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::time::{Duration, Instant};
+
+use vigilant_canine_proto::{Alert, Severity};
+
+#[derive(Debug, Clone, Copy)]
+pub struct AggregateConfig {
+    /// How long after the first alert its repeats are collapsed.
+    pub window: Duration,
+    /// Most windows open at once.
+    pub capacity: usize,
+}
+
+impl Default for AggregateConfig {
+    fn default() -> AggregateConfig {
+        AggregateConfig { window: Duration::from_secs(60), capacity: 4096 }
+    }
+}
+
+#[derive(PartialEq, Eq, Hash)]
+struct Key {
+    source: String,
+    severity: Severity,
+    addr: Option<IpAddr>,
+    /// Only for alerts without an address.
+    message: Option<String>,
+}
+
+impl Key {
+    fn of(alert: &Alert) -> Key {
+        Key {
+            source: alert.source.clone(),
+            severity: alert.severity,
+            addr: alert.addr,
+            message: alert.addr.is_none().then(|| alert.message.clone()),
+        }
+    }
+}
+
+struct Group {
+    closes: Instant,
+    /// The repeats so far, as the record they will become.
+    repeats: Option<Alert>,
+}
+
+impl Group {
+    fn add(&mut self, alert: &Alert) {
+        match &mut self.repeats {
+            Some(repeats) => {
+                repeats.count += alert.count;
+                repeats.time_ms = repeats.time_ms.min(alert.time_ms);
+                repeats.last_ms = repeats.last_ms.max(alert.last_ms);
+            }
+            None => self.repeats = Some(alert.clone()),
+        }
+    }
+}
+
+pub struct Aggregator {
+    config: AggregateConfig,
+    groups: HashMap<Key, Group>,
+    /// Repeats whose window closed before [`expire`](Aggregator::expire) got to them.
+    closed: Vec<Alert>,
+    /// Repeats collapsed since the start.
+    collapsed: u64,
+}
+
+impl Aggregator {
+    pub fn new(config: AggregateConfig) -> Aggregator {
+        let capacity = config.capacity.max(1);
+        Aggregator {
+            config: AggregateConfig { capacity, ..config },
+            groups: HashMap::with_capacity(capacity),
+            closed: Vec::new(),
+            collapsed: 0,
+        }
+    }
+
+    /// Whether `alert`, raised at `now`, should be recorded on its own; if not, it was counted
+    /// as a repeat.
+    pub fn admit(&mut self, alert: &Alert, now: Instant) -> bool {
+        let key = Key::of(alert);
+        if let Some(group) = self.groups.get_mut(&key) {
+            if now < group.closes {
+                group.add(alert);
+                self.collapsed += alert.count;
+                return false;
+            }
+            // The window closed and `expire` has not run yet: this alert opens the next one.
+            self.closed.extend(group.repeats.take());
+            group.closes = now + self.config.window;
+            return true;
+        }
+        if self.groups.len() < self.config.capacity {
+            self.groups.insert(key, Group { closes: now + self.config.window, repeats: None });
+        }
+        true
+    }
+
+    /// Adds `alert`, which opened its window but was not recorded, to the record of the window's
+    /// repeats. Does nothing if it opened no window, when too many were open.
+    pub fn carry(&mut self, alert: &Alert) {
+        if let Some(group) = self.groups.get_mut(&Key::of(alert)) {
+            group.add(alert);
+        }
+    }
+
+    /// Closes the windows that ended by `now`, appending to `out`, oldest first, a record for
+    /// each that collapsed repeats.
+    pub fn expire(&mut self, now: Instant, out: &mut Vec<Alert>) {
+        let start = out.len();
+        out.append(&mut self.closed);
+        self.groups.retain(|_, group| {
+            if now < group.closes {
+                return true;
+            }
+            out.extend(group.repeats.take());
+            false
+        });
+        out[start..].sort_by_key(|alert| alert.time_ms);
+    }
+
+    /// Time from `now` until the next window closes, if any is open.
+    pub fn until_expiry(&self, now: Instant) -> Option<Duration> {
+        if !self.closed.is_empty() {
+            return Some(Duration::ZERO);
+        }
+        self.groups.values().map(|group| group.closes.saturating_duration_since(now)).min()
+    }
+
+    /// Repeats collapsed since the start.
+    pub fn collapsed(&self) -> u64 {
+        self.collapsed
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{AggregateConfig, Aggregator};
+    use std::time::{Duration, Instant};
+    use vigilant_canine_proto::{Alert, Severity};
+
+    fn alert(time_ms: u64) -> Alert {
+        Alert::new(time_ms, Severity::Low, "brute-force".to_string(), Some("192.0.2.1".parse().unwrap()), "failed".to_string())
+    }
+
+    #[test]
+    fn repeats_collapse_into_one_record() {
+        let start = Instant::now();
+        let mut aggregator = Aggregator::new(AggregateConfig { window: Duration::from_secs(60), capacity: 16 });
+        assert!(aggregator.admit(&alert(0), start));
+        for second in 1..4 {
+            assert!(!aggregator.admit(&alert(second * 1000), start + Duration::from_secs(second)));
+        }
+        let mut out = Vec::new();
+        aggregator.expire(start + Duration::from_secs(59), &mut out);
+        assert!(out.is_empty());
+        aggregator.expire(start + Duration::from_secs(60), &mut out);
+        assert_eq!(out.len(), 1);
+        assert_eq!((out[0].count, out[0].time_ms, out[0].last_ms), (3, 1000, 3000));
+        assert_eq!(aggregator.collapsed(), 3);
+        assert!(aggregator.admit(&alert(61_000), start + Duration::from_secs(61)));
+    }
+
+    #[test]
+    fn carried_first_alert_is_reported_with_its_repeats() {
+        let start = Instant::now();
+        let mut aggregator = Aggregator::new(AggregateConfig { window: Duration::from_secs(60), capacity: 16 });
+        assert!(aggregator.admit(&alert(0), start));
+        aggregator.carry(&alert(0));
+        assert!(!aggregator.admit(&alert(5000), start + Duration::from_secs(5)));
+        let mut out = Vec::new();
+        aggregator.expire(start + Duration::from_secs(60), &mut out);
+        assert_eq!(out.len(), 1);
+        assert_eq!((out[0].count, out[0].time_ms, out[0].last_ms), (2, 0, 5000));
+
+        // Alone in its window, it is still reported when the window closes.
+        let later = start + Duration::from_secs(120);
+        assert!(aggregator.admit(&alert(120_000), later));
+        aggregator.carry(&alert(120_000));
+        out.clear();
+        aggregator.expire(later + Duration::from_secs(60), &mut out);
+        assert_eq!(out.len(), 1);
+        assert_eq!(out[0].count, 1);
+    }
+}
@@ -0,0 +1,306 @@
+//! Failed-authentication counting per source address.
+//!
+//! Each tracked address keeps a ring of per-interval counters covering the window, so adding an
+//! event and sliding the window are both O(1). The table has a fixed capacity, reserved up
+//! front, and evicts the least recently seen address when full: during a credential-stuffing
+//! burst from tens of thousands of addresses memory stays flat, and the addresses that are
+//! actually hammering us stay hot and are not the ones evicted. Slots of addresses that were
+//! forgotten or expired go on a free list and are reused before anything is evicted.
+
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::time::{Duration, Instant};
+
+const BUCKETS: usize = 12;
+const NIL: u32 = u32::MAX;
+
+#[derive(Debug, Clone, Copy)]
+pub struct BruteForceConfig {
+    /// Failures are counted over this sliding window.
+    pub window: Duration,
+    /// Failures within the window that make an address an offender.
+    pub threshold: u32,
+    /// Most addresses tracked at once.
+    pub capacity: usize,
+}
+
+impl Default for BruteForceConfig {
+    fn default() -> BruteForceConfig {
+        BruteForceConfig { window: Duration::from_secs(10 * 60), threshold: 5, capacity: 65536 }
+    }
+}
+
+/// An address that crossed the threshold.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Offense {
+    pub addr: IpAddr,
+    /// Failures seen within the window.
+    pub failures: u32,
+}
+
+struct Slot {
+    addr: IpAddr,
+    counts: [u16; BUCKETS],
+    total: u32,
+    /// Interval number of the newest bucket.
+    interval: u64,
+    /// Interval at which the address was last reported, so it is reported once per window.
+    reported: Option<u64>,
+    prev: u32,
+    /// The next slot towards the tail or, for a free slot, the next free one.
+    next: u32,
+}
+
+pub struct BruteForceDetector {
+    config: BruteForceConfig,
+    origin: Instant,
+    bucket_ms: u64,
+    index: HashMap<IpAddr, u32>,
+    slots: Vec<Slot>,
+    /// Most recently used slot.
+    head: u32,
+    /// Least recently used slot, evicted first.
+    tail: u32,
+    /// First slot of the free list.
+    free: u32,
+}
+
+impl BruteForceDetector {
+    pub fn new(config: BruteForceConfig) -> BruteForceDetector {
+        let capacity = config.capacity.clamp(1, NIL as usize - 1);
+        BruteForceDetector {
+            config: BruteForceConfig { capacity, ..config },
+            origin: Instant::now(),
+            bucket_ms: (config.window.as_millis() as u64 / BUCKETS as u64).max(1),
+            index: HashMap::with_capacity(capacity),
+            slots: Vec::with_capacity(capacity),
+            head: NIL,
+            tail: NIL,
+            free: NIL,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.index.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.index.is_empty()
+    }
+
+    /// Counts one failure from `addr` at `now`, returning an offense the first time the address
+    /// reaches the threshold within a window.
+    pub fn record(&mut self, addr: IpAddr, now: Instant) -> Option<Offense> {
+        let interval = now.saturating_duration_since(self.origin).as_millis() as u64 / self.bucket_ms;
+        let slot = match self.index.get(&addr) {
+            Some(&slot) => {
+                self.unlink(slot);
+                slot
+            }
+            None => self.allocate(addr, interval),
+        };
+        self.push_front(slot);
+
+        let entry = &mut self.slots[slot as usize];
+        // Zero the buckets that slid out of the window since this address was last seen.
+        let elapsed = interval.saturating_sub(entry.interval).min(BUCKETS as u64);
+        for step in 1..=elapsed {
+            let bucket = ((entry.interval + step) % BUCKETS as u64) as usize;
+            entry.total -= entry.counts[bucket] as u32;
+            entry.counts[bucket] = 0;
+        }
+        entry.interval = entry.interval.max(interval);
+        let bucket = (entry.interval % BUCKETS as u64) as usize;
+        if entry.counts[bucket] < u16::MAX {
+            entry.counts[bucket] += 1;
+            entry.total += 1;
+        }
+
+        let due = entry.reported.is_none_or(|reported| entry.interval >= reported + BUCKETS as u64);
+        if entry.total >= self.config.threshold && due {
+            entry.reported = Some(entry.interval);
+            return Some(Offense { addr, failures: entry.total });
+        }
+        None
+    }
+
+    /// Stops tracking `addr`, e.g. after a successful login or once it has been blocked.
+    pub fn forget(&mut self, addr: IpAddr) {
+        if let Some(slot) = self.index.remove(&addr) {
+            self.unlink(slot);
+            self.release(slot);
+        }
+    }
+
+    /// Stops tracking addresses that have not failed for a whole window, returning how many.
+    /// Addresses are kept in the order they were last seen, so this only visits the ones it
+    /// drops and the first one it keeps.
+    pub fn expire(&mut self, now: Instant) -> usize {
+        let interval = now.saturating_duration_since(self.origin).as_millis() as u64 / self.bucket_ms;
+        let mut expired = 0;
+        while self.tail != NIL {
+            let slot = self.tail;
+            let entry = &self.slots[slot as usize];
+            if entry.interval + (BUCKETS as u64) > interval {
+                break;
+            }
+            self.index.remove(&entry.addr);
+            self.unlink(slot);
+            self.release(slot);
+            expired += 1;
+        }
+        expired
+    }
+
+    fn allocate(&mut self, addr: IpAddr, interval: u64) -> u32 {
+        let fresh = Slot { addr, counts: [0; BUCKETS], total: 0, interval, reported: None, prev: NIL, next: NIL };
+        let slot = if self.free != NIL {
+            let slot = self.free;
+            self.free = self.slots[slot as usize].next;
+            self.slots[slot as usize] = fresh;
+            slot
+        } else if self.slots.len() < self.config.capacity {
+            self.slots.push(fresh);
+            (self.slots.len() - 1) as u32
+        } else {
+            let slot = self.tail;
+            self.unlink(slot);
+            let evicted = std::mem::replace(&mut self.slots[slot as usize], fresh);
+            self.index.remove(&evicted.addr);
+            slot
+        };
+        self.index.insert(addr, slot);
+        slot
+    }
+
+    /// Puts an unlinked slot on the free list.
+    fn release(&mut self, slot: u32) {
+        self.slots[slot as usize].next = self.free;
+        self.free = slot;
+    }
+
+    fn unlink(&mut self, slot: u32) {
+        let (prev, next) = (self.slots[slot as usize].prev, self.slots[slot as usize].next);
+        match prev {
+            NIL if self.head == slot => self.head = next,
+            NIL => {}
+            prev => self.slots[prev as usize].next = next,
+        }
+        match next {
+            NIL if self.tail == slot => self.tail = prev,
+            NIL => {}
+            next => self.slots[next as usize].prev = prev,
+        }
+        self.slots[slot as usize].prev = NIL;
+        self.slots[slot as usize].next = NIL;
+    }
+
+    fn push_front(&mut self, slot: u32) {
+        self.slots[slot as usize].next = self.head;
+        if self.head != NIL {
+            self.slots[self.head as usize].prev = slot;
+        }
+        self.head = slot;
+        if self.tail == NIL {
+            self.tail = slot;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr};
+    use std::time::{Duration, Instant};
+
+    use super::{BruteForceConfig, BruteForceDetector, Offense};
+
+    fn detector(threshold: u32, capacity: usize) -> BruteForceDetector {
+        BruteForceDetector::new(BruteForceConfig { window: Duration::from_secs(12), threshold, capacity })
+    }
+
+    fn addr(last: u8) -> IpAddr {
+        IpAddr::V4(Ipv4Addr::new(192, 0, 2, last))
+    }
+
+    #[test]
+    fn reports_once_per_window() {
+        let mut detector = detector(3, 16);
+        let now = Instant::now();
+        assert_eq!(detector.record(addr(1), now), None);
+        assert_eq!(detector.record(addr(1), now), None);
+        assert_eq!(detector.record(addr(1), now), Some(Offense { addr: addr(1), failures: 3 }));
+        assert_eq!(detector.record(addr(1), now + Duration::from_secs(1)), None);
+        let later = now + Duration::from_secs(13);
+        assert_eq!(detector.record(addr(1), later), None);
+        assert_eq!(detector.record(addr(1), later), None);
+        assert!(detector.record(addr(1), later).is_some());
+    }
+
+    #[test]
+    fn failures_slide_out_of_the_window() {
+        let mut detector = detector(3, 16);
+        let now = Instant::now();
+        detector.record(addr(1), now);
+        detector.record(addr(1), now);
+        assert_eq!(detector.record(addr(1), now + Duration::from_secs(13)), None);
+        assert_eq!(detector.record(addr(1), now + Duration::from_secs(14)), None);
+        assert!(detector.record(addr(1), now + Duration::from_secs(15)).is_some());
+    }
+
+    #[test]
+    fn evicts_the_least_recently_seen() {
+        let mut detector = detector(3, 2);
+        let now = Instant::now();
+        detector.record(addr(1), now);
+        detector.record(addr(2), now);
+        detector.record(addr(1), now);
+        // Full: the third address takes the slot of the second, seen least recently.
+        detector.record(addr(3), now);
+        assert_eq!(detector.len(), 2);
+        assert_eq!(detector.record(addr(1), now), Some(Offense { addr: addr(1), failures: 3 }));
+        // The second starts over, evicting the third.
+        assert_eq!(detector.record(addr(2), now), None);
+        assert_eq!(detector.record(addr(2), now), None);
+        assert_eq!(detector.len(), 2);
+    }
+
+    #[test]
+    fn forgets_and_expires() {
+        let mut detector = detector(2, 4);
+        let now = Instant::now();
+        detector.record(addr(1), now);
+        detector.forget(addr(1));
+        assert!(detector.is_empty());
+        assert_eq!(detector.record(addr(1), now), None);
+        detector.record(addr(2), now + Duration::from_secs(6));
+        assert_eq!(detector.expire(now + Duration::from_secs(12)), 1);
+        assert_eq!(detector.len(), 1);
+        assert_eq!(detector.expire(now + Duration::from_secs(18)), 1);
+        assert!(detector.is_empty());
+    }
+
+    #[test]
+    fn freed_slots_are_reused_before_evicting() {
+        let mut detector = detector(3, 2);
+        let now = Instant::now();
+        detector.record(addr(1), now);
+        detector.record(addr(2), now);
+        let later = now + Duration::from_secs(12);
+        assert_eq!(detector.expire(later), 2);
+        assert_eq!((detector.head, detector.tail), (super::NIL, super::NIL));
+        assert_eq!(detector.expire(later), 0);
+
+        detector.record(addr(3), later);
+        detector.record(addr(4), later);
+        assert_eq!(detector.slots.len(), 2);
+        // Neither took the other's slot.
+        detector.record(addr(3), later);
+        assert_eq!(detector.record(addr(3), later), Some(Offense { addr: addr(3), failures: 3 }));
+        detector.forget(addr(3));
+        detector.record(addr(5), later);
+        detector.record(addr(4), later);
+        assert_eq!(detector.record(addr(4), later), Some(Offense { addr: addr(4), failures: 3 }));
+        assert_eq!(detector.record(addr(5), later), None);
+        assert_eq!(detector.len(), 2);
+    }
+}
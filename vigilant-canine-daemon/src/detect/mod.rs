@@ -0,0 +1,4 @@
+//! Detectors that turn individual events into findings.
+
+pub mod bruteforce;
+pub mod reputation;
@@ -0,0 +1,425 @@
+//! IP reputation lists.
+//!
+//! Lists placed on disk (FireHOL netsets, Spamhaus DROP exports, or anything else with one
+//! address, CIDR prefix or `first-last` range per line) are compiled into a single immutable
+//! file of merged, sorted ranges that is memory-mapped and searched in place. Most addresses
+//! checked are on no list, so a blocked Bloom filter keyed by /24 (IPv4) or /48 (IPv6) prefix
+//! sits in front of the ranges: a clean address costs one hash and one cache line, and only a
+//! probable hit pays for the binary search. Ranges too wide to spread over the filter (an
+//! allocation-sized DROP entry) go in a short table of their own, checked first.
+//!
+//! Being file-backed, the compiled lists live in the page cache rather than the daemon's heap.
+//! A reload maps the new file and drops the old mapping, so the two never need to be resident
+//! in full at once. Layout (native endian):
+//!
+//! ```text
+//! header     (64 bytes)
+//! filter     (words * 8 bytes)
+//! v4 ranges  (count * 8 bytes: first, last)
+//! v4 wide    (count * 8 bytes)
+//! v6 ranges  (count * 32 bytes: first, last)
+//! v6 wide    (count * 32 bytes)
+//! ```
+
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, Write};
+use std::net::IpAddr;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+
+use xxhash_rust::xxh3::Xxh3;
+
+use crate::sys::{replace_file, Mmap};
+
+const MAGIC: [u8; 8] = *b"VCREP\0\0\0";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+/// Filter keys are prefixes of this many bits.
+const V4_KEY_BITS: u32 = 24;
+const V6_KEY_BITS: u32 = 48;
+/// Ranges covering more filter keys than this go in the wide table.
+const MAX_RANGE_KEYS: u64 = 1024;
+const FILTER_BITS_PER_KEY: u64 = 16;
+const FILTER_PROBES: u32 = 4;
+
+/// Compiled reputation lists.
+pub struct Reputation {
+    map: Mmap,
+    /// Mask selecting a filter word; the word count is a power of two.
+    word_mask: u64,
+    v4: Table,
+    v4_wide: Table,
+    v6: Table,
+    v6_wide: Table,
+    stamp: u64,
+}
+
+/// Where a run of ranges is in the file.
+#[derive(Debug, Clone, Copy)]
+struct Table {
+    offset: usize,
+    count: usize,
+}
+
+impl Reputation {
+    /// Loads the lists in `dir`, reusing the compiled file at `compiled` if it was built from
+    /// the lists as they are now and rebuilding it otherwise. Every file in `dir` is a list.
+    pub fn load(dir: &Path, compiled: &Path) -> io::Result<Reputation> {
+        let sources = list_sources(dir)?;
+        let stamp = sources_stamp(&sources)?;
+        if let Ok(reputation) = Reputation::open(compiled) {
+            if reputation.stamp == stamp {
+                return Ok(reputation);
+            }
+        }
+        compile(&sources, stamp, compiled)?;
+        Reputation::open(compiled)
+    }
+
+    /// Whether the lists in `dir` are still the ones this was compiled from. Only their metadata
+    /// is read.
+    pub fn is_current(&self, dir: &Path) -> io::Result<bool> {
+        Ok(sources_stamp(&list_sources(dir)?)? == self.stamp)
+    }
+
+    pub fn open(path: &Path) -> io::Result<Reputation> {
+        let map = Mmap::map(&File::open(path)?, libc::MADV_RANDOM)?;
+        if map.len() < HEADER_SIZE || map[..8] != MAGIC || read_u32(&map, 8) != VERSION {
+            return Err(invalid("not a compiled reputation file"));
+        }
+        let words = read_u64(&map, 16) as usize;
+        let counts = [24, 32, 40, 48].map(|off| read_u64(&map, off) as usize);
+        let stamp = read_u64(&map, 56);
+        if !words.is_power_of_two() {
+            return Err(invalid("corrupt reputation filter"));
+        }
+        let mut offset = HEADER_SIZE + words * 8;
+        let mut table = |count: usize, size: usize| {
+            let table = Table { offset, count };
+            offset += count * size;
+            table
+        };
+        let (v4, v4_wide, v6, v6_wide) = (table(counts[0], 8), table(counts[1], 8), table(counts[2], 32), table(counts[3], 32));
+        if offset != map.len() {
+            return Err(invalid("truncated reputation file"));
+        }
+        Ok(Reputation { map, word_mask: words as u64 - 1, v4, v4_wide, v6, v6_wide, stamp })
+    }
+
+    /// Number of distinct ranges listed.
+    pub fn len(&self) -> usize {
+        self.v4.count + self.v4_wide.count + self.v6.count + self.v6_wide.count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn contains(&self, addr: IpAddr) -> bool {
+        let addr = match addr {
+            IpAddr::V6(v6) => v6.to_ipv4_mapped().map_or(addr, IpAddr::V4),
+            v4 => v4,
+        };
+        match addr {
+            IpAddr::V4(v4) => {
+                let ip = u32::from(v4);
+                find_v4(&self.map, self.v4_wide, ip) || (self.maybe(v4_key(ip)) && find_v4(&self.map, self.v4, ip))
+            }
+            IpAddr::V6(v6) => {
+                let ip = u128::from(v6);
+                find_v6(&self.map, self.v6_wide, ip) || (self.maybe(v6_key(ip)) && find_v6(&self.map, self.v6, ip))
+            }
+        }
+    }
+
+    /// Whether the filter says `key` might be listed.
+    fn maybe(&self, key: u64) -> bool {
+        let (word, bits) = filter_probe(key, self.word_mask);
+        read_u64(&self.map, HEADER_SIZE + word * 8) & bits == bits
+    }
+}
+
+/// The files in `dir`, sorted so the stamp does not depend on directory order.
+fn list_sources(dir: &Path) -> io::Result<Vec<PathBuf>> {
+    let mut sources = Vec::new();
+    for entry in fs::read_dir(dir)? {
+        let entry = entry?;
+        if entry.file_type()?.is_file() && !entry.file_name().to_string_lossy().starts_with('.') {
+            sources.push(entry.path());
+        }
+    }
+    sources.sort();
+    Ok(sources)
+}
+
+/// Identifies the lists by name and metadata, which is enough to notice an update without
+/// reading them.
+fn sources_stamp(sources: &[PathBuf]) -> io::Result<u64> {
+    let mut hasher = Xxh3::new();
+    hasher.update(&VERSION.to_ne_bytes());
+    for source in sources {
+        let meta = fs::metadata(source)?;
+        hasher.update(source.as_os_str().as_encoded_bytes());
+        hasher.update(&[0]);
+        for value in [meta.size(), meta.ino(), meta.mtime() as u64, meta.mtime_nsec() as u64] {
+            hasher.update(&value.to_ne_bytes());
+        }
+    }
+    Ok(hasher.digest())
+}
+
+fn compile(sources: &[PathBuf], stamp: u64, out: &Path) -> io::Result<()> {
+    let (mut v4, mut v6) = (Vec::new(), Vec::new());
+    let mut line = String::new();
+    for source in sources {
+        let mut reader = BufReader::new(File::open(source)?);
+        loop {
+            line.clear();
+            // Lists are not always clean UTF-8 (comments); such lines are skipped like any other
+            // line that is not an address.
+            match reader.read_line(&mut line) {
+                Ok(0) => break,
+                Ok(_) => {}
+                Err(err) if err.kind() == io::ErrorKind::InvalidData => continue,
+                Err(err) => return Err(err),
+            }
+            match parse_entry(&line) {
+                Some(Entry::V4(first, last)) => v4.push([first, last]),
+                Some(Entry::V6(first, last)) => v6.push([first, last]),
+                None => {}
+            }
+        }
+    }
+    let (v4, v4_wide): (Vec<_>, Vec<_>) = merge(v4).into_iter().partition(|&[first, last]| v4_keys(first, last) <= MAX_RANGE_KEYS);
+    let (v6, v6_wide): (Vec<_>, Vec<_>) = merge(v6).into_iter().partition(|&[first, last]| v6_keys(first, last) <= MAX_RANGE_KEYS);
+
+    let keys = v4.iter().map(|&[first, last]| v4_keys(first, last)).sum::<u64>()
+        + v6.iter().map(|&[first, last]| v6_keys(first, last)).sum::<u64>();
+    let words = (keys * FILTER_BITS_PER_KEY).div_ceil(64).max(1).next_power_of_two();
+    let mut filter = vec![0u64; words as usize];
+    let mut insert = |key: u64| {
+        let (word, bits) = filter_probe(key, words - 1);
+        filter[word] |= bits;
+    };
+    for &[first, last] in &v4 {
+        (v4_key(first)..=v4_key(last)).for_each(&mut insert);
+    }
+    for &[first, last] in &v6 {
+        (v6_key(first)..=v6_key(last)).for_each(&mut insert);
+    }
+
+    replace_file(out, |out| {
+        let mut header = [0u8; HEADER_SIZE];
+        header[..8].copy_from_slice(&MAGIC);
+        header[8..12].copy_from_slice(&VERSION.to_ne_bytes());
+        header[16..24].copy_from_slice(&words.to_ne_bytes());
+        for (off, count) in [(24, v4.len()), (32, v4_wide.len()), (40, v6.len()), (48, v6_wide.len())] {
+            header[off..off + 8].copy_from_slice(&(count as u64).to_ne_bytes());
+        }
+        header[56..64].copy_from_slice(&stamp.to_ne_bytes());
+        out.write_all(&header)?;
+        let mut buf = Vec::with_capacity(filter.len() * 8);
+        filter.iter().for_each(|word| buf.extend_from_slice(&word.to_ne_bytes()));
+        out.write_all(&buf)?;
+        buf.clear();
+        v4.iter().chain(&v4_wide).flatten().for_each(|bound| buf.extend_from_slice(&bound.to_ne_bytes()));
+        v6.iter().chain(&v6_wide).flatten().for_each(|bound| buf.extend_from_slice(&bound.to_ne_bytes()));
+        out.write_all(&buf)
+    })
+}
+
+#[derive(Debug, PartialEq, Eq)]
+enum Entry {
+    V4(u32, u32),
+    V6(u128, u128),
+}
+
+/// Parses the address, prefix or range a list line starts with; comments start with `#` or `;`.
+fn parse_entry(line: &str) -> Option<Entry> {
+    let token = line.split(['#', ';']).next()?.split_whitespace().next()?;
+    if let Some((first, last)) = token.split_once('-') {
+        return match (first.parse().ok()?, last.parse().ok()?) {
+            (IpAddr::V4(first), IpAddr::V4(last)) => (first <= last).then(|| Entry::V4(first.into(), last.into())),
+            (IpAddr::V6(first), IpAddr::V6(last)) => (first <= last).then(|| Entry::V6(first.into(), last.into())),
+            _ => None,
+        };
+    }
+    let (addr, len) = match token.split_once('/') {
+        Some((addr, len)) => (addr.parse().ok()?, Some(len.parse::<u32>().ok()?)),
+        None => (token.parse().ok()?, None),
+    };
+    match addr {
+        IpAddr::V4(addr) => {
+            let len = len.unwrap_or(32);
+            let host = u32::MAX.checked_shr(len).unwrap_or(0);
+            (len <= 32).then(|| Entry::V4(u32::from(addr) & !host, u32::from(addr) | host))
+        }
+        IpAddr::V6(addr) => {
+            let len = len.unwrap_or(128);
+            let host = u128::MAX.checked_shr(len).unwrap_or(0);
+            (len <= 128).then(|| Entry::V6(u128::from(addr) & !host, u128::from(addr) | host))
+        }
+    }
+}
+
+/// Sorts ranges and merges those that overlap or touch.
+fn merge<T: Copy + Ord + Successor>(mut ranges: Vec<[T; 2]>) -> Vec<[T; 2]> {
+    ranges.sort_unstable();
+    let mut merged: Vec<[T; 2]> = Vec::with_capacity(ranges.len());
+    for [first, last] in ranges {
+        match merged.last_mut() {
+            Some(prev) if prev[1].successor().is_none_or(|next| first <= next) => prev[1] = prev[1].max(last),
+            _ => merged.push([first, last]),
+        }
+    }
+    merged
+}
+
+trait Successor: Sized {
+    fn successor(self) -> Option<Self>;
+}
+
+impl Successor for u32 {
+    fn successor(self) -> Option<u32> {
+        self.checked_add(1)
+    }
+}
+
+impl Successor for u128 {
+    fn successor(self) -> Option<u128> {
+        self.checked_add(1)
+    }
+}
+
+/// Number of filter keys the range from `first` to `last` covers.
+fn v4_keys(first: u32, last: u32) -> u64 {
+    v4_key(last) - v4_key(first) + 1
+}
+
+fn v6_keys(first: u128, last: u128) -> u64 {
+    v6_key(last) - v6_key(first) + 1
+}
+
+/// The filter key of an address: its prefix, with IPv4 keys kept apart from IPv6 ones by the
+/// top bit.
+fn v4_key(ip: u32) -> u64 {
+    (ip >> (u32::BITS - V4_KEY_BITS)) as u64 | 1 << 63
+}
+
+fn v6_key(ip: u128) -> u64 {
+    (ip >> (u128::BITS - V6_KEY_BITS)) as u64
+}
+
+/// The filter word for `key` and the bits that must all be set in it. All probes land in one
+/// word, so a lookup touches a single cache line.
+fn filter_probe(key: u64, word_mask: u64) -> (usize, u64) {
+    // splitmix64's finalizer.
+    let mut h = key.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    h = (h ^ (h >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    h = (h ^ (h >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    h ^= h >> 31;
+    let bits = (0..FILTER_PROBES).fold(0u64, |bits, probe| bits | 1 << ((h >> (40 + 6 * probe)) & 63));
+    ((h & word_mask) as usize, bits)
+}
+
+fn find_v4(map: &[u8], table: Table, ip: u32) -> bool {
+    // The last range starting at or before `ip` is the only one that can hold it.
+    let index = partition_point(table.count, |i| read_u32(map, table.offset + i * 8) <= ip);
+    index > 0 && ip <= read_u32(map, table.offset + (index - 1) * 8 + 4)
+}
+
+fn find_v6(map: &[u8], table: Table, ip: u128) -> bool {
+    let index = partition_point(table.count, |i| read_u128(map, table.offset + i * 32) <= ip);
+    index > 0 && ip <= read_u128(map, table.offset + (index - 1) * 32 + 16)
+}
+
+/// The number of leading indexes in `0..count` for which `pred` holds.
+fn partition_point<F: Fn(usize) -> bool>(count: usize, pred: F) -> usize {
+    let (mut lo, mut hi) = (0, count);
+    while lo < hi {
+        let mid = lo + (hi - lo) / 2;
+        if pred(mid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    lo
+}
+
+fn read_u32(buf: &[u8], off: usize) -> u32 {
+    u32::from_ne_bytes(buf[off..off + 4].try_into().expect("slice length is fixed"))
+}
+
+fn read_u64(buf: &[u8], off: usize) -> u64 {
+    u64::from_ne_bytes(buf[off..off + 8].try_into().expect("slice length is fixed"))
+}
+
+fn read_u128(buf: &[u8], off: usize) -> u128 {
+    u128::from_ne_bytes(buf[off..off + 16].try_into().expect("slice length is fixed"))
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::net::{Ipv4Addr, Ipv6Addr};
+
+    use super::{merge, parse_entry, Entry, Reputation};
+
+    fn v4(addr: &str) -> u32 {
+        addr.parse::<Ipv4Addr>().unwrap().into()
+    }
+
+    fn v6(addr: &str) -> u128 {
+        addr.parse::<Ipv6Addr>().unwrap().into()
+    }
+
+    #[test]
+    fn parses_addresses_prefixes_and_ranges() {
+        assert_eq!(parse_entry("192.0.2.7"), Some(Entry::V4(v4("192.0.2.7"), v4("192.0.2.7"))));
+        assert_eq!(parse_entry("192.0.2.77/24 ; SBL123"), Some(Entry::V4(v4("192.0.2.0"), v4("192.0.2.255"))));
+        assert_eq!(parse_entry("0.0.0.0/0"), Some(Entry::V4(0, u32::MAX)));
+        assert_eq!(parse_entry("198.51.100.10-198.51.100.20\tfirehol"), Some(Entry::V4(v4("198.51.100.10"), v4("198.51.100.20"))));
+        assert_eq!(parse_entry("2001:db8::/32"), Some(Entry::V6(v6("2001:db8::"), v6("2001:db8:ffff:ffff:ffff:ffff:ffff:ffff"))));
+        assert_eq!(parse_entry("  2001:db8::1 # host"), Some(Entry::V6(v6("2001:db8::1"), v6("2001:db8::1"))));
+    }
+
+    #[test]
+    fn rejects_what_is_not_an_entry() {
+        for line in ["", "# comment", "; comment", "192.0.2.0/33", "2001:db8::/129", "192.0.2.9-192.0.2.1", "192.0.2.1-2001:db8::1", "example.com"] {
+            assert_eq!(parse_entry(line), None, "{line:?}");
+        }
+    }
+
+    #[test]
+    fn merges_overlapping_and_adjacent_ranges() {
+        assert_eq!(merge(vec![[20u32, 30], [1, 5], [6, 10], [8, 9], [12, 12]]), [[1, 10], [12, 12], [20, 30]]);
+        assert_eq!(merge(vec![[u32::MAX, u32::MAX], [0, u32::MAX - 1]]), [[0, u32::MAX]]);
+        assert_eq!(merge(vec![[5u128, 5], [5, 5]]), [[5, 5]]);
+        assert!(merge(Vec::<[u32; 2]>::new()).is_empty());
+    }
+
+    #[test]
+    fn compiled_lists_find_listed_addresses() {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-reputation-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(dir.join("lists")).unwrap();
+        // A wide range (in a table of its own), a narrow one and a host, in two lists.
+        fs::write(dir.join("lists/drop"), "10.0.0.0/8 ; SBL1\n2001:db8::/48\n").unwrap();
+        fs::write(dir.join("lists/hosts"), "# hosts\n192.0.2.7\n192.0.2.8\n").unwrap();
+        let reputation = Reputation::load(&dir.join("lists"), &dir.join("compiled")).unwrap();
+        assert_eq!(reputation.len(), 3);
+        for listed in ["10.1.2.3", "192.0.2.8", "::ffff:192.0.2.7", "2001:db8:0:ffff::1"] {
+            assert!(reputation.contains(listed.parse().unwrap()), "{listed}");
+        }
+        for clean in ["11.0.0.1", "192.0.2.9", "2001:db8:1::1", "::1"] {
+            assert!(!reputation.contains(clean.parse().unwrap()), "{clean}");
+        }
+        assert!(reputation.is_current(&dir.join("lists")).unwrap());
+        fs::remove_dir_all(dir).unwrap();
+    }
+}
@@ -0,0 +1,407 @@
+//! Listening sockets and connections, from sock_diag.
+//!
+//! The kernel is asked for sockets through `NETLINK_SOCK_DIAG` with a state filter, so it only
+//! walks the tables that can hold matching sockets and sends fixed-size binary records: listing
+//! the listeners costs the same on a host with a hundred thousand connections as on an idle one,
+//! where reading /proc/net/tcp would format and parse every connection as text. Each scan is
+//! diffed against the previous one in place (entries are stamped with the scan that saw them and
+//! the unstamped ones are gone), so a scan allocates nothing unless something new appeared.
+
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+use std::time::Duration;
+
+use crate::netlink::{Builder, Socket, NLMSG_DONE, NLM_F_DUMP, NLM_F_REQUEST};
+
+const NETLINK_SOCK_DIAG: libc::c_int = 4;
+const SOCK_DIAG_BY_FAMILY: u16 = 20;
+const TCP_ESTABLISHED: u32 = 1;
+/// What an unconnected UDP socket reports, i.e. one that receives from anyone.
+const TCP_CLOSE: u32 = 7;
+const TCP_LISTEN: u32 = 10;
+
+/// `struct inet_diag_req_v2`.
+const REQUEST_LEN: usize = 56;
+/// `struct inet_diag_msg`, before its attributes.
+const RECORD_LEN: usize = 72;
+const REPLY_TIMEOUT: Duration = Duration::from_secs(2);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Protocol {
+    Tcp,
+    Udp,
+}
+
+impl Protocol {
+    pub fn name(self) -> &'static str {
+        match self {
+            Protocol::Tcp => "tcp",
+            Protocol::Udp => "udp",
+        }
+    }
+
+    fn number(self) -> u8 {
+        match self {
+            Protocol::Tcp => libc::IPPROTO_TCP as u8,
+            Protocol::Udp => libc::IPPROTO_UDP as u8,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct SocketInfo {
+    pub protocol: Protocol,
+    pub local: SocketAddr,
+    /// Unspecified for listeners.
+    pub remote: SocketAddr,
+    pub uid: u32,
+    pub inode: u32,
+}
+
+/// A change in what the host listens on.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Exposure {
+    Listening(SocketInfo),
+    Closed(SocketInfo),
+}
+
+struct Tracked {
+    socket: SocketInfo,
+    /// The scan that last saw it.
+    scan: u64,
+}
+
+pub struct ExposureMonitor {
+    socket: Socket,
+    request: Builder,
+    seq: u32,
+    inventory: Inventory,
+    /// Scratch space for the sockets of one scan.
+    found: Vec<(u64, SocketInfo)>,
+}
+
+/// What the scans saw.
+struct Inventory {
+    scans: u64,
+    /// Keyed by what a client would connect to, so a service that restarts between two scans
+    /// is not a new listener.
+    listeners: HashMap<(Protocol, SocketAddr), Tracked>,
+    /// Keyed by the kernel's socket cookie, which is never reused.
+    connections: HashMap<u64, Tracked>,
+    /// The kernel's range for automatically bound ports. UDP sockets in it are almost always
+    /// clients (e.g. a resolver waiting for its answer), not services.
+    ephemeral_ports: (u16, u16),
+}
+
+impl ExposureMonitor {
+    /// Takes stock of the current listeners; only changes from here on are reported.
+    pub fn open() -> io::Result<ExposureMonitor> {
+        let socket = Socket::open(NETLINK_SOCK_DIAG, 0)?;
+        socket.set_recv_timeout(REPLY_TIMEOUT)?;
+        let mut monitor = ExposureMonitor {
+            socket,
+            request: Builder::new(),
+            seq: 0,
+            inventory: Inventory::new(ephemeral_ports().unwrap_or((32768, 60999))),
+            found: Vec::new(),
+        };
+        monitor.scan_listeners(&mut Vec::new())?;
+        Ok(monitor)
+    }
+
+    pub fn listeners(&self) -> usize {
+        self.inventory.listeners.len()
+    }
+
+    pub fn connections(&self) -> usize {
+        self.inventory.connections.len()
+    }
+
+    /// Lists the listening sockets, appending what changed since the last scan to `out`.
+    pub fn scan_listeners(&mut self, out: &mut Vec<Exposure>) -> io::Result<()> {
+        let mut found = std::mem::take(&mut self.found);
+        found.clear();
+        let result = self.dump(Protocol::Tcp, 1 << TCP_LISTEN, &mut found).and_then(|()| self.dump(Protocol::Udp, 1 << TCP_CLOSE, &mut found));
+        // A failed scan saw only some of the listeners; the rest are not gone.
+        self.inventory.update_listeners(&found, result.is_ok(), out);
+        self.found = found;
+        result
+    }
+
+    /// Updates the inventory of established TCP connections, appending the ones not seen before
+    /// to `out`. The first scan reports every connection.
+    pub fn scan_connections(&mut self, out: &mut Vec<SocketInfo>) -> io::Result<()> {
+        let mut found = std::mem::take(&mut self.found);
+        found.clear();
+        let result = self.dump(Protocol::Tcp, 1 << TCP_ESTABLISHED, &mut found);
+        self.inventory.update_connections(&found, result.is_ok(), out);
+        self.found = found;
+        result
+    }
+
+    /// Appends the `protocol` sockets of both address families in `states` (a bitmask of
+    /// `1 << state`) to `out`, with their cookies.
+    fn dump(&mut self, protocol: Protocol, states: u32, out: &mut Vec<(u64, SocketInfo)>) -> io::Result<()> {
+        for family in [libc::AF_INET, libc::AF_INET6] {
+            self.seq = self.seq.wrapping_add(1);
+            let mut request = [0; REQUEST_LEN];
+            request[0] = family as u8;
+            request[1] = protocol.number();
+            request[4..8].copy_from_slice(&states.to_ne_bytes());
+            self.request.clear();
+            let start = self.request.begin(SOCK_DIAG_BY_FAMILY, NLM_F_REQUEST | NLM_F_DUMP, self.seq);
+            self.request.extend(&request);
+            self.request.end(start);
+            self.socket.send(self.request.as_bytes())?;
+
+            'dump: loop {
+                let messages = match self.socket.recv() {
+                    Ok(messages) => messages,
+                    Err(err) if err.kind() == io::ErrorKind::WouldBlock => {
+                        return Err(io::Error::new(io::ErrorKind::TimedOut, "sock_diag did not finish the dump"));
+                    }
+                    Err(err) => return Err(err),
+                };
+                for message in messages.filter(|message| message.seq == self.seq) {
+                    match message.error() {
+                        // No sock_diag module for this protocol (e.g. udp_diag not loaded).
+                        Some(Err(err)) if err.raw_os_error() == Some(libc::ENOENT) => break 'dump,
+                        Some(Err(err)) => return Err(err),
+                        Some(Ok(())) => {}
+                        None if message.kind == NLMSG_DONE => break 'dump,
+                        None => out.extend(parse_record(protocol, message.payload)),
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+impl Inventory {
+    fn new(ephemeral_ports: (u16, u16)) -> Inventory {
+        Inventory { scans: 0, listeners: HashMap::new(), connections: HashMap::new(), ephemeral_ports }
+    }
+
+    /// Takes in the listeners a scan `found`, appending what changed to `out`. Nothing is new on
+    /// the first scan, and nothing is gone unless the scan was `complete`.
+    fn update_listeners(&mut self, found: &[(u64, SocketInfo)], complete: bool, out: &mut Vec<Exposure>) {
+        let primed = self.scans > 0;
+        self.scans += 1;
+        for &(_, socket) in found {
+            let port = socket.local.port();
+            if socket.protocol == Protocol::Udp && (self.ephemeral_ports.0..=self.ephemeral_ports.1).contains(&port) {
+                continue;
+            }
+            let tracked = self.listeners.entry((socket.protocol, socket.local)).or_insert_with(|| {
+                if primed {
+                    out.push(Exposure::Listening(socket));
+                }
+                Tracked { socket, scan: 0 }
+            });
+            tracked.scan = self.scans;
+        }
+        if !complete {
+            return;
+        }
+        let scan = self.scans;
+        self.listeners.retain(|_, tracked| {
+            if tracked.scan != scan {
+                out.push(Exposure::Closed(tracked.socket));
+            }
+            tracked.scan == scan
+        });
+    }
+
+    /// Takes in the connections a scan `found`, appending the new ones to `out`. Nothing is
+    /// forgotten unless the scan was `complete`.
+    fn update_connections(&mut self, found: &[(u64, SocketInfo)], complete: bool, out: &mut Vec<SocketInfo>) {
+        self.scans += 1;
+        for &(cookie, socket) in found {
+            let tracked = self.connections.entry(cookie).or_insert_with(|| {
+                out.push(socket);
+                Tracked { socket, scan: 0 }
+            });
+            tracked.scan = self.scans;
+        }
+        if complete {
+            let scan = self.scans;
+            self.connections.retain(|_, tracked| tracked.scan == scan);
+        }
+    }
+}
+
+fn parse_record(protocol: Protocol, record: &[u8]) -> Option<(u64, SocketInfo)> {
+    if record.len() < RECORD_LEN {
+        return None;
+    }
+    let u32_at = |offset: usize| u32::from_ne_bytes(record[offset..offset + 4].try_into().unwrap());
+    let port_at = |offset: usize| u16::from_be_bytes([record[offset], record[offset + 1]]);
+    let addr_at = |offset: usize| -> Option<IpAddr> {
+        match record[0] as libc::c_int {
+            libc::AF_INET => Some(Ipv4Addr::from(<[u8; 4]>::try_from(&record[offset..offset + 4]).unwrap()).into()),
+            libc::AF_INET6 => Some(Ipv6Addr::from(<[u8; 16]>::try_from(&record[offset..offset + 16]).unwrap()).into()),
+            _ => None,
+        }
+    };
+    let cookie = u32_at(44) as u64 | (u32_at(48) as u64) << 32;
+    let socket = SocketInfo {
+        protocol,
+        local: SocketAddr::new(addr_at(8)?, port_at(4)),
+        remote: SocketAddr::new(addr_at(24)?, port_at(6)),
+        uid: u32_at(64),
+        inode: u32_at(68),
+    };
+    Some((cookie, socket))
+}
+
+fn ephemeral_ports() -> Option<(u16, u16)> {
+    let range = fs::read_to_string("/proc/sys/net/ipv4/ip_local_port_range").ok()?;
+    let mut bounds = range.split_whitespace().map(|bound| bound.parse().ok());
+    Some((bounds.next()??, bounds.next()??))
+}
+
+/// Finds the process holding the socket with `inode`, by walking every process's descriptors.
+/// That is far too slow to do per socket, but fine for the odd new listener. The walk gives up
+/// after `budget` processes and descriptors, and leaves what is left of it in `budget`, so
+/// a caller can bound the time spent on all the sockets a scan turned up.
+pub fn socket_owner(inode: u32, budget: &mut usize) -> Option<u32> {
+    let target = format!("socket:[{inode}]");
+    for process in fs::read_dir("/proc").ok()?.flatten() {
+        *budget = budget.checked_sub(1)?;
+        let Some(pid) = process.file_name().to_str().and_then(|name| name.parse::<u32>().ok()) else {
+            continue;
+        };
+        let Ok(fds) = fs::read_dir(process.path().join("fd")) else {
+            continue;
+        };
+        for fd in fds.flatten() {
+            *budget = budget.checked_sub(1)?;
+            if fs::read_link(fd.path()).is_ok_and(|link| link.as_os_str() == target.as_str()) {
+                return Some(pid);
+            }
+        }
+    }
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::net::TcpListener;
+    use std::os::fd::AsRawFd;
+    use std::os::unix::fs::MetadataExt;
+
+    use super::{parse_record, socket_owner, Exposure, Inventory, Protocol, SocketInfo, RECORD_LEN};
+
+    /// `inet_diag_msg` records as a little-endian kernel sends them: a TCP listener on
+    /// 127.0.0.1:44149, and one end of a connection from [::1]:45848 to [::1]:8443 followed by
+    /// the start of its attributes.
+    const LISTENER: [u8; RECORD_LEN] = [
+        0x02, 0x0a, 0x00, 0x00, 0xac, 0x75, 0x00, 0x00, 0x7f, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x47, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x26, 0xc4, 0x01, 0x00,
+    ];
+    const CONNECTION: [u8; RECORD_LEN + 8] = [
+        0x0a, 0x01, 0x00, 0x00, 0xb3, 0x18, 0x20, 0xfb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x00, 0x00, 0x00, 0x00, 0x49, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0xe8, 0x03, 0x00, 0x00, 0x59, 0xc4, 0x01, 0x00, 0x05, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00,
+    ];
+
+    fn socket(protocol: Protocol, local: &str, inode: u32) -> SocketInfo {
+        SocketInfo { protocol, local: local.parse().unwrap(), remote: "0.0.0.0:0".parse().unwrap(), uid: 0, inode }
+    }
+
+    #[test]
+    #[cfg(target_endian = "little")]
+    fn records_are_parsed() {
+        let listener = SocketInfo {
+            protocol: Protocol::Tcp,
+            local: "127.0.0.1:44149".parse().unwrap(),
+            remote: "0.0.0.0:0".parse().unwrap(),
+            uid: 0,
+            inode: 115_750,
+        };
+        assert_eq!(parse_record(Protocol::Tcp, &LISTENER), Some((0x2047, listener)));
+        let connection = SocketInfo {
+            protocol: Protocol::Tcp,
+            local: "[::1]:45848".parse().unwrap(),
+            remote: "[::1]:8443".parse().unwrap(),
+            uid: 1000,
+            inode: 115_801,
+        };
+        assert_eq!(parse_record(Protocol::Tcp, &CONNECTION), Some((1 << 32 | 0x2049, connection)));
+    }
+
+    #[test]
+    fn malformed_records_are_skipped() {
+        assert_eq!(parse_record(Protocol::Tcp, &LISTENER[..RECORD_LEN - 1]), None);
+        let mut unix = LISTENER;
+        unix[0] = libc::AF_UNIX as u8;
+        assert_eq!(parse_record(Protocol::Tcp, &unix), None);
+    }
+
+    #[test]
+    fn listener_scans_report_changes() {
+        let mut inventory = Inventory::new((32768, 60999));
+        let ssh = socket(Protocol::Tcp, "0.0.0.0:22", 1);
+        let dns = socket(Protocol::Udp, "127.0.0.53:53", 2);
+        let mut out = Vec::new();
+        // What is there at the start is not news.
+        inventory.update_listeners(&[(1, ssh), (2, dns)], true, &mut out);
+        assert_eq!(out, []);
+        assert_eq!(inventory.listeners.len(), 2);
+
+        // A restarted service has a new socket at the same address; a UDP client is ignored.
+        let restarted = SocketInfo { inode: 3, ..ssh };
+        let web = socket(Protocol::Tcp, "[::]:443", 4);
+        let client = socket(Protocol::Udp, "0.0.0.0:40000", 5);
+        inventory.update_listeners(&[(3, restarted), (4, web), (5, client)], true, &mut out);
+        assert_eq!(out, [Exposure::Listening(web), Exposure::Closed(dns)]);
+        out.clear();
+
+        // A scan that failed part way forgets nothing.
+        inventory.update_listeners(&[(4, web)], false, &mut out);
+        assert_eq!(out, []);
+        assert_eq!(inventory.listeners.len(), 2);
+        inventory.update_listeners(&[(4, web)], true, &mut out);
+        assert_eq!(out, [Exposure::Closed(ssh)]);
+        assert_eq!(inventory.listeners.len(), 1);
+    }
+
+    #[test]
+    fn connection_scans_report_new_connections_once() {
+        let mut inventory = Inventory::new((32768, 60999));
+        let (a, b) = (socket(Protocol::Tcp, "10.0.0.1:22", 1), socket(Protocol::Tcp, "10.0.0.1:22", 2));
+        let mut out = Vec::new();
+        inventory.update_connections(&[(1, a)], true, &mut out);
+        assert_eq!(out, [a]);
+        out.clear();
+        inventory.update_connections(&[(1, a), (2, b)], true, &mut out);
+        assert_eq!(out, [b]);
+        out.clear();
+        inventory.update_connections(&[(2, b)], false, &mut out);
+        inventory.update_connections(&[(1, a), (2, b)], true, &mut out);
+        assert_eq!(out, []);
+        inventory.update_connections(&[(2, b)], true, &mut out);
+        assert_eq!(inventory.connections.keys().collect::<Vec<_>>(), [&2]);
+        // The cookie is the key, so a closed connection's reused address is still new.
+        inventory.update_connections(&[(2, b), (3, a)], true, &mut out);
+        assert_eq!(out, [a]);
+    }
+
+    #[test]
+    fn owners_are_found_within_the_budget() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let inode = fs::metadata(format!("/proc/self/fd/{}", listener.as_raw_fd())).unwrap().ino() as u32;
+        let mut budget = usize::MAX;
+        assert_eq!(socket_owner(inode, &mut budget), Some(std::process::id()));
+        assert!(budget < usize::MAX);
+        let mut budget = 0;
+        assert_eq!(socket_owner(inode, &mut budget), None);
+    }
+}
@@ -0,0 +1,339 @@
+//! Persistent baseline of known-good file states.
+//!
+//! The baseline is a single file that is memory-mapped and queried in place, so opening it costs
+//! a few syscalls regardless of how many files it describes, and only the pages actually touched
+//! by lookups become resident, apart from the records, which `open` reads once to check that each
+//! refers to bytes inside the strings. Layout (native endian):
+//!
+//! ```text
+//! header  (64 bytes)
+//! records (count * RECORD_SIZE bytes, sorted by path key, then path)
+//! strings (concatenated path bytes referenced by the records)
+//! ```
+
+use std::ffi::OsStr;
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+
+use crate::sys::{replace_file, Mmap};
+
+pub type Digest = [u8; 32];
+
+const MAGIC: [u8; 8] = *b"VCBASE\0\0";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const RECORD_SIZE: usize = 104;
+
+/// The `stat` fields recorded for each file.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct FileMeta {
+    pub dev: u64,
+    pub ino: u64,
+    pub mode: u32,
+    pub uid: u32,
+    pub gid: u32,
+    pub size: u64,
+    pub mtime_ns: i64,
+    pub ctime_ns: i64,
+}
+
+impl FileMeta {
+    pub fn from_metadata(meta: &fs::Metadata) -> FileMeta {
+        FileMeta {
+            dev: meta.dev(),
+            ino: meta.ino(),
+            mode: meta.mode(),
+            uid: meta.uid(),
+            gid: meta.gid(),
+            size: meta.size(),
+            mtime_ns: meta.mtime() * 1_000_000_000 + meta.mtime_nsec(),
+            ctime_ns: meta.ctime() * 1_000_000_000 + meta.ctime_nsec(),
+        }
+    }
+}
+
+/// An owned baseline entry, used when building a baseline.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Entry {
+    pub path: PathBuf,
+    pub meta: FileMeta,
+    pub digest: Digest,
+}
+
+/// A baseline entry borrowed from the mapped file.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Record<'a> {
+    pub path: &'a Path,
+    pub meta: FileMeta,
+    pub digest: &'a Digest,
+}
+
+/// A read-only, memory-mapped baseline.
+pub struct Baseline {
+    map: Mmap,
+    count: usize,
+    strings: usize,
+    digest_algo: u32,
+}
+
+impl Baseline {
+    pub fn open(path: &Path) -> io::Result<Baseline> {
+        let map = Mmap::map(&File::open(path)?, libc::MADV_RANDOM)?;
+        if map.len() < HEADER_SIZE || map[..8] != MAGIC || read_u32(&map, 8) != VERSION {
+            return Err(invalid("not a baseline file"));
+        }
+        if read_u32(&map, 12) as usize != RECORD_SIZE {
+            return Err(invalid("unsupported baseline record size"));
+        }
+        let count = read_u64(&map, 16) as usize;
+        let strings_len = read_u64(&map, 24) as usize;
+        let strings = count.checked_mul(RECORD_SIZE).and_then(|len| len.checked_add(HEADER_SIZE));
+        let Some(strings) = strings.filter(|&strings| strings.checked_add(strings_len) == Some(map.len())) else {
+            return Err(invalid("truncated baseline file"));
+        };
+        // A corrupt record would otherwise panic the first lookup or audit that reaches it.
+        for index in 0..count {
+            let off = record_offset(index);
+            let end = read_u64(&map, off + 8).checked_add(u64::from(read_u32(&map, off + 16)));
+            if end.is_none_or(|end| end > strings_len as u64) {
+                return Err(invalid("baseline record outside the strings"));
+            }
+        }
+        let digest_algo = read_u32(&map, 32);
+        Ok(Baseline { map, count, strings, digest_algo })
+    }
+
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.count == 0
+    }
+
+    /// Identifies the algorithm that produced the digests (see `BaselineBuilder::digest_algo`).
+    pub fn digest_algo(&self) -> u32 {
+        self.digest_algo
+    }
+
+    pub fn get(&self, path: &Path) -> Option<Record<'_>> {
+        let bytes = path.as_os_str().as_bytes();
+        let key = path_key(bytes);
+        // Records are ordered by (key, path); find the first record with our key and scan the
+        // (almost always single) run of equal keys.
+        let (mut lo, mut hi) = (0, self.count);
+        while lo < hi {
+            let mid = lo + (hi - lo) / 2;
+            if read_u64(&self.map, record_offset(mid)) < key {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        (lo..self.count)
+            .take_while(|&i| read_u64(&self.map, record_offset(i)) == key)
+            .map(|i| self.record(i))
+            .find(|record| record.path.as_os_str().as_bytes() == bytes)
+    }
+
+    /// Iterates over all records in storage order (which is not path order).
+    pub fn iter(&self) -> impl Iterator<Item = Record<'_>> + '_ {
+        (0..self.count).map(move |i| self.record(i))
+    }
+
+    /// The record at `index` in storage order.
+    pub fn record(&self, index: usize) -> Record<'_> {
+        let off = record_offset(index);
+        let m = &self.map[..];
+        let path_off = self.strings + read_u64(m, off + 8) as usize;
+        let path_len = read_u32(m, off + 16) as usize;
+        let path = Path::new(OsStr::from_bytes(&m[path_off..path_off + path_len]));
+        let meta = FileMeta {
+            mode: read_u32(m, off + 20),
+            dev: read_u64(m, off + 24),
+            ino: read_u64(m, off + 32),
+            size: read_u64(m, off + 40),
+            mtime_ns: read_u64(m, off + 48) as i64,
+            ctime_ns: read_u64(m, off + 56) as i64,
+            uid: read_u32(m, off + 64),
+            gid: read_u32(m, off + 68),
+        };
+        let digest = m[off + 72..off + 104].try_into().expect("slice length is fixed");
+        Record { path, meta, digest }
+    }
+}
+
+/// Collects entries and writes them out as a new baseline file.
+#[derive(Default)]
+pub struct BaselineBuilder {
+    entries: Vec<Entry>,
+    digest_algo: u32,
+}
+
+impl BaselineBuilder {
+    pub fn new() -> BaselineBuilder {
+        BaselineBuilder::default()
+    }
+
+    /// Records which hash produced the digests, so a baseline is never compared across algorithms.
+    pub fn digest_algo(mut self, algo: u32) -> BaselineBuilder {
+        self.digest_algo = algo;
+        self
+    }
+
+    pub fn push(&mut self, entry: Entry) {
+        self.entries.push(entry);
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Writes the baseline atomically to `path`. Later entries for a path replace earlier ones.
+    pub fn write(self, path: &Path) -> io::Result<()> {
+        let mut entries: Vec<(u64, Entry)> = self
+            .entries
+            .into_iter()
+            .rev()
+            .map(|entry| (path_key(entry.path.as_os_str().as_bytes()), entry))
+            .collect();
+        // Stable sort keeps the reversed push order within a path, so dedup keeps the newest.
+        entries.sort_by(|(ka, a), (kb, b)| ka.cmp(kb).then_with(|| a.path.cmp(&b.path)));
+        entries.dedup_by(|(_, a), (_, b)| a.path == b.path);
+
+        let strings_len: usize = entries.iter().map(|(_, entry)| entry.path.as_os_str().len()).sum();
+        let digest_algo = self.digest_algo;
+        replace_file(path, |out| {
+            let mut header = [0u8; HEADER_SIZE];
+            header[..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_ne_bytes());
+            header[12..16].copy_from_slice(&(RECORD_SIZE as u32).to_ne_bytes());
+            header[16..24].copy_from_slice(&(entries.len() as u64).to_ne_bytes());
+            header[24..32].copy_from_slice(&(strings_len as u64).to_ne_bytes());
+            header[32..36].copy_from_slice(&digest_algo.to_ne_bytes());
+            out.write_all(&header)?;
+
+            let mut path_off = 0u64;
+            for (key, entry) in &entries {
+                let path_len = entry.path.as_os_str().len();
+                let meta = &entry.meta;
+                let mut record = [0u8; RECORD_SIZE];
+                record[0..8].copy_from_slice(&key.to_ne_bytes());
+                record[8..16].copy_from_slice(&path_off.to_ne_bytes());
+                record[16..20].copy_from_slice(&(path_len as u32).to_ne_bytes());
+                record[20..24].copy_from_slice(&meta.mode.to_ne_bytes());
+                record[24..32].copy_from_slice(&meta.dev.to_ne_bytes());
+                record[32..40].copy_from_slice(&meta.ino.to_ne_bytes());
+                record[40..48].copy_from_slice(&meta.size.to_ne_bytes());
+                record[48..56].copy_from_slice(&meta.mtime_ns.to_ne_bytes());
+                record[56..64].copy_from_slice(&meta.ctime_ns.to_ne_bytes());
+                record[64..68].copy_from_slice(&meta.uid.to_ne_bytes());
+                record[68..72].copy_from_slice(&meta.gid.to_ne_bytes());
+                record[72..104].copy_from_slice(&entry.digest);
+                out.write_all(&record)?;
+                path_off += path_len as u64;
+            }
+            for (_, entry) in &entries {
+                out.write_all(entry.path.as_os_str().as_bytes())?;
+            }
+            Ok(())
+        })
+    }
+}
+
+/// FNV-1a over the path bytes. Cheap, stable across runs, and good enough to spread paths.
+fn path_key(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf2_9ce4_8422_2325, |hash, &b| (hash ^ b as u64).wrapping_mul(0x0100_0000_01b3))
+}
+
+fn record_offset(index: usize) -> usize {
+    HEADER_SIZE + index * RECORD_SIZE
+}
+
+fn read_u32(buf: &[u8], off: usize) -> u32 {
+    u32::from_ne_bytes(buf[off..off + 4].try_into().expect("slice length is fixed"))
+}
+
+fn read_u64(buf: &[u8], off: usize) -> u64 {
+    u64::from_ne_bytes(buf[off..off + 8].try_into().expect("slice length is fixed"))
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Baseline, BaselineBuilder, Entry, FileMeta, HEADER_SIZE};
+    use std::fs;
+    use std::io;
+    use std::path::{Path, PathBuf};
+
+    fn entry(path: &str, size: u64) -> Entry {
+        Entry { path: PathBuf::from(path), meta: FileMeta { ino: size + 1, size, ..FileMeta::default() }, digest: [size as u8; 32] }
+    }
+
+    fn write(name: &str, entries: &[Entry]) -> PathBuf {
+        let path = std::env::temp_dir().join(format!("vigilant-canine-baseline-{name}-{}", std::process::id()));
+        let mut builder = BaselineBuilder::new().digest_algo(7);
+        for entry in entries {
+            builder.push(entry.clone());
+        }
+        builder.write(&path).unwrap();
+        path
+    }
+
+    #[test]
+    fn written_entries_are_found() {
+        let entries: Vec<Entry> = (0..100).map(|i| entry(&format!("/etc/file-{i}"), i)).collect();
+        let mut newer = entries.clone();
+        newer.push(entry("/etc/file-7", 200));
+        let path = write("lookup", &newer);
+        let baseline = Baseline::open(&path).unwrap();
+        assert_eq!(baseline.len(), 100);
+        assert_eq!(baseline.digest_algo(), 7);
+        for entry in &entries[..] {
+            let record = baseline.get(&entry.path).unwrap();
+            let expected = if entry.path == Path::new("/etc/file-7") { 200 } else { entry.meta.size };
+            assert_eq!((record.path, record.meta.size, record.digest), (entry.path.as_path(), expected, &[expected as u8; 32]));
+        }
+        assert!(baseline.get(Path::new("/etc/file-100")).is_none());
+        assert!(baseline.get(Path::new("/etc/file-")).is_none());
+        assert_eq!(baseline.iter().count(), 100);
+        fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn corrupt_files_are_rejected() {
+        let path = write("corrupt", &[entry("/bin/sh", 1), entry("/bin/ls", 2)]);
+        let good = fs::read(&path).unwrap();
+        let rejected = |data: &[u8]| {
+            fs::write(&path, data).unwrap();
+            Baseline::open(&path).err().map(|err| err.kind())
+        };
+
+        assert_eq!(rejected(&good[..good.len() - 1]), Some(io::ErrorKind::InvalidData));
+        assert_eq!(rejected(&good[..HEADER_SIZE - 1]), Some(io::ErrorKind::InvalidData));
+        let mut bad = good.clone();
+        bad[0] ^= 1;
+        assert_eq!(rejected(&bad), Some(io::ErrorKind::InvalidData));
+        // A record whose path starts past the strings.
+        let mut bad = good.clone();
+        bad[HEADER_SIZE + 8..HEADER_SIZE + 16].copy_from_slice(&u64::MAX.to_ne_bytes());
+        assert_eq!(rejected(&bad), Some(io::ErrorKind::InvalidData));
+        // A record whose path runs past the strings.
+        let mut bad = good.clone();
+        bad[HEADER_SIZE + 16..HEADER_SIZE + 20].copy_from_slice(&100u32.to_ne_bytes());
+        assert_eq!(rejected(&bad), Some(io::ErrorKind::InvalidData));
+
+        assert_eq!(rejected(&good), None);
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,119 @@
+//! Content digests for monitored files.
+//!
+//! The baseline is a tamper-evidence record, so its digests are SHA-256. The `sha2` crate selects
+//! SHA-NI (x86) or the ARMv8 SHA2 instructions at runtime, which puts it in the GB/s range on
+//! anything recent. Most changes never reach the hash at all: files whose metadata is unchanged
+//! are not read (see `verify`). A faster non-cryptographic digest (XXH3) used to be selectable
+//! for the baseline; it let anyone able to write a file choose one that matches, so baselines
+//! made with it are rejected.
+
+use std::fs::{self, File};
+use std::io::{self, Read};
+use std::os::fd::AsRawFd;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+
+use sha2::{Digest as _, Sha256};
+
+use super::baseline::Digest;
+
+/// Baseline `digest_algo` identifier for SHA-256. (2 was XXH3-128.)
+pub const ALGO_SHA256: u32 = 1;
+
+const READ_CHUNK: usize = 128 * 1024;
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub enum HashAlgo {
+    #[default]
+    Sha256,
+}
+
+impl HashAlgo {
+    pub fn from_id(id: u32) -> Option<HashAlgo> {
+        match id {
+            ALGO_SHA256 => Some(HashAlgo::Sha256),
+            _ => None,
+        }
+    }
+
+    pub fn id(self) -> u32 {
+        match self {
+            HashAlgo::Sha256 => ALGO_SHA256,
+        }
+    }
+
+    pub fn name(self) -> &'static str {
+        match self {
+            HashAlgo::Sha256 => "sha256",
+        }
+    }
+
+    /// The instruction set the implementation will actually use on this CPU, for logging.
+    pub fn implementation(self) -> &'static str {
+        match self {
+            HashAlgo::Sha256 => sha256_implementation(),
+        }
+    }
+}
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn sha256_implementation() -> &'static str {
+    if is_x86_feature_detected!("sha") && is_x86_feature_detected!("sse4.1") && is_x86_feature_detected!("ssse3") {
+        "sha-ni"
+    } else {
+        "portable"
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+fn sha256_implementation() -> &'static str {
+    if std::arch::is_aarch64_feature_detected!("sha2") {
+        "armv8-sha2"
+    } else {
+        "portable"
+    }
+}
+
+#[cfg(not(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64")))]
+fn sha256_implementation() -> &'static str {
+    "portable"
+}
+
+/// Digests whatever `path` is without following it: file contents for regular files, the link
+/// target for symlinks, and all zeroes for anything else.
+pub fn digest_path(path: &Path, meta: &fs::Metadata, algo: HashAlgo) -> io::Result<Digest> {
+    let file_type = meta.file_type();
+    let HashAlgo::Sha256 = algo;
+    let mut hasher = Sha256::new();
+    if file_type.is_symlink() {
+        hasher.update(fs::read_link(path)?.as_os_str().as_bytes());
+        return Ok(hasher.finalize().into());
+    }
+    if !file_type.is_file() {
+        return Ok([0; 32]);
+    }
+    digest_file(&mut File::open(path)?, algo)
+}
+
+/// Digests the contents of `file`, a regular file, from its current offset.
+pub fn digest_file(file: &mut File, algo: HashAlgo) -> io::Result<Digest> {
+    let HashAlgo::Sha256 = algo;
+    let mut hasher = Sha256::new();
+    let fd = file.as_raw_fd();
+    // SAFETY: `fd` is open for as long as `file` lives, and the call only takes integers. The
+    // advice is a hint, so a failure is of no consequence.
+    unsafe { libc::posix_fadvise(fd, 0, 0, libc::POSIX_FADV_SEQUENTIAL) };
+    let mut buf = vec![0; READ_CHUNK];
+    loop {
+        match file.read(&mut buf) {
+            Ok(0) => break,
+            Ok(n) => hasher.update(&buf[..n]),
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+            Err(err) => return Err(err),
+        }
+    }
+    // Audits read each file once; keeping it cached would only push out pages users care about.
+    // SAFETY: as above; `file` is still open.
+    unsafe { libc::posix_fadvise(fd, 0, 0, libc::POSIX_FADV_DONTNEED) };
+    Ok(hasher.finalize().into())
+}
@@ -0,0 +1,7 @@
+//! File integrity monitoring.
+
+pub mod baseline;
+pub mod hash;
+pub mod monitor;
+pub mod scan;
+pub mod verify;
@@ -0,0 +1,394 @@
+//! Event-driven change notification for monitored paths.
+//!
+//! The monitor prefers fanotify, which covers a whole filesystem with one mark and reports
+//! directory-entry changes by file handle. That mode needs `CAP_SYS_ADMIN` and a 5.9+ kernel, so
+//! anywhere it is refused we fall back to inotify with one watch per directory. Either way the
+//! steady-state cost is proportional to what changes, not to how much is monitored.
+//!
+//! A filesystem mark also reports everything outside the monitored roots: journald's writes, our
+//! own alert history. Turning a handle into a path takes `open_by_handle_at` and a `readlink`, so
+//! the verdict for each directory handle is remembered and events in directories already known
+//! to be elsewhere cost one hash lookup. Renaming a directory can move a tree in or out of the
+//! roots, so it forgets every verdict.
+
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::fs;
+use std::io;
+use std::mem;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::unix::ffi::OsStrExt;
+use std::path::{Path, PathBuf};
+
+use crate::sys::{cstr, cvt};
+
+/// Kernel interface used by a [`Monitor`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Backend {
+    Fanotify,
+    Inotify,
+}
+
+/// What happened to a path.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ChangeKind {
+    /// The file was opened for writing and closed.
+    Modified,
+    /// Ownership, permissions, link count or timestamps changed.
+    Attrib,
+    Created,
+    Deleted,
+    MovedFrom,
+    MovedTo,
+    /// The kernel queue overflowed. Events below `path` were lost and it must be rescanned.
+    Overflow,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ChangeEvent {
+    pub path: PathBuf,
+    pub kind: ChangeKind,
+}
+
+// The low event bits are shared by inotify and fanotify.
+const KIND_BITS: [(u32, ChangeKind); 6] = [
+    (libc::IN_DELETE, ChangeKind::Deleted),
+    (libc::IN_MOVED_FROM, ChangeKind::MovedFrom),
+    (libc::IN_CREATE, ChangeKind::Created),
+    (libc::IN_MOVED_TO, ChangeKind::MovedTo),
+    (libc::IN_CLOSE_WRITE, ChangeKind::Modified),
+    (libc::IN_ATTRIB, ChangeKind::Attrib),
+];
+
+const INOTIFY_MASK: u32 = libc::IN_CLOSE_WRITE
+    | libc::IN_ATTRIB
+    | libc::IN_CREATE
+    | libc::IN_DELETE
+    | libc::IN_MOVED_FROM
+    | libc::IN_MOVED_TO
+    | libc::IN_DONT_FOLLOW
+    | libc::IN_EXCL_UNLINK;
+
+const FANOTIFY_MASK: u64 = libc::FAN_CLOSE_WRITE
+    | libc::FAN_ATTRIB
+    | libc::FAN_CREATE
+    | libc::FAN_DELETE
+    | libc::FAN_MOVED_FROM
+    | libc::FAN_MOVED_TO
+    | libc::FAN_ONDIR;
+
+const FAN_EVENT_INFO_TYPE_DFID_NAME: u8 = 2;
+const FAN_EVENT_INFO_TYPE_DFID: u8 = 3;
+const MAX_HANDLE_SZ: usize = 128;
+
+const READ_BUFFER_SIZE: usize = 64 * 1024;
+/// Directory handles whose verdict is remembered; past that the cache starts over.
+const DIR_CACHE_CAPACITY: usize = 4096;
+
+/// Watches a set of root paths (recursively) for changes.
+pub struct Monitor {
+    fd: OwnedFd,
+    roots: Vec<PathBuf>,
+    inner: Inner,
+    buf: Vec<u8>,
+}
+
+enum Inner {
+    /// One descriptor per marked filesystem, used to resolve file handles back to paths, and
+    /// the directories seen so far by fsid and handle: their path if it is in or above a root.
+    Fanotify {
+        mounts: Vec<([libc::c_int; 2], OwnedFd)>,
+        dirs: HashMap<Box<[u8]>, Option<PathBuf>>,
+    },
+    /// Watch descriptor to directory.
+    Inotify { watches: HashMap<libc::c_int, PathBuf> },
+}
+
+impl Monitor {
+    /// Starts monitoring `roots`, using fanotify when permitted and inotify otherwise.
+    pub fn open(roots: &[PathBuf]) -> io::Result<Monitor> {
+        Self::open_fanotify(roots).or_else(|_| Self::open_inotify(roots))
+    }
+
+    /// Starts monitoring `roots` with inotify only.
+    pub fn open_inotify(roots: &[PathBuf]) -> io::Result<Monitor> {
+        let fd = cvt(unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) })?;
+        let mut monitor = Monitor {
+            fd: unsafe { OwnedFd::from_raw_fd(fd) },
+            roots: roots.to_vec(),
+            inner: Inner::Inotify { watches: HashMap::new() },
+            buf: vec![0; READ_BUFFER_SIZE],
+        };
+        for root in roots {
+            monitor.watch_tree(root, None)?;
+        }
+        Ok(monitor)
+    }
+
+    fn open_fanotify(roots: &[PathBuf]) -> io::Result<Monitor> {
+        let fd = cvt(unsafe {
+            libc::fanotify_init(
+                libc::FAN_CLASS_NOTIF | libc::FAN_CLOEXEC | libc::FAN_NONBLOCK | libc::FAN_REPORT_DFID_NAME,
+                (libc::O_RDONLY | libc::O_CLOEXEC) as libc::c_uint,
+            )
+        })?;
+        let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+        let mut mounts: Vec<([libc::c_int; 2], OwnedFd)> = Vec::new();
+        for root in roots {
+            let path = cstr(root)?;
+            cvt(unsafe {
+                libc::fanotify_mark(
+                    fd.as_raw_fd(),
+                    libc::FAN_MARK_ADD | libc::FAN_MARK_FILESYSTEM,
+                    FANOTIFY_MASK,
+                    libc::AT_FDCWD,
+                    path.as_ptr(),
+                )
+            })?;
+            let mut st: libc::statfs = unsafe { mem::zeroed() };
+            cvt(unsafe { libc::statfs(path.as_ptr(), &mut st) })?;
+            let fsid: [libc::c_int; 2] = unsafe { mem::transmute(st.f_fsid) };
+            if mounts.iter().all(|(id, _)| *id != fsid) {
+                let dir = cvt(unsafe { libc::open(path.as_ptr(), libc::O_RDONLY | libc::O_CLOEXEC) })?;
+                mounts.push((fsid, unsafe { OwnedFd::from_raw_fd(dir) }));
+            }
+        }
+        Ok(Monitor {
+            fd,
+            roots: roots.to_vec(),
+            inner: Inner::Fanotify { mounts, dirs: HashMap::new() },
+            buf: vec![0; READ_BUFFER_SIZE],
+        })
+    }
+
+    pub fn backend(&self) -> Backend {
+        match self.inner {
+            Inner::Fanotify { .. } => Backend::Fanotify,
+            Inner::Inotify { .. } => Backend::Inotify,
+        }
+    }
+
+    pub fn roots(&self) -> &[PathBuf] {
+        &self.roots
+    }
+
+    /// Drains all pending notifications into `out` without blocking.
+    pub fn read_events(&mut self, out: &mut Vec<ChangeEvent>) -> io::Result<()> {
+        loop {
+            let n = unsafe { libc::read(self.fd.as_raw_fd(), self.buf.as_mut_ptr().cast(), self.buf.len()) };
+            if n < 0 {
+                let err = io::Error::last_os_error();
+                match err.kind() {
+                    io::ErrorKind::WouldBlock => return Ok(()),
+                    io::ErrorKind::Interrupted => continue,
+                    _ => return Err(err),
+                }
+            }
+            if n == 0 {
+                return Ok(());
+            }
+            let buf = mem::take(&mut self.buf);
+            match self.inner {
+                Inner::Fanotify { .. } => self.parse_fanotify(&buf[..n as usize], out),
+                Inner::Inotify { .. } => self.parse_inotify(&buf[..n as usize], out),
+            }
+            self.buf = buf;
+        }
+    }
+
+    fn parse_fanotify(&mut self, mut buf: &[u8], out: &mut Vec<ChangeEvent>) {
+        const META_LEN: usize = mem::size_of::<libc::fanotify_event_metadata>();
+        while buf.len() >= META_LEN {
+            let meta: libc::fanotify_event_metadata = unsafe { std::ptr::read_unaligned(buf.as_ptr().cast()) };
+            let len = meta.event_len as usize;
+            if len < META_LEN || len > buf.len() {
+                break;
+            }
+            if meta.fd >= 0 {
+                unsafe { libc::close(meta.fd) };
+            }
+            if meta.mask & libc::FAN_Q_OVERFLOW != 0 {
+                self.push_overflow(out);
+            } else if let Some(path) = self.resolve_fid(&buf[meta.metadata_len as usize..len]) {
+                if self.is_monitored(&path) {
+                    push_kinds(meta.mask as u32, &path, out);
+                }
+            }
+            if meta.mask & libc::FAN_ONDIR != 0 && meta.mask & (libc::FAN_MOVED_FROM | libc::FAN_MOVED_TO) != 0 {
+                if let Inner::Fanotify { dirs, .. } = &mut self.inner {
+                    dirs.clear();
+                }
+            }
+            buf = &buf[len..];
+        }
+    }
+
+    /// Turns the directory file handle and entry name of a fanotify event into a path, or
+    /// `None` if the directory is outside the roots.
+    fn resolve_fid(&mut self, mut info: &[u8]) -> Option<PathBuf> {
+        let Inner::Fanotify { mounts, dirs } = &mut self.inner else {
+            return None;
+        };
+        while info.len() >= 4 {
+            let info_type = info[0];
+            let len = u16::from_ne_bytes([info[2], info[3]]) as usize;
+            if len < 4 || len > info.len() {
+                return None;
+            }
+            let record = &info[..len];
+            info = &info[len..];
+            if info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && info_type != FAN_EVENT_INFO_TYPE_DFID {
+                continue;
+            }
+            // header (4) | fsid (8) | handle_bytes (4) | handle_type (4) | f_handle | name
+            if record.len() < 20 {
+                return None;
+            }
+            let fsid = [
+                libc::c_int::from_ne_bytes(record[4..8].try_into().ok()?),
+                libc::c_int::from_ne_bytes(record[8..12].try_into().ok()?),
+            ];
+            let handle_bytes = u32::from_ne_bytes(record[12..16].try_into().ok()?) as usize;
+            if handle_bytes > MAX_HANDLE_SZ || record.len() < 20 + handle_bytes {
+                return None;
+            }
+            let key = &record[4..20 + handle_bytes];
+            let mut path = match dirs.get(key) {
+                Some(dir) => dir.clone()?,
+                None => {
+                    let (_, mount) = mounts.iter().find(|(id, _)| *id == fsid)?;
+                    // The directory may already be gone (ESTALE); nothing left to attribute then.
+                    let dir = open_by_handle(mount, &record[12..20 + handle_bytes])?;
+                    let roots = &self.roots;
+                    let dir = Some(dir).filter(|dir| roots.iter().any(|root| dir.starts_with(root) || root.starts_with(dir)));
+                    if dirs.len() >= DIR_CACHE_CAPACITY {
+                        dirs.clear();
+                    }
+                    dirs.insert(key.into(), dir.clone());
+                    dir?
+                }
+            };
+            if info_type == FAN_EVENT_INFO_TYPE_DFID_NAME {
+                let name = &record[20 + handle_bytes..];
+                let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+                if !name.is_empty() && name != b"." {
+                    path.push(OsStr::from_bytes(name));
+                }
+            }
+            return Some(path);
+        }
+        None
+    }
+
+    fn parse_inotify(&mut self, mut buf: &[u8], out: &mut Vec<ChangeEvent>) {
+        const HEADER_LEN: usize = mem::size_of::<libc::inotify_event>();
+        while buf.len() >= HEADER_LEN {
+            let event: libc::inotify_event = unsafe { std::ptr::read_unaligned(buf.as_ptr().cast()) };
+            let len = HEADER_LEN + event.len as usize;
+            if len > buf.len() {
+                break;
+            }
+            let name = &buf[HEADER_LEN..len];
+            let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+            buf = &buf[len..];
+
+            if event.mask & libc::IN_Q_OVERFLOW != 0 {
+                self.push_overflow(out);
+                continue;
+            }
+            let Inner::Inotify { watches } = &mut self.inner else {
+                return;
+            };
+            if event.mask & libc::IN_IGNORED != 0 {
+                watches.remove(&event.wd);
+                continue;
+            }
+            let Some(dir) = watches.get(&event.wd) else {
+                continue;
+            };
+            let path = if name.is_empty() { dir.clone() } else { dir.join(OsStr::from_bytes(name)) };
+            push_kinds(event.mask, &path, out);
+
+            // New directories need their own watches, and anything created in them before the
+            // watch existed would otherwise go unseen.
+            if event.mask & libc::IN_ISDIR != 0 && event.mask & (libc::IN_CREATE | libc::IN_MOVED_TO) != 0 {
+                let mut found = Vec::new();
+                if self.watch_tree(&path, Some(&mut found)).is_ok() {
+                    out.extend(found.into_iter().map(|path| ChangeEvent { path, kind: ChangeKind::Created }));
+                }
+            }
+        }
+    }
+
+    /// Adds inotify watches to `root` and every directory below it, without following symlinks.
+    fn watch_tree(&mut self, root: &Path, mut found: Option<&mut Vec<PathBuf>>) -> io::Result<()> {
+        let Inner::Inotify { watches } = &mut self.inner else {
+            return Ok(());
+        };
+        let mut pending = vec![root.to_path_buf()];
+        while let Some(dir) = pending.pop() {
+            let path = cstr(&dir)?;
+            let wd = match cvt(unsafe { libc::inotify_add_watch(self.fd.as_raw_fd(), path.as_ptr(), INOTIFY_MASK) }) {
+                Ok(wd) => wd,
+                // Entries can vanish while we walk; the parent's watch reports that.
+                Err(err) if dir != root && err.kind() == io::ErrorKind::NotFound => continue,
+                Err(err) => return Err(err),
+            };
+            let Ok(entries) = fs::read_dir(&dir) else {
+                watches.insert(wd, dir);
+                continue;
+            };
+            for entry in entries.flatten() {
+                let Ok(file_type) = entry.file_type() else {
+                    continue;
+                };
+                if file_type.is_dir() {
+                    pending.push(entry.path());
+                } else if let Some(found) = found.as_deref_mut() {
+                    found.push(entry.path());
+                }
+            }
+            watches.insert(wd, dir);
+        }
+        Ok(())
+    }
+
+    fn is_monitored(&self, path: &Path) -> bool {
+        self.roots.iter().any(|root| path.starts_with(root))
+    }
+
+    fn push_overflow(&self, out: &mut Vec<ChangeEvent>) {
+        out.extend(self.roots.iter().map(|root| ChangeEvent { path: root.clone(), kind: ChangeKind::Overflow }));
+    }
+}
+
+/// Resolves `handle` (a `struct file_handle`) on the filesystem of `mount` to a path.
+fn open_by_handle(mount: &OwnedFd, handle: &[u8]) -> Option<PathBuf> {
+    // struct file_handle must be 4-byte aligned, which the read buffer does not promise.
+    let mut aligned = [0u32; (8 + MAX_HANDLE_SZ) / 4];
+    unsafe {
+        std::ptr::copy_nonoverlapping(handle.as_ptr(), aligned.as_mut_ptr().cast::<u8>(), handle.len());
+    }
+    let dir = unsafe {
+        libc::syscall(libc::SYS_open_by_handle_at, mount.as_raw_fd(), aligned.as_mut_ptr(), libc::O_PATH | libc::O_CLOEXEC)
+    };
+    if dir < 0 {
+        return None;
+    }
+    let dir = unsafe { OwnedFd::from_raw_fd(dir as RawFd) };
+    fs::read_link(format!("/proc/self/fd/{}", dir.as_raw_fd())).ok()
+}
+
+impl AsRawFd for Monitor {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+}
+
+fn push_kinds(mask: u32, path: &Path, out: &mut Vec<ChangeEvent>) {
+    for (bit, kind) in KIND_BITS {
+        if mask & bit != 0 {
+            out.push(ChangeEvent { path: path.to_path_buf(), kind });
+        }
+    }
+}
@@ -0,0 +1,237 @@
+//! Parallel filesystem walk that builds a new baseline.
+//!
+//! Traversal, reads and hashing all run as tasks on one bounded pool of work-stealing workers,
+//! so directory listing on one device overlaps with hashing on another. Reads are throttled per
+//! device: a spinning disk gets one reader at a time (seeking between files is what makes
+//! naive parallel hashing slower than a single thread), while SSDs and NVMe get one per worker.
+
+use std::collections::{HashMap, VecDeque};
+use std::fs;
+use std::io;
+use std::os::unix::fs::MetadataExt;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use super::baseline::{BaselineBuilder, Entry, FileMeta};
+use super::hash::{digest_path, HashAlgo};
+
+#[derive(Debug, Clone, Copy)]
+pub struct ScanOptions {
+    /// Number of worker threads.
+    pub threads: usize,
+    /// Concurrent reads allowed per non-rotational device.
+    pub solid_state_depth: usize,
+    pub algo: HashAlgo,
+}
+
+impl Default for ScanOptions {
+    fn default() -> ScanOptions {
+        let threads = thread::available_parallelism().map_or(4, |n| n.get());
+        ScanOptions { threads, solid_state_depth: threads, algo: HashAlgo::default() }
+    }
+}
+
+/// Counts of what a scan saw, for reporting.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ScanStats {
+    pub files: usize,
+    pub directories: usize,
+    /// Entries that vanished or could not be read while scanning.
+    pub errors: usize,
+}
+
+enum Task {
+    Dir(PathBuf),
+    File(PathBuf, fs::Metadata),
+}
+
+/// Walks `roots` without following symlinks and hashes every entry into a baseline builder.
+pub fn scan(roots: &[PathBuf], options: ScanOptions) -> io::Result<(BaselineBuilder, ScanStats)> {
+    let threads = options.threads.max(1);
+    let pool = Pool {
+        algo: options.algo,
+        queues: (0..threads).map(|_| Mutex::new(VecDeque::new())).collect(),
+        pending: AtomicUsize::new(0),
+        idle: (Mutex::new(()), Condvar::new()),
+        devices: Devices { slots: Mutex::new(HashMap::new()), released: Condvar::new(), solid_state_depth: options.solid_state_depth.max(1) },
+    };
+    for (i, root) in roots.iter().enumerate() {
+        let meta = fs::symlink_metadata(root)?;
+        let task = if meta.is_dir() { Task::Dir(root.clone()) } else { Task::File(root.clone(), meta) };
+        pool.push(i % threads, task);
+    }
+
+    let results: Vec<(Vec<Entry>, ScanStats)> = thread::scope(|scope| {
+        let pool = &pool;
+        let workers: Vec<_> = (0..threads).map(|id| scope.spawn(move || pool.work(id))).collect();
+        workers.into_iter().map(|worker| worker.join().expect("scan worker panicked")).collect()
+    });
+
+    let mut builder = BaselineBuilder::new().digest_algo(options.algo.id());
+    let mut stats = ScanStats::default();
+    for (entries, worker_stats) in results {
+        stats.files += worker_stats.files;
+        stats.directories += worker_stats.directories;
+        stats.errors += worker_stats.errors;
+        entries.into_iter().for_each(|entry| builder.push(entry));
+    }
+    Ok((builder, stats))
+}
+
+struct Pool {
+    algo: HashAlgo,
+    /// One deque per worker: the owner pushes and pops at the back (depth-first, which keeps
+    /// the frontier small), thieves take from the front.
+    queues: Vec<Mutex<VecDeque<Task>>>,
+    /// Tasks queued or running; the scan is finished when this drops to zero.
+    pending: AtomicUsize,
+    idle: (Mutex<()>, Condvar),
+    devices: Devices,
+}
+
+impl Pool {
+    fn push(&self, worker: usize, task: Task) {
+        self.pending.fetch_add(1, Ordering::SeqCst);
+        self.queues[worker].lock().unwrap().push_back(task);
+        self.idle.1.notify_one();
+    }
+
+    fn pop(&self, worker: usize) -> Option<Task> {
+        if let Some(task) = self.queues[worker].lock().unwrap().pop_back() {
+            return Some(task);
+        }
+        let n = self.queues.len();
+        (1..n).find_map(|i| self.queues[(worker + i) % n].lock().unwrap().pop_front())
+    }
+
+    fn work(&self, id: usize) -> (Vec<Entry>, ScanStats) {
+        let mut entries = Vec::new();
+        let mut stats = ScanStats::default();
+        let mut deferred = 0;
+        loop {
+            let Some(task) = self.pop(id) else {
+                if self.pending.load(Ordering::SeqCst) == 0 {
+                    self.idle.1.notify_all();
+                    return (entries, stats);
+                }
+                // Timed so a missed notification costs a millisecond rather than a hang.
+                let guard = self.idle.0.lock().unwrap();
+                drop(self.idle.1.wait_timeout(guard, Duration::from_millis(1)).unwrap());
+                continue;
+            };
+            match task {
+                Task::Dir(dir) => {
+                    stats.directories += 1;
+                    match fs::read_dir(&dir) {
+                        Ok(children) => {
+                            for child in children.flatten() {
+                                match child.metadata() {
+                                    Ok(meta) if meta.is_dir() => self.push(id, Task::Dir(child.path())),
+                                    Ok(meta) => self.push(id, Task::File(child.path(), meta)),
+                                    Err(_) => stats.errors += 1,
+                                }
+                            }
+                        }
+                        Err(_) => stats.errors += 1,
+                    }
+                }
+                Task::File(path, meta) => {
+                    let dev = meta.dev();
+                    // Rather than idle behind a busy disk, requeue the file and go do something
+                    // else; only block once everything we hold is waiting on a device.
+                    let permit = if deferred <= self.queues[id].lock().unwrap().len() {
+                        self.devices.try_acquire(dev)
+                    } else {
+                        Some(self.devices.acquire(dev))
+                    };
+                    let Some(permit) = permit else {
+                        deferred += 1;
+                        self.queues[id].lock().unwrap().push_front(Task::File(path, meta));
+                        continue;
+                    };
+                    deferred = 0;
+                    match digest_path(&path, &meta, self.algo) {
+                        Ok(digest) => {
+                            stats.files += 1;
+                            entries.push(Entry { path, meta: FileMeta::from_metadata(&meta), digest });
+                        }
+                        Err(_) => stats.errors += 1,
+                    }
+                    drop(permit);
+                }
+            }
+            self.pending.fetch_sub(1, Ordering::SeqCst);
+        }
+    }
+}
+
+/// Per-device read concurrency limits.
+struct Devices {
+    /// Device number to (limit, readers in flight).
+    slots: Mutex<HashMap<u64, (usize, usize)>>,
+    released: Condvar,
+    solid_state_depth: usize,
+}
+
+struct Permit<'a> {
+    devices: &'a Devices,
+    dev: u64,
+}
+
+impl Devices {
+    fn try_acquire(&self, dev: u64) -> Option<Permit<'_>> {
+        let mut slots = self.slots.lock().unwrap();
+        let slot = slots.entry(dev).or_insert_with(|| (self.limit(dev), 0));
+        if slot.1 >= slot.0 {
+            return None;
+        }
+        slot.1 += 1;
+        Some(Permit { devices: self, dev })
+    }
+
+    fn acquire(&self, dev: u64) -> Permit<'_> {
+        let mut slots = self.slots.lock().unwrap();
+        loop {
+            let slot = slots.entry(dev).or_insert_with(|| (self.limit(dev), 0));
+            if slot.1 < slot.0 {
+                slot.1 += 1;
+                return Permit { devices: self, dev };
+            }
+            slots = self.released.wait(slots).unwrap();
+        }
+    }
+
+    fn limit(&self, dev: u64) -> usize {
+        if is_rotational(dev) {
+            1
+        } else {
+            self.solid_state_depth
+        }
+    }
+}
+
+impl Drop for Permit<'_> {
+    fn drop(&mut self) {
+        if let Some(slot) = self.devices.slots.lock().unwrap().get_mut(&self.dev) {
+            slot.1 -= 1;
+        }
+        self.devices.released.notify_all();
+    }
+}
+
+/// Whether the block device behind `dev` is a spinning disk. Partitions keep their queue
+/// settings on the parent disk; anything we cannot resolve (tmpfs, overlay, network) is treated
+/// as solid state.
+fn is_rotational(dev: u64) -> bool {
+    let (major, minor) = (libc::major(dev), libc::minor(dev));
+    let Ok(sysfs) = fs::canonicalize(format!("/sys/dev/block/{major}:{minor}")) else {
+        return false;
+    };
+    [sysfs.join("queue/rotational"), sysfs.join("../queue/rotational")]
+        .iter()
+        .find_map(|path| fs::read_to_string(path).ok())
+        .is_some_and(|value| value.trim() == "1")
+}
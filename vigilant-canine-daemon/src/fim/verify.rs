@@ -0,0 +1,395 @@
+//! Checking files against the baseline.
+//!
+//! Verification is metadata-first: the current `lstat` is compared with the recorded state and
+//! contents are only read when it differs, or during a deep audit. Any legitimate write changes
+//! mtime/ctime, so a match means the file was not written through the filesystem; deep audits
+//! exist to catch the rest (e.g. tampering with the block device or restored timestamps) on a
+//! cadence slow enough not to matter for battery or disk wear. When the last one ran is wall-clock
+//! time kept by the caller across restarts; a machine that reboots daily would otherwise never
+//! get to one.
+//!
+//! An audit, deep or not, reads every file of the baseline, far too much to do on the event
+//! loop. The verifier hands it out in [`AuditBatch`]es of a few hundred paths, each carrying the
+//! states known when it was taken; the caller runs them on a worker thread and gives them back,
+//! and the findings of a path are dropped if a check on the loop got to it in the meantime.
+
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime};
+
+use super::baseline::{Baseline, Digest, FileMeta};
+use super::hash::{digest_path, HashAlgo};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Change {
+    /// The path exists but is not in the baseline.
+    Added,
+    Removed,
+    /// The contents (or symlink target) differ.
+    Content,
+    /// Same contents, but the file type, permissions, owner or inode changed.
+    Metadata,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Finding {
+    pub path: PathBuf,
+    pub change: Change,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct VerifyPolicy {
+    /// How often every baseline file is rehashed regardless of metadata.
+    pub deep_audit_interval: Duration,
+}
+
+impl Default for VerifyPolicy {
+    fn default() -> VerifyPolicy {
+        VerifyPolicy { deep_audit_interval: Duration::from_secs(7 * 24 * 60 * 60) }
+    }
+}
+
+/// Last known state of a path; `None` means it is known not to exist.
+type State = Option<(FileMeta, Digest)>;
+
+/// What checking a path found: the change, if any, and the state it is in now.
+type Checked = (Option<Change>, State);
+
+/// Most paths whose state differs from the baseline that are remembered. Past that, changes to
+/// further paths are reported on every check instead of once.
+const OBSERVED_CAPACITY: usize = 65536;
+
+pub struct Verifier {
+    baseline: Baseline,
+    /// Always the baseline's algorithm; digests are never compared across algorithms.
+    algo: HashAlgo,
+    policy: VerifyPolicy,
+    /// States that differ from the baseline and have already been reported, so a change is
+    /// reported (and hashed) once rather than on every check. A path whose state is back to
+    /// the baseline's is dropped.
+    observed: HashMap<PathBuf, State>,
+    last_deep_audit: SystemTime,
+    /// The audit under way, if any.
+    audit: Option<Audit>,
+    /// Whether another audit, deep if `true`, is to follow the one under way.
+    queued: Option<bool>,
+}
+
+struct Audit {
+    deep: bool,
+    /// The next baseline record to check.
+    next: usize,
+    /// Files added since the baseline was taken, only known from earlier checks; checked after
+    /// the baseline's.
+    added: Vec<PathBuf>,
+}
+
+/// What [`Verifier::next_batch`] has for the caller.
+pub enum AuditStep {
+    Batch(AuditBatch),
+    /// The audit under way just ended.
+    Finished { deep: bool },
+    /// No audit is under way.
+    Idle,
+}
+
+/// Part of an audit, to be checked off the event loop with [`run`](AuditBatch::run) and handed
+/// back to [`Verifier::apply`].
+pub struct AuditBatch {
+    algo: HashAlgo,
+    deep: bool,
+    /// Each path, its state when the batch was taken and, once run, what checking it found
+    /// (`None` if it could not be read).
+    paths: Vec<(PathBuf, State, Option<Checked>)>,
+}
+
+impl AuditBatch {
+    pub fn is_deep(&self) -> bool {
+        self.deep
+    }
+
+    /// Checks the batch's paths; this is the part that reads files.
+    pub fn run(mut self) -> AuditBatch {
+        for (path, known, checked) in &mut self.paths {
+            // Unreadable files are reported by the next successful check.
+            *checked = inspect(path, *known, self.algo, self.deep).ok();
+        }
+        self
+    }
+}
+
+impl Verifier {
+    /// Verifies against `baseline`, whose files were last all hashed at `last_deep_audit`.
+    pub fn new(baseline: Baseline, policy: VerifyPolicy, last_deep_audit: SystemTime) -> io::Result<Verifier> {
+        let Some(algo) = HashAlgo::from_id(baseline.digest_algo()) else {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "baseline uses an unsupported hash algorithm; build it again"));
+        };
+        Ok(Verifier { baseline, algo, policy, observed: HashMap::new(), last_deep_audit, audit: None, queued: None })
+    }
+
+    pub fn baseline(&self) -> &Baseline {
+        &self.baseline
+    }
+
+    pub fn algo(&self) -> HashAlgo {
+        self.algo
+    }
+
+    /// Checks one path, hashing it only if its metadata no longer matches the known state.
+    pub fn check(&mut self, path: &Path) -> io::Result<Option<Change>> {
+        let recorded = recorded(&self.baseline, path);
+        let known = self.observed.get(path).copied().unwrap_or(recorded);
+        let (change, state) = inspect(path, known, self.algo, false)?;
+        settle(&mut self.observed, path, recorded, known, state);
+        Ok(change)
+    }
+
+    /// Starts checking every known path, in batches taken with [`next_batch`](Verifier::next_batch).
+    /// A deep audit rehashes everything; otherwise only files whose metadata changed are read,
+    /// which makes it cheap enough to run after a queue overflow. Asked for while one is under
+    /// way, another audit (deep if either is) follows it, as the paths already checked may have
+    /// changed since.
+    pub fn start_audit(&mut self, deep: bool) {
+        if self.audit.is_some() {
+            self.queued = Some(self.queued.unwrap_or(false) | deep);
+            return;
+        }
+        let added = self.observed.keys().filter(|path| self.baseline.get(path).is_none()).cloned().collect();
+        self.audit = Some(Audit { deep, next: 0, added });
+    }
+
+    pub fn is_auditing(&self) -> bool {
+        self.audit.is_some()
+    }
+
+    /// The next batch of at most `max` paths of the audit under way. Once it has handed them all
+    /// out, ends the audit, starting the queued one if any.
+    pub fn next_batch(&mut self, max: usize) -> AuditStep {
+        let Some(audit) = &mut self.audit else {
+            return AuditStep::Idle;
+        };
+        let mut paths = Vec::with_capacity(max);
+        while paths.len() < max {
+            let path = if audit.next < self.baseline.len() {
+                audit.next += 1;
+                self.baseline.record(audit.next - 1).path.to_path_buf()
+            } else if let Some(path) = audit.added.pop() {
+                path
+            } else {
+                break;
+            };
+            let known = self.observed.get(&path).copied().unwrap_or_else(|| recorded(&self.baseline, &path));
+            paths.push((path, known, None));
+        }
+        if !paths.is_empty() {
+            return AuditStep::Batch(AuditBatch { algo: self.algo, deep: audit.deep, paths });
+        }
+        let deep = audit.deep;
+        if deep {
+            self.last_deep_audit = SystemTime::now();
+        }
+        self.audit = None;
+        if let Some(deep) = self.queued.take() {
+            self.start_audit(deep);
+        }
+        AuditStep::Finished { deep }
+    }
+
+    /// Takes in a batch that has been run, appending what changed to `out`.
+    pub fn apply(&mut self, batch: AuditBatch, out: &mut Vec<Finding>) {
+        for (path, known, checked) in batch.paths {
+            let Some((change, state)) = checked else { continue };
+            let recorded = recorded(&self.baseline, &path);
+            // A check on the loop got to the path while the batch ran; what it saw is newer.
+            if self.observed.get(&path).copied().unwrap_or(recorded) != known {
+                continue;
+            }
+            settle(&mut self.observed, &path, recorded, known, state);
+            if let Some(change) = change {
+                out.push(Finding { path, change });
+            }
+        }
+    }
+
+    /// When the last deep audit finished, for the caller to keep.
+    pub fn last_deep_audit(&self) -> SystemTime {
+        self.last_deep_audit
+    }
+
+    /// Time left until the next deep audit is due. A last audit in the future (the clock was
+    /// set back) counts as one just done.
+    pub fn until_deep_audit(&self) -> Duration {
+        let elapsed = SystemTime::now().duration_since(self.last_deep_audit).unwrap_or(Duration::ZERO);
+        self.policy.deep_audit_interval.saturating_sub(elapsed)
+    }
+}
+
+fn recorded(baseline: &Baseline, path: &Path) -> State {
+    baseline.get(path).map(|record| (record.meta, *record.digest))
+}
+
+/// Compares `path` with its `known` state, returning what changed and the state it is in now.
+fn inspect(path: &Path, known: State, algo: HashAlgo, deep: bool) -> io::Result<Checked> {
+    let current = match fs::symlink_metadata(path) {
+        Ok(meta) => Some(meta),
+        Err(err) if err.kind() == io::ErrorKind::NotFound => None,
+        Err(err) => return Err(err),
+    };
+    // The baseline holds everything but directories (see `scan`), so a directory that was not
+    // in it is no news; one that replaced a file still is.
+    if known.is_none() && current.as_ref().is_some_and(fs::Metadata::is_dir) {
+        return Ok((None, known));
+    }
+    Ok(match (known, current) {
+        (None, None) => (None, None),
+        (Some(_), None) => (Some(Change::Removed), None),
+        (None, Some(meta)) => (Some(Change::Added), Some((FileMeta::from_metadata(&meta), digest_path(path, &meta, algo)?))),
+        (Some((known_meta, known_digest)), Some(meta)) => {
+            let current_meta = FileMeta::from_metadata(&meta);
+            if current_meta == known_meta && !deep {
+                return Ok((None, known));
+            }
+            let digest = digest_path(path, &meta, algo)?;
+            let change = if digest != known_digest {
+                Some(Change::Content)
+            } else if (current_meta.dev, current_meta.ino, current_meta.mode, current_meta.uid, current_meta.gid)
+                != (known_meta.dev, known_meta.ino, known_meta.mode, known_meta.uid, known_meta.gid)
+            {
+                Some(Change::Metadata)
+            } else {
+                // Only timestamps moved (e.g. `touch`); remember them so we do not rehash again.
+                None
+            };
+            (change, Some((current_meta, digest)))
+        }
+    })
+}
+
+/// Remembers that `path`, last known as `known`, is now in `state`.
+fn settle(observed: &mut HashMap<PathBuf, State>, path: &Path, recorded: State, known: State, state: State) {
+    if state == recorded {
+        observed.remove(path);
+    } else if state != known && (observed.len() < OBSERVED_CAPACITY || observed.contains_key(path)) {
+        observed.insert(path.to_path_buf(), state);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::path::{Path, PathBuf};
+    use std::time::{Duration, SystemTime};
+
+    use super::{AuditStep, Change, Finding, Verifier, VerifyPolicy};
+    use crate::fim::baseline::{Baseline, BaselineBuilder, Entry, FileMeta};
+    use crate::fim::hash::{digest_path, HashAlgo};
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-verify-{}-{name}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn entry(path: &Path) -> Entry {
+        let meta = fs::symlink_metadata(path).unwrap();
+        Entry { path: path.to_path_buf(), meta: FileMeta::from_metadata(&meta), digest: digest_path(path, &meta, HashAlgo::Sha256).unwrap() }
+    }
+
+    /// A verifier over `entries`, with the baseline kept in `dir`.
+    fn verifier(dir: &Path, entries: Vec<Entry>) -> Verifier {
+        let mut builder = BaselineBuilder::new().digest_algo(HashAlgo::Sha256.id());
+        entries.into_iter().for_each(|entry| builder.push(entry));
+        let path = dir.join("baseline");
+        builder.write(&path).unwrap();
+        Verifier::new(Baseline::open(&path).unwrap(), VerifyPolicy::default(), SystemTime::now()).unwrap()
+    }
+
+    /// Runs an audit to the end, each batch on the spot.
+    fn audit(verifier: &mut Verifier, deep: bool) -> Vec<Finding> {
+        let mut findings = Vec::new();
+        verifier.start_audit(deep);
+        loop {
+            match verifier.next_batch(2) {
+                AuditStep::Batch(batch) => verifier.apply(batch.run(), &mut findings),
+                AuditStep::Finished { deep: finished } => {
+                    assert_eq!(finished, deep);
+                    return findings;
+                }
+                AuditStep::Idle => panic!("no audit under way"),
+            }
+        }
+    }
+
+    #[test]
+    fn unchanged_metadata_is_not_hashed_until_a_deep_audit() {
+        let dir = scratch("metadata");
+        let file = dir.join("file");
+        fs::write(&file, "original").unwrap();
+        // A recorded digest that does not match: only hashing notices.
+        let mut recorded = entry(&file);
+        recorded.digest[0] ^= 1;
+        let mut verifier = verifier(&dir, vec![recorded]);
+
+        assert_eq!(verifier.check(&file).unwrap(), None);
+        assert!(audit(&mut verifier, false).is_empty());
+        let before = verifier.last_deep_audit();
+        assert_eq!(audit(&mut verifier, true), [Finding { path: file.clone(), change: Change::Content }]);
+        assert!(verifier.last_deep_audit() >= before);
+        // Reported once; the next deep audit compares with what it found.
+        assert!(audit(&mut verifier, true).is_empty());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn a_touch_only_refreshes_the_known_state() {
+        let dir = scratch("touch");
+        let file = dir.join("file");
+        fs::write(&file, "contents").unwrap();
+        let mut verifier = verifier(&dir, vec![entry(&file)]);
+
+        let touched = SystemTime::now() + Duration::from_secs(3600);
+        fs::File::options().write(true).open(&file).unwrap().set_modified(touched).unwrap();
+        assert_eq!(verifier.check(&file).unwrap(), None);
+        let current = FileMeta::from_metadata(&fs::symlink_metadata(&file).unwrap());
+        assert_eq!(verifier.observed.get(&file).and_then(|state| state.map(|(meta, _)| meta)), Some(current));
+
+        // Content changes are still noticed after that, once.
+        fs::write(&file, "tampered").unwrap();
+        assert_eq!(verifier.check(&file).unwrap(), Some(Change::Content));
+        assert_eq!(verifier.check(&file).unwrap(), None);
+        fs::remove_file(&file).unwrap();
+        assert_eq!(verifier.check(&file).unwrap(), Some(Change::Removed));
+        // Back to what the baseline has: forgotten again.
+        fs::write(&file, "contents").unwrap();
+        assert_eq!(verifier.check(&file).unwrap(), Some(Change::Added));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn audit_findings_give_way_to_newer_checks() {
+        let dir = scratch("race");
+        let (first, second) = (dir.join("first"), dir.join("second"));
+        fs::write(&first, "one").unwrap();
+        fs::write(&second, "two").unwrap();
+        let mut verifier = verifier(&dir, vec![entry(&first), entry(&second)]);
+
+        verifier.start_audit(false);
+        let AuditStep::Batch(batch) = verifier.next_batch(16) else { panic!("no batch") };
+        fs::write(&first, "one, changed").unwrap();
+        fs::write(&second, "two, changed").unwrap();
+        // The loop sees a change to `first` while the batch is out.
+        assert_eq!(verifier.check(&first).unwrap(), Some(Change::Content));
+        let mut findings = Vec::new();
+        verifier.apply(batch.run(), &mut findings);
+        assert_eq!(findings, [Finding { path: second.clone(), change: Change::Content }]);
+        assert!(matches!(verifier.next_batch(16), AuditStep::Finished { deep: false }));
+        assert!(!verifier.is_auditing());
+        // Neither is reported again.
+        assert!(audit(&mut verifier, false).is_empty());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,291 @@
+//! The daemon's end of the client socket.
+//!
+//! The listener and every connection are non-blocking and registered with the daemon's
+//! [`Reactor`] next to the monitors, so any number of CLI and GUI clients are served without a
+//! thread each and a slow client never holds up detection. Each connection keeps its own input
+//! and output buffers. Requests are answered one at a time: the next one is only decoded, or
+//! read from the socket, once the previous reply has been written out, which is all the
+//! backpressure a request/response protocol needs, however many requests a client pipelines.
+//! A connection waiting for its reply to drain, or holding a request it has read but not yet
+//! answered, is watched for writability instead of readability, so that it is served again on
+//! the next wakeup and one client gets through one request per wakeup.
+
+use std::fs;
+use std::io::{self, Read, Write};
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::PermissionsExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+
+use vigilant_canine_proto::{decode_frame, Request, Response};
+
+use crate::reactor::{Interest, Reactor, Token};
+
+/// Connections beyond this are closed as soon as they are accepted.
+const MAX_CLIENTS: usize = 64;
+const READ_CHUNK: usize = 16 * 1024;
+
+pub struct Server {
+    listener: UnixListener,
+    path: PathBuf,
+    /// The listener's token; client `i` has the token right after it plus `i`.
+    token: Token,
+    clients: Vec<Option<Connection>>,
+}
+
+struct Connection {
+    stream: UnixStream,
+    input: Vec<u8>,
+    output: Vec<u8>,
+    /// Bytes of `output` already sent.
+    written: usize,
+}
+
+impl Server {
+    /// Listens on `path`, replacing a socket left behind by a daemon that is no longer running.
+    /// Only root may connect. The listener is registered with `reactor` as `token` and clients
+    /// get the tokens after it, up to `token + MAX_CLIENTS`.
+    pub fn bind(path: &Path, reactor: &Reactor, token: Token) -> io::Result<Server> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+        match fs::symlink_metadata(path) {
+            Ok(_) if UnixStream::connect(path).is_ok() => {
+                return Err(io::Error::new(io::ErrorKind::AddrInUse, "another daemon is listening"));
+            }
+            Ok(_) => fs::remove_file(path)?,
+            Err(err) if err.kind() == io::ErrorKind::NotFound => {}
+            Err(err) => return Err(err),
+        }
+        let listener = UnixListener::bind(path)?;
+        fs::set_permissions(path, fs::Permissions::from_mode(0o600))?;
+        listener.set_nonblocking(true)?;
+        reactor.register(listener.as_raw_fd(), token, Interest::Readable)?;
+        Ok(Server { listener, path: path.to_path_buf(), token, clients: Vec::new() })
+    }
+
+    pub fn clients(&self) -> usize {
+        self.clients.iter().flatten().count()
+    }
+
+    /// Whether `token` is the listener's or a client's.
+    pub fn owns(&self, token: Token) -> bool {
+        (self.token.0..=self.token.0 + MAX_CLIENTS as u64).contains(&token.0)
+    }
+
+    /// Handles readiness of `token` (one the server [owns](Server::owns)): accepts new clients
+    /// or serves one. `handler` appends the framed response to a request to its output buffer.
+    pub fn dispatch<F: FnOnce(Request, &mut Vec<u8>)>(&mut self, reactor: &Reactor, token: Token, handler: F) {
+        if token == self.token {
+            self.accept(reactor);
+            return;
+        }
+        let slot = (token.0 - self.token.0 - 1) as usize;
+        let Some(client) = self.clients.get_mut(slot).and_then(Option::as_mut) else {
+            return;
+        };
+        let was_pending = client.pending();
+        match client.serve(handler) {
+            Ok(()) if client.pending() == was_pending => {}
+            Ok(()) => {
+                let interest = if client.pending() { Interest::Writable } else { Interest::Readable };
+                if reactor.reregister(client.stream.as_raw_fd(), token, interest).is_err() {
+                    self.clients[slot] = None;
+                }
+            }
+            // Closing the stream also removes it from the reactor.
+            Err(_) => self.clients[slot] = None,
+        }
+    }
+
+    fn accept(&mut self, reactor: &Reactor) {
+        loop {
+            match self.listener.accept() {
+                Ok((stream, _)) => {
+                    let slot = match self.clients.iter().position(Option::is_none) {
+                        Some(slot) => slot,
+                        None if self.clients.len() < MAX_CLIENTS => {
+                            self.clients.push(None);
+                            self.clients.len() - 1
+                        }
+                        None => continue,
+                    };
+                    let token = Token(self.token.0 + 1 + slot as u64);
+                    if stream.set_nonblocking(true).is_err() || reactor.register(stream.as_raw_fd(), token, Interest::Readable).is_err() {
+                        continue;
+                    }
+                    self.clients[slot] = Some(Connection { stream, input: Vec::new(), output: Vec::new(), written: 0 });
+                }
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                // WouldBlock once the backlog is empty; anything else (EMFILE, ...) is retried on
+                // the next wakeup.
+                Err(_) => return,
+            }
+        }
+    }
+}
+
+impl Drop for Server {
+    fn drop(&mut self) {
+        let _ = fs::remove_file(&self.path);
+    }
+}
+
+impl Connection {
+    /// Whether a reply is waiting for the socket to accept more data.
+    fn writing(&self) -> bool {
+        self.written < self.output.len()
+    }
+
+    /// Whether there is more to do before the next request is read: a reply to write out, or a
+    /// request already read to answer.
+    fn pending(&self) -> bool {
+        self.writing() || !matches!(decode_frame(&self.input), Ok(None))
+    }
+
+    /// Makes what progress the socket allows, answering at most one request. An error means the
+    /// connection should be dropped.
+    fn serve<F: FnOnce(Request, &mut Vec<u8>)>(&mut self, handler: F) -> io::Result<()> {
+        if self.writing() {
+            return self.flush();
+        }
+        if decode_frame(&self.input)?.is_none() {
+            self.receive()?;
+        }
+        let Some((body, len)) = decode_frame(&self.input)? else {
+            return Ok(());
+        };
+        match Request::decode(body) {
+            Ok(request) => handler(request, &mut self.output),
+            Err(err) => Response::Error(err.to_string()).encode(&mut self.output),
+        }
+        self.input.drain(..len);
+        self.flush()
+    }
+
+    /// Reads until a whole request is buffered or the socket has nothing more.
+    fn receive(&mut self) -> io::Result<()> {
+        let mut chunk = [0; READ_CHUNK];
+        loop {
+            match self.stream.read(&mut chunk) {
+                Ok(0) => return Err(io::ErrorKind::UnexpectedEof.into()),
+                Ok(n) => {
+                    self.input.extend_from_slice(&chunk[..n]);
+                    if decode_frame(&self.input)?.is_some() {
+                        return Ok(());
+                    }
+                }
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        while self.written < self.output.len() {
+            match self.stream.write(&self.output[self.written..]) {
+                Ok(n) => self.written += n,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+        self.output.clear();
+        self.written = 0;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Connection;
+    use std::cell::Cell;
+    use std::io::{Read, Write};
+    use std::os::unix::net::UnixStream;
+    use vigilant_canine_proto::{decode_frame, Request, Response};
+
+    fn connection() -> (Connection, UnixStream) {
+        let (stream, peer) = UnixStream::pair().unwrap();
+        stream.set_nonblocking(true).unwrap();
+        (Connection { stream, input: Vec::new(), output: Vec::new(), written: 0 }, peer)
+    }
+
+    #[test]
+    fn pipelined_requests_are_answered_one_at_a_time() {
+        let (mut connection, mut peer) = connection();
+        let mut requests = Vec::new();
+        for limit in 0..1000 {
+            Request::RecentAlerts { limit }.encode(&mut requests);
+        }
+        peer.write_all(&requests).unwrap();
+        let reader = std::thread::spawn(move || {
+            let mut replies = Vec::new();
+            let mut chunk = [0; 4096];
+            let mut limits = Vec::new();
+            while limits.len() < 1000 {
+                let n = peer.read(&mut chunk).unwrap();
+                replies.extend_from_slice(&chunk[..n]);
+                while let Some((body, len)) = decode_frame(&replies).unwrap() {
+                    let Response::Error(limit) = Response::decode(body).unwrap() else { panic!() };
+                    limits.push(limit.parse::<u32>().unwrap());
+                    replies.drain(..len);
+                }
+            }
+            limits
+        });
+
+        let mut answered = Vec::new();
+        while answered.len() < 1000 || connection.pending() {
+            let before = answered.len();
+            connection
+                .serve(|request, out| {
+                    let Request::RecentAlerts { limit } = request else { panic!("{request:?}") };
+                    answered.push(limit);
+                    Response::Error(limit.to_string()).encode(out);
+                })
+                .unwrap();
+            assert!(answered.len() <= before + 1);
+            assert!(connection.output.len() < 64);
+        }
+        assert_eq!(answered, (0..1000).collect::<Vec<_>>());
+        assert_eq!(reader.join().unwrap(), answered);
+    }
+
+    #[test]
+    fn nothing_more_is_answered_while_a_reply_is_unsent() {
+        let (mut connection, mut peer) = connection();
+        let mut requests = Vec::new();
+        for limit in 0..100 {
+            Request::RecentAlerts { limit }.encode(&mut requests);
+        }
+        peer.write_all(&requests).unwrap();
+
+        // A reply larger than the socket buffer, which the peer does not read yet.
+        let answered = Cell::new(0);
+        let big = |_: Request, out: &mut Vec<u8>| {
+            answered.set(answered.get() + 1);
+            Response::Error("x".repeat(4 << 20)).encode(out);
+        };
+        connection.serve(big).unwrap();
+        assert!(connection.writing());
+        for _ in 0..10 {
+            connection.serve(big).unwrap();
+        }
+        assert_eq!(answered.get(), 1);
+        assert!(connection.output.len() < 5 << 20);
+
+        // Once the peer takes the reply, the next request is answered.
+        let mut reply = vec![0; connection.output.len()];
+        let reader = std::thread::spawn(move || {
+            peer.read_exact(&mut reply).unwrap();
+            peer
+        });
+        while connection.writing() {
+            connection.serve(|_, _| panic!("answered before the reply was sent")).unwrap();
+        }
+        let _peer = reader.join().unwrap();
+        connection.serve(big).unwrap();
+        assert_eq!(answered.get(), 2);
+    }
+}
@@ -0,0 +1,3 @@
+//! Active responses to detected attacks (the "prevention" in IDS/IPS).
+
+pub mod nftables;
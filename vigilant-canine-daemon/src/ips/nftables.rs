@@ -0,0 +1,349 @@
+//! Blocking offenders through an nftables set.
+//!
+//! The daemon owns one `inet` table holding a set per address family and an input chain with a
+//! single drop rule per set. Blocking an address is then a set insertion with a timeout: packet
+//! filtering stays a hash lookup however many addresses are blocked, the kernel expires entries
+//! on its own, and nothing is forked. Everything blocked since the last flush goes to the kernel
+//! as one netlink batch, which nf_tables applies as a single transaction. The event loop does
+//! not wait for the kernel to acknowledge it: the acknowledgements are read when the socket
+//! becomes readable, and only a failure is reported.
+
+use std::io;
+use std::net::IpAddr;
+use std::os::fd::{AsRawFd, RawFd};
+use std::time::Duration;
+
+use crate::netlink::{Builder, Socket, NLM_F_ACK, NLM_F_APPEND, NLM_F_CREATE, NLM_F_REQUEST};
+
+pub const TABLE: &str = "vigilant_canine";
+const CHAIN: &str = "input";
+const SET_V4: &str = "blocked4";
+const SET_V6: &str = "blocked6";
+/// Ahead of the conventional `filter` priority so blocked hosts never reach the user's rules.
+const CHAIN_PRIORITY: i32 = -10;
+/// Elements per transaction; larger backlogs are sent as several.
+const MAX_BATCH_ELEMENTS: usize = 2048;
+/// How long [`NftBlocker::open`] waits for the table to be set up.
+const REPLY_TIMEOUT: Duration = Duration::from_secs(2);
+
+const NFNL_SUBSYS_NFTABLES: u16 = 10;
+const NFNL_MSG_BATCH_BEGIN: u16 = 0x10;
+const NFNL_MSG_BATCH_END: u16 = 0x11;
+const NFPROTO_INET: u8 = 1;
+const NFPROTO_IPV4: u8 = 2;
+const NFPROTO_IPV6: u8 = 10;
+
+const NFT_MSG_NEWTABLE: u16 = 0;
+const NFT_MSG_NEWCHAIN: u16 = 3;
+const NFT_MSG_NEWRULE: u16 = 6;
+const NFT_MSG_DELRULE: u16 = 8;
+const NFT_MSG_NEWSET: u16 = 9;
+const NFT_MSG_NEWSETELEM: u16 = 12;
+
+const NFTA_LIST_ELEM: u16 = 1;
+const NFTA_TABLE_NAME: u16 = 1;
+const NFTA_CHAIN_TABLE: u16 = 1;
+const NFTA_CHAIN_NAME: u16 = 3;
+const NFTA_CHAIN_HOOK: u16 = 4;
+const NFTA_CHAIN_POLICY: u16 = 5;
+const NFTA_CHAIN_TYPE: u16 = 7;
+const NFTA_HOOK_HOOKNUM: u16 = 1;
+const NFTA_HOOK_PRIORITY: u16 = 2;
+const NFTA_RULE_TABLE: u16 = 1;
+const NFTA_RULE_CHAIN: u16 = 2;
+const NFTA_RULE_EXPRESSIONS: u16 = 4;
+const NFTA_EXPR_NAME: u16 = 1;
+const NFTA_EXPR_DATA: u16 = 2;
+const NFTA_SET_TABLE: u16 = 1;
+const NFTA_SET_NAME: u16 = 2;
+const NFTA_SET_FLAGS: u16 = 3;
+const NFTA_SET_KEY_TYPE: u16 = 4;
+const NFTA_SET_KEY_LEN: u16 = 5;
+const NFTA_SET_ID: u16 = 10;
+const NFTA_SET_ELEM_LIST_TABLE: u16 = 1;
+const NFTA_SET_ELEM_LIST_SET: u16 = 2;
+const NFTA_SET_ELEM_LIST_ELEMENTS: u16 = 3;
+const NFTA_SET_ELEM_KEY: u16 = 1;
+const NFTA_SET_ELEM_TIMEOUT: u16 = 4;
+const NFTA_DATA_VALUE: u16 = 1;
+const NFTA_DATA_VERDICT: u16 = 2;
+const NFTA_VERDICT_CODE: u16 = 1;
+const NFTA_META_DREG: u16 = 1;
+const NFTA_META_KEY: u16 = 2;
+const NFTA_CMP_SREG: u16 = 1;
+const NFTA_CMP_OP: u16 = 2;
+const NFTA_CMP_DATA: u16 = 3;
+const NFTA_PAYLOAD_DREG: u16 = 1;
+const NFTA_PAYLOAD_BASE: u16 = 2;
+const NFTA_PAYLOAD_OFFSET: u16 = 3;
+const NFTA_PAYLOAD_LEN: u16 = 4;
+const NFTA_LOOKUP_SET: u16 = 1;
+const NFTA_LOOKUP_SREG: u16 = 2;
+const NFTA_IMMEDIATE_DREG: u16 = 1;
+const NFTA_IMMEDIATE_DATA: u16 = 2;
+
+const NF_INET_LOCAL_IN: u32 = 1;
+const NF_DROP: u32 = 0;
+const NF_ACCEPT: u32 = 1;
+const NFT_SET_TIMEOUT: u32 = 0x10;
+const NFT_META_NFPROTO: u32 = 15;
+const NFT_CMP_EQ: u32 = 0;
+const NFT_PAYLOAD_NETWORK_HEADER: u32 = 1;
+const NFT_REG_VERDICT: u32 = 0;
+const NFT_REG_1: u32 = 1;
+/// nft's datatype numbers, so `nft list set` prints the elements as addresses.
+const TYPE_IPADDR: u32 = 7;
+const TYPE_IP6ADDR: u32 = 8;
+
+pub struct NftBlocker {
+    socket: Socket,
+    batch: Builder,
+    seq: u32,
+    pending: Vec<(IpAddr, Duration)>,
+    /// Sequence number of the oldest message sent and not yet acknowledged.
+    oldest: u32,
+    /// Messages sent and not yet acknowledged.
+    unacked: usize,
+}
+
+impl NftBlocker {
+    /// Creates (or takes over) the daemon's table, sets and chain. Needs `CAP_NET_ADMIN`.
+    pub fn open() -> io::Result<NftBlocker> {
+        let socket = Socket::open(libc::NETLINK_NETFILTER, 0)?;
+        socket.set_recv_timeout(REPLY_TIMEOUT)?;
+        let mut blocker = NftBlocker { socket, batch: Builder::new(), seq: 0, pending: Vec::new(), oldest: 0, unacked: 0 };
+        blocker.send(|batch| {
+            let msg = batch.begin(NFT_MSG_NEWTABLE, NLM_F_CREATE);
+            batch.b.attr_str(NFTA_TABLE_NAME, TABLE);
+            batch.b.end(msg);
+
+            for (id, (set, key_type, key_len)) in [(SET_V4, TYPE_IPADDR, 4), (SET_V6, TYPE_IP6ADDR, 16)].into_iter().enumerate() {
+                let msg = batch.begin(NFT_MSG_NEWSET, NLM_F_CREATE);
+                batch.b.attr_str(NFTA_SET_TABLE, TABLE);
+                batch.b.attr_str(NFTA_SET_NAME, set);
+                batch.b.attr_be32(NFTA_SET_FLAGS, NFT_SET_TIMEOUT);
+                batch.b.attr_be32(NFTA_SET_KEY_TYPE, key_type);
+                batch.b.attr_be32(NFTA_SET_KEY_LEN, key_len);
+                batch.b.attr_be32(NFTA_SET_ID, id as u32 + 1);
+                batch.b.end(msg);
+            }
+
+            let msg = batch.begin(NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+            batch.b.attr_str(NFTA_CHAIN_TABLE, TABLE);
+            batch.b.attr_str(NFTA_CHAIN_NAME, CHAIN);
+            let hook = batch.b.nest_begin(NFTA_CHAIN_HOOK);
+            batch.b.attr_be32(NFTA_HOOK_HOOKNUM, NF_INET_LOCAL_IN);
+            batch.b.attr_be32(NFTA_HOOK_PRIORITY, CHAIN_PRIORITY as u32);
+            batch.b.nest_end(hook);
+            batch.b.attr_be32(NFTA_CHAIN_POLICY, NF_ACCEPT);
+            batch.b.attr_str(NFTA_CHAIN_TYPE, "filter");
+            batch.b.end(msg);
+
+            // Flush the chain before adding the rules so a restart does not duplicate them. The
+            // sets are left alone: addresses blocked before the restart stay blocked.
+            let msg = batch.begin(NFT_MSG_DELRULE, 0);
+            batch.b.attr_str(NFTA_RULE_TABLE, TABLE);
+            batch.b.attr_str(NFTA_RULE_CHAIN, CHAIN);
+            batch.b.end(msg);
+
+            // ip saddr 12 bytes into the IPv4 header, ip6 saddr 8 bytes into the IPv6 header.
+            for (set, nfproto, offset, len) in [(SET_V4, NFPROTO_IPV4, 12, 4), (SET_V6, NFPROTO_IPV6, 8, 16)] {
+                let msg = batch.begin(NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+                batch.b.attr_str(NFTA_RULE_TABLE, TABLE);
+                batch.b.attr_str(NFTA_RULE_CHAIN, CHAIN);
+                let exprs = batch.b.nest_begin(NFTA_RULE_EXPRESSIONS);
+                expr(batch.b, "meta", |b| {
+                    b.attr_be32(NFTA_META_KEY, NFT_META_NFPROTO);
+                    b.attr_be32(NFTA_META_DREG, NFT_REG_1);
+                });
+                expr(batch.b, "cmp", |b| {
+                    b.attr_be32(NFTA_CMP_SREG, NFT_REG_1);
+                    b.attr_be32(NFTA_CMP_OP, NFT_CMP_EQ);
+                    let data = b.nest_begin(NFTA_CMP_DATA);
+                    b.attr(NFTA_DATA_VALUE, &[nfproto]);
+                    b.nest_end(data);
+                });
+                expr(batch.b, "payload", |b| {
+                    b.attr_be32(NFTA_PAYLOAD_DREG, NFT_REG_1);
+                    b.attr_be32(NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+                    b.attr_be32(NFTA_PAYLOAD_OFFSET, offset);
+                    b.attr_be32(NFTA_PAYLOAD_LEN, len);
+                });
+                expr(batch.b, "lookup", |b| {
+                    b.attr_str(NFTA_LOOKUP_SET, set);
+                    b.attr_be32(NFTA_LOOKUP_SREG, NFT_REG_1);
+                });
+                expr(batch.b, "immediate", |b| {
+                    b.attr_be32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+                    let data = b.nest_begin(NFTA_IMMEDIATE_DATA);
+                    let verdict = b.nest_begin(NFTA_DATA_VERDICT);
+                    b.attr_be32(NFTA_VERDICT_CODE, NF_DROP);
+                    b.nest_end(verdict);
+                    b.nest_end(data);
+                });
+                batch.b.nest_end(exprs);
+                batch.b.end(msg);
+            }
+        })?;
+        blocker.receive(true)?;
+        Ok(blocker)
+    }
+
+    /// Queues `addr` to be dropped for `timeout`. Nothing reaches the kernel until
+    /// [`flush`](NftBlocker::flush).
+    pub fn block(&mut self, addr: IpAddr, timeout: Duration) {
+        self.pending.push((addr.to_canonical(), timeout));
+    }
+
+    /// Addresses queued since the last flush.
+    pub fn pending(&self) -> usize {
+        self.pending.len()
+    }
+
+    /// Messages sent to the kernel and not yet acknowledged.
+    pub fn unacknowledged(&self) -> usize {
+        self.unacked
+    }
+
+    /// Sends every queued address to the kernel, one transaction per `MAX_BATCH_ELEMENTS`,
+    /// without waiting for it to be applied; [`acknowledge`](NftBlocker::acknowledge) reports
+    /// whether it was. Queued addresses are dropped on failure; the detector will report them
+    /// again.
+    pub fn flush(&mut self) -> io::Result<()> {
+        let mut pending = std::mem::take(&mut self.pending);
+        let result = pending.chunks(MAX_BATCH_ELEMENTS).try_for_each(|chunk| {
+            self.send(|batch| {
+                for (set, v4) in [(SET_V4, true), (SET_V6, false)] {
+                    let mut elements = chunk.iter().filter(|(addr, _)| addr.is_ipv4() == v4).peekable();
+                    if elements.peek().is_none() {
+                        continue;
+                    }
+                    let msg = batch.begin(NFT_MSG_NEWSETELEM, NLM_F_CREATE);
+                    batch.b.attr_str(NFTA_SET_ELEM_LIST_TABLE, TABLE);
+                    batch.b.attr_str(NFTA_SET_ELEM_LIST_SET, set);
+                    let list = batch.b.nest_begin(NFTA_SET_ELEM_LIST_ELEMENTS);
+                    for (addr, timeout) in elements {
+                        let element = batch.b.nest_begin(NFTA_LIST_ELEM);
+                        let key = batch.b.nest_begin(NFTA_SET_ELEM_KEY);
+                        match addr {
+                            IpAddr::V4(addr) => batch.b.attr(NFTA_DATA_VALUE, &addr.octets()),
+                            IpAddr::V6(addr) => batch.b.attr(NFTA_DATA_VALUE, &addr.octets()),
+                        }
+                        batch.b.nest_end(key);
+                        batch.b.attr_be64(NFTA_SET_ELEM_TIMEOUT, timeout.as_millis().max(1) as u64);
+                        batch.b.nest_end(element);
+                    }
+                    batch.b.nest_end(list);
+                    batch.b.end(msg);
+                }
+            })
+        });
+        pending.clear();
+        self.pending = pending;
+        result
+    }
+
+    /// Reads the acknowledgements that have arrived, failing with the first error among them.
+    /// Call it when the socket is readable.
+    pub fn acknowledge(&mut self) -> io::Result<()> {
+        self.receive(false)
+    }
+
+    /// Sends the messages `build` adds as one nf_tables transaction.
+    fn send<F: FnOnce(&mut Batch)>(&mut self, build: F) -> io::Result<()> {
+        self.batch.clear();
+        let first = self.seq.wrapping_add(1);
+        let mut batch = Batch { b: &mut self.batch, seq: self.seq, messages: 0 };
+        batch.control(NFNL_MSG_BATCH_BEGIN);
+        build(&mut batch);
+        batch.control(NFNL_MSG_BATCH_END);
+        let messages = batch.messages;
+        self.seq = batch.seq;
+        if messages == 0 {
+            return Ok(());
+        }
+        self.socket.send(self.batch.as_bytes())?;
+        if self.unacked == 0 {
+            self.oldest = first;
+        }
+        self.unacked += messages;
+        Ok(())
+    }
+
+    /// Counts acknowledgements until none are outstanding or, unless `wait`, none are queued.
+    fn receive(&mut self, wait: bool) -> io::Result<()> {
+        while self.unacked > 0 {
+            let replies = match if wait { self.socket.recv() } else { self.socket.try_recv() } {
+                Ok(replies) => replies,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock && wait => {
+                    return Err(io::Error::new(io::ErrorKind::TimedOut, "nf_tables did not acknowledge the batch"));
+                }
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(err) => return Err(err),
+            };
+            for reply in replies {
+                // Replies to a transaction that failed part way are stale once the failure has
+                // been reported.
+                if reply.seq.wrapping_sub(self.oldest) > self.seq.wrapping_sub(self.oldest) {
+                    continue;
+                }
+                match reply.error() {
+                    Some(Ok(())) => self.unacked = self.unacked.saturating_sub(1),
+                    Some(Err(err)) => {
+                        self.unacked = 0;
+                        return Err(err);
+                    }
+                    None => {}
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+impl AsRawFd for NftBlocker {
+    fn as_raw_fd(&self) -> RawFd {
+        self.socket.as_raw_fd()
+    }
+}
+
+/// The batch being built by [`NftBlocker::send`].
+struct Batch<'a> {
+    b: &'a mut Builder,
+    seq: u32,
+    /// Messages that will be acknowledged (batch delimiters are not).
+    messages: usize,
+}
+
+impl Batch<'_> {
+    /// Starts an nf_tables message for the daemon's `inet` table.
+    fn begin(&mut self, msg: u16, flags: u16) -> usize {
+        self.seq = self.seq.wrapping_add(1);
+        self.messages += 1;
+        let start = self.b.begin(NFNL_SUBSYS_NFTABLES << 8 | msg, NLM_F_REQUEST | NLM_F_ACK | flags, self.seq);
+        self.b.extend(&nfgenmsg(NFPROTO_INET, 0));
+        start
+    }
+
+    fn control(&mut self, kind: u16) {
+        self.seq = self.seq.wrapping_add(1);
+        let start = self.b.begin(kind, NLM_F_REQUEST, self.seq);
+        self.b.extend(&nfgenmsg(libc::AF_UNSPEC as u8, NFNL_SUBSYS_NFTABLES));
+        self.b.end(start);
+    }
+}
+
+fn nfgenmsg(family: u8, res_id: u16) -> [u8; 4] {
+    let res_id = res_id.to_be_bytes();
+    [family, 0, res_id[0], res_id[1]]
+}
+
+/// Appends one rule expression named `name` whose attributes `data` writes.
+fn expr<F: FnOnce(&mut Builder)>(b: &mut Builder, name: &str, data: F) {
+    let elem = b.nest_begin(NFTA_LIST_ELEM);
+    b.attr_str(NFTA_EXPR_NAME, name);
+    let nested = b.nest_begin(NFTA_EXPR_DATA);
+    data(b);
+    b.nest_end(nested);
+    b.nest_end(elem);
+}
@@ -0,0 +1,20 @@
+//! Vigilant Canine daemon.
+
+pub mod aggregate;
+pub mod detect;
+pub mod exposure;
+pub mod fim;
+pub mod ipc;
+pub mod ips;
+pub mod logs;
+pub mod metrics;
+pub mod netlink;
+pub mod process;
+pub mod reactor;
+pub mod shed;
+pub mod signal;
+pub mod snapshot;
+pub mod store;
+pub mod sys;
+pub mod timer;
+pub mod worker;
@@ -0,0 +1,231 @@
+//! systemd journal follower.
+//!
+//! libsystemd is loaded at runtime, so the daemon still runs on systems without journald. Field
+//! data is returned as slices into the journal's own memory mapping (sd-journal only copies when
+//! a field is compressed), and each entry is visited once: the cursor of the last entry handed
+//! out is persisted (when the caller asks, see [`JournalReader::save_cursor`]) and the reader
+//! resumes after it on restart.
+
+use std::ffi::{c_char, c_int, c_void, CStr, CString};
+use std::io;
+use std::os::fd::RawFd;
+use std::path::{Path, PathBuf};
+use std::ops::Range;
+use std::ptr;
+
+use crate::sys::replace_file;
+
+const SD_JOURNAL_LOCAL_ONLY: c_int = 1;
+const SD_JOURNAL_SYSTEM: c_int = 4;
+
+/// One journal entry, borrowed from the reader and valid until its next call.
+#[derive(Debug, Clone, Copy)]
+pub struct JournalEntry<'a> {
+    pub message: &'a [u8],
+    pub identifier: Option<&'a [u8]>,
+}
+
+type Journal = c_void;
+
+/// Declares the entry points resolved from libsystemd, each with its symbol and type once.
+macro_rules! api {
+    ($($field:ident = $name:literal: $ty:ty;)*) => {
+        struct Api {
+            $($field: $ty,)*
+        }
+
+        impl Api {
+            fn load() -> io::Result<Api> {
+                let lib = unsafe { libc::dlopen(c"libsystemd.so.0".as_ptr(), libc::RTLD_NOW | libc::RTLD_LOCAL) };
+                if lib.is_null() {
+                    return Err(io::Error::new(io::ErrorKind::Unsupported, "libsystemd is not available"));
+                }
+                // The handle is intentionally never closed; the functions are used for the process lifetime.
+                Ok(Api {
+                    $($field: {
+                        let sym = unsafe { libc::dlsym(lib, concat!($name, "\0").as_ptr().cast()) };
+                        if sym.is_null() {
+                            return Err(io::Error::new(io::ErrorKind::Unsupported, concat!("libsystemd lacks ", $name)));
+                        }
+                        unsafe { std::mem::transmute::<*mut c_void, $ty>(sym) }
+                    },)*
+                })
+            }
+        }
+    };
+}
+
+api! {
+    open = "sd_journal_open": unsafe extern "C" fn(*mut *mut Journal, c_int) -> c_int;
+    close = "sd_journal_close": unsafe extern "C" fn(*mut Journal);
+    get_fd = "sd_journal_get_fd": unsafe extern "C" fn(*mut Journal) -> c_int;
+    process = "sd_journal_process": unsafe extern "C" fn(*mut Journal) -> c_int;
+    next = "sd_journal_next": unsafe extern "C" fn(*mut Journal) -> c_int;
+    previous = "sd_journal_previous": unsafe extern "C" fn(*mut Journal) -> c_int;
+    seek_tail = "sd_journal_seek_tail": unsafe extern "C" fn(*mut Journal) -> c_int;
+    seek_cursor = "sd_journal_seek_cursor": unsafe extern "C" fn(*mut Journal, *const c_char) -> c_int;
+    test_cursor = "sd_journal_test_cursor": unsafe extern "C" fn(*mut Journal, *const c_char) -> c_int;
+    get_cursor = "sd_journal_get_cursor": unsafe extern "C" fn(*mut Journal, *mut *mut c_char) -> c_int;
+    get_data = "sd_journal_get_data": unsafe extern "C" fn(*mut Journal, *const c_char, *mut *const c_void, *mut usize) -> c_int;
+}
+
+pub struct JournalReader {
+    api: Api,
+    journal: *mut Journal,
+    fd: RawFd,
+    cursor_path: PathBuf,
+    /// Copies of the current entry's short fields.
+    fields: Vec<u8>,
+    /// Whether entries were consumed since the cursor was last saved.
+    dirty: bool,
+    /// Our own `_PID`, as journald records it.
+    own_pid: Vec<u8>,
+}
+
+impl JournalReader {
+    /// Opens the local system journal and positions it after the entry recorded in
+    /// `cursor_path`, or at the current tail if there is no usable cursor (history from before
+    /// the first start is not replayed).
+    pub fn open(cursor_path: &Path) -> io::Result<JournalReader> {
+        let api = Api::load()?;
+        let mut journal = ptr::null_mut();
+        sd(unsafe { (api.open)(&mut journal, SD_JOURNAL_LOCAL_ONLY | SD_JOURNAL_SYSTEM) })?;
+        let mut reader = JournalReader {
+            api,
+            journal,
+            fd: -1,
+            cursor_path: cursor_path.to_path_buf(),
+            fields: Vec::new(),
+            dirty: false,
+            own_pid: std::process::id().to_string().into_bytes(),
+        };
+        reader.fd = sd(unsafe { (reader.api.get_fd)(journal) })?;
+
+        let resumed = match std::fs::read(cursor_path) {
+            Ok(cursor) => reader.seek_after(cursor.trim_ascii_end())?,
+            Err(err) if err.kind() == io::ErrorKind::NotFound => false,
+            Err(err) => return Err(err),
+        };
+        if !resumed {
+            sd(unsafe { (reader.api.seek_tail)(journal) })?;
+            // Seeking to the tail leaves us after the last entry; step back onto it so the next
+            // call to `next` yields the first new entry, and so there is a cursor to save (entries
+            // logged while we are stopped are then picked up on the next start).
+            reader.dirty = sd(unsafe { (reader.api.previous)(journal) })? > 0;
+        }
+        Ok(reader)
+    }
+
+    fn seek_after(&mut self, cursor: &[u8]) -> io::Result<bool> {
+        let Ok(cursor) = CString::new(cursor) else {
+            return Ok(false);
+        };
+        if sd(unsafe { (self.api.seek_cursor)(self.journal, cursor.as_ptr()) }).is_err() {
+            return Ok(false);
+        }
+        // Seeking lands on (or next to) the cursor entry; that entry was already handled.
+        let moved = sd(unsafe { (self.api.next)(self.journal) })? > 0;
+        if moved && sd(unsafe { (self.api.test_cursor)(self.journal, cursor.as_ptr()) })? == 0 {
+            sd(unsafe { (self.api.previous)(self.journal) })?;
+        }
+        Ok(true)
+    }
+
+    /// Descriptor that becomes readable when the journal changes. Call [`process`] after it
+    /// fires and before reading entries.
+    ///
+    /// [`process`]: JournalReader::process
+    pub fn fd(&self) -> RawFd {
+        self.fd
+    }
+
+    /// Acknowledges a wakeup on [`fd`](JournalReader::fd).
+    pub fn process(&mut self) -> io::Result<()> {
+        sd(unsafe { (self.api.process)(self.journal) }).map(drop)
+    }
+
+    /// Advances to the next entry, or returns `None` when caught up. Our own messages are
+    /// skipped: what the daemon prints lands in the journal, and matching it again would feed
+    /// alerts back into themselves.
+    pub fn next_entry(&mut self) -> io::Result<Option<JournalEntry<'_>>> {
+        loop {
+            if sd(unsafe { (self.api.next)(self.journal) })? == 0 {
+                return Ok(None);
+            }
+            self.dirty = true;
+            // sd-journal only promises field data until the next sd_journal_get_data() call, so
+            // the small fields are copied into a reused buffer and MESSAGE, fetched last, is
+            // borrowed in place.
+            self.fields.clear();
+            if self.field(c"_PID")?.is_some_and(|(data, len)| unsafe { std::slice::from_raw_parts(data, len) } == self.own_pid) {
+                continue;
+            }
+            let identifier = self.copy_field(c"SYSLOG_IDENTIFIER")?;
+            // Entries without a message carry nothing we can match on.
+            let Some((data, len)) = self.field(c"MESSAGE")? else {
+                continue;
+            };
+            return Ok(Some(JournalEntry {
+                message: unsafe { std::slice::from_raw_parts(data, len) },
+                identifier: identifier.map(|range| &self.fields[range]),
+            }));
+        }
+    }
+
+    fn copy_field(&mut self, name: &CStr) -> io::Result<Option<Range<usize>>> {
+        let Some((data, len)) = self.field(name)? else {
+            return Ok(None);
+        };
+        let start = self.fields.len();
+        self.fields.extend_from_slice(unsafe { std::slice::from_raw_parts(data, len) });
+        Ok(Some(start..self.fields.len()))
+    }
+
+    /// Locates the value of `name` in the current entry. The pointer is into the journal mapping
+    /// (or sd-journal's decompression buffer) and is valid until the next `field` call.
+    fn field(&self, name: &CStr) -> io::Result<Option<(*const u8, usize)>> {
+        let mut data = ptr::null();
+        let mut len = 0;
+        let ret = unsafe { (self.api.get_data)(self.journal, name.as_ptr(), &mut data, &mut len) };
+        if ret == -libc::ENOENT {
+            return Ok(None);
+        }
+        sd(ret)?;
+        // sd-journal returns "NAME=value".
+        let prefix = (name.to_bytes().len() + 1).min(len);
+        Ok(Some((unsafe { data.cast::<u8>().add(prefix) }, len - prefix)))
+    }
+
+    /// Persists the current position if it changed. A crash replays what was read since.
+    pub fn save_cursor(&mut self) -> io::Result<()> {
+        if !self.dirty {
+            return Ok(());
+        }
+        let mut cursor = ptr::null_mut();
+        sd(unsafe { (self.api.get_cursor)(self.journal, &mut cursor) })?;
+        let result = {
+            let bytes = unsafe { CStr::from_ptr(cursor) }.to_bytes();
+            replace_file(&self.cursor_path, |out| io::Write::write_all(out, bytes))
+        };
+        unsafe { libc::free(cursor.cast()) };
+        result?;
+        self.dirty = false;
+        Ok(())
+    }
+}
+
+impl Drop for JournalReader {
+    fn drop(&mut self) {
+        let _ = self.save_cursor();
+        unsafe { (self.api.close)(self.journal) };
+    }
+}
+
+/// Converts sd-journal's negative-errno convention into an `io::Result`.
+fn sd(ret: c_int) -> io::Result<c_int> {
+    if ret < 0 {
+        Err(io::Error::from_raw_os_error(-ret))
+    } else {
+        Ok(ret)
+    }
+}
@@ -0,0 +1,107 @@
+//! Log sources.
+
+pub mod journal;
+pub mod syslog;
+pub mod tail;
+
+use std::io;
+use std::os::fd::{AsRawFd, RawFd};
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+use std::sync::OnceLock;
+
+use journal::JournalReader;
+use tail::Tailer;
+
+/// Where log lines come from: the journal when it is available, the classic syslog files otherwise
+/// (reading both would see every message twice where rsyslog forwards the journal). Logs that
+/// servers write themselves, such as web server access and error logs, are followed either way.
+pub struct LogSource {
+    journal: Option<JournalReader>,
+    tailer: Tailer,
+    /// For each tailed file, the program its lines are reported as, or `None` for syslog files,
+    /// whose lines name their program.
+    programs: Vec<Option<Vec<u8>>>,
+}
+
+impl LogSource {
+    /// Opens the journal, or falls back to following whichever of `syslog_files` have a directory.
+    /// Whichever of `server_files` have a directory are followed in both cases, their lines
+    /// reported as logged by the program paired with each.
+    pub fn open(cursor_path: &Path, syslog_files: &[&Path], server_files: &[(&Path, &str)]) -> io::Result<LogSource> {
+        let journal = JournalReader::open(cursor_path).ok();
+        let mut logs = LogSource { journal, tailer: Tailer::new()?, programs: Vec::new() };
+        let syslog_files = if logs.journal.is_some() { &[][..] } else { syslog_files };
+        let files = syslog_files.iter().map(|&file| (file, None)).chain(server_files.iter().map(|&(file, program)| (file, Some(program))));
+        for (file, program) in files.filter(|(file, _)| file.parent().is_some_and(Path::is_dir)) {
+            logs.tailer.add(file)?;
+            logs.programs.push(program.map(|program| program.as_bytes().to_vec()));
+        }
+        Ok(logs)
+    }
+
+    /// Whether messages come from the journal rather than syslog files.
+    pub fn is_journal(&self) -> bool {
+        self.journal.is_some()
+    }
+
+    /// How many files are followed.
+    pub fn files(&self) -> usize {
+        self.programs.len()
+    }
+
+    /// Passes new messages, with the program that logged each if known, to `on_line`: about
+    /// `budget` of them at most. Returns whether there may be more; those wait in the journal or
+    /// file, so a flood of messages does not pile up in memory. How far the journal was read is
+    /// only persisted by [`save_cursor`](LogSource::save_cursor).
+    pub fn read<F: FnMut(Option<&[u8]>, &[u8])>(&mut self, budget: usize, mut on_line: F) -> io::Result<bool> {
+        let mut read = 0;
+        if let Some(journal) = &mut self.journal {
+            journal.process()?;
+            while read < budget {
+                let Some(entry) = journal.next_entry()? else {
+                    break;
+                };
+                on_line(entry.identifier, entry.message);
+                read += 1;
+            }
+            if read == budget {
+                return Ok(true);
+            }
+        }
+        let programs = &self.programs;
+        self.tailer.read_lines(budget - read, |id, line| match &programs[id] {
+            Some(program) => on_line(Some(program), line),
+            None => {
+                let (program, message) = syslog::split(line);
+                // What we print may be forwarded to these files too; see `next_entry`.
+                if program.is_none() || program != own_program() {
+                    on_line(program, message);
+                }
+            }
+        })
+    }
+
+    /// The descriptors that become readable when there is something new to read.
+    pub fn fds(&self) -> impl Iterator<Item = RawFd> + '_ {
+        self.journal.iter().map(JournalReader::fd).chain([self.tailer.as_raw_fd()])
+    }
+}
+
+impl LogSource {
+    /// Persists how far the journal has been read. Log files are followed from their end on
+    /// every start and have nothing to save.
+    pub fn save_cursor(&mut self) -> io::Result<()> {
+        match &mut self.journal {
+            Some(journal) => journal.save_cursor(),
+            None => Ok(()),
+        }
+    }
+}
+
+/// The program name our own messages are logged under.
+fn own_program() -> Option<&'static [u8]> {
+    static NAME: OnceLock<Option<Vec<u8>>> = OnceLock::new();
+    let name = || std::env::current_exe().ok()?.file_name().map(|name| name.as_bytes().to_vec());
+    NAME.get_or_init(name).as_deref()
+}
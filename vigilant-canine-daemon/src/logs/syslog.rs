@@ -0,0 +1,64 @@
+//! Splitting traditional syslog lines into program and message.
+
+/// Splits `Mmm dd hh:mm:ss host prog[pid]: message` (or the same with an RFC 3339 timestamp, as
+/// written by rsyslog's high-precision format) into the program name and the message, without
+/// copying. Lines that do not look like syslog are returned whole as the message.
+pub fn split(line: &[u8]) -> (Option<&[u8]>, &[u8]) {
+    let timestamp_fields = if line.first().is_some_and(u8::is_ascii_digit) { 1 } else { 3 };
+    let mut rest = line;
+    // Timestamp, then host name.
+    for _ in 0..timestamp_fields + 1 {
+        let Some(space) = rest.iter().position(|&b| b == b' ') else {
+            return (None, line);
+        };
+        rest = &rest[space + 1..];
+        // Single-digit days are padded with a second space ("Oct  5").
+        while rest.first() == Some(&b' ') {
+            rest = &rest[1..];
+        }
+    }
+    let Some(colon) = rest.iter().position(|&b| b == b':') else {
+        return (None, line);
+    };
+    let tag = &rest[..colon];
+    if tag.is_empty() || tag.contains(&b' ') {
+        return (None, line);
+    }
+    let program = tag.iter().position(|&b| b == b'[').map_or(tag, |bracket| &tag[..bracket]);
+    let message = &rest[colon + 1..];
+    (Some(program), message.strip_prefix(b" ").unwrap_or(message))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::split;
+
+    #[test]
+    fn splits_traditional_lines() {
+        let line = b"Oct  5 12:00:01 host sshd[123]: Failed password for root from 192.0.2.1 port 22 ssh2";
+        let (program, message) = split(line);
+        assert_eq!(program, Some(&b"sshd"[..]));
+        assert_eq!(message, b"Failed password for root from 192.0.2.1 port 22 ssh2");
+    }
+
+    #[test]
+    fn splits_rfc3339_lines() {
+        let (program, message) = split(b"2024-10-05T12:00:01.123456+02:00 host su: FAILED SU (to root) alice on pts/0");
+        assert_eq!(program, Some(&b"su"[..]));
+        assert_eq!(message, b"FAILED SU (to root) alice on pts/0");
+    }
+
+    #[test]
+    fn keeps_colons_in_the_message() {
+        let (program, message) = split(b"Oct 15 01:02:03 host kernel: audit: type=1305 audit_enabled=0");
+        assert_eq!(program, Some(&b"kernel"[..]));
+        assert_eq!(message, b"audit: type=1305 audit_enabled=0");
+    }
+
+    #[test]
+    fn returns_other_lines_whole() {
+        for line in [&b""[..], b"no syslog here", b"Oct  5 12:00:01 host", b"Oct  5 12:00:01 host not a tag: message"] {
+            assert_eq!(split(line), (None, line));
+        }
+    }
+}
@@ -0,0 +1,387 @@
+//! Follower for plain-text log files (auth.log, secure, web server access logs).
+//!
+//! All followed files share one inotify descriptor: the file itself is watched for writes and
+//! its directory for the create/rename that log rotation performs. A wakeup reads what is new, up
+//! to a budget of lines, in large chunks and hands complete lines to the caller as slices of the
+//! read buffer; only a line split across two reads is copied. Rotation by rename is noticed by
+//! the path resolving to a new inode (the old file is drained before we switch), and
+//! copytruncate by the file shrinking below our offset or no longer having a line break where our
+//! last line ended.
+
+use std::collections::HashMap;
+use std::ffi::OsString;
+use std::fs::{self, File};
+use std::io::{self, Read, Seek, SeekFrom};
+use std::mem;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::{Path, PathBuf};
+
+use crate::sys::{cstr, cvt};
+
+const READ_BUFFER_SIZE: usize = 256 * 1024;
+/// Longer lines are cut here rather than buffered without bound.
+const MAX_LINE: usize = 64 * 1024;
+
+const FILE_MASK: u32 = libc::IN_MODIFY;
+const DIR_MASK: u32 = libc::IN_CREATE | libc::IN_MOVED_TO | libc::IN_MOVED_FROM | libc::IN_DELETE | libc::IN_ONLYDIR | libc::IN_MASK_ADD;
+
+/// Index of a followed file, as returned by [`Tailer::add`].
+pub type TailId = usize;
+
+pub struct Tailer {
+    inotify: OwnedFd,
+    files: Vec<TailedFile>,
+    /// Watch descriptor to the files it concerns (a directory watch can serve several).
+    watches: HashMap<libc::c_int, Vec<TailId>>,
+    buf: Vec<u8>,
+}
+
+struct TailedFile {
+    path: PathBuf,
+    name: OsString,
+    file: Option<File>,
+    ino: u64,
+    offset: u64,
+    file_wd: Option<libc::c_int>,
+    /// Start of a line whose end has not been read yet.
+    partial: Vec<u8>,
+    dirty: bool,
+}
+
+impl Tailer {
+    pub fn new() -> io::Result<Tailer> {
+        let fd = cvt(unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) })?;
+        Ok(Tailer {
+            inotify: unsafe { OwnedFd::from_raw_fd(fd) },
+            files: Vec::new(),
+            watches: HashMap::new(),
+            buf: vec![0; READ_BUFFER_SIZE],
+        })
+    }
+
+    /// Follows `path` from its current end. The file may not exist yet, but its directory must.
+    pub fn add(&mut self, path: &Path) -> io::Result<TailId> {
+        let (Some(dir), Some(name)) = (path.parent(), path.file_name()) else {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "log path has no directory"));
+        };
+        let id = self.files.len();
+        let dir = if dir.as_os_str().is_empty() { Path::new(".") } else { dir };
+        let dir_wd = self.add_watch(dir, DIR_MASK)?;
+        self.watches.entry(dir_wd).or_default().push(id);
+        self.files.push(TailedFile {
+            path: path.to_path_buf(),
+            name: name.to_os_string(),
+            file: None,
+            ino: 0,
+            offset: 0,
+            file_wd: None,
+            partial: Vec::new(),
+            dirty: false,
+        });
+        match File::open(path) {
+            Ok(file) => {
+                let end = file.metadata()?.len();
+                self.attach(id, file, end)?;
+            }
+            Err(err) if err.kind() == io::ErrorKind::NotFound => {}
+            Err(err) => return Err(err),
+        }
+        Ok(id)
+    }
+
+    /// Handles pending notifications and passes new complete lines to `on_line`, stopping at the
+    /// end of the read in which `budget` lines were reached. Returns whether there is more: the
+    /// rest stays in the files, and the next call carries on where this one stopped.
+    pub fn read_lines<F: FnMut(TailId, &[u8])>(&mut self, mut budget: usize, mut on_line: F) -> io::Result<bool> {
+        self.drain_notifications()?;
+        for id in 0..self.files.len() {
+            if budget > 0 && mem::take(&mut self.files[id].dirty) {
+                self.files[id].dirty = !self.pump(id, &mut budget, &mut on_line)?;
+            }
+        }
+        Ok(self.files.iter().any(|file| file.dirty))
+    }
+
+    fn drain_notifications(&mut self) -> io::Result<()> {
+        const HEADER_LEN: usize = mem::size_of::<libc::inotify_event>();
+        loop {
+            let n = unsafe { libc::read(self.inotify.as_raw_fd(), self.buf.as_mut_ptr().cast(), self.buf.len()) };
+            if n < 0 {
+                let err = io::Error::last_os_error();
+                match err.kind() {
+                    io::ErrorKind::WouldBlock => return Ok(()),
+                    io::ErrorKind::Interrupted => continue,
+                    _ => return Err(err),
+                }
+            }
+            let mut events = &self.buf[..n as usize];
+            while events.len() >= HEADER_LEN {
+                let event: libc::inotify_event = unsafe { std::ptr::read_unaligned(events.as_ptr().cast()) };
+                let len = HEADER_LEN + event.len as usize;
+                let name = &events[HEADER_LEN..len.min(events.len())];
+                let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+                events = &events[len.min(events.len())..];
+                if event.mask & libc::IN_Q_OVERFLOW != 0 {
+                    self.files.iter_mut().for_each(|file| file.dirty = true);
+                    continue;
+                }
+                let Some(ids) = self.watches.get(&event.wd) else {
+                    continue;
+                };
+                for &id in ids {
+                    let file = &mut self.files[id];
+                    // Directory events concern only our file name; file events have no name.
+                    if name.is_empty() || name == file.name.as_bytes() {
+                        file.dirty = true;
+                    }
+                }
+            }
+        }
+    }
+
+    /// Reads what is new in file `id`, following truncation and rotation. Returns false if it
+    /// ran out of budget first.
+    fn pump<F: FnMut(TailId, &[u8])>(&mut self, id: TailId, budget: &mut usize, on_line: &mut F) -> io::Result<bool> {
+        // A rotated file is only let go of once it is drained.
+        if self.files[id].file.is_some() && !self.read_to_end(id, budget, on_line)? {
+            return Ok(false);
+        }
+        let current = match fs::metadata(&self.files[id].path) {
+            Ok(meta) => Some(meta.ino()),
+            Err(err) if err.kind() == io::ErrorKind::NotFound => None,
+            Err(err) => return Err(err),
+        };
+        let file = &mut self.files[id];
+        match current {
+            // Renamed away with no replacement yet: the writer may still be appending to the file
+            // we hold, so keep following it until a new file takes its name.
+            None => return Ok(true),
+            Some(ino) if file.file.is_some() && ino == file.ino => return Ok(true),
+            Some(_) => {}
+        }
+        if file.file.take().is_some() {
+            if !file.partial.is_empty() {
+                on_line(id, &file.partial);
+                file.partial.clear();
+            }
+            if let Some(wd) = file.file_wd.take() {
+                self.remove_watch(wd, id);
+            }
+        }
+        match File::open(&self.files[id].path) {
+            Ok(file) => {
+                // A file that appeared after we started is new in its entirety.
+                self.attach(id, file, 0)?;
+                self.read_to_end(id, budget, on_line)
+            }
+            Err(err) if err.kind() == io::ErrorKind::NotFound => Ok(true),
+            Err(err) => Err(err),
+        }
+    }
+
+    fn attach(&mut self, id: TailId, mut file: File, offset: u64) -> io::Result<()> {
+        file.seek(SeekFrom::Start(offset))?;
+        let wd = self.add_watch(&self.files[id].path, FILE_MASK)?;
+        self.watches.entry(wd).or_default().push(id);
+        let tailed = &mut self.files[id];
+        tailed.ino = file.metadata()?.ino();
+        tailed.offset = offset;
+        tailed.file = Some(file);
+        tailed.file_wd = Some(wd);
+        Ok(())
+    }
+
+    /// Reads file `id` up to its end, or until `budget` lines were passed on. Returns false in
+    /// the latter case.
+    fn read_to_end<F: FnMut(TailId, &[u8])>(&mut self, id: TailId, budget: &mut usize, on_line: &mut F) -> io::Result<bool> {
+        let Tailer { files, buf, .. } = self;
+        let tailed = &mut files[id];
+        let Some(file) = tailed.file.as_mut() else {
+            return Ok(true);
+        };
+        // copytruncate: the file was emptied in place and writing restarted from zero. If the
+        // writer already got past our old offset, the byte before it is no longer the newline
+        // that ended the last line we read.
+        let mut last = [0u8];
+        let rewritten = tailed.partial.is_empty()
+            && tailed.offset > 0
+            && file.read_at(&mut last, tailed.offset - 1).is_ok_and(|n| n == 1 && last[0] != b'\n');
+        if rewritten || file.metadata()?.len() < tailed.offset {
+            file.seek(SeekFrom::Start(0))?;
+            tailed.offset = 0;
+            tailed.partial.clear();
+        }
+        loop {
+            if *budget == 0 {
+                return Ok(false);
+            }
+            let n = match file.read(buf) {
+                Ok(0) => return Ok(true),
+                Ok(n) => n,
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            };
+            tailed.offset += n as u64;
+            let mut chunk = &buf[..n];
+            while let Some(end) = memchr::memchr(b'\n', chunk) {
+                *budget = budget.saturating_sub(1);
+                if tailed.partial.is_empty() {
+                    on_line(id, &chunk[..end]);
+                } else {
+                    tailed.partial.extend_from_slice(&chunk[..end]);
+                    on_line(id, &tailed.partial);
+                    tailed.partial.clear();
+                }
+                chunk = &chunk[end + 1..];
+            }
+            tailed.partial.extend_from_slice(chunk);
+            if tailed.partial.len() >= MAX_LINE {
+                on_line(id, &tailed.partial);
+                tailed.partial.clear();
+            }
+        }
+    }
+
+    fn remove_watch(&mut self, wd: libc::c_int, id: TailId) {
+        let Some(ids) = self.watches.get_mut(&wd) else {
+            return;
+        };
+        ids.retain(|&other| other != id);
+        if ids.is_empty() {
+            self.watches.remove(&wd);
+            unsafe { libc::inotify_rm_watch(self.inotify.as_raw_fd(), wd) };
+        }
+    }
+
+    fn add_watch(&self, path: &Path, mask: u32) -> io::Result<libc::c_int> {
+        let path = cstr(path)?;
+        cvt(unsafe { libc::inotify_add_watch(self.inotify.as_raw_fd(), path.as_ptr(), mask) })
+    }
+}
+
+impl AsRawFd for Tailer {
+    fn as_raw_fd(&self) -> RawFd {
+        self.inotify.as_raw_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{self, OpenOptions};
+    use std::io::Write;
+    use std::path::{Path, PathBuf};
+
+    use super::{Tailer, READ_BUFFER_SIZE};
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-tail-{}-{name}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn append(path: &Path, text: &str) {
+        OpenOptions::new().append(true).create(true).open(path).unwrap().write_all(text.as_bytes()).unwrap();
+    }
+
+    /// Every line there is, as much as `budget` allows per call, and whether more was left after the first call.
+    fn lines(tailer: &mut Tailer, budget: usize) -> (Vec<String>, bool) {
+        let mut out = Vec::new();
+        let mut on_line = |_, line: &[u8]| out.push(String::from_utf8(line.to_vec()).unwrap());
+        let more = tailer.read_lines(budget, &mut on_line).unwrap();
+        let mut again = more;
+        while again {
+            again = tailer.read_lines(budget, &mut on_line).unwrap();
+        }
+        (out, more)
+    }
+
+    #[test]
+    fn follows_from_the_end() {
+        let dir = scratch("end");
+        let log = dir.join("auth.log");
+        append(&log, "old 1\nold 2\n");
+        let mut tailer = Tailer::new().unwrap();
+        tailer.add(&log).unwrap();
+        assert_eq!(lines(&mut tailer, 100).0, Vec::<String>::new());
+        append(&log, "new 1\nnew ");
+        assert_eq!(lines(&mut tailer, 100).0, ["new 1"]);
+        append(&log, "2\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["new 2"]);
+        // A file that only appears later is read from its start.
+        let late = dir.join("secure");
+        let id = tailer.add(&late).unwrap();
+        assert_eq!(id, 1);
+        append(&late, "first\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["first"]);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn budget_stops_between_reads_and_keeps_split_lines() {
+        let dir = scratch("budget");
+        let log = dir.join("access.log");
+        append(&log, "");
+        let mut tailer = Tailer::new().unwrap();
+        tailer.add(&log).unwrap();
+        // Lines of 100 bytes, so reads end in the middle of one.
+        let written: Vec<String> = (0..3 * READ_BUFFER_SIZE / 100).map(|i| format!("{i:099}")).collect();
+        append(&log, &written.iter().map(|line| format!("{line}\n")).collect::<String>());
+
+        let mut first = Vec::new();
+        assert!(tailer.read_lines(1, |_, line| first.push(line.to_vec())).unwrap());
+        assert_eq!(first.len(), READ_BUFFER_SIZE / 100);
+        let (rest, _) = lines(&mut tailer, 1);
+        let all: Vec<String> = first.into_iter().map(|line| String::from_utf8(line).unwrap()).chain(rest).collect();
+        assert_eq!(all, written);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn follows_rename_rotation() {
+        let dir = scratch("rename");
+        let log = dir.join("auth.log");
+        append(&log, "");
+        let mut tailer = Tailer::new().unwrap();
+        tailer.add(&log).unwrap();
+        append(&log, "before\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["before"]);
+
+        fs::rename(&log, dir.join("auth.log.1")).unwrap();
+        // The writer still has the old file open until it is told to reopen.
+        append(&dir.join("auth.log.1"), "late\nunfinished");
+        assert_eq!(lines(&mut tailer, 100).0, ["late"]);
+        append(&log, "after\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["unfinished", "after"]);
+        append(&dir.join("auth.log.1"), "ignored\n");
+        append(&log, "more\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["more"]);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn follows_copytruncate() {
+        let dir = scratch("truncate");
+        let log = dir.join("access.log");
+        append(&log, "");
+        let mut tailer = Tailer::new().unwrap();
+        tailer.add(&log).unwrap();
+        append(&log, "one\ntwo\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["one", "two"]);
+
+        // Emptied and written again, less than was there.
+        fs::write(&log, "").unwrap();
+        append(&log, "3\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["3"]);
+        // Emptied and written again past where we were, before we looked.
+        fs::write(&log, "").unwrap();
+        append(&log, "a longer line\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["a longer line"]);
+        append(&log, "next\n");
+        assert_eq!(lines(&mut tailer, 100).0, ["next"]);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
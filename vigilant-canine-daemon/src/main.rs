@@ -1,3 +1,1015 @@
-fn main() {
-    println!("Hello, world!");
+use std::fs;
+use std::io::{self, Write};
+use std::os::fd::AsRawFd;
+use std::net::IpAddr;
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use vigilant_canine_daemon::aggregate::{AggregateConfig, Aggregator};
+use vigilant_canine_daemon::detect::bruteforce::{BruteForceConfig, BruteForceDetector};
+use vigilant_canine_daemon::detect::reputation::Reputation;
+use vigilant_canine_daemon::exposure::{socket_owner, Exposure, ExposureMonitor, SocketInfo};
+use vigilant_canine_daemon::fim::baseline::Baseline;
+use vigilant_canine_daemon::fim::monitor::{ChangeKind, Monitor};
+use vigilant_canine_daemon::fim::scan::{scan, ScanOptions};
+use vigilant_canine_daemon::fim::verify::{AuditBatch, AuditStep, Change, Finding, Verifier, VerifyPolicy};
+use vigilant_canine_daemon::ipc::Server;
+use vigilant_canine_daemon::ips::nftables::{NftBlocker, TABLE};
+use vigilant_canine_daemon::logs::LogSource;
+use vigilant_canine_daemon::metrics::{write_prometheus, Count, Metrics, Queue, Stage};
+use vigilant_canine_daemon::process::exec::{ExecFinding, ExecKind, ExecMonitor, ExecPolicy};
+use vigilant_canine_daemon::reactor::{Interest, Reactor, Token};
+use vigilant_canine_daemon::shed::{ShedConfig, Shedder};
+use vigilant_canine_daemon::signal::Signals;
+use vigilant_canine_daemon::snapshot;
+use vigilant_canine_daemon::sys::replace_file;
+use vigilant_canine_daemon::store::{Compacted, EventStore, Maintenance, StoreConfig};
+use vigilant_canine_daemon::timer::TimerWheel;
+use vigilant_canine_daemon::worker::Worker;
+use vigilant_canine_proto::{Alert, Counter, Request, Response, Status, DEFAULT_SOCKET_PATH, MAX_ALERTS, MAX_FRAME};
+use vigilant_canine_rules::{Rule, RuleSet, Severity, DEFAULT_RULES};
+
+const BASELINE_PATH: &str = "/var/lib/vigilant-canine/baseline";
+/// When the last deep audit finished, in Unix seconds.
+const DEEP_AUDIT_PATH: &str = "/var/lib/vigilant-canine/deep-audit";
+const JOURNAL_CURSOR_PATH: &str = "/var/lib/vigilant-canine/journal.cursor";
+const EVENTS_PATH: &str = "/var/lib/vigilant-canine/events";
+/// Syslog files, followed when there is no journal.
+const LOG_FILES: &[&str] = &["/var/log/auth.log", "/var/log/secure"];
+/// Logs servers write themselves, followed with or without a journal. Their lines are matched as
+/// logged by the program named here, so local rules select them with `program = nginx` and so on.
+const SERVER_LOG_FILES: &[(&str, &str)] = &[
+    ("/var/log/nginx/access.log", "nginx"),
+    ("/var/log/nginx/error.log", "nginx"),
+    ("/var/log/apache2/access.log", "apache2"),
+    ("/var/log/apache2/error.log", "apache2"),
+    ("/var/log/httpd/access_log", "httpd"),
+    ("/var/log/httpd/error_log", "httpd"),
+];
+/// Local rules (`*.rules`), loaded after the shipped ones.
+const RULES_DIR: &str = "/etc/vigilant-canine/rules.d";
+const RULES_SNAPSHOT_PATH: &str = "/var/lib/vigilant-canine/rules.snapshot";
+/// Every file here is an IP reputation list (FireHOL netset, Spamhaus DROP and the like).
+const REPUTATION_DIR: &str = "/etc/vigilant-canine/reputation";
+const REPUTATION_PATH: &str = "/var/lib/vigilant-canine/reputation";
+/// How often the reputation lists are checked for updates.
+const REPUTATION_CHECK_INTERVAL: Duration = Duration::from_secs(5 * 60);
+/// node_exporter's textfile collector directory. Metrics are written there if it exists.
+const PROMETHEUS_DIR: &str = "/var/lib/prometheus/node-exporter";
+const PROMETHEUS_FILE: &str = "vigilant-canine.prom";
+const METRICS_INTERVAL: Duration = Duration::from_secs(15);
+/// Log lines handled per wakeup at most. The rest wait in the journal or file, which bounds
+/// them, while file and exec events, timers and clients get their turn.
+const LOG_BATCH: usize = 4096;
+/// How often shed alerts are summed up in one.
+const SHED_REPORT_INTERVAL: Duration = Duration::from_secs(60);
+/// How long a brute-force source stays blocked.
+const BLOCK_TIME: Duration = Duration::from_secs(60 * 60);
+/// How long retention waits after failing before it tries again.
+const RETENTION_RETRY: Duration = Duration::from_secs(60 * 60);
+/// How soon a new listening socket is noticed.
+const LISTENER_SCAN_INTERVAL: Duration = Duration::from_secs(1);
+const CONNECTION_SCAN_INTERVAL: Duration = Duration::from_secs(10);
+/// Entries of /proc looked at to find who holds the sockets one scan turned up (a few ms per
+/// thousand), so a burst of new sockets cannot hold up the loop; the rest are described by uid.
+const OWNER_SEARCH_BUDGET: usize = 20_000;
+/// Scheduled work due within the same tick of this grid runs in one wakeup.
+const TIMER_RESOLUTION: Duration = Duration::from_secs(1);
+/// How long alerts and the journal position may wait before they are written to disk. A power
+/// loss loses at most this much.
+const FLUSH_DELAY: Duration = Duration::from_secs(5);
+/// Files an audit checks per batch on the worker.
+const AUDIT_BATCH: usize = 256;
+/// How long an audit waits after its worker failed to start before it tries again.
+const AUDIT_RETRY: Duration = Duration::from_secs(60);
+/// Event loop tokens; clients of the socket take the ones after `SERVER`.
+const TIMER: Token = Token(0);
+const MONITOR: Token = Token(1);
+const LOGS: Token = Token(2);
+const PROCESSES: Token = Token(3);
+const SIGNALS: Token = Token(4);
+const RELOADS: Token = Token(5);
+const BLOCKER: Token = Token(6);
+const AUDITS: Token = Token(7);
+const COMPACTIONS: Token = Token(8);
+const HASHES: Token = Token(9);
+const SERVER: Token = Token(10);
+const DEFAULT_WATCH_PATHS: &[&str] = &["/etc", "/usr/bin", "/usr/sbin", "/usr/local/bin", "/usr/local/sbin", "/boot"];
+
+/// Work the daemon does on a clock rather than in response to an event.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+enum Job {
+    DeepAudit,
+    /// Handing the next batch of a deep audit to the worker.
+    Audit,
+    Retention,
+    /// Syncing the alert history and saving the journal cursor.
+    Flush,
+    ExpireCounters,
+    ScanListeners,
+    ScanConnections,
+    CheckReputation,
+    WriteMetrics,
+    ReportShed,
+    /// Recording the repeats collapsed in windows that have closed.
+    ExpireRepeats,
+}
+
+/// What a reload built off the event loop.
+struct Reloaded {
+    rules: Result<RuleSet, String>,
+    reputation: io::Result<Reputation>,
+}
+
+const USAGE: &str = "usage: vigilant-canine-daemon [--deep-audit DAYS] | baseline
+  DAYS is how often every baseline file is rehashed (default 7)";
+
+fn main() -> ExitCode {
+    let roots: Vec<PathBuf> = DEFAULT_WATCH_PATHS.iter().map(PathBuf::from).filter(|path| path.exists()).collect();
+    let mut verify_policy = VerifyPolicy::default();
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "baseline" => {
+                if args.len() != 0 {
+                    eprintln!("{USAGE}");
+                    return ExitCode::FAILURE;
+                }
+                return match build_baseline(&roots, ScanOptions::default()) {
+                    Ok(()) => ExitCode::SUCCESS,
+                    Err(err) => {
+                        eprintln!("vigilant-canine: cannot build baseline: {err}");
+                        ExitCode::FAILURE
+                    }
+                };
+            }
+            "--deep-audit" => match args.next().and_then(|days| days.parse::<u64>().ok()).filter(|&days| days > 0) {
+                Some(days) => verify_policy.deep_audit_interval = Duration::from_secs(days * 24 * 60 * 60),
+                None => {
+                    eprintln!("{USAGE}");
+                    return ExitCode::FAILURE;
+                }
+            },
+            _ => {
+                eprintln!("{USAGE}\nunknown argument: {arg}");
+                return ExitCode::FAILURE;
+            }
+        }
+    }
+
+    // Blocked before anything else, so a SIGHUP during startup is a reload rather than the end.
+    // SIGTERM and SIGINT end the loop, so what is pending gets written out first.
+    let signals = match Signals::open(&[libc::SIGHUP, libc::SIGTERM, libc::SIGINT]) {
+        Ok(signals) => signals,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot handle signals: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    // The first start (e.g. right after a distribution installs us) takes the baseline.
+    if !Path::new(BASELINE_PATH).exists() {
+        if let Err(err) = build_baseline(&roots, ScanOptions::default()) {
+            eprintln!("vigilant-canine: cannot build baseline: {err}");
+            return ExitCode::FAILURE;
+        }
+    }
+    let opened = Baseline::open(Path::new(BASELINE_PATH)).and_then(|baseline| Verifier::new(baseline, verify_policy, last_deep_audit()));
+    let mut verifier = match opened {
+        Ok(verifier) => {
+            let algo = verifier.algo();
+            eprintln!(
+                "vigilant-canine: loaded baseline of {} files ({}, {})",
+                verifier.baseline().len(),
+                algo.name(),
+                algo.implementation()
+            );
+            verifier
+        }
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot open baseline {BASELINE_PATH}: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let mut monitor = match Monitor::open(&roots) {
+        Ok(monitor) => monitor,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot monitor files: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    eprintln!("vigilant-canine: watching {} paths with {:?}", roots.len(), monitor.backend());
+
+    let mut rules = match load_rules() {
+        Ok(rules) => Arc::new(rules),
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot load rules: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    // Rules restored from the snapshot build their regexes on first use; build them on a thread
+    // of their own meanwhile, so the loop does not. Should it not start, first use still does.
+    let prepared = Arc::clone(&rules);
+    let _ = thread::Builder::new().name("vigilant-canine-prepare".into()).spawn(move || prepared.prepare());
+    let log_files: Vec<&Path> = LOG_FILES.iter().map(Path::new).collect();
+    let server_log_files: Vec<(&Path, &str)> = SERVER_LOG_FILES.iter().map(|&(path, program)| (Path::new(path), program)).collect();
+    let mut logs = match LogSource::open(Path::new(JOURNAL_CURSOR_PATH), &log_files, &server_log_files) {
+        Ok(logs) => logs,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot read logs: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    if logs.is_journal() {
+        eprintln!("vigilant-canine: following the journal and {} log files with {} rules", logs.files(), rules.rules().len());
+    } else {
+        eprintln!("vigilant-canine: following {} log files with {} rules", logs.files(), rules.rules().len());
+    }
+
+    // Without CAP_NET_ADMIN (or nf_tables) we still detect, we just cannot block.
+    let mut blocker = match NftBlocker::open() {
+        Ok(blocker) => {
+            eprintln!("vigilant-canine: blocking offenders in nftables table inet {TABLE}");
+            Some(blocker)
+        }
+        Err(err) => {
+            eprintln!("vigilant-canine: blocking disabled: {err}");
+            None
+        }
+    };
+    let mut reactor = match Reactor::new() {
+        Ok(reactor) => reactor,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut timers = match TimerWheel::new(TIMER_RESOLUTION) {
+        Ok(timers) => timers,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut reloads: Worker<Reloaded> = match Worker::new() {
+        Ok(reloads) => reloads,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut audits: Worker<AuditBatch> = match Worker::new() {
+        Ok(audits) => audits,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut compactions: Worker<io::Result<Compacted>> = match Worker::new() {
+        Ok(compactions) => compactions,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let mut hashes: Worker<Vec<ExecFinding>> = match Worker::new() {
+        Ok(hashes) => hashes,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot create event loop: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+    let registered = reactor
+        .register(timers.as_raw_fd(), TIMER, Interest::Readable)
+        .and_then(|()| reactor.register(monitor.as_raw_fd(), MONITOR, Interest::Readable))
+        .and_then(|()| logs.fds().try_for_each(|fd| reactor.register(fd, LOGS, Interest::Readable)))
+        .and_then(|()| reactor.register(signals.as_raw_fd(), SIGNALS, Interest::Readable))
+        .and_then(|()| reactor.register(reloads.as_raw_fd(), RELOADS, Interest::Readable))
+        .and_then(|()| reactor.register(audits.as_raw_fd(), AUDITS, Interest::Readable))
+        .and_then(|()| reactor.register(compactions.as_raw_fd(), COMPACTIONS, Interest::Readable))
+        .and_then(|()| reactor.register(hashes.as_raw_fd(), HASHES, Interest::Readable));
+    let registered = registered.and_then(|()| blocker.as_ref().map_or(Ok(()), |blocker| reactor.register(blocker.as_raw_fd(), BLOCKER, Interest::Readable)));
+    if let Err(err) = registered {
+        eprintln!("vigilant-canine: cannot create event loop: {err}");
+        return ExitCode::FAILURE;
+    }
+    // Like blocking, this needs CAP_NET_ADMIN (and the initial network namespace).
+    let mut processes = match ExecMonitor::open(verifier.algo(), ExecPolicy::default()) {
+        Ok(processes) => match reactor.register(processes.as_raw_fd(), PROCESSES, Interest::Readable) {
+            Ok(()) => {
+                eprintln!("vigilant-canine: checking executed programs");
+                Some(processes)
+            }
+            Err(err) => {
+                eprintln!("vigilant-canine: cannot create event loop: {err}");
+                return ExitCode::FAILURE;
+            }
+        },
+        Err(err) => {
+            eprintln!("vigilant-canine: exec monitoring disabled: {err}");
+            None
+        }
+    };
+    let mut exposure = match ExposureMonitor::open() {
+        Ok(exposure) => {
+            eprintln!("vigilant-canine: watching {} listening sockets", exposure.listeners());
+            Some(exposure)
+        }
+        Err(err) => {
+            eprintln!("vigilant-canine: exposure monitoring disabled: {err}");
+            None
+        }
+    };
+    // Lists are optional: with none installed there is nothing to check addresses against.
+    let mut reputation = match Reputation::load(Path::new(REPUTATION_DIR), Path::new(REPUTATION_PATH)) {
+        Ok(reputation) => {
+            eprintln!("vigilant-canine: checking addresses against {} listed ranges", reputation.len());
+            Some(reputation)
+        }
+        Err(err) => {
+            if err.kind() != io::ErrorKind::NotFound {
+                eprintln!("vigilant-canine: reputation lists disabled: {err}");
+            }
+            None
+        }
+    };
+    let mut server = match Server::bind(Path::new(DEFAULT_SOCKET_PATH), &reactor, SERVER) {
+        Ok(server) => Some(server),
+        Err(err) => {
+            eprintln!("vigilant-canine: not accepting clients on {DEFAULT_SOCKET_PATH}: {err}");
+            None
+        }
+    };
+
+    let mut store = match EventStore::open(Path::new(EVENTS_PATH), StoreConfig::default()) {
+        Ok(store) => store,
+        Err(err) => {
+            eprintln!("vigilant-canine: cannot open alert history {EVENTS_PATH}: {err}");
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let started = Instant::now();
+    let brute_force_config = BruteForceConfig::default();
+    let mut brute_force = BruteForceDetector::new(brute_force_config);
+    let mut retention_failed = false;
+    let mut reload_wanted = false;
+    let mut scanner = rules.scanner();
+    let mut matches = Vec::new();
+    let mut events = Vec::new();
+    let mut findings = Vec::new();
+    let mut execs = Vec::new();
+    let mut exposures = Vec::new();
+    let mut connections = Vec::new();
+    let mut ready = Vec::new();
+    let mut metrics = Metrics::new();
+    let mut aggregator = Aggregator::new(AggregateConfig::default());
+    let mut shedder = Shedder::new(ShedConfig::default());
+    let mut repeats = Vec::new();
+    let mut logs_backlog = false;
+    let mut received = Vec::new();
+    let mut due = Vec::new();
+    timers.schedule(Job::DeepAudit, verifier.until_deep_audit());
+    if let Some(until) = store.until_maintenance(now_ms()) {
+        timers.schedule(Job::Retention, until);
+    }
+    if exposure.is_some() {
+        timers.schedule(Job::ScanListeners, LISTENER_SCAN_INTERVAL);
+        timers.schedule(Job::ScanConnections, Duration::ZERO);
+    }
+    timers.schedule(Job::CheckReputation, REPUTATION_CHECK_INTERVAL);
+    if Path::new(PROMETHEUS_DIR).is_dir() {
+        timers.schedule(Job::WriteMetrics, METRICS_INTERVAL);
+    }
+    loop {
+        // With nothing scheduled and no events the daemon sleeps indefinitely.
+        if let Err(err) = timers.arm() {
+            eprintln!("vigilant-canine: cannot set timer: {err}");
+            return ExitCode::FAILURE;
+        }
+        ready.clear();
+        // With log lines left over from the last wakeup, only look for other events.
+        if let Err(err) = reactor.wait(logs_backlog.then_some(Duration::ZERO), &mut ready) {
+            eprintln!("vigilant-canine: event loop failed: {err}");
+            return ExitCode::FAILURE;
+        }
+        metrics.wakeup(ready.len());
+        if logs_backlog && !ready.contains(&LOGS) {
+            ready.push(LOGS);
+        }
+        if ready.contains(&TIMER) {
+            if let Err(err) = timers.expired(&mut due) {
+                eprintln!("vigilant-canine: cannot read timer: {err}");
+                return ExitCode::FAILURE;
+            }
+        }
+        let alerts_before = store.len();
+
+        if ready.contains(&SIGNALS) {
+            if let Err(err) = signals.read(&mut received) {
+                eprintln!("vigilant-canine: cannot read signals: {err}");
+            }
+            reload_wanted |= received.contains(&libc::SIGHUP);
+            if received.drain(..).any(|signal| signal == libc::SIGTERM || signal == libc::SIGINT) {
+                break;
+            }
+        }
+        // The new rules and lists take the old ones' place between two events: lines already
+        // scanned were matched against the old rules and the next ones see the new. Counters,
+        // blocks and the journal position are untouched. The old values are freed on a thread
+        // of their own, as that alone can take longer than the loop may be held up.
+        if ready.contains(&RELOADS) {
+            if let Some(reloaded) = reloads.take() {
+                metrics.count(Count::Reloads);
+                let old_rules = match reloaded.rules {
+                    Ok(new) => {
+                        eprintln!("vigilant-canine: reloaded {} rules", new.rules().len());
+                        scanner = new.scanner();
+                        Some(std::mem::replace(&mut rules, Arc::new(new)))
+                    }
+                    Err(err) => {
+                        eprintln!("vigilant-canine: keeping the current rules: {err}");
+                        None
+                    }
+                };
+                let old_reputation = match reloaded.reputation {
+                    Ok(new) => {
+                        eprintln!("vigilant-canine: checking addresses against {} listed ranges", new.len());
+                        reputation.replace(new)
+                    }
+                    Err(err) if err.kind() == io::ErrorKind::NotFound => reputation.take(),
+                    Err(err) => {
+                        eprintln!("vigilant-canine: keeping the current reputation lists: {err}");
+                        None
+                    }
+                };
+                let _ = thread::Builder::new().name("vigilant-canine-reclaim".into()).spawn(move || drop((old_rules, old_reputation)));
+            }
+        }
+
+        if ready.contains(&LOGS) {
+            // A line's ingest time is the time since the previous one was done with.
+            let mut timer = metrics.timer();
+            let mut lines = 0;
+            let result = logs.read(LOG_BATCH, |program, message| {
+                lines += 1;
+                timer.lap(&mut metrics, Stage::Ingest);
+                rules.scan(&mut scanner, program, message, &mut matches);
+                timer.lap(&mut metrics, Stage::Match);
+                for found in matches.drain(..) {
+                    let rule = &rules.rules()[found.rule];
+                    let src: Option<IpAddr> = found.src.and_then(|range| std::str::from_utf8(&message[range]).ok()?.parse().ok());
+                    let text = String::from_utf8_lossy(message).into_owned();
+                    timer.lap(&mut metrics, Stage::Parse);
+                    let alert = Alert::new(now_ms(), rule.severity, rule.id.clone(), src, text);
+                    raise_alert(&mut store, &mut aggregator, &mut shedder, alert, false);
+                    timer.lap(&mut metrics, Stage::Store);
+                    let auth_failure = rule.category.as_deref() == Some("auth-failure");
+                    if let Some(src) = src.filter(|&src| reputation.as_ref().is_some_and(|reputation| reputation.contains(src))) {
+                        raise(&mut store, &mut aggregator, &mut shedder, Severity::High, "reputation", Some(src), format!("{} from listed address {src}", rule.id));
+                        // A listed source gets no benefit of the doubt.
+                        if let Some(blocker) = blocker.as_mut().filter(|_| auth_failure) {
+                            blocker.block(src, BLOCK_TIME);
+                            metrics.count(Count::Blocks);
+                            timer.lap(&mut metrics, Stage::Act);
+                            continue;
+                        }
+                    }
+                    if let (true, Some(src)) = (auth_failure, src) {
+                        if !timers.is_scheduled(Job::ExpireCounters) {
+                            timers.schedule(Job::ExpireCounters, brute_force_config.window);
+                        }
+                        if let Some(offense) = brute_force.record(src, Instant::now()) {
+                            let message = format!("{} failed logins from {}", offense.failures, offense.addr);
+                            raise(&mut store, &mut aggregator, &mut shedder, Severity::High, "brute-force", Some(offense.addr), message);
+                            if let Some(blocker) = &mut blocker {
+                                blocker.block(offense.addr, BLOCK_TIME);
+                                metrics.count(Count::Blocks);
+                                brute_force.forget(offense.addr);
+                            }
+                        }
+                    }
+                    timer.lap(&mut metrics, Stage::Act);
+                }
+                timer = metrics.timer();
+            });
+            metrics.depth(Queue::LogLines, lines);
+            match result {
+                Ok(more) => logs_backlog = more,
+                Err(err) => {
+                    eprintln!("vigilant-canine: reading logs failed: {err}");
+                    return ExitCode::FAILURE;
+                }
+            }
+            if !timers.is_scheduled(Job::Flush) {
+                timers.schedule(Job::Flush, FLUSH_DELAY);
+            }
+            // Everything blocked while handling this wakeup goes out as one transaction.
+            if let Some(blocker) = blocker.as_mut().filter(|blocker| blocker.pending() > 0) {
+                if let Err(err) = blocker.flush() {
+                    eprintln!("vigilant-canine: blocking failed: {err}");
+                }
+            }
+        }
+
+        if ready.contains(&BLOCKER) {
+            if let Some(Err(err)) = blocker.as_mut().map(NftBlocker::acknowledge) {
+                eprintln!("vigilant-canine: blocking failed: {err}");
+            }
+        }
+
+        if ready.contains(&MONITOR) {
+            if let Err(err) = monitor.read_events(&mut events) {
+                eprintln!("vigilant-canine: file monitor failed: {err}");
+                return ExitCode::FAILURE;
+            }
+            metrics.depth(Queue::FileEvents, events.len());
+        }
+        if ready.contains(&PROCESSES) {
+            let start = Instant::now();
+            let result = processes.as_mut().map_or(Ok(()), |processes| processes.read_events(verifier.baseline(), &mut execs));
+            metrics.record(Stage::Exec, start.elapsed());
+            metrics.depth(Queue::Execs, execs.len());
+            if let Err(err) = result {
+                eprintln!("vigilant-canine: exec monitoring failed: {err}");
+                processes = None;
+            }
+        }
+        if ready.contains(&HASHES) {
+            // Nothing while the job still runs means a spurious wakeup; otherwise its thread died
+            // and the next batch goes ahead.
+            execs.extend(hashes.take().into_iter().flatten());
+        }
+        if !hashes.is_running() {
+            if let Some(batch) = processes.as_mut().and_then(ExecMonitor::take_hashes) {
+                if let Err(err) = hashes.start(move || batch.run()) {
+                    eprintln!("vigilant-canine: cannot start hashing executed programs: {err}");
+                }
+            }
+        }
+        for exec in execs.drain(..) {
+            let severity = match exec.kind {
+                ExecKind::Deleted | ExecKind::Modified => Severity::High,
+                ExecKind::Suspicious => Severity::Medium,
+            };
+            raise(&mut store, &mut aggregator, &mut shedder, severity, "exec", None, describe_exec(&exec, verifier.algo().name()));
+        }
+
+        let mut overflowed = false;
+        for event in events.drain(..) {
+            if event.kind == ChangeKind::Overflow {
+                overflowed = true;
+                continue;
+            }
+            let mut timer = metrics.timer();
+            let checked = verifier.check(&event.path);
+            timer.lap(&mut metrics, Stage::Verify);
+            if let Ok(Some(change)) = checked {
+                findings.push(Finding { path: event.path, change });
+            }
+        }
+        if overflowed {
+            verifier.start_audit(false);
+            if !audits.is_running() {
+                continue_audit(&mut verifier, &mut audits, &mut timers);
+            }
+        }
+        // Events were lost before an overflow audit, so its batches follow each other as fast as
+        // the worker gets through them; a deep audit's are spread one per tick.
+        if ready.contains(&AUDITS) {
+            if let Some(batch) = audits.take() {
+                let deep = batch.is_deep();
+                verifier.apply(batch, &mut findings);
+                if deep {
+                    timers.schedule(Job::Audit, Duration::ZERO);
+                } else {
+                    continue_audit(&mut verifier, &mut audits, &mut timers);
+                }
+            } else if !audits.is_running() && !timers.is_scheduled(Job::Audit) {
+                // The batch's thread died; go on with the next.
+                timers.schedule(Job::Audit, Duration::ZERO);
+            }
+        }
+
+        if ready.contains(&COMPACTIONS) {
+            let compacted = compactions.take();
+            // No result while the job still runs means a spurious wakeup; otherwise its thread died.
+            if compacted.is_some() || !compactions.is_running() {
+                match store.finish_compaction(compacted) {
+                    Ok(()) => timers.schedule(Job::Retention, Duration::ZERO),
+                    Err(err) => {
+                        eprintln!("vigilant-canine: alert history retention failed: {err}");
+                        retention_failed = true;
+                        timers.schedule(Job::Retention, RETENTION_RETRY);
+                    }
+                }
+            }
+        }
+
+        for job in due.drain(..) {
+            match job {
+                Job::DeepAudit => {
+                    verifier.start_audit(true);
+                    if !audits.is_running() {
+                        continue_audit(&mut verifier, &mut audits, &mut timers);
+                    }
+                }
+                Job::Audit => {
+                    if !audits.is_running() {
+                        continue_audit(&mut verifier, &mut audits, &mut timers);
+                    }
+                }
+                // One segment per tick at most, so retention never holds up detection for long.
+                Job::Retention => match store.maintain(now_ms()) {
+                    Ok(Maintenance::Idle) => {
+                        retention_failed = false;
+                        if let Some(until) = store.until_maintenance(now_ms()) {
+                            timers.schedule(Job::Retention, until);
+                        }
+                    }
+                    Ok(Maintenance::Dropped { .. }) => {
+                        retention_failed = false;
+                        timers.schedule(Job::Retention, Duration::ZERO);
+                    }
+                    // Rewriting a segment reads and syncs megabytes, so it runs on the worker;
+                    // retention goes on once it is done.
+                    Ok(Maintenance::Compact(compaction)) => {
+                        retention_failed = false;
+                        if let Err(err) = compactions.start(move || compaction.run()) {
+                            let _ = store.finish_compaction(None);
+                            eprintln!("vigilant-canine: cannot start alert history compaction: {err}");
+                            retention_failed = true;
+                            timers.schedule(Job::Retention, RETENTION_RETRY);
+                        }
+                    }
+                    Err(err) => {
+                        eprintln!("vigilant-canine: alert history retention failed: {err}");
+                        retention_failed = true;
+                        timers.schedule(Job::Retention, RETENTION_RETRY);
+                    }
+                },
+                Job::Flush => {
+                    if let Err(err) = store.sync(true) {
+                        eprintln!("vigilant-canine: cannot sync alert history: {err}");
+                    }
+                    if let Err(err) = logs.save_cursor() {
+                        eprintln!("vigilant-canine: cannot save journal cursor: {err}");
+                    }
+                }
+                Job::ExpireCounters => {
+                    brute_force.expire(Instant::now());
+                    if !brute_force.is_empty() {
+                        timers.schedule(Job::ExpireCounters, brute_force_config.window);
+                    }
+                }
+                Job::ScanListeners => {
+                    let Some(exposure) = &mut exposure else { continue };
+                    if let Err(err) = exposure.scan_listeners(&mut exposures) {
+                        eprintln!("vigilant-canine: cannot list listening sockets: {err}");
+                    }
+                    let mut budget = OWNER_SEARCH_BUDGET;
+                    for change in exposures.drain(..) {
+                        match change {
+                            Exposure::Listening(socket) => {
+                                let owner = describe_owner(&socket, &mut budget);
+                                let message = format!("{} {} listening ({owner})", socket.protocol.name(), socket.local);
+                                raise(&mut store, &mut aggregator, &mut shedder, Severity::Medium, "exposure", None, message);
+                            }
+                            Exposure::Closed(socket) => {
+                                let message = format!("{} {} no longer listening", socket.protocol.name(), socket.local);
+                                raise(&mut store, &mut aggregator, &mut shedder, Severity::Info, "exposure", None, message);
+                            }
+                        }
+                    }
+                    timers.schedule(Job::ScanListeners, LISTENER_SCAN_INTERVAL);
+                }
+                Job::ScanConnections => {
+                    let Some(exposure) = &mut exposure else { continue };
+                    if let Err(err) = exposure.scan_connections(&mut connections) {
+                        eprintln!("vigilant-canine: cannot list connections: {err}");
+                    }
+                    let mut budget = OWNER_SEARCH_BUDGET;
+                    for socket in connections.drain(..) {
+                        if reputation.as_ref().is_some_and(|reputation| reputation.contains(socket.remote.ip())) {
+                            let owner = describe_owner(&socket, &mut budget);
+                            let message = format!("tcp {} connected to listed address {} ({owner})", socket.local, socket.remote);
+                            raise(&mut store, &mut aggregator, &mut shedder, Severity::High, "reputation", Some(socket.remote.ip()), message);
+                        }
+                    }
+                    timers.schedule(Job::ScanConnections, CONNECTION_SCAN_INTERVAL);
+                }
+                // Only metadata is looked at here; the reload itself runs off the loop.
+                Job::CheckReputation => {
+                    let dir = Path::new(REPUTATION_DIR);
+                    let current = match &reputation {
+                        Some(reputation) => reputation.is_current(dir).unwrap_or(false),
+                        None => !dir.exists(),
+                    };
+                    reload_wanted |= !current;
+                    timers.schedule(Job::CheckReputation, REPUTATION_CHECK_INTERVAL);
+                }
+                Job::WriteMetrics => {
+                    let snapshot = metrics_snapshot(&metrics, &aggregator, &shedder);
+                    if let Err(err) = write_prometheus(&Path::new(PROMETHEUS_DIR).join(PROMETHEUS_FILE), &snapshot) {
+                        eprintln!("vigilant-canine: cannot write metrics: {err}");
+                    }
+                    timers.schedule(Job::WriteMetrics, METRICS_INTERVAL);
+                }
+                // The summary is never shed itself.
+                Job::ReportShed => {
+                    let shed = shedder.take_unreported();
+                    let total: u64 = shed.iter().map(|&(_, count)| count).sum();
+                    let counts: Vec<String> = shed.iter().map(|(severity, count)| format!("{count} {severity}")).collect();
+                    let message = format!("{total} alerts not recorded to keep up: {}", counts.join(", "));
+                    record(&mut store, &Alert::new(now_ms(), Severity::Medium, "shed".to_string(), None, message), true);
+                }
+                Job::ExpireRepeats => {
+                    aggregator.expire(Instant::now(), &mut repeats);
+                    for alert in repeats.drain(..) {
+                        record(&mut store, &alert, false);
+                    }
+                }
+            }
+        }
+        for finding in findings.drain(..) {
+            let severity = match finding.change {
+                Change::Content | Change::Removed => Severity::High,
+                Change::Added | Change::Metadata => Severity::Medium,
+            };
+            raise(&mut store, &mut aggregator, &mut shedder, severity, "fim", None, format!("{:?} {}", finding.change, finding.path.display()));
+        }
+
+        if shedder.has_unreported() && !timers.is_scheduled(Job::ReportShed) {
+            timers.schedule(Job::ReportShed, SHED_REPORT_INTERVAL);
+        }
+        if !timers.is_scheduled(Job::ExpireRepeats) {
+            if let Some(until) = aggregator.until_expiry(Instant::now()) {
+                timers.schedule(Job::ExpireRepeats, until);
+            }
+        }
+        // New alerts may have sealed a segment, which can make retention due sooner.
+        if store.len() != alerts_before {
+            if !timers.is_scheduled(Job::Flush) {
+                timers.schedule(Job::Flush, FLUSH_DELAY);
+            }
+            if !retention_failed {
+                if let Some(until) = store.until_maintenance(now_ms()) {
+                    timers.schedule(Job::Retention, until);
+                }
+            }
+        }
+
+        for &token in ready.iter().filter(|&&token| token >= SERVER) {
+            let Some(server) = server.as_mut().filter(|server| server.owns(token)) else {
+                continue;
+            };
+            server.dispatch(&reactor, token, |request, out| {
+                let response = match request {
+                    Request::Status => Response::Status(Status {
+                        version: env!("CARGO_PKG_VERSION").to_string(),
+                        uptime_secs: started.elapsed().as_secs(),
+                        baseline_files: verifier.baseline().len() as u64,
+                        rules: rules.rules().len() as u32,
+                        blocking: blocker.is_some(),
+                        alerts: store.len(),
+                        listeners: exposure.as_ref().map_or(0, |exposure| exposure.listeners() as u32),
+                        connections: exposure.as_ref().map_or(0, |exposure| exposure.connections() as u32),
+                    }),
+                    Request::RecentAlerts { limit } => query_alerts(&store, 0, limit),
+                    Request::AlertsSince { since_ms, limit } => query_alerts(&store, since_ms, limit),
+                    Request::Metrics => Response::Metrics(metrics_snapshot(&metrics, &aggregator, &shedder)),
+                    Request::Reload => {
+                        reload_wanted = true;
+                        Response::Reloading
+                    }
+                };
+                response.encode(out);
+            });
+        }
+
+        // A request made while a reload runs is served by another one once it is done, so the
+        // latest changes are never missed.
+        if reload_wanted && !reloads.is_running() {
+            let started = reloads.start(|| {
+                // Restored rules build their regexes on first use; do that here, not in the loop.
+                let rules = load_rules().inspect(RuleSet::prepare);
+                Reloaded { rules, reputation: Reputation::load(Path::new(REPUTATION_DIR), Path::new(REPUTATION_PATH)) }
+            });
+            match started {
+                Ok(_) => reload_wanted = false,
+                Err(err) => eprintln!("vigilant-canine: cannot start reload: {err}"),
+            }
+        }
+    }
+
+    // Lines not read yet stay in the journal for the next start.
+    if let Err(err) = store.sync(true) {
+        eprintln!("vigilant-canine: cannot sync alert history: {err}");
+    }
+    if let Err(err) = logs.save_cursor() {
+        eprintln!("vigilant-canine: cannot save journal cursor: {err}");
+    }
+    eprintln!("vigilant-canine: stopped");
+    ExitCode::SUCCESS
+}
+
+/// Hands the next batch of the audit under way to the worker, which must be idle, after wrapping
+/// up the audit if it has none left.
+fn continue_audit(verifier: &mut Verifier, audits: &mut Worker<AuditBatch>, timers: &mut TimerWheel<Job>) {
+    loop {
+        match verifier.next_batch(AUDIT_BATCH) {
+            AuditStep::Batch(batch) => {
+                if let Err(err) = audits.start(move || batch.run()) {
+                    eprintln!("vigilant-canine: cannot start audit: {err}");
+                    timers.schedule(Job::Audit, AUDIT_RETRY);
+                }
+                return;
+            }
+            AuditStep::Finished { deep: true } => {
+                if let Err(err) = save_deep_audit(verifier.last_deep_audit()) {
+                    eprintln!("vigilant-canine: cannot save deep audit time: {err}");
+                }
+                timers.schedule(Job::DeepAudit, verifier.until_deep_audit());
+            }
+            // A queued audit may have started; the loop goes on with it.
+            AuditStep::Finished { deep: false } => {}
+            AuditStep::Idle => return,
+        }
+    }
+}
+
+/// Reports an alert and records it in the history, unless it repeats one recorded moments ago
+/// (it is then counted towards a single record of the repeats) or it is shed. A shed alert that
+/// opened a window of repeats goes into their record instead, so it is reported when that closes.
+fn raise(store: &mut EventStore, aggregator: &mut Aggregator, shedder: &mut Shedder, severity: Severity, source: &str, addr: Option<IpAddr>, message: String) {
+    raise_alert(store, aggregator, shedder, Alert::new(now_ms(), severity, source.to_string(), addr, message), true);
+}
+
+/// [`raise`] for an alert already made; `echo` as for [`record`].
+fn raise_alert(store: &mut EventStore, aggregator: &mut Aggregator, shedder: &mut Shedder, alert: Alert, echo: bool) {
+    let now = Instant::now();
+    if !aggregator.admit(&alert, now) {
+        return;
+    }
+    if shedder.admit(alert.severity, now) {
+        record(store, &alert, echo);
+    } else {
+        aggregator.carry(&alert);
+    }
+}
+
+/// Prints an alert and appends it to the history. Whatever is printed ends up in the journal
+/// the daemon reads, so the message is only printed with `echo`, never for text taken from a log.
+fn record(store: &mut EventStore, alert: &Alert, echo: bool) {
+    let Alert { severity, source, message, .. } = alert;
+    let mut line = format!("{severity} {source}");
+    if echo {
+        line.push_str(&format!(" {message}"));
+    }
+    if let Some(addr) = alert.addr {
+        line.push_str(&format!(" (from {addr})"));
+    }
+    if alert.count > 1 {
+        line.push_str(&format!(" ({} times in {} s)", alert.count, (alert.last_ms - alert.time_ms).div_ceil(1000)));
+    }
+    println!("{line}");
+    if let Err(err) = store.append(alert) {
+        eprintln!("vigilant-canine: cannot record alert: {err}");
+    }
+}
+
+fn describe_exec(exec: &ExecFinding, algo: &str) -> String {
+    let mut message = format!("{:?} {} as pid {}", exec.kind, exec.path.display(), exec.pid);
+    if let Some(parent) = &exec.parent {
+        message.push_str(&format!(" from {}", parent.display()));
+    }
+    if let Some(digest) = &exec.digest {
+        message.push_str(&format!(", {algo} "));
+        message.extend(digest[..8].iter().map(|byte| format!("{byte:02x}")));
+    }
+    message
+}
+
+/// Names whoever holds a socket, as precisely as can still be found out within `budget`.
+fn describe_owner(socket: &SocketInfo, budget: &mut usize) -> String {
+    match socket_owner(socket.inode, budget) {
+        Some(pid) => match fs::read_link(format!("/proc/{pid}/exe")) {
+            Ok(exe) => format!("pid {pid}, {}", exe.display()),
+            Err(_) => format!("pid {pid}"),
+        },
+        None => format!("uid {}", socket.uid),
+    }
+}
+
+fn metrics_snapshot(metrics: &Metrics, aggregator: &Aggregator, shedder: &Shedder) -> vigilant_canine_proto::Metrics {
+    let mut snapshot = metrics.snapshot();
+    snapshot.counters.push(Counter { name: "collapsed".to_string(), value: aggregator.collapsed() });
+    for severity in [Severity::Info, Severity::Low, Severity::Medium] {
+        snapshot.counters.push(Counter { name: format!("shed-{severity}"), value: shedder.shed(severity) });
+    }
+    snapshot
+}
+
+fn now_ms() -> u64 {
+    SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |since| since.as_millis() as u64)
+}
+
+/// At most `limit` alerts, and no more than [`MAX_ALERTS`] or fit in a frame; the reply says
+/// which limit was applied.
+fn query_alerts(store: &EventStore, since_ms: u64, limit: u32) -> Response {
+    let mut limit = limit.min(MAX_ALERTS);
+    let mut alerts = Vec::new();
+    if let Err(err) = store.query(since_ms, limit as usize, &mut alerts) {
+        return Response::Error(format!("cannot read alert history: {err}"));
+    }
+    // The response tag, limit and alert count come first.
+    let mut size = 9;
+    if let Some(fits) = alerts.iter().position(|alert| {
+        size += alert.encoded_len();
+        size > MAX_FRAME
+    }) {
+        alerts.truncate(fits);
+        limit = fits as u32;
+    }
+    Response::Alerts { alerts, limit }
+}
+
+/// Loads the shipped rules and the local ones, restoring them from the snapshot if none changed
+/// since it was taken and compiling them (and taking a new snapshot) otherwise.
+fn load_rules() -> Result<RuleSet, String> {
+    let mut sources = vec![("default".to_string(), DEFAULT_RULES.to_string())];
+    match fs::read_dir(RULES_DIR) {
+        Ok(entries) => {
+            let mut paths: Vec<PathBuf> = entries
+                .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+                .filter(|path| path.extension().is_some_and(|extension| extension == "rules"))
+                .collect();
+            paths.sort();
+            for path in paths {
+                let text = fs::read_to_string(&path).map_err(|err| format!("{}: {err}", path.display()))?;
+                sources.push((path.display().to_string(), text));
+            }
+        }
+        Err(err) if err.kind() == io::ErrorKind::NotFound => {}
+        Err(err) => return Err(format!("{RULES_DIR}: {err}")),
+    }
+
+    let hash = snapshot::source_hash(sources.iter().map(|(name, text)| (name.as_str(), text.as_str())));
+    match snapshot::open(Path::new(RULES_SNAPSHOT_PATH), hash) {
+        Ok(Some(rules)) => return Ok(rules),
+        Ok(None) => {}
+        Err(err) if err.kind() == io::ErrorKind::NotFound => {}
+        Err(err) => eprintln!("vigilant-canine: ignoring rule snapshot: {err}"),
+    }
+    let mut rules: Vec<Rule> = Vec::new();
+    for (name, text) in &sources {
+        for rule in vigilant_canine_rules::parse(text).map_err(|err| format!("{name}: {err}"))? {
+            if rules.iter().any(|known| known.id == rule.id) {
+                return Err(format!("{name}: duplicate rule {}", rule.id));
+            }
+            rules.push(rule);
+        }
+    }
+    let rules = RuleSet::compile(rules).map_err(|err| err.to_string())?;
+    if let Err(err) = snapshot::write(Path::new(RULES_SNAPSHOT_PATH), hash, &rules) {
+        eprintln!("vigilant-canine: cannot save rule snapshot: {err}");
+    }
+    Ok(rules)
+}
+
+/// When every baseline file was last hashed: at the last deep audit, or when the baseline was
+/// taken if there has not been one since.
+fn last_deep_audit() -> SystemTime {
+    let saved = fs::read_to_string(DEEP_AUDIT_PATH).ok().and_then(|text| text.trim().parse().ok());
+    let saved = saved.map_or(UNIX_EPOCH, |secs| UNIX_EPOCH + Duration::from_secs(secs));
+    let taken = fs::metadata(BASELINE_PATH).and_then(|meta| meta.modified()).unwrap_or_else(|_| SystemTime::now());
+    saved.max(taken)
+}
+
+fn save_deep_audit(time: SystemTime) -> io::Result<()> {
+    let secs = time.duration_since(UNIX_EPOCH).map_or(0, |since| since.as_secs());
+    replace_file(Path::new(DEEP_AUDIT_PATH), |out| writeln!(out, "{secs}"))
+}
+
+fn build_baseline(roots: &[PathBuf], options: ScanOptions) -> io::Result<()> {
+    let started = Instant::now();
+    let (builder, stats) = scan(roots, options)?;
+    if let Some(dir) = Path::new(BASELINE_PATH).parent() {
+        fs::create_dir_all(dir)?;
+    }
+    builder.write(Path::new(BASELINE_PATH))?;
+    eprintln!(
+        "vigilant-canine: baseline of {} files in {} directories written in {:.1?} ({}, {}; {} unreadable)",
+        stats.files,
+        stats.directories,
+        started.elapsed(),
+        options.algo.name(),
+        options.algo.implementation(),
+        stats.errors
+    );
+    Ok(())
 }
@@ -0,0 +1,381 @@
+//! The daemon's own metrics.
+//!
+//! When the daemon uses CPU on a box, these say which stage of the pipeline it went to without
+//! attaching a profiler: how long each stage takes per item, how many items each source had
+//! waiting per wakeup, and a few counters. They are served over the socket and can be written
+//! in Prometheus' text format for node_exporter's textfile collector.
+//!
+//! Times go into histograms with 16 linear buckets per power of two (as HdrHistogram does), so
+//! any percentile is within about 6% of the true value whatever the range, and recording one is
+//! an index computation and an increment. Reading the clock around every stage of every log line
+//! would cost a good part of what matching the line does, so only a random one in
+//! `SAMPLE_EVERY` items is timed and stands for the ones in between; counts and sums are scaled
+//! back up, percentiles need no scaling.
+
+use std::fmt::Write as _;
+use std::fs;
+use std::io;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use vigilant_canine_proto::{Counter, Distribution, Metrics as Snapshot};
+
+/// How many of the items a [`Timer`] is started for are timed, one in this many.
+pub const SAMPLE_EVERY: u64 = 16;
+
+const SUB_BITS: u32 = 4;
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+/// Values below `SUB_BUCKETS` get a bucket each; every power of two above gets `SUB_BUCKETS`.
+const BUCKETS: usize = (u64::BITS - SUB_BITS + 1) as usize * SUB_BUCKETS;
+
+/// Pipeline stages, each timed per item.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Stage {
+    /// Reading and splitting a log line, including waiting for the read.
+    Ingest,
+    /// Matching a line against the rules.
+    Match,
+    /// Taking a rule match apart into an alert.
+    Parse,
+    /// Reporting an alert and appending it to the history.
+    Store,
+    /// Acting on an alert: reputation checks, brute-force counting, blocking.
+    Act,
+    /// Checking a changed file against the baseline.
+    Verify,
+    /// Reading a batch of exec events and checking the programs.
+    Exec,
+}
+
+const STAGES: [Stage; 7] = [Stage::Ingest, Stage::Match, Stage::Parse, Stage::Store, Stage::Act, Stage::Verify, Stage::Exec];
+
+impl Stage {
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::Ingest => "ingest",
+            Stage::Match => "match",
+            Stage::Parse => "parse",
+            Stage::Store => "store",
+            Stage::Act => "act",
+            Stage::Verify => "verify",
+            Stage::Exec => "exec",
+        }
+    }
+}
+
+/// Sources whose backlog is recorded each time the event loop gets to them.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Queue {
+    /// Events the loop woke up for.
+    Ready,
+    LogLines,
+    FileEvents,
+    Execs,
+}
+
+const QUEUES: [Queue; 4] = [Queue::Ready, Queue::LogLines, Queue::FileEvents, Queue::Execs];
+
+impl Queue {
+    pub fn name(self) -> &'static str {
+        match self {
+            Queue::Ready => "ready",
+            Queue::LogLines => "log-lines",
+            Queue::FileEvents => "file-events",
+            Queue::Execs => "execs",
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Count {
+    Blocks,
+    Reloads,
+}
+
+const COUNTS: [Count; 2] = [Count::Blocks, Count::Reloads];
+
+impl Count {
+    pub fn name(self) -> &'static str {
+        match self {
+            Count::Blocks => "blocks",
+            Count::Reloads => "reloads",
+        }
+    }
+}
+
+/// A histogram of `u64` values with bounded relative error.
+pub struct Histogram {
+    buckets: Box<[u64; BUCKETS]>,
+    count: u64,
+    sum: u64,
+    max: u64,
+}
+
+impl Histogram {
+    pub fn new() -> Histogram {
+        Histogram { buckets: Box::new([0; BUCKETS]), count: 0, sum: 0, max: 0 }
+    }
+
+    pub fn record(&mut self, value: u64) {
+        self.record_n(value, 1);
+    }
+
+    /// Records `value` as if it had been seen `n` times.
+    pub fn record_n(&mut self, value: u64, n: u64) {
+        self.buckets[bucket(value)] += n;
+        self.count += n;
+        self.sum = self.sum.saturating_add(value.saturating_mul(n));
+        self.max = self.max.max(value);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// The value below which a `q` (0 to 1) fraction of the recorded ones fall, rounded up to the
+    /// end of its bucket.
+    pub fn quantile(&self, q: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        let rank = ((q * self.count as f64).ceil() as u64).clamp(1, self.count);
+        let mut seen = 0;
+        for (index, &n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                return bucket_end(index).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    pub fn summary(&self, name: &str) -> Distribution {
+        Distribution {
+            name: name.to_string(),
+            count: self.count,
+            sum: self.sum,
+            p50: self.quantile(0.5),
+            p90: self.quantile(0.9),
+            p99: self.quantile(0.99),
+            max: self.max,
+        }
+    }
+}
+
+impl Default for Histogram {
+    fn default() -> Histogram {
+        Histogram::new()
+    }
+}
+
+fn bucket(value: u64) -> usize {
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let exponent = u64::BITS - 1 - value.leading_zeros();
+    let sub = (value >> (exponent - SUB_BITS)) as usize & (SUB_BUCKETS - 1);
+    (exponent - SUB_BITS + 1) as usize * SUB_BUCKETS + sub
+}
+
+/// The largest value that falls into bucket `index`.
+fn bucket_end(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    let shift = (index / SUB_BUCKETS - 1) as u32;
+    let start = ((SUB_BUCKETS + index % SUB_BUCKETS) as u64) << shift;
+    start + ((1u64 << shift) - 1)
+}
+
+/// Everything the daemon records about itself. Only the event loop writes to it, so none of it
+/// is atomic.
+pub struct Metrics {
+    started: Instant,
+    wakeups: u64,
+    stages: Vec<Histogram>,
+    queues: Vec<Histogram>,
+    counts: [u64; COUNTS.len()],
+    /// xorshift state deciding which items are timed. Random rather than every n-th, so a
+    /// pattern in the input (one alert per line, say) cannot line up with it.
+    sampler: u32,
+}
+
+impl Metrics {
+    pub fn new() -> Metrics {
+        Metrics {
+            started: Instant::now(),
+            wakeups: 0,
+            stages: STAGES.iter().map(|_| Histogram::new()).collect(),
+            queues: QUEUES.iter().map(|_| Histogram::new()).collect(),
+            counts: [0; COUNTS.len()],
+            sampler: 0x9e37_79b9,
+        }
+    }
+
+    /// Records a wakeup of the event loop with `ready` events.
+    pub fn wakeup(&mut self, ready: usize) {
+        self.wakeups += 1;
+        self.depth(Queue::Ready, ready);
+    }
+
+    /// Records that `queue` had `items` waiting.
+    pub fn depth(&mut self, queue: Queue, items: usize) {
+        self.queues[queue as usize].record(items as u64);
+    }
+
+    pub fn count(&mut self, count: Count) {
+        self.counts[count as usize] += 1;
+    }
+
+    /// Records a duration that was measured for every item rather than sampled.
+    pub fn record(&mut self, stage: Stage, took: Duration) {
+        self.stages[stage as usize].record(took.as_nanos() as u64);
+    }
+
+    /// A timer for the next item, running if the item is one of those sampled.
+    pub fn timer(&mut self) -> Timer {
+        self.sampler ^= self.sampler << 13;
+        self.sampler ^= self.sampler >> 17;
+        self.sampler ^= self.sampler << 5;
+        Timer { lap: (u64::from(self.sampler) % SAMPLE_EVERY == 0).then(Instant::now) }
+    }
+
+    /// Everything recorded so far, with the process' CPU time and memory as of now.
+    pub fn snapshot(&self) -> Snapshot {
+        let mut usage = unsafe { std::mem::zeroed::<libc::rusage>() };
+        unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+        let micros = |time: libc::timeval| time.tv_sec as u64 * 1_000_000 + time.tv_usec as u64;
+        Snapshot {
+            uptime_secs: self.started.elapsed().as_secs(),
+            cpu_user_us: micros(usage.ru_utime),
+            cpu_system_us: micros(usage.ru_stime),
+            max_rss_kib: usage.ru_maxrss as u64,
+            wakeups: self.wakeups,
+            counters: COUNTS.iter().map(|&count| Counter { name: count.name().into(), value: self.counts[count as usize] }).collect(),
+            stages: STAGES.iter().map(|&stage| self.stages[stage as usize].summary(stage.name())).collect(),
+            queues: QUEUES.iter().map(|&queue| self.queues[queue as usize].summary(queue.name())).collect(),
+        }
+    }
+}
+
+impl Default for Metrics {
+    fn default() -> Metrics {
+        Metrics::new()
+    }
+}
+
+/// Times the stages one item goes through, one after the other, reading the clock once per
+/// stage. Does nothing for items that are not sampled.
+pub struct Timer {
+    lap: Option<Instant>,
+}
+
+impl Timer {
+    /// Records the time since the last lap (or the start) as `stage`'s.
+    pub fn lap(&mut self, metrics: &mut Metrics, stage: Stage) {
+        if let Some(start) = self.lap {
+            let now = Instant::now();
+            metrics.stages[stage as usize].record_n((now - start).as_nanos() as u64, SAMPLE_EVERY);
+            self.lap = Some(now);
+        }
+    }
+}
+
+/// Writes `metrics` in the Prometheus text exposition format. The file is replaced atomically,
+/// so a collector never reads half of it.
+pub fn write_prometheus(path: &Path, metrics: &Snapshot) -> io::Result<()> {
+    let mut text = String::new();
+    let seconds = |ns: u64| ns as f64 / 1e9;
+    let _ = writeln!(text, "# HELP vigilant_canine_cpu_seconds_total CPU time used by the daemon.");
+    let _ = writeln!(text, "# TYPE vigilant_canine_cpu_seconds_total counter");
+    let _ = writeln!(text, "vigilant_canine_cpu_seconds_total{{mode=\"user\"}} {}", metrics.cpu_user_us as f64 / 1e6);
+    let _ = writeln!(text, "vigilant_canine_cpu_seconds_total{{mode=\"system\"}} {}", metrics.cpu_system_us as f64 / 1e6);
+    let _ = writeln!(text, "# HELP vigilant_canine_max_resident_bytes Peak resident memory of the daemon.");
+    let _ = writeln!(text, "# TYPE vigilant_canine_max_resident_bytes gauge");
+    let _ = writeln!(text, "vigilant_canine_max_resident_bytes {}", metrics.max_rss_kib * 1024);
+    let _ = writeln!(text, "# HELP vigilant_canine_wakeups_total Times the event loop woke up.");
+    let _ = writeln!(text, "# TYPE vigilant_canine_wakeups_total counter");
+    let _ = writeln!(text, "vigilant_canine_wakeups_total {}", metrics.wakeups);
+    for counter in &metrics.counters {
+        let name = counter.name.replace('-', "_");
+        let _ = writeln!(text, "# TYPE vigilant_canine_{name}_total counter");
+        let _ = writeln!(text, "vigilant_canine_{name}_total {}", counter.value);
+    }
+    let _ = writeln!(text, "# HELP vigilant_canine_stage_seconds Time each pipeline stage took per item.");
+    let _ = writeln!(text, "# TYPE vigilant_canine_stage_seconds summary");
+    for stage in &metrics.stages {
+        let label = format!("stage=\"{}\"", stage.name);
+        for (quantile, value) in [("0.5", stage.p50), ("0.9", stage.p90), ("0.99", stage.p99), ("1", stage.max)] {
+            let _ = writeln!(text, "vigilant_canine_stage_seconds{{{label},quantile=\"{quantile}\"}} {}", seconds(value));
+        }
+        let _ = writeln!(text, "vigilant_canine_stage_seconds_sum{{{label}}} {}", seconds(stage.sum));
+        let _ = writeln!(text, "vigilant_canine_stage_seconds_count{{{label}}} {}", stage.count);
+    }
+    let _ = writeln!(text, "# HELP vigilant_canine_queue_depth Items a source had waiting when the event loop got to it.");
+    let _ = writeln!(text, "# TYPE vigilant_canine_queue_depth summary");
+    for queue in &metrics.queues {
+        let label = format!("queue=\"{}\"", queue.name);
+        for (quantile, value) in [("0.5", queue.p50), ("0.9", queue.p90), ("0.99", queue.p99), ("1", queue.max)] {
+            let _ = writeln!(text, "vigilant_canine_queue_depth{{{label},quantile=\"{quantile}\"}} {value}");
+        }
+        let _ = writeln!(text, "vigilant_canine_queue_depth_sum{{{label}}} {}", queue.sum);
+        let _ = writeln!(text, "vigilant_canine_queue_depth_count{{{label}}} {}", queue.count);
+    }
+
+    let mut temp = path.as_os_str().to_owned();
+    temp.push(".tmp");
+    fs::write(&temp, text)?;
+    fs::rename(&temp, path)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{bucket, bucket_end, Histogram, BUCKETS, SUB_BUCKETS};
+
+    #[test]
+    fn buckets_tile_the_range() {
+        assert_eq!(bucket(0), 0);
+        for index in 0..BUCKETS - 1 {
+            let end = bucket_end(index);
+            assert_eq!(bucket(end), index, "end of {index}");
+            assert_eq!(bucket(end + 1), index + 1, "start of {}", index + 1);
+        }
+        assert_eq!(bucket_end(BUCKETS - 1), u64::MAX);
+        assert_eq!(bucket(u64::MAX), BUCKETS - 1);
+    }
+
+    #[test]
+    fn small_values_are_exact() {
+        for value in 0..2 * SUB_BUCKETS as u64 {
+            assert_eq!(bucket_end(bucket(value)), value);
+        }
+    }
+
+    #[test]
+    fn bucket_ends_are_within_a_sixteenth() {
+        let mut value = 1u64;
+        while value < u64::MAX / 3 {
+            for value in [value, value * 3 / 2, value * 2 - 1] {
+                let end = bucket_end(bucket(value));
+                assert!(end >= value && end - value <= value / SUB_BUCKETS as u64, "{value} ends at {end}");
+            }
+            value *= 2;
+        }
+    }
+
+    #[test]
+    fn quantiles() {
+        let mut histogram = Histogram::new();
+        assert_eq!(histogram.quantile(0.5), 0);
+        for value in 1..=1000 {
+            histogram.record(value);
+        }
+        histogram.record_n(5000, 10);
+        assert_eq!(histogram.count(), 1010);
+        let p50 = histogram.quantile(0.5);
+        assert!((505..=505 + 505 / 16).contains(&p50), "{p50}");
+        assert_eq!(histogram.quantile(1.0), 5000);
+        assert_eq!(histogram.quantile(0.0), 1);
+        assert_eq!(histogram.summary("x").sum, 500_500 + 50_000);
+    }
+}
@@ -0,0 +1,296 @@
+//! Minimal netlink plumbing: a socket, a message builder and parsers for replies.
+//!
+//! Only what the daemon's own requests need is here. Messages are built straight into one
+//! reusable buffer so a batch of many requests goes to the kernel in a single `send`.
+
+use std::io;
+use std::mem;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::time::Duration;
+
+use crate::sys::cvt;
+
+pub const NLM_F_REQUEST: u16 = 0x1;
+pub const NLM_F_MULTI: u16 = 0x2;
+pub const NLM_F_ACK: u16 = 0x4;
+pub const NLM_F_EXCL: u16 = 0x200;
+pub const NLM_F_CREATE: u16 = 0x400;
+pub const NLM_F_APPEND: u16 = 0x800;
+pub const NLM_F_DUMP: u16 = 0x300;
+
+pub const NLMSG_ERROR: u16 = 2;
+pub const NLMSG_DONE: u16 = 3;
+
+pub const NLA_F_NESTED: u16 = 0x8000;
+const NLA_TYPE_MASK: u16 = 0x3fff;
+
+const HEADER_LEN: usize = mem::size_of::<libc::nlmsghdr>();
+const RECV_BUFFER_SIZE: usize = 64 * 1024;
+
+const fn align(len: usize) -> usize {
+    (len + 3) & !3
+}
+
+pub struct Socket {
+    fd: OwnedFd,
+    buf: Vec<u8>,
+}
+
+impl Socket {
+    /// Opens a netlink socket for `protocol` (e.g. `libc::NETLINK_NETFILTER`) subscribed to
+    /// the multicast `groups` bitmask.
+    pub fn open(protocol: libc::c_int, groups: u32) -> io::Result<Socket> {
+        let fd = cvt(unsafe { libc::socket(libc::AF_NETLINK, libc::SOCK_RAW | libc::SOCK_CLOEXEC, protocol) })?;
+        let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+        let mut addr: libc::sockaddr_nl = unsafe { mem::zeroed() };
+        addr.nl_family = libc::AF_NETLINK as libc::sa_family_t;
+        addr.nl_groups = groups;
+        cvt(unsafe {
+            libc::bind(fd.as_raw_fd(), (&addr as *const libc::sockaddr_nl).cast(), mem::size_of_val(&addr) as libc::socklen_t)
+        })?;
+        Ok(Socket { fd, buf: vec![0; RECV_BUFFER_SIZE] })
+    }
+
+    /// Bounds how long [`recv`](Socket::recv) waits, so a kernel that never answers cannot
+    /// wedge the caller.
+    pub fn set_recv_timeout(&self, timeout: Duration) -> io::Result<()> {
+        let tv = libc::timeval { tv_sec: timeout.as_secs() as libc::time_t, tv_usec: timeout.subsec_micros() as libc::suseconds_t };
+        cvt(unsafe {
+            libc::setsockopt(
+                self.fd.as_raw_fd(),
+                libc::SOL_SOCKET,
+                libc::SO_RCVTIMEO,
+                (&tv as *const libc::timeval).cast(),
+                mem::size_of_val(&tv) as libc::socklen_t,
+            )
+        })
+        .map(drop)
+    }
+
+    pub fn send(&self, data: &[u8]) -> io::Result<()> {
+        let mut addr: libc::sockaddr_nl = unsafe { mem::zeroed() };
+        addr.nl_family = libc::AF_NETLINK as libc::sa_family_t;
+        loop {
+            let n = unsafe {
+                libc::sendto(
+                    self.fd.as_raw_fd(),
+                    data.as_ptr().cast(),
+                    data.len(),
+                    0,
+                    (&addr as *const libc::sockaddr_nl).cast(),
+                    mem::size_of_val(&addr) as libc::socklen_t,
+                )
+            };
+            if n >= 0 {
+                return Ok(());
+            }
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+    }
+
+    /// Asks for a receive buffer of `size` bytes, beyond the system limit if the daemon is
+    /// privileged enough, so a burst of events is queued rather than dropped.
+    pub fn set_recv_buffer(&self, size: usize) -> io::Result<()> {
+        let size = size.min(libc::c_int::MAX as usize) as libc::c_int;
+        let set = |option| {
+            cvt(unsafe {
+                libc::setsockopt(
+                    self.fd.as_raw_fd(),
+                    libc::SOL_SOCKET,
+                    option,
+                    (&size as *const libc::c_int).cast(),
+                    mem::size_of_val(&size) as libc::socklen_t,
+                )
+            })
+        };
+        set(libc::SO_RCVBUFFORCE).or_else(|_| set(libc::SO_RCVBUF)).map(drop)
+    }
+
+    /// Receives one datagram and returns the messages in it.
+    pub fn recv(&mut self) -> io::Result<Messages<'_>> {
+        self.recv_with(0)
+    }
+
+    /// Like [`recv`](Socket::recv), but fails with `WouldBlock` instead of waiting when nothing
+    /// is queued.
+    pub fn try_recv(&mut self) -> io::Result<Messages<'_>> {
+        self.recv_with(libc::MSG_DONTWAIT)
+    }
+
+    fn recv_with(&mut self, flags: libc::c_int) -> io::Result<Messages<'_>> {
+        loop {
+            let n = unsafe { libc::recv(self.fd.as_raw_fd(), self.buf.as_mut_ptr().cast(), self.buf.len(), flags) };
+            if n >= 0 {
+                return Ok(Messages { data: &self.buf[..n as usize] });
+            }
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+    }
+}
+
+impl AsRawFd for Socket {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+}
+
+/// A received netlink message.
+#[derive(Debug, Clone, Copy)]
+pub struct Message<'a> {
+    pub kind: u16,
+    pub flags: u16,
+    pub seq: u32,
+    pub payload: &'a [u8],
+}
+
+impl Message<'_> {
+    /// For an `NLMSG_ERROR` message, the error it carries (`Ok` for an acknowledgement).
+    pub fn error(&self) -> Option<io::Result<()>> {
+        if self.kind != NLMSG_ERROR {
+            return None;
+        }
+        let code = self.payload.get(..4).map_or(-libc::EPROTO, |code| i32::from_ne_bytes(code.try_into().unwrap()));
+        Some(if code == 0 { Ok(()) } else { Err(io::Error::from_raw_os_error(-code)) })
+    }
+}
+
+/// The messages in one datagram.
+pub struct Messages<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Iterator for Messages<'a> {
+    type Item = Message<'a>;
+
+    fn next(&mut self) -> Option<Message<'a>> {
+        if self.data.len() < HEADER_LEN {
+            return None;
+        }
+        let header: libc::nlmsghdr = unsafe { std::ptr::read_unaligned(self.data.as_ptr().cast()) };
+        let len = header.nlmsg_len as usize;
+        if len < HEADER_LEN || len > self.data.len() {
+            self.data = &[];
+            return None;
+        }
+        let message = Message { kind: header.nlmsg_type, flags: header.nlmsg_flags, seq: header.nlmsg_seq, payload: &self.data[HEADER_LEN..len] };
+        self.data = &self.data[align(len).min(self.data.len())..];
+        Some(message)
+    }
+}
+
+/// Iterates over the attributes in `data` as `(type, payload)` pairs.
+pub fn attrs(data: &[u8]) -> Attrs<'_> {
+    Attrs { data }
+}
+
+pub struct Attrs<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Iterator for Attrs<'a> {
+    type Item = (u16, &'a [u8]);
+
+    fn next(&mut self) -> Option<(u16, &'a [u8])> {
+        if self.data.len() < 4 {
+            return None;
+        }
+        let len = u16::from_ne_bytes([self.data[0], self.data[1]]) as usize;
+        let kind = u16::from_ne_bytes([self.data[2], self.data[3]]) & NLA_TYPE_MASK;
+        if len < 4 || len > self.data.len() {
+            self.data = &[];
+            return None;
+        }
+        let payload = &self.data[4..len];
+        self.data = &self.data[align(len).min(self.data.len())..];
+        Some((kind, payload))
+    }
+}
+
+/// Builds netlink messages back to back in one buffer.
+#[derive(Default)]
+pub struct Builder {
+    buf: Vec<u8>,
+}
+
+impl Builder {
+    pub fn new() -> Builder {
+        Builder::default()
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        &self.buf
+    }
+
+    pub fn len(&self) -> usize {
+        self.buf.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    pub fn clear(&mut self) {
+        self.buf.clear();
+    }
+
+    /// Starts a message; its length is filled in by [`end`](Builder::end).
+    pub fn begin(&mut self, kind: u16, flags: u16, seq: u32) -> usize {
+        let start = self.buf.len();
+        let header = libc::nlmsghdr { nlmsg_len: 0, nlmsg_type: kind, nlmsg_flags: flags, nlmsg_seq: seq, nlmsg_pid: 0 };
+        self.buf.extend_from_slice(unsafe { std::slice::from_raw_parts((&header as *const libc::nlmsghdr).cast(), HEADER_LEN) });
+        start
+    }
+
+    pub fn end(&mut self, start: usize) {
+        let len = (self.buf.len() - start) as u32;
+        self.buf[start..start + 4].copy_from_slice(&len.to_ne_bytes());
+    }
+
+    /// Appends raw bytes (a family header) padded to the netlink alignment.
+    pub fn extend(&mut self, data: &[u8]) {
+        self.buf.extend_from_slice(data);
+        self.buf.resize(align(self.buf.len()), 0);
+    }
+
+    pub fn attr(&mut self, kind: u16, data: &[u8]) {
+        self.buf.extend_from_slice(&((4 + data.len()) as u16).to_ne_bytes());
+        self.buf.extend_from_slice(&kind.to_ne_bytes());
+        self.extend(data);
+    }
+
+    /// Appends a NUL-terminated string attribute.
+    pub fn attr_str(&mut self, kind: u16, value: &str) {
+        self.buf.extend_from_slice(&((4 + value.len() + 1) as u16).to_ne_bytes());
+        self.buf.extend_from_slice(&kind.to_ne_bytes());
+        self.buf.extend_from_slice(value.as_bytes());
+        self.buf.push(0);
+        self.buf.resize(align(self.buf.len()), 0);
+    }
+
+    pub fn attr_be32(&mut self, kind: u16, value: u32) {
+        self.attr(kind, &value.to_be_bytes());
+    }
+
+    pub fn attr_be64(&mut self, kind: u16, value: u64) {
+        self.attr(kind, &value.to_be_bytes());
+    }
+
+    /// Opens a nested attribute; close it with [`nest_end`](Builder::nest_end).
+    pub fn nest_begin(&mut self, kind: u16) -> usize {
+        let start = self.buf.len();
+        self.buf.extend_from_slice(&[0, 0]);
+        self.buf.extend_from_slice(&(kind | NLA_F_NESTED).to_ne_bytes());
+        start
+    }
+
+    pub fn nest_end(&mut self, start: usize) {
+        let len = (self.buf.len() - start) as u16;
+        self.buf[start..start + 2].copy_from_slice(&len.to_ne_bytes());
+    }
+}
@@ -0,0 +1,120 @@
+//! The kernel's process events connector.
+//!
+//! Once subscribed, the kernel multicasts a small fixed-size record for every fork, exec and
+//! exit on the system. Nothing has to be polled or scanned in /proc: a wakeup drains whatever
+//! records have queued up, many per datagram read. Only events of whole processes are passed
+//! on; thread creation and exit are filtered out here.
+
+use std::io;
+use std::os::fd::{AsRawFd, RawFd};
+
+use crate::netlink::{Builder, Socket, NLMSG_DONE};
+
+const NETLINK_CONNECTOR: libc::c_int = 11;
+const CN_IDX_PROC: u32 = 1;
+const CN_VAL_PROC: u32 = 1;
+const PROC_CN_MCAST_LISTEN: u32 = 1;
+const PROC_CN_MCAST_IGNORE: u32 = 2;
+
+const PROC_EVENT_FORK: u32 = 0x1;
+const PROC_EVENT_EXEC: u32 = 0x2;
+const PROC_EVENT_EXIT: u32 = 0x8000_0000;
+
+/// `struct cn_msg`, which precedes every event.
+const CN_MSG_LEN: usize = 20;
+/// `what`, `cpu` and `timestamp_ns` of `struct proc_event`, before the per-event fields.
+const EVENT_HEADER_LEN: usize = 16;
+/// Large enough to ride out an exec storm on a build server between two wakeups.
+const RECV_BUFFER_SIZE: usize = 4 * 1024 * 1024;
+
+/// A process-level event; pids are thread group ids.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ProcEvent {
+    Fork { parent: u32, child: u32 },
+    Exec { pid: u32 },
+    Exit { pid: u32 },
+    /// The receive queue overflowed and events were lost.
+    Overflow,
+}
+
+pub struct Connector {
+    socket: Socket,
+}
+
+impl Connector {
+    /// Subscribes to process events. Needs CAP_NET_ADMIN, and the kernel only delivers them in
+    /// the initial network namespace.
+    pub fn open() -> io::Result<Connector> {
+        let socket = Socket::open(NETLINK_CONNECTOR, CN_IDX_PROC)?;
+        socket.set_recv_buffer(RECV_BUFFER_SIZE)?;
+        let connector = Connector { socket };
+        connector.control(PROC_CN_MCAST_LISTEN)?;
+        Ok(connector)
+    }
+
+    /// Appends the events queued since the last call to `out` without blocking.
+    pub fn read_events(&mut self, out: &mut Vec<ProcEvent>) -> io::Result<()> {
+        loop {
+            let messages = match self.socket.try_recv() {
+                Ok(messages) => messages,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.raw_os_error() == Some(libc::ENOBUFS) => {
+                    out.push(ProcEvent::Overflow);
+                    continue;
+                }
+                Err(err) => return Err(err),
+            };
+            for message in messages.filter(|message| message.kind == NLMSG_DONE) {
+                if let Some(event) = message.payload.get(CN_MSG_LEN..).and_then(parse_event) {
+                    out.push(event);
+                }
+            }
+        }
+    }
+
+    fn control(&self, op: u32) -> io::Result<()> {
+        let mut builder = Builder::new();
+        let start = builder.begin(NLMSG_DONE, 0, 0);
+        let mut header = [0; CN_MSG_LEN];
+        header[0..4].copy_from_slice(&CN_IDX_PROC.to_ne_bytes());
+        header[4..8].copy_from_slice(&CN_VAL_PROC.to_ne_bytes());
+        header[16..18].copy_from_slice(&(4u16).to_ne_bytes());
+        builder.extend(&header);
+        builder.extend(&op.to_ne_bytes());
+        builder.end(start);
+        self.socket.send(builder.as_bytes())
+    }
+}
+
+impl Drop for Connector {
+    fn drop(&mut self) {
+        // The kernel only generates events while someone listens; tell it we stopped.
+        let _ = self.control(PROC_CN_MCAST_IGNORE);
+    }
+}
+
+impl AsRawFd for Connector {
+    fn as_raw_fd(&self) -> RawFd {
+        self.socket.as_raw_fd()
+    }
+}
+
+fn parse_event(event: &[u8]) -> Option<ProcEvent> {
+    let word = |offset: usize| event.get(offset..offset + 4).map(|bytes| u32::from_ne_bytes(bytes.try_into().unwrap()));
+    let field = |index: usize| word(EVENT_HEADER_LEN + 4 * index);
+    match word(0)? {
+        // parent_pid, parent_tgid, child_pid, child_tgid
+        PROC_EVENT_FORK => {
+            let (child_pid, child) = (field(2)?, field(3)?);
+            (child_pid == child).then_some(ProcEvent::Fork { parent: field(1)?, child })
+        }
+        // process_pid, process_tgid
+        PROC_EVENT_EXEC => Some(ProcEvent::Exec { pid: field(1)? }),
+        // process_pid, process_tgid, ...
+        PROC_EVENT_EXIT => {
+            let (pid, tgid) = (field(0)?, field(1)?);
+            (pid == tgid).then_some(ProcEvent::Exit { pid })
+        }
+        _ => None,
+    }
+}
@@ -0,0 +1,361 @@
+//! Checking what processes execute.
+//!
+//! Every exec costs one `stat` of `/proc/<pid>/exe`, which identifies the executable image by
+//! (device, inode, mtime), and a lookup of that identity in a cache. Only the first exec of an
+//! image resolves its path, and an image is only hashed when there is something to report about
+//! it or it is a baseline file whose metadata moved. A build server running the same compiler
+//! thousands of times a second therefore never reads /proc beyond the `stat` nor hashes anything
+//! twice, and a rebuilt binary is a new identity that is looked at afresh.
+//!
+//! Hashing is not done here either: the image is opened, which keeps it readable once the process
+//! exits, and handed out in a [`HashBatch`] to hash off the event loop. A storm of fresh binaries
+//! in `/tmp` costs the loop an `open` each. Past `pending_hashes` waiting images they are reported
+//! without a digest, or for baseline files, left to be checked by their next exec.
+//!
+//! The event only carries a pid, so a process that has already exited when its exec is handled
+//! leaves nothing to look at: a program that runs for a millisecond can slip through. What
+//! matters most here (implants, miners, shells) keeps running.
+
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io;
+use std::os::fd::{AsRawFd, RawFd};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use super::connector::{Connector, ProcEvent};
+use crate::fim::baseline::{Baseline, Digest, FileMeta};
+use crate::fim::hash::{digest_file, HashAlgo};
+
+/// Suffix the kernel gives the exe link of a process whose executable was unlinked.
+const DELETED_SUFFIX: &[u8] = b" (deleted)";
+
+#[derive(Debug, Clone)]
+pub struct ExecPolicy {
+    /// Executing anything below these is reported.
+    pub suspicious_dirs: Vec<PathBuf>,
+    /// Executable images remembered at once.
+    pub cache_capacity: usize,
+    /// Images waiting to be hashed at once.
+    pub pending_hashes: usize,
+}
+
+impl Default for ExecPolicy {
+    fn default() -> ExecPolicy {
+        ExecPolicy { suspicious_dirs: ["/tmp", "/var/tmp", "/dev/shm"].map(PathBuf::from).to_vec(), cache_capacity: 4096, pending_hashes: 256 }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ExecKind {
+    /// The executable has no name on disk: it was deleted after starting, or is a memfd.
+    Deleted,
+    /// The executable lives in one of the policy's suspicious directories.
+    Suspicious,
+    /// A baseline file whose contents no longer match the baseline.
+    Modified,
+}
+
+/// An exec worth reporting. Each executable image is reported once, by its first exec.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ExecFinding {
+    pub pid: u32,
+    pub path: PathBuf,
+    pub digest: Option<Digest>,
+    pub kind: ExecKind,
+    /// The executable of the process that forked it, if that was seen starting.
+    pub parent: Option<PathBuf>,
+}
+
+/// (device, inode, mtime in nanoseconds) of an executable.
+type ImageKey = (u64, u64, i64);
+
+struct Image {
+    path: Arc<Path>,
+    /// Whether the image has been checked and, if needed, reported.
+    checked: bool,
+}
+
+struct Process {
+    parent: u32,
+    /// Shared with the image cache, but kept when the cache sheds the image.
+    executable: Option<Arc<Path>>,
+}
+
+/// An exec whose image is yet to be hashed, held open.
+struct Unhashed {
+    finding: ExecFinding,
+    file: File,
+    /// For a baseline file, its recorded digest: the exec is only worth reporting if it differs.
+    recorded: Option<Digest>,
+}
+
+/// Execs whose images are to be hashed off the event loop.
+pub struct HashBatch {
+    algo: HashAlgo,
+    execs: Vec<Unhashed>,
+}
+
+impl HashBatch {
+    /// Hashes every image, returning the execs worth reporting.
+    pub fn run(self) -> Vec<ExecFinding> {
+        self.execs.into_iter().filter_map(|exec| exec.hash(self.algo)).collect()
+    }
+}
+
+impl Unhashed {
+    fn hash(mut self, algo: HashAlgo) -> Option<ExecFinding> {
+        let digest = digest_file(&mut self.file, algo);
+        match self.recorded {
+            Some(recorded) => {
+                let digest = digest.ok()?;
+                (digest != recorded).then_some(ExecFinding { digest: Some(digest), ..self.finding })
+            }
+            None => Some(ExecFinding { digest: digest.ok(), ..self.finding }),
+        }
+    }
+}
+
+pub struct ExecMonitor {
+    connector: Connector,
+    algo: HashAlgo,
+    policy: ExecPolicy,
+    images: HashMap<ImageKey, Image>,
+    /// Processes seen starting since the monitor opened, by pid.
+    processes: HashMap<u32, Process>,
+    events: Vec<ProcEvent>,
+    unhashed: Vec<Unhashed>,
+}
+
+impl ExecMonitor {
+    /// Starts following process events. Images are hashed with `algo`, which must be the
+    /// baseline's.
+    pub fn open(algo: HashAlgo, policy: ExecPolicy) -> io::Result<ExecMonitor> {
+        Ok(ExecMonitor {
+            connector: Connector::open()?,
+            algo,
+            policy,
+            images: HashMap::new(),
+            processes: HashMap::new(),
+            events: Vec::new(),
+            unhashed: Vec::new(),
+        })
+    }
+
+    /// Handles the queued process events, appending execs worth reporting to `out`. Most wait to
+    /// be hashed first; see [`take_hashes`](ExecMonitor::take_hashes).
+    pub fn read_events(&mut self, baseline: &Baseline, out: &mut Vec<ExecFinding>) -> io::Result<()> {
+        self.connector.read_events(&mut self.events)?;
+        let mut events = std::mem::take(&mut self.events);
+        for event in events.drain(..) {
+            match event {
+                ProcEvent::Fork { parent, child } => {
+                    let executable = self.processes.get(&parent).and_then(|process| process.executable.clone());
+                    self.processes.insert(child, Process { parent, executable });
+                }
+                ProcEvent::Exec { pid } => {
+                    self.exec(pid, baseline, out);
+                }
+                ProcEvent::Exit { pid } => {
+                    self.processes.remove(&pid);
+                }
+                // Exits were probably lost too; forget the processes that are gone.
+                ProcEvent::Overflow => {
+                    self.processes.retain(|pid, _| Path::new(&format!("/proc/{pid}")).exists());
+                }
+            }
+        }
+        self.events = events;
+        Ok(())
+    }
+
+    /// The executable `pid` is running, if it was seen starting.
+    pub fn executable(&self, pid: u32) -> Option<&Path> {
+        self.processes.get(&pid)?.executable.as_deref()
+    }
+
+    /// The execs waiting for their images to be hashed, if any. [`HashBatch::run`] gives those
+    /// worth reporting.
+    pub fn take_hashes(&mut self) -> Option<HashBatch> {
+        (!self.unhashed.is_empty()).then(|| HashBatch { algo: self.algo, execs: std::mem::take(&mut self.unhashed) })
+    }
+
+    fn exec(&mut self, pid: u32, baseline: &Baseline, out: &mut Vec<ExecFinding>) {
+        // Gone already, or a kernel thread; either way there is nothing to look at.
+        let exe = PathBuf::from(format!("/proc/{pid}/exe"));
+        let Ok(meta) = fs::metadata(&exe) else {
+            return;
+        };
+        let key = image_key(&meta);
+        if !self.images.contains_key(&key) {
+            // A build server churning through fresh binaries sheds the lot at once; the images
+            // still in use come back with one miss each.
+            if self.images.len() >= self.policy.cache_capacity {
+                self.images.clear();
+            }
+            let Ok(path) = fs::read_link(&exe) else {
+                return;
+            };
+            self.images.insert(key, Image { path: path.into(), checked: false });
+        }
+        let image = self.images.get_mut(&key).expect("inserted above");
+        let parent = self.processes.get(&pid).map(|process| process.parent);
+        self.processes.insert(pid, Process { parent: parent.unwrap_or(0), executable: Some(Arc::clone(&image.path)) });
+        if image.checked {
+            return;
+        }
+
+        let Some((kind, recorded)) = classify(&image.path, &meta, baseline, &self.policy) else {
+            image.checked = true;
+            return;
+        };
+        let full = self.unhashed.len() >= self.policy.pending_hashes;
+        if full && recorded.is_some() {
+            return;
+        }
+        image.checked = true;
+        let path = image.path.to_path_buf();
+        let parent = parent.and_then(|parent| self.executable(parent)).map(Path::to_path_buf);
+        let finding = ExecFinding { pid, path, digest: None, kind, parent };
+        // The exe link still reaches an unlinked or memfd image.
+        match (full, File::open(&exe)) {
+            (false, Ok(file)) => self.unhashed.push(Unhashed { finding, file, recorded }),
+            _ if recorded.is_some() => {}
+            _ => out.push(finding),
+        }
+    }
+}
+
+impl AsRawFd for ExecMonitor {
+    fn as_raw_fd(&self) -> RawFd {
+        self.connector.as_raw_fd()
+    }
+}
+
+/// The identity an executable image is cached by.
+fn image_key(meta: &fs::Metadata) -> ImageKey {
+    (meta.dev(), meta.ino(), meta.mtime() * 1_000_000_000 + meta.mtime_nsec())
+}
+
+/// Decides whether the image at `path` may be worth reporting, without reading it. For a baseline
+/// file whose metadata moved, that rests on whether its contents still match the recorded digest
+/// returned alongside.
+fn classify(path: &Path, meta: &fs::Metadata, baseline: &Baseline, policy: &ExecPolicy) -> Option<(ExecKind, Option<Digest>)> {
+    let bytes = path.as_os_str().as_bytes();
+    if bytes.ends_with(DELETED_SUFFIX) || bytes.starts_with(b"/memfd:") {
+        return Some((ExecKind::Deleted, None));
+    }
+    if policy.suspicious_dirs.iter().any(|dir| path.starts_with(dir)) {
+        return Some((ExecKind::Suspicious, None));
+    }
+    let record = baseline.get(path)?;
+    let current = FileMeta::from_metadata(meta);
+    let identity = |meta: &FileMeta| (meta.dev, meta.ino, meta.size, meta.mtime_ns);
+    (identity(&current) != identity(&record.meta)).then_some((ExecKind::Modified, Some(*record.digest)))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{self, File};
+    use std::path::{Path, PathBuf};
+
+    use super::{classify, image_key, ExecFinding, ExecKind, ExecPolicy, HashBatch, Unhashed};
+    use crate::fim::baseline::{Baseline, BaselineBuilder, Entry, FileMeta};
+    use crate::fim::hash::{digest_path, HashAlgo};
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-exec-{}-{name}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    /// A baseline recording `files` as they are now.
+    fn baseline(dir: &Path, files: &[&Path]) -> Baseline {
+        let mut builder = BaselineBuilder::new();
+        for &path in files {
+            let meta = fs::metadata(path).unwrap();
+            let digest = digest_path(path, &meta, HashAlgo::Sha256).unwrap();
+            builder.push(Entry { path: path.to_path_buf(), meta: FileMeta::from_metadata(&meta), digest });
+        }
+        let path = dir.join("baseline");
+        builder.write(&path).unwrap();
+        Baseline::open(&path).unwrap()
+    }
+
+    fn finding(path: &Path, kind: ExecKind) -> ExecFinding {
+        ExecFinding { pid: 1, path: path.to_path_buf(), digest: None, kind, parent: None }
+    }
+
+    #[test]
+    fn images_are_keyed_by_file_and_mtime() {
+        let dir = scratch("key");
+        let (a, b) = (dir.join("a"), dir.join("b"));
+        fs::write(&a, "one").unwrap();
+        fs::write(&b, "one").unwrap();
+        let key = image_key(&fs::metadata(&a).unwrap());
+        assert_eq!(key, image_key(&fs::metadata(&a).unwrap()));
+        assert_ne!(key, image_key(&fs::metadata(&b).unwrap()));
+        // Rebuilt in place: same inode, new mtime.
+        File::options().write(true).open(&a).unwrap().set_modified(std::time::UNIX_EPOCH).unwrap();
+        assert_ne!(key, image_key(&fs::metadata(&a).unwrap()));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn classification() {
+        let dir = scratch("classify");
+        let (tool, other) = (dir.join("tool"), dir.join("other"));
+        fs::write(&tool, "tool").unwrap();
+        fs::write(&other, "other").unwrap();
+        let baseline = baseline(&dir, &[&tool]);
+        // Not /tmp, which the scratch directory is likely under.
+        let policy = ExecPolicy { suspicious_dirs: vec!["/var/tmp".into(), "/dev/shm".into()], ..ExecPolicy::default() };
+        let meta = fs::metadata(&tool).unwrap();
+        let kind = |path: &str, meta: &fs::Metadata| classify(Path::new(path), meta, &baseline, &policy).map(|(kind, _)| kind);
+
+        assert_eq!(kind("/usr/bin/x (deleted)", &meta), Some(ExecKind::Deleted));
+        assert_eq!(kind("/memfd:payload (deleted)", &meta), Some(ExecKind::Deleted));
+        assert_eq!(kind("/var/tmp/.x/miner", &meta), Some(ExecKind::Suspicious));
+        assert_eq!(kind("/dev/shm/x", &meta), Some(ExecKind::Suspicious));
+        assert_eq!(kind("/var/tmpfoo", &meta), None);
+        assert_eq!(kind(other.to_str().unwrap(), &fs::metadata(&other).unwrap()), None);
+        // A baseline file is only worth hashing once its metadata moved.
+        assert_eq!(kind(tool.to_str().unwrap(), &meta), None);
+        fs::write(&tool, "tool, rebuilt").unwrap();
+        let moved = classify(&tool, &fs::metadata(&tool).unwrap(), &baseline, &policy).unwrap();
+        assert_eq!(moved, (ExecKind::Modified, Some(*baseline.get(&tool).unwrap().digest)));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn hashing_reports_changed_contents_only() {
+        let dir = scratch("hash");
+        let (same, changed, dropped) = (dir.join("same"), dir.join("changed"), dir.join("dropped"));
+        for path in [&same, &changed, &dropped] {
+            fs::write(path, "contents").unwrap();
+        }
+        let recorded = digest_path(&same, &fs::metadata(&same).unwrap(), HashAlgo::Sha256).unwrap();
+        fs::write(&changed, "other contents").unwrap();
+        let exec = |path: &Path, kind, recorded| Unhashed { finding: finding(path, kind), file: File::open(path).unwrap(), recorded };
+        let execs = vec![
+            exec(&same, ExecKind::Modified, Some(recorded)),
+            exec(&changed, ExecKind::Modified, Some(recorded)),
+            exec(&dropped, ExecKind::Deleted, None),
+        ];
+        // Held open, the image is still read after it is unlinked.
+        fs::remove_file(&dropped).unwrap();
+
+        let found = HashBatch { algo: HashAlgo::Sha256, execs }.run();
+        let changed_digest = digest_path(&changed, &fs::metadata(&changed).unwrap(), HashAlgo::Sha256).unwrap();
+        let expected = [
+            ExecFinding { digest: Some(changed_digest), ..finding(&changed, ExecKind::Modified) },
+            ExecFinding { digest: Some(recorded), ..finding(&dropped, ExecKind::Deleted) },
+        ];
+        assert_eq!(found, expected);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,4 @@
+//! Process monitoring.
+
+pub mod connector;
+pub mod exec;
@@ -0,0 +1,94 @@
+//! The daemon's single event loop.
+//!
+//! Every event source (the file monitor, the journal or log files, the client socket and each
+//! client) is a descriptor registered with one epoll instance under a [`Token`]. The daemon has
+//! one thread that sleeps in [`Reactor::wait`] until a descriptor is ready or the nearest
+//! deadline passes; nothing wakes it periodically, so an idle daemon costs no CPU and does not
+//! keep a laptop out of deep sleep. Registration is level-triggered: a source that is not fully
+//! drained in one pass is simply reported again.
+
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::time::Duration;
+
+use crate::sys::cvt;
+
+/// Readiness events fetched per wait.
+const MAX_EVENTS: usize = 64;
+
+/// Identifies a registered descriptor in the events [`Reactor::wait`] returns.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct Token(pub u64);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Interest {
+    Readable,
+    Writable,
+}
+
+impl Interest {
+    fn events(self) -> u32 {
+        match self {
+            Interest::Readable => libc::EPOLLIN as u32,
+            Interest::Writable => libc::EPOLLOUT as u32,
+        }
+    }
+}
+
+pub struct Reactor {
+    epoll: OwnedFd,
+    events: Vec<libc::epoll_event>,
+}
+
+impl Reactor {
+    pub fn new() -> io::Result<Reactor> {
+        let fd = cvt(unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) })?;
+        Ok(Reactor {
+            epoll: unsafe { OwnedFd::from_raw_fd(fd) },
+            events: vec![libc::epoll_event { events: 0, u64: 0 }; MAX_EVENTS],
+        })
+    }
+
+    pub fn register(&self, fd: RawFd, token: Token, interest: Interest) -> io::Result<()> {
+        self.ctl(libc::EPOLL_CTL_ADD, fd, token, interest)
+    }
+
+    /// Changes what `fd` is watched for.
+    pub fn reregister(&self, fd: RawFd, token: Token, interest: Interest) -> io::Result<()> {
+        self.ctl(libc::EPOLL_CTL_MOD, fd, token, interest)
+    }
+
+    /// Stops watching `fd`. Closing a descriptor does this implicitly.
+    pub fn deregister(&self, fd: RawFd) -> io::Result<()> {
+        cvt(unsafe { libc::epoll_ctl(self.epoll.as_raw_fd(), libc::EPOLL_CTL_DEL, fd, std::ptr::null_mut()) }).map(drop)
+    }
+
+    fn ctl(&self, op: libc::c_int, fd: RawFd, token: Token, interest: Interest) -> io::Result<()> {
+        let mut event = libc::epoll_event { events: interest.events(), u64: token.0 };
+        cvt(unsafe { libc::epoll_ctl(self.epoll.as_raw_fd(), op, fd, &mut event) }).map(drop)
+    }
+
+    /// Sleeps until a registered descriptor is ready or `timeout` elapses (`None` waits
+    /// indefinitely), then appends the tokens of the ready descriptors to `ready`. A signal
+    /// ends the wait early with nothing added.
+    pub fn wait(&mut self, timeout: Option<Duration>, ready: &mut Vec<Token>) -> io::Result<()> {
+        // Round up so a deadline less than a millisecond away does not turn into a busy loop.
+        let timeout_ms = timeout.map_or(-1, |timeout| {
+            let ms = timeout.as_millis() + (timeout.subsec_nanos() % 1_000_000 != 0) as u128;
+            ms.min(i32::MAX as u128) as i32
+        });
+        let n = unsafe { libc::epoll_wait(self.epoll.as_raw_fd(), self.events.as_mut_ptr(), self.events.len() as i32, timeout_ms) };
+        if n < 0 {
+            let err = io::Error::last_os_error();
+            return if err.kind() == io::ErrorKind::Interrupted { Ok(()) } else { Err(err) };
+        }
+        ready.extend(self.events[..n as usize].iter().map(|event| Token(event.u64)));
+        Ok(())
+    }
+}
+
+impl AsRawFd for Reactor {
+    fn as_raw_fd(&self) -> RawFd {
+        self.epoll.as_raw_fd()
+    }
+}
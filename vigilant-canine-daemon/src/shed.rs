@@ -0,0 +1,166 @@
+//! Load shedding between detection and the alert history.
+//!
+//! A flood of alerts (a scanner hammering sshd, a program logging the same failure in a loop)
+//! must not turn into a flood of disk writes and notifications, nor keep the daemon from
+//! everything else it has to do. Alerts are admitted at a sustained rate with an allowance for
+//! bursts, a token bucket; as the allowance runs low the least severe alerts are turned away
+//! first: info below half of it, low below a quarter, medium once it is used up. High and
+//! critical alerts are always admitted, and still use up the allowance: while they alone come
+//! faster than the rate, every medium and lower alert is shed. Only recording is skipped: a shed
+//! failed login still counts towards blocking its source. What was shed is counted, so it can be
+//! reported in one summary instead.
+
+use std::time::Instant;
+
+use vigilant_canine_proto::Severity;
+
+const SEVERITIES: usize = Severity::Critical as usize + 1;
+
+#[derive(Debug, Clone, Copy)]
+pub struct ShedConfig {
+    /// Alerts admitted per second, sustained.
+    pub rate: u32,
+    /// Alerts admitted in a burst on top of the rate.
+    pub burst: u32,
+}
+
+impl Default for ShedConfig {
+    fn default() -> ShedConfig {
+        ShedConfig { rate: 100, burst: 1000 }
+    }
+}
+
+pub struct Shedder {
+    config: ShedConfig,
+    tokens: f64,
+    refilled: Instant,
+    /// Shed since the start, by severity.
+    shed: [u64; SEVERITIES],
+    /// Shed since the last [`take_unreported`](Shedder::take_unreported).
+    unreported: [u64; SEVERITIES],
+}
+
+impl Shedder {
+    pub fn new(config: ShedConfig) -> Shedder {
+        Shedder {
+            config,
+            tokens: f64::from(config.burst),
+            refilled: Instant::now(),
+            shed: [0; SEVERITIES],
+            unreported: [0; SEVERITIES],
+        }
+    }
+
+    /// Whether an alert of `severity` raised at `now` should be recorded.
+    pub fn admit(&mut self, severity: Severity, now: Instant) -> bool {
+        let elapsed = now.saturating_duration_since(self.refilled).as_secs_f64();
+        self.tokens = (self.tokens + elapsed * f64::from(self.config.rate)).min(f64::from(self.config.burst));
+        self.refilled = now;
+        let reserve = match severity {
+            Severity::Info => f64::from(self.config.burst) / 2.0,
+            Severity::Low => f64::from(self.config.burst) / 4.0,
+            Severity::Medium => 0.0,
+            Severity::High | Severity::Critical => {
+                self.tokens = (self.tokens - 1.0).max(0.0);
+                return true;
+            }
+        };
+        if self.tokens >= reserve + 1.0 {
+            self.tokens -= 1.0;
+            return true;
+        }
+        self.shed[severity as usize] += 1;
+        self.unreported[severity as usize] += 1;
+        false
+    }
+
+    /// Alerts of `severity` shed since the start.
+    pub fn shed(&self, severity: Severity) -> u64 {
+        self.shed[severity as usize]
+    }
+
+    pub fn has_unreported(&self) -> bool {
+        self.unreported.iter().any(|&count| count > 0)
+    }
+
+    /// The alerts shed since the last call, most severe first, with their counts.
+    pub fn take_unreported(&mut self) -> Vec<(Severity, u64)> {
+        let unreported = std::mem::take(&mut self.unreported);
+        [Severity::Medium, Severity::Low, Severity::Info]
+            .into_iter()
+            .map(|severity| (severity, unreported[severity as usize]))
+            .filter(|&(_, count)| count > 0)
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, Instant};
+
+    use vigilant_canine_proto::Severity;
+
+    use super::{ShedConfig, Shedder};
+
+    /// How many of `count` alerts of `severity`, raised at `now`, are admitted.
+    fn admitted(shedder: &mut Shedder, severity: Severity, count: usize, now: Instant) -> usize {
+        (0..count).filter(|_| shedder.admit(severity, now)).count()
+    }
+
+    #[test]
+    fn reserves_keep_tokens_for_more_severe_alerts() {
+        let now = Instant::now();
+        let mut shedder = Shedder::new(ShedConfig { rate: 10, burst: 100 });
+        // Info stops at half the burst, low at a quarter, medium when it is used up.
+        assert_eq!(admitted(&mut shedder, Severity::Info, 1000, now), 50);
+        assert_eq!(admitted(&mut shedder, Severity::Low, 1000, now), 25);
+        assert_eq!(admitted(&mut shedder, Severity::Info, 1000, now), 0);
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, now), 25);
+        assert_eq!(admitted(&mut shedder, Severity::Low, 1000, now), 0);
+        assert_eq!(admitted(&mut shedder, Severity::High, 10, now), 10);
+        assert_eq!(admitted(&mut shedder, Severity::Critical, 10, now), 10);
+        assert_eq!((shedder.shed(Severity::Info), shedder.shed(Severity::Low), shedder.shed(Severity::Medium)), (1950, 1975, 975));
+        assert_eq!(shedder.shed(Severity::High), 0);
+    }
+
+    #[test]
+    fn high_severity_floods_starve_medium_alerts() {
+        let start = Instant::now();
+        let mut shedder = Shedder::new(ShedConfig { rate: 10, burst: 100 });
+        for second in 0..10 {
+            let now = start + Duration::from_secs(second);
+            assert_eq!(admitted(&mut shedder, Severity::High, 150, now), 150);
+            assert_eq!(admitted(&mut shedder, Severity::Medium, 1, now), 0);
+        }
+    }
+
+    #[test]
+    fn tokens_refill_at_the_rate_up_to_the_burst() {
+        let start = Instant::now();
+        let mut shedder = Shedder::new(ShedConfig { rate: 10, burst: 100 });
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, start), 100);
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, start + Duration::from_millis(500)), 5);
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, start + Duration::from_secs(2)), 15);
+        // Idle for long, the allowance is the burst again and no more.
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, start + Duration::from_secs(3600)), 100);
+        // Time going backwards adds nothing.
+        assert_eq!(admitted(&mut shedder, Severity::Medium, 1000, start), 0);
+    }
+
+    #[test]
+    fn unreported_counts_are_taken_once() {
+        let now = Instant::now();
+        let mut shedder = Shedder::new(ShedConfig { rate: 1, burst: 4 });
+        assert!(!shedder.has_unreported());
+        assert_eq!(shedder.take_unreported(), []);
+        admitted(&mut shedder, Severity::Info, 5, now);
+        admitted(&mut shedder, Severity::Medium, 10, now);
+        assert!(shedder.has_unreported());
+        assert_eq!(shedder.take_unreported(), [(Severity::Medium, 8), (Severity::Info, 3)]);
+        assert!(!shedder.has_unreported());
+        assert_eq!(shedder.take_unreported(), []);
+        admitted(&mut shedder, Severity::Low, 1, now);
+        assert_eq!(shedder.take_unreported(), [(Severity::Low, 1)]);
+        assert_eq!((shedder.shed(Severity::Info), shedder.shed(Severity::Low), shedder.shed(Severity::Medium)), (3, 1, 8));
+    }
+}
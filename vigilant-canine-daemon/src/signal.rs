@@ -0,0 +1,54 @@
+//! Signals as events.
+//!
+//! The signals the daemon acts on are blocked and read from a signalfd registered with the
+//! [`Reactor`](crate::reactor::Reactor), so they are handled by the event loop between two events
+//! like anything else, with no handler running in the middle of one.
+
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+
+use crate::sys::cvt;
+
+pub struct Signals {
+    fd: OwnedFd,
+}
+
+impl Signals {
+    /// Blocks `signals` and starts delivering them through a descriptor. Blocking only affects
+    /// the calling thread and threads it starts afterwards, so call it before starting any.
+    pub fn open(signals: &[libc::c_int]) -> io::Result<Signals> {
+        let mut set = unsafe { std::mem::zeroed::<libc::sigset_t>() };
+        unsafe { libc::sigemptyset(&mut set) };
+        for &signal in signals {
+            cvt(unsafe { libc::sigaddset(&mut set, signal) })?;
+        }
+        cvt(unsafe { libc::pthread_sigmask(libc::SIG_BLOCK, &set, std::ptr::null_mut()) })?;
+        let fd = cvt(unsafe { libc::signalfd(-1, &set, libc::SFD_NONBLOCK | libc::SFD_CLOEXEC) })?;
+        Ok(Signals { fd: unsafe { OwnedFd::from_raw_fd(fd) } })
+    }
+
+    /// Appends the signals received since the last call to `out`. The kernel keeps at most one
+    /// of each standard signal pending, so a burst of the same signal arrives once.
+    pub fn read(&self, out: &mut Vec<libc::c_int>) -> io::Result<()> {
+        loop {
+            let mut info = unsafe { std::mem::zeroed::<libc::signalfd_siginfo>() };
+            let size = std::mem::size_of::<libc::signalfd_siginfo>();
+            let ret = unsafe { libc::read(self.fd.as_raw_fd(), (&mut info as *mut libc::signalfd_siginfo).cast(), size) };
+            if ret < 0 {
+                let err = io::Error::last_os_error();
+                return match err.kind() {
+                    io::ErrorKind::WouldBlock => Ok(()),
+                    io::ErrorKind::Interrupted => continue,
+                    _ => Err(err),
+                };
+            }
+            out.push(info.ssi_signo as libc::c_int);
+        }
+    }
+}
+
+impl AsRawFd for Signals {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+}
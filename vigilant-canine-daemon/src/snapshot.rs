@@ -0,0 +1,119 @@
+//! Startup snapshot of the compiled rules.
+//!
+//! Distributions that enable the daemon start it on every boot, and compiling the rules' regexes
+//! is most of what startup costs once the baseline is mapped. What can be kept of a compiled set
+//! (the rules, their prefilter literals and capture groups, but not the regexes, which cannot be
+//! saved) is therefore kept as a snapshot keyed by a hash of the rule files' contents: while they
+//! are unchanged, startup maps the snapshot and skips parsing, literal extraction and validation,
+//! and the regexes are built off the event loop instead of before it starts. The rule text is
+//! only parsed again after an edit or an upgrade of the rule engine. Layout (native endian):
+//!
+//! ```text
+//! header   (32 bytes: magic, version, source hash, payload hash)
+//! payload  (RuleSet::snapshot)
+//! ```
+
+use std::fs::File;
+use std::io::{self, Write};
+use std::path::Path;
+
+use vigilant_canine_rules::RuleSet;
+use xxhash_rust::xxh3::{xxh3_64, Xxh3};
+
+use crate::sys::{replace_file, Mmap};
+
+const MAGIC: [u8; 8] = *b"VCSNAP\0\0";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 32;
+
+/// Hash of the rule files a snapshot is made from, as (name, contents) pairs in load order.
+pub fn source_hash<'a>(sources: impl IntoIterator<Item = (&'a str, &'a str)>) -> u64 {
+    let mut hasher = Xxh3::new();
+    for (name, text) in sources {
+        for part in [name, text] {
+            hasher.update(&(part.len() as u64).to_ne_bytes());
+            hasher.update(part.as_bytes());
+        }
+    }
+    hasher.digest()
+}
+
+/// Restores the rules from the snapshot at `path` if it was made from sources with `hash`.
+pub fn open(path: &Path, hash: u64) -> io::Result<Option<RuleSet>> {
+    let map = Mmap::map(&File::open(path)?, libc::MADV_SEQUENTIAL)?;
+    if map.len() < HEADER_SIZE || map[..8] != MAGIC || read_u32(&map, 8) != VERSION {
+        return Err(invalid("not a rule snapshot"));
+    }
+    if read_u64(&map, 16) != hash {
+        return Ok(None);
+    }
+    let payload = &map[HEADER_SIZE..];
+    if xxh3_64(payload) != read_u64(&map, 24) {
+        return Err(invalid("corrupt rule snapshot"));
+    }
+    RuleSet::from_snapshot(payload).map(Some).map_err(|err| invalid(&err.to_string()))
+}
+
+/// Saves `rules`, compiled from sources with `hash`, as the snapshot at `path`.
+pub fn write(path: &Path, hash: u64, rules: &RuleSet) -> io::Result<()> {
+    let payload = rules.snapshot();
+    replace_file(path, |out| {
+        let mut header = [0u8; HEADER_SIZE];
+        header[..8].copy_from_slice(&MAGIC);
+        header[8..12].copy_from_slice(&VERSION.to_ne_bytes());
+        header[16..24].copy_from_slice(&hash.to_ne_bytes());
+        header[24..32].copy_from_slice(&xxh3_64(&payload).to_ne_bytes());
+        out.write_all(&header)?;
+        out.write_all(&payload)
+    })
+}
+
+fn read_u32(buf: &[u8], off: usize) -> u32 {
+    u32::from_ne_bytes(buf[off..off + 4].try_into().expect("slice length is fixed"))
+}
+
+fn read_u64(buf: &[u8], off: usize) -> u64 {
+    u64::from_ne_bytes(buf[off..off + 8].try_into().expect("slice length is fixed"))
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{open, source_hash, write, HEADER_SIZE};
+    use std::fs;
+    use std::io;
+    use vigilant_canine_rules::{parse, RuleSet, DEFAULT_RULES};
+
+    #[test]
+    fn snapshots_are_keyed_and_checked() {
+        let path = std::env::temp_dir().join(format!("vigilant-canine-snapshot-{}", std::process::id()));
+        let rules = RuleSet::compile(parse(DEFAULT_RULES).unwrap()).unwrap();
+        let hash = source_hash([("default.rules", DEFAULT_RULES)]);
+        assert_ne!(hash, source_hash([("default.rules", "")]));
+        assert_ne!(hash, source_hash([("other.rules", DEFAULT_RULES)]));
+        write(&path, hash, &rules).unwrap();
+
+        let restored = open(&path, hash).unwrap().unwrap();
+        assert_eq!(restored.rules(), rules.rules());
+        // Made from other sources.
+        assert!(open(&path, hash ^ 1).unwrap().is_none());
+
+        let good = fs::read(&path).unwrap();
+        let rejected = |data: &[u8]| {
+            fs::write(&path, data).unwrap();
+            open(&path, hash).err().map(|err| err.kind())
+        };
+        let mut bad = good.clone();
+        *bad.last_mut().unwrap() ^= 1;
+        assert_eq!(rejected(&bad), Some(io::ErrorKind::InvalidData));
+        assert_eq!(rejected(&good[..good.len() - 1]), Some(io::ErrorKind::InvalidData));
+        assert_eq!(rejected(&good[..HEADER_SIZE - 1]), Some(io::ErrorKind::InvalidData));
+        let mut bad = good.clone();
+        bad[8] ^= 1;
+        assert_eq!(rejected(&bad), Some(io::ErrorKind::InvalidData));
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,173 @@
+//! Alert history on disk.
+//!
+//! Alerts are appended to segment files and never rewritten in place: the disk only ever sees
+//! sequential writes to the newest segment, and a segment is sealed once it reaches a size or
+//! time span limit. Each segment's time range and sparse index are kept in memory, so a query
+//! such as "the last hour" or "the newest 50" skips every segment outside the range and reads
+//! only the tail of the ones inside it. Appends are not synced one by one; the data is synced at
+//! most every few seconds and whenever a segment is sealed, so an alert storm does not turn into
+//! an fsync storm (cheap SSDs and SD cards suffer badly from those).
+
+mod retention;
+mod segment;
+
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+use vigilant_canine_proto::Alert;
+
+pub use retention::{Compacted, Compaction, Maintenance, RetentionPolicy};
+use segment::{record_header, Segment, RECORD_HEADER_LEN};
+
+/// How often appended alerts are synced to disk. A power loss loses at most this much.
+const SYNC_INTERVAL: Duration = Duration::from_secs(5);
+
+#[derive(Debug, Clone, Copy)]
+pub struct StoreConfig {
+    /// A segment is sealed once it grows past this many bytes.
+    pub segment_size: u64,
+    /// ... or once its alerts span this long, so retention can drop history by age.
+    pub segment_span: Duration,
+    pub retention: RetentionPolicy,
+}
+
+impl Default for StoreConfig {
+    fn default() -> StoreConfig {
+        StoreConfig {
+            segment_size: 4 * 1024 * 1024,
+            segment_span: Duration::from_secs(24 * 60 * 60),
+            retention: RetentionPolicy::default(),
+        }
+    }
+}
+
+pub struct EventStore {
+    dir: PathBuf,
+    config: StoreConfig,
+    /// Oldest first.
+    sealed: Vec<Segment>,
+    active: Segment,
+    file: File,
+    buf: Vec<u8>,
+    /// Whether appends happened since the last sync.
+    dirty: bool,
+    last_sync: Instant,
+    /// The sealed segment a [`Compaction`] is running for.
+    compacting: Option<u64>,
+}
+
+impl EventStore {
+    /// Opens the store in `dir`, creating it if needed. A record torn by a crash is dropped.
+    pub fn open(dir: &Path, config: StoreConfig) -> io::Result<EventStore> {
+        fs::create_dir_all(dir)?;
+        let mut seqs = Vec::new();
+        for entry in fs::read_dir(dir)? {
+            let entry = entry?;
+            let name = entry.file_name();
+            let name = name.to_string_lossy();
+            // Left behind by a crash during a seal or compaction; the original is intact.
+            if name.ends_with(".tmp") {
+                fs::remove_file(entry.path())?;
+            } else if let Some(seq) = name.strip_suffix(".seg").and_then(|hex| u64::from_str_radix(hex, 16).ok()) {
+                seqs.push(seq);
+            }
+        }
+        seqs.sort_unstable();
+
+        let (active, file) = match seqs.pop() {
+            Some(seq) => {
+                let segment = Segment::recover(dir, seq)?;
+                let file = fs::OpenOptions::new().append(true).open(segment::segment_path(dir, seq))?;
+                (segment, file)
+            }
+            None => Segment::create(dir, 0)?,
+        };
+        let sealed = seqs.into_iter().map(|seq| Segment::load(dir, seq)).collect::<io::Result<_>>()?;
+        Ok(EventStore {
+            dir: dir.to_path_buf(),
+            config,
+            sealed,
+            active,
+            file,
+            buf: Vec::new(),
+            dirty: false,
+            last_sync: Instant::now(),
+            compacting: None,
+        })
+    }
+
+    /// Number of stored alerts.
+    pub fn len(&self) -> u64 {
+        self.sealed.iter().map(|segment| segment.count).sum::<u64>() + self.active.count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn append(&mut self, alert: &Alert) -> io::Result<()> {
+        self.buf.clear();
+        self.buf.extend_from_slice(&[0; RECORD_HEADER_LEN]);
+        alert.encode(&mut self.buf);
+        let header = record_header(&self.buf[RECORD_HEADER_LEN..]);
+        self.buf[..RECORD_HEADER_LEN].copy_from_slice(&header);
+
+        let span = Duration::from_millis(alert.time_ms.saturating_sub(self.active.min_ms));
+        let full = self.active.len + self.buf.len() as u64 > self.config.segment_size || span > self.config.segment_span;
+        if self.active.count > 0 && full {
+            self.seal()?;
+        }
+        self.file.write_all(&self.buf)?;
+        self.active.note(alert.time_ms, self.buf.len() as u64);
+        self.dirty = true;
+        Ok(())
+    }
+
+    /// Syncs appended alerts if the sync interval elapsed, or unconditionally with `force`.
+    pub fn sync(&mut self, force: bool) -> io::Result<()> {
+        if !self.dirty || (!force && self.last_sync.elapsed() < SYNC_INTERVAL) {
+            return Ok(());
+        }
+        self.file.sync_data()?;
+        self.dirty = false;
+        self.last_sync = Instant::now();
+        Ok(())
+    }
+
+    /// Collects, newest first, at most `limit` alerts raised at or after `since_ms` (Unix
+    /// milliseconds; `0` for no bound).
+    pub fn query(&self, since_ms: u64, limit: usize, out: &mut Vec<Alert>) -> io::Result<()> {
+        let wanted = out.len() + limit;
+        for segment in std::iter::once(&self.active).chain(self.sealed.iter().rev()) {
+            if out.len() >= wanted {
+                break;
+            }
+            // Segments are in time order, so once one ends before `since_ms` all older ones do.
+            if segment.count > 0 && segment.max_ms < since_ms {
+                break;
+            }
+            segment.query(&self.dir, since_ms, wanted - out.len(), out)?;
+        }
+        Ok(())
+    }
+
+    fn seal(&mut self) -> io::Result<()> {
+        self.file.sync_data()?;
+        self.active.write_index(&self.dir)?;
+        let (next, file) = Segment::create(&self.dir, self.active.seq + 1)?;
+        File::open(&self.dir)?.sync_all()?;
+        self.sealed.push(std::mem::replace(&mut self.active, next));
+        self.file = file;
+        self.dirty = false;
+        self.last_sync = Instant::now();
+        Ok(())
+    }
+}
+
+impl Drop for EventStore {
+    fn drop(&mut self) {
+        let _ = self.sync(true);
+    }
+}
@@ -0,0 +1,307 @@
+//! Bounding the history's disk footprint.
+//!
+//! History is only ever removed a whole segment at a time, which is two unlinks however much it
+//! held. Before old segments go, the low-severity alerts in them are folded into one summary per
+//! source, so a week of port-scan noise shrinks to a handful of records while anything serious is
+//! kept verbatim. The work is split into steps of at most one segment so the caller can interleave
+//! it with handling events, and [`EventStore::until_maintenance`] says when the next step is due
+//! so an idle daemon does not have to wake up to look. Compacting a segment reads and rewrites up
+//! to a whole segment and syncs it, so that step is handed back as a [`Compaction`] to run off the
+//! event loop; the store keeps serving the original meanwhile and swaps in the rewrite in
+//! [`EventStore::finish_compaction`].
+
+use std::io;
+use std::path::PathBuf;
+use std::time::Duration;
+
+use vigilant_canine_proto::Severity;
+
+use super::segment::Segment;
+use super::EventStore;
+
+#[derive(Debug, Clone, Copy)]
+pub struct RetentionPolicy {
+    /// Oldest segments are dropped while the history is larger than this.
+    pub max_bytes: u64,
+    /// Segments whose newest alert is older than this are dropped.
+    pub max_age: Duration,
+    /// Segments whose newest alert is older than this are compacted...
+    pub compact_after: Duration,
+    /// ... by summarizing the alerts below this severity.
+    pub compact_below: Severity,
+}
+
+impl Default for RetentionPolicy {
+    fn default() -> RetentionPolicy {
+        RetentionPolicy {
+            max_bytes: 64 * 1024 * 1024,
+            max_age: Duration::from_secs(180 * 24 * 60 * 60),
+            compact_after: Duration::from_secs(7 * 24 * 60 * 60),
+            compact_below: Severity::Medium,
+        }
+    }
+}
+
+/// What one call to [`EventStore::maintain`] did.
+#[derive(Debug)]
+pub enum Maintenance {
+    /// Nothing is due, or a compaction is still running.
+    Idle,
+    /// A segment of this many alerts was deleted.
+    Dropped { alerts: u64 },
+    /// A segment is due for compaction, which the caller runs, typically on another thread, and
+    /// hands back to [`EventStore::finish_compaction`].
+    Compact(Compaction),
+}
+
+/// Rewriting one segment in compacted form.
+#[derive(Debug)]
+pub struct Compaction {
+    dir: PathBuf,
+    segment: Segment,
+    below: Severity,
+}
+
+/// A compacted segment, written but not yet in place.
+#[derive(Debug)]
+pub struct Compacted {
+    segment: Segment,
+    /// Alerts in the segment before it was compacted.
+    pub before: u64,
+}
+
+impl Compaction {
+    pub fn run(self) -> io::Result<Compacted> {
+        let segment = self.segment.compact(&self.dir, |alert| alert.severity < self.below)?;
+        Ok(Compacted { segment, before: self.segment.count })
+    }
+}
+
+impl Compacted {
+    /// Alerts in the segment after it was compacted.
+    pub fn after(&self) -> u64 {
+        self.segment.count
+    }
+}
+
+impl EventStore {
+    /// Bytes of alert history on disk (indexes excluded).
+    pub fn disk_usage(&self) -> u64 {
+        self.sealed.iter().map(|segment| segment.len).sum::<u64>() + self.active.len
+    }
+
+    /// Performs the most urgent retention step, if any is due at `now_ms`. Call it again while
+    /// it returns something other than [`Maintenance::Idle`].
+    pub fn maintain(&mut self, now_ms: u64) -> io::Result<Maintenance> {
+        if self.compacting.is_some() {
+            return Ok(Maintenance::Idle);
+        }
+        let policy = self.config.retention;
+        let max_age_ms = policy.max_age.as_millis() as u64;
+        if let Some(oldest) = self.sealed.first() {
+            if self.disk_usage() > policy.max_bytes || oldest.max_ms.saturating_add(max_age_ms) <= now_ms {
+                let oldest = self.sealed.remove(0);
+                oldest.remove(&self.dir)?;
+                return Ok(Maintenance::Dropped { alerts: oldest.count });
+            }
+        }
+        let compact_after_ms = policy.compact_after.as_millis() as u64;
+        let due = self.sealed.iter().position(|segment| !segment.compacted && segment.max_ms.saturating_add(compact_after_ms) <= now_ms);
+        if let Some(index) = due {
+            let segment = self.sealed[index].clone();
+            self.compacting = Some(segment.seq);
+            return Ok(Maintenance::Compact(Compaction { dir: self.dir.clone(), segment, below: policy.compact_below }));
+        }
+        Ok(Maintenance::Idle)
+    }
+
+    /// Puts the result of the last [`Compaction`] in place of the segment it was made from, which
+    /// is left alone if it failed (`None` if it never finished). Maintenance goes on afterwards.
+    pub fn finish_compaction(&mut self, compacted: Option<io::Result<Compacted>>) -> io::Result<()> {
+        let Some(seq) = self.compacting.take() else {
+            return Ok(());
+        };
+        let compacted = compacted.unwrap_or_else(|| Err(io::Error::other("compaction did not finish")))?;
+        // Nothing drops a segment while it is being compacted.
+        let index = self.sealed.iter().position(|segment| segment.seq == seq).expect("compacted segment is kept");
+        compacted.segment.install(&self.dir)?;
+        self.sealed[index] = compacted.segment;
+        Ok(())
+    }
+
+    /// Time from `now_ms` until a sealed segment becomes due for compaction or deletion by age
+    /// (zero if one already is), or `None` if no sealed segment will ever be. Going over the size
+    /// cap is noticed when a segment is sealed, which always happens in a call to `append`. While
+    /// a compaction runs, nothing is due until it has finished.
+    pub fn until_maintenance(&self, now_ms: u64) -> Option<Duration> {
+        if self.compacting.is_some() {
+            return None;
+        }
+        let policy = self.config.retention;
+        let (max_age_ms, compact_after_ms) = (policy.max_age.as_millis() as u64, policy.compact_after.as_millis() as u64);
+        let mut due = self.sealed.first().map(|oldest| oldest.max_ms.saturating_add(max_age_ms));
+        if self.disk_usage() > policy.max_bytes && !self.sealed.is_empty() {
+            due = Some(now_ms);
+        }
+        let compaction = self.sealed.iter().filter(|segment| !segment.compacted).map(|segment| segment.max_ms.saturating_add(compact_after_ms)).min();
+        let due = match (due, compaction) {
+            (Some(a), Some(b)) => a.min(b),
+            (a, b) => a.or(b)?,
+        };
+        Some(Duration::from_millis(due.saturating_sub(now_ms)))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::path::PathBuf;
+    use std::time::Duration;
+
+    use vigilant_canine_proto::{Alert, Severity};
+
+    use super::{Maintenance, RetentionPolicy};
+    use crate::store::{EventStore, StoreConfig};
+
+    const HOUR_MS: u64 = 60 * 60 * 1000;
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-retention-{}-{name}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn config(segment_size: u64, retention: RetentionPolicy) -> StoreConfig {
+        StoreConfig { segment_size, segment_span: Duration::from_millis(HOUR_MS), retention }
+    }
+
+    fn keep_everything() -> RetentionPolicy {
+        let forever = Duration::from_secs(u64::MAX / 2000);
+        RetentionPolicy { max_bytes: u64::MAX, max_age: forever, compact_after: forever, compact_below: Severity::Medium }
+    }
+
+    fn alert(time_ms: u64, severity: Severity) -> Alert {
+        Alert::new(time_ms, severity, "test".into(), None, format!("alert {time_ms}"))
+    }
+
+    fn times(store: &EventStore) -> Vec<u64> {
+        let mut out = Vec::new();
+        store.query(0, usize::MAX, &mut out).unwrap();
+        out.iter().rev().map(|alert| alert.time_ms).collect()
+    }
+
+    /// Runs maintenance to completion, compacting in place, and returns what each step did.
+    fn maintain(store: &mut EventStore, now_ms: u64) -> Vec<String> {
+        let mut steps = Vec::new();
+        loop {
+            match store.maintain(now_ms).unwrap() {
+                Maintenance::Idle => return steps,
+                Maintenance::Dropped { alerts } => steps.push(format!("dropped {alerts}")),
+                Maintenance::Compact(compaction) => {
+                    let compacted = compaction.run().unwrap();
+                    steps.push(format!("compacted {} to {}", compacted.before, compacted.after()));
+                    store.finish_compaction(Some(Ok(compacted))).unwrap();
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn oldest_segments_go_over_the_size_cap() {
+        let dir = scratch("size");
+        let mut store = EventStore::open(&dir, config(200, keep_everything())).unwrap();
+        for time in 0..40 {
+            store.append(&alert(time, Severity::High)).unwrap();
+        }
+        let usage = store.disk_usage();
+        let all = times(&store);
+        assert_eq!(all.len(), 40);
+        assert!(maintain(&mut store, 100).is_empty());
+
+        store.config.retention.max_bytes = usage / 2;
+        let steps = maintain(&mut store, 100);
+        assert!(!steps.is_empty() && steps.iter().all(|step| step.starts_with("dropped")));
+        assert!(store.disk_usage() <= usage / 2);
+        // What is left is the newest part, with nothing missing in between.
+        let left = times(&store);
+        assert_eq!(left[..], all[all.len() - left.len()..]);
+        assert!(store.until_maintenance(100).is_none_or(|until| until > Duration::ZERO));
+        drop(store);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn segments_go_once_their_newest_alert_is_too_old() {
+        let dir = scratch("age");
+        let retention = RetentionPolicy { max_age: Duration::from_millis(10 * HOUR_MS), ..keep_everything() };
+        let mut store = EventStore::open(&dir, config(u64::MAX, retention)).unwrap();
+        // Segments span at most an hour: [0, 30 min], [2 h], [5 h], then the active one.
+        for time in [0, HOUR_MS / 2, 2 * HOUR_MS, 5 * HOUR_MS, 9 * HOUR_MS] {
+            store.append(&alert(time, Severity::High)).unwrap();
+        }
+        assert_eq!(store.until_maintenance(0), Some(Duration::from_millis(10 * HOUR_MS + HOUR_MS / 2)));
+        assert!(maintain(&mut store, 10 * HOUR_MS).is_empty());
+        assert_eq!(maintain(&mut store, 12 * HOUR_MS), ["dropped 2", "dropped 1"]);
+        assert_eq!(times(&store), [5 * HOUR_MS, 9 * HOUR_MS]);
+        assert_eq!(store.until_maintenance(12 * HOUR_MS), Some(Duration::from_millis(3 * HOUR_MS)));
+        drop(store);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn compaction_summarizes_low_severity_and_keeps_the_rest() {
+        let dir = scratch("compact");
+        let retention = RetentionPolicy { compact_after: Duration::from_millis(HOUR_MS), ..keep_everything() };
+        let mut store = EventStore::open(&dir, config(u64::MAX, retention)).unwrap();
+        for time in 0..100 {
+            let severity = if time % 25 == 0 { Severity::Critical } else { Severity::Low };
+            store.append(&alert(time, severity)).unwrap();
+        }
+        store.append(&alert(2 * HOUR_MS, Severity::Low)).unwrap();
+        assert_eq!(store.len(), 101);
+        let now = HOUR_MS + 100;
+
+        let Maintenance::Compact(compaction) = store.maintain(now).unwrap() else { panic!("nothing to compact") };
+        // While it runs, the original is served and nothing else is started.
+        assert!(matches!(store.maintain(now).unwrap(), Maintenance::Idle));
+        assert_eq!(store.until_maintenance(now), None);
+        let compacted = std::thread::spawn(move || compaction.run()).join().unwrap();
+        assert_eq!(store.len(), 101);
+        store.finish_compaction(Some(compacted)).unwrap();
+
+        let mut alerts = Vec::new();
+        store.query(0, usize::MAX, &mut alerts).unwrap();
+        alerts.reverse();
+        let critical: Vec<u64> = alerts.iter().filter(|alert| alert.severity == Severity::Critical).map(|alert| alert.time_ms).collect();
+        assert_eq!(critical, [0, 25, 50, 75]);
+        let low: Vec<&Alert> = alerts[..alerts.len() - 1].iter().filter(|alert| alert.severity == Severity::Low).collect();
+        assert_eq!(low.len(), 1);
+        assert_eq!((low[0].count, low[0].time_ms, low[0].last_ms), (96, 1, 99));
+        assert!(low[0].message.ends_with("(compacted)"));
+        assert_eq!(store.len(), 6);
+        // Not compacted twice, and the same after reopening.
+        assert!(maintain(&mut store, 10 * HOUR_MS).is_empty());
+        drop(store);
+        let mut store = EventStore::open(&dir, config(u64::MAX, retention)).unwrap();
+        assert_eq!(store.len(), 6);
+        assert!(maintain(&mut store, 10 * HOUR_MS).is_empty());
+        drop(store);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn failed_compaction_leaves_the_segment() {
+        let dir = scratch("failed");
+        let retention = RetentionPolicy { compact_after: Duration::ZERO, ..keep_everything() };
+        let mut store = EventStore::open(&dir, config(u64::MAX, retention)).unwrap();
+        store.append(&alert(0, Severity::Low)).unwrap();
+        store.append(&alert(2 * HOUR_MS, Severity::Low)).unwrap();
+        let Maintenance::Compact(_) = store.maintain(3 * HOUR_MS).unwrap() else { panic!("nothing to compact") };
+        assert!(store.finish_compaction(None).is_err());
+        assert_eq!(times(&store), [0, 2 * HOUR_MS]);
+        assert!(matches!(store.maintain(3 * HOUR_MS).unwrap(), Maintenance::Compact(_)));
+        drop(store);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,421 @@
+//! One segment file and its sparse index.
+//!
+//! A segment is a 16-byte header followed by records: a `u32` body length, a `u32` checksum of
+//! the body (low half of XXH3-64) and the body, an [`Alert`] in its wire encoding. Every
+//! `INDEX_STRIDE`th record is noted in a sparse index with its time and offset. When a segment
+//! is sealed its index and time range are written next to it (`.idx`), so opening the store never
+//! reads sealed segment data. Retention may later rewrite a sealed segment in compacted form; the
+//! header flags record that so it is not compacted twice. The rewrite goes to temporary files
+//! next to the original, which stays readable until the rewrite is renamed over it.
+
+use std::collections::btree_map::Entry;
+use std::collections::BTreeMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+
+use vigilant_canine_proto::{Alert, Severity};
+use xxhash_rust::xxh3::xxh3_64;
+
+use crate::sys::{replace_file, temporary_path, write_synced};
+
+const SEGMENT_MAGIC: &[u8; 8] = b"VCSEG\0\0\0";
+const INDEX_MAGIC: &[u8; 8] = b"VCSIDX\0\0";
+const VERSION: u32 = 1;
+const HEADER_LEN: u64 = 16;
+const FLAG_COMPACTED: u32 = 1;
+pub(super) const RECORD_HEADER_LEN: usize = 8;
+/// Records between sparse index entries.
+const INDEX_STRIDE: u64 = 64;
+const INDEX_HEADER_LEN: usize = 56;
+const INDEX_ENTRY_LEN: usize = 16;
+
+/// Time and offset of record `i * INDEX_STRIDE`.
+#[derive(Debug, Clone, Copy)]
+struct IndexEntry {
+    time_ms: u64,
+    offset: u64,
+}
+
+#[derive(Debug, Clone)]
+pub(super) struct Segment {
+    pub seq: u64,
+    pub min_ms: u64,
+    pub max_ms: u64,
+    pub count: u64,
+    /// End of the last valid record.
+    pub len: u64,
+    /// Whether record times never go backwards, which lets queries search the index by time.
+    monotonic: bool,
+    pub compacted: bool,
+    index: Vec<IndexEntry>,
+}
+
+pub(super) fn segment_path(dir: &Path, seq: u64) -> PathBuf {
+    dir.join(format!("{seq:016x}.seg"))
+}
+
+fn index_path(dir: &Path, seq: u64) -> PathBuf {
+    dir.join(format!("{seq:016x}.idx"))
+}
+
+fn invalid(message: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message.to_string())
+}
+
+impl Segment {
+    /// Creates an empty segment file, returning it opened for appending.
+    pub fn create(dir: &Path, seq: u64) -> io::Result<(Segment, File)> {
+        let mut file = OpenOptions::new().append(true).create_new(true).open(segment_path(dir, seq))?;
+        file.write_all(&header(0))?;
+        Ok((Segment::empty(seq), file))
+    }
+
+    fn empty(seq: u64) -> Segment {
+        Segment {
+            seq,
+            min_ms: u64::MAX,
+            max_ms: 0,
+            count: 0,
+            len: HEADER_LEN,
+            monotonic: true,
+            compacted: false,
+            index: Vec::new(),
+        }
+    }
+
+    /// Accounts for a record of `record_len` bytes at the current end.
+    pub fn note(&mut self, time_ms: u64, record_len: u64) {
+        if self.count.is_multiple_of(INDEX_STRIDE) {
+            self.index.push(IndexEntry { time_ms, offset: self.len });
+        }
+        self.monotonic &= self.count == 0 || time_ms >= self.max_ms;
+        self.min_ms = self.min_ms.min(time_ms);
+        self.max_ms = self.max_ms.max(time_ms);
+        self.count += 1;
+        self.len += record_len;
+    }
+
+    /// Rebuilds the metadata of segment `seq` by reading it, and cuts off a torn final record
+    /// (left by a crash mid-append) so appending can resume after the last good one.
+    pub fn recover(dir: &Path, seq: u64) -> io::Result<Segment> {
+        let path = segment_path(dir, seq);
+        let data = fs::read(&path)?;
+        if data.len() < HEADER_LEN as usize || &data[..8] != SEGMENT_MAGIC {
+            return Err(invalid("not an event segment"));
+        }
+        if u32::from_le_bytes(data[8..12].try_into().unwrap()) != VERSION {
+            return Err(invalid("unsupported event segment version"));
+        }
+        let mut segment = Segment::empty(seq);
+        segment.compacted = u32::from_le_bytes(data[12..16].try_into().unwrap()) & FLAG_COMPACTED != 0;
+        let mut records = Records { data: &data, offset: HEADER_LEN as usize };
+        while let Some(Ok((time_ms, len))) = records.next_time() {
+            segment.note(time_ms, len as u64);
+        }
+        if segment.len < data.len() as u64 {
+            OpenOptions::new().write(true).open(&path)?.set_len(segment.len)?;
+        }
+        Ok(segment)
+    }
+
+    /// Loads the metadata of sealed segment `seq` from its index file, rebuilding the index if
+    /// it is missing or does not match the segment.
+    pub fn load(dir: &Path, seq: u64) -> io::Result<Segment> {
+        let segment_len = fs::metadata(segment_path(dir, seq))?.len();
+        match fs::read(index_path(dir, seq)).ok().and_then(|data| Segment::parse_index(seq, &data)) {
+            Some(segment) if segment.len == segment_len => Ok(segment),
+            _ => {
+                let segment = Segment::recover(dir, seq)?;
+                segment.write_index(dir)?;
+                Ok(segment)
+            }
+        }
+    }
+
+    fn parse_index(seq: u64, data: &[u8]) -> Option<Segment> {
+        let header = data.get(..INDEX_HEADER_LEN)?;
+        let u64_at = |at: usize| u64::from_le_bytes(data[at..at + 8].try_into().unwrap());
+        if &header[..8] != INDEX_MAGIC || u32::from_le_bytes(header[8..12].try_into().unwrap()) != VERSION {
+            return None;
+        }
+        let entries = u64_at(48) as usize;
+        if data.len() != INDEX_HEADER_LEN + entries.checked_mul(INDEX_ENTRY_LEN)? {
+            return None;
+        }
+        let index = (0..entries)
+            .map(|i| INDEX_HEADER_LEN + i * INDEX_ENTRY_LEN)
+            .map(|at| IndexEntry { time_ms: u64_at(at), offset: u64_at(at + 8) })
+            .collect();
+        Some(Segment {
+            seq,
+            monotonic: header[12] != 0,
+            compacted: header[13] != 0,
+            min_ms: u64_at(16),
+            max_ms: u64_at(24),
+            count: u64_at(32),
+            len: u64_at(40),
+            index,
+        })
+    }
+
+    pub fn write_index(&self, dir: &Path) -> io::Result<()> {
+        replace_file(&index_path(dir, self.seq), |out| self.encode_index(out))
+    }
+
+    fn encode_index(&self, out: &mut impl Write) -> io::Result<()> {
+        let mut header = [0; INDEX_HEADER_LEN];
+        header[..8].copy_from_slice(INDEX_MAGIC);
+        header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+        header[12] = self.monotonic as u8;
+        header[13] = self.compacted as u8;
+        header[16..24].copy_from_slice(&self.min_ms.to_le_bytes());
+        header[24..32].copy_from_slice(&self.max_ms.to_le_bytes());
+        header[32..40].copy_from_slice(&self.count.to_le_bytes());
+        header[40..48].copy_from_slice(&self.len.to_le_bytes());
+        header[48..56].copy_from_slice(&(self.index.len() as u64).to_le_bytes());
+        out.write_all(&header)?;
+        for entry in &self.index {
+            out.write_all(&entry.time_ms.to_le_bytes())?;
+            out.write_all(&entry.offset.to_le_bytes())?;
+        }
+        Ok(())
+    }
+
+    /// Deletes the segment and its index.
+    pub fn remove(&self, dir: &Path) -> io::Result<()> {
+        match fs::remove_file(index_path(dir, self.seq)) {
+            Err(err) if err.kind() != io::ErrorKind::NotFound => return Err(err),
+            _ => {}
+        }
+        fs::remove_file(segment_path(dir, self.seq))
+    }
+
+    /// Writes the segment again with every alert `summarize` selects folded into one summary per
+    /// source and severity, returning the new segment. The rewrite and its index go to temporary
+    /// files and only replace the originals in [`install`](Segment::install), so this may run
+    /// on another thread while the original is queried.
+    pub fn compact<F: Fn(&Alert) -> bool>(&self, dir: &Path, summarize: F) -> io::Result<Segment> {
+        let data = fs::read(segment_path(dir, self.seq))?;
+        let mut kept = Vec::new();
+        let mut groups: BTreeMap<(String, Severity), Alert> = BTreeMap::new();
+        let mut records = Records { data: &data[(HEADER_LEN as usize).min(data.len())..], offset: 0 };
+        while let Some(Ok(record)) = records.next_body() {
+            let alert = Alert::decode(record)?;
+            if !summarize(&alert) {
+                kept.push(alert);
+                continue;
+            }
+            match groups.entry((alert.source.clone(), alert.severity)) {
+                Entry::Vacant(entry) => {
+                    entry.insert(alert);
+                }
+                Entry::Occupied(mut entry) => {
+                    let summary = entry.get_mut();
+                    if summary.addr != alert.addr {
+                        summary.addr = None;
+                    }
+                    summary.count += alert.count;
+                    summary.last_ms = summary.last_ms.max(alert.last_ms);
+                }
+            }
+        }
+        for mut summary in groups.into_values() {
+            if summary.count > 1 {
+                summary.message = format!("{} (compacted)", summary.message);
+            }
+            kept.push(summary);
+        }
+        kept.sort_by_key(|alert| alert.time_ms);
+
+        let mut segment = Segment::empty(self.seq);
+        segment.compacted = true;
+        let mut body = Vec::new();
+        write_synced(&temporary_path(&segment_path(dir, self.seq)), |out| {
+            out.write_all(&header(FLAG_COMPACTED))?;
+            for alert in &kept {
+                body.clear();
+                alert.encode(&mut body);
+                out.write_all(&record_header(&body))?;
+                out.write_all(&body)?;
+                segment.note(alert.time_ms, (RECORD_HEADER_LEN + body.len()) as u64);
+            }
+            Ok(())
+        })?;
+        write_synced(&temporary_path(&index_path(dir, self.seq)), |out| segment.encode_index(out))?;
+        Ok(segment)
+    }
+
+    /// Renames the files [`compact`](Segment::compact) wrote into place. A crash between the two
+    /// renames leaves an index that does not match the segment, which `load` rebuilds.
+    pub fn install(&self, dir: &Path) -> io::Result<()> {
+        for path in [segment_path(dir, self.seq), index_path(dir, self.seq)] {
+            fs::rename(temporary_path(&path), &path)?;
+        }
+        File::open(dir)?.sync_all()
+    }
+
+    /// Appends to `out`, newest first, the newest `limit` records at or after `since_ms`.
+    /// Only the part of the segment the sparse index says can hold them is read.
+    pub fn query(&self, dir: &Path, since_ms: u64, limit: usize, out: &mut Vec<Alert>) -> io::Result<()> {
+        if self.count == 0 || limit == 0 || self.max_ms < since_ms {
+            return Ok(());
+        }
+        let by_count = (self.count.saturating_sub(limit as u64) / INDEX_STRIDE) as usize;
+        let by_time = if self.monotonic {
+            self.index.partition_point(|entry| entry.time_ms < since_ms).saturating_sub(1)
+        } else {
+            0
+        };
+        let first = by_count.max(by_time);
+        let start = self.index[first].offset;
+        let mut data = vec![0; (self.len - start) as usize];
+        File::open(segment_path(dir, self.seq))?.read_exact_at(&mut data, start)?;
+
+        let mut found = Vec::new();
+        let mut records = Records { data: &data, offset: 0 };
+        while let Some(record) = records.next_body() {
+            let alert = Alert::decode(record?)?;
+            if alert.time_ms >= since_ms {
+                found.push(alert);
+            }
+        }
+        out.extend(found.into_iter().rev().take(limit));
+        Ok(())
+    }
+}
+
+/// Walks the records in a segment's bytes.
+struct Records<'a> {
+    data: &'a [u8],
+    offset: usize,
+}
+
+impl<'a> Records<'a> {
+    /// The next record's body, or an error for a damaged record (which ends the walk).
+    fn next_body(&mut self) -> Option<io::Result<&'a [u8]>> {
+        let rest = &self.data[self.offset..];
+        let header = rest.get(..RECORD_HEADER_LEN)?;
+        let len = u32::from_le_bytes(header[..4].try_into().unwrap()) as usize;
+        let checksum = u32::from_le_bytes(header[4..].try_into().unwrap());
+        let Some(body) = rest.get(RECORD_HEADER_LEN..RECORD_HEADER_LEN + len) else {
+            self.offset = self.data.len();
+            return Some(Err(invalid("truncated event record")));
+        };
+        if xxh3_64(body) as u32 != checksum {
+            self.offset = self.data.len();
+            return Some(Err(invalid("corrupt event record")));
+        }
+        self.offset += RECORD_HEADER_LEN + len;
+        Some(Ok(body))
+    }
+
+    /// The next record's time and total length, without decoding the rest of it.
+    fn next_time(&mut self) -> Option<io::Result<(u64, usize)>> {
+        let start = self.offset;
+        Some(self.next_body()?.and_then(|body| {
+            let time = body.get(..8).ok_or_else(|| invalid("short event record"))?;
+            Ok((u64::from_le_bytes(time.try_into().unwrap()), self.offset - start))
+        }))
+    }
+}
+
+fn header(flags: u32) -> [u8; HEADER_LEN as usize] {
+    let mut header = [0; HEADER_LEN as usize];
+    header[..8].copy_from_slice(SEGMENT_MAGIC);
+    header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+    header[12..16].copy_from_slice(&flags.to_le_bytes());
+    header
+}
+
+/// Frames `body` as a record.
+pub(super) fn record_header(body: &[u8]) -> [u8; RECORD_HEADER_LEN] {
+    let mut header = [0; RECORD_HEADER_LEN];
+    header[..4].copy_from_slice(&(body.len() as u32).to_le_bytes());
+    header[4..].copy_from_slice(&(xxh3_64(body) as u32).to_le_bytes());
+    header
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{self, File};
+    use std::io::Write;
+    use std::path::PathBuf;
+
+    use vigilant_canine_proto::{Alert, Severity};
+
+    use super::{record_header, segment_path, Segment, RECORD_HEADER_LEN};
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("vigilant-canine-segment-{}-{name}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn alert(time_ms: u64) -> Alert {
+        Alert::new(time_ms, Severity::Low, "test".into(), None, format!("alert {time_ms}"))
+    }
+
+    fn append(segment: &mut Segment, file: &mut File, alert: &Alert) {
+        let mut body = Vec::new();
+        alert.encode(&mut body);
+        file.write_all(&record_header(&body)).unwrap();
+        file.write_all(&body).unwrap();
+        segment.note(alert.time_ms, (RECORD_HEADER_LEN + body.len()) as u64);
+    }
+
+    fn times(alerts: &[Alert]) -> Vec<u64> {
+        alerts.iter().map(|alert| alert.time_ms).collect()
+    }
+
+    #[test]
+    fn recovery_cuts_off_a_torn_record() {
+        let dir = scratch("torn");
+        let (mut segment, mut file) = Segment::create(&dir, 1).unwrap();
+        for time_ms in 0..100 {
+            append(&mut segment, &mut file, &alert(time_ms));
+        }
+        let mut body = Vec::new();
+        alert(100).encode(&mut body);
+        file.write_all(&record_header(&body)).unwrap();
+        file.write_all(&body[..body.len() / 2]).unwrap();
+        drop(file);
+
+        let recovered = Segment::recover(&dir, 1).unwrap();
+        assert_eq!((recovered.count, recovered.len), (100, segment.len));
+        assert_eq!((recovered.min_ms, recovered.max_ms), (0, 99));
+        assert_eq!(fs::metadata(segment_path(&dir, 1)).unwrap().len(), segment.len);
+        let mut out = Vec::new();
+        recovered.query(&dir, 0, 1, &mut out).unwrap();
+        assert_eq!(times(&out), [99]);
+        fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn queries_read_from_the_indexed_record() {
+        let dir = scratch("query");
+        let (mut segment, mut file) = Segment::create(&dir, 1).unwrap();
+        for time_ms in (0..1000).map(|i| i * 10) {
+            append(&mut segment, &mut file, &alert(time_ms));
+        }
+        drop(file);
+        segment.write_index(&dir).unwrap();
+        let loaded = Segment::load(&dir, 1).unwrap();
+        assert_eq!((loaded.count, loaded.len, loaded.index.len()), (1000, segment.len, 16));
+
+        let mut out = Vec::new();
+        loaded.query(&dir, 0, 3, &mut out).unwrap();
+        assert_eq!(times(&out), [9990, 9980, 9970]);
+        out.clear();
+        // Starts between two index entries, so the search has to back up to the earlier one.
+        loaded.query(&dir, 9955, 100, &mut out).unwrap();
+        assert_eq!(times(&out), [9990, 9980, 9970, 9960]);
+        out.clear();
+        loaded.query(&dir, 10_000, 100, &mut out).unwrap();
+        assert!(out.is_empty());
+        fs::remove_dir_all(dir).unwrap();
+    }
+}
@@ -0,0 +1,104 @@
+//! Thin helpers around raw libc calls.
+
+use std::ffi::CString;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+
+/// Converts a `-1` return value from a libc call into the current `errno`.
+pub fn cvt(ret: libc::c_int) -> io::Result<libc::c_int> {
+    if ret == -1 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(ret)
+    }
+}
+
+/// Converts a path into a NUL-terminated string for libc.
+pub fn cstr(path: &Path) -> io::Result<CString> {
+    CString::new(path.as_os_str().as_bytes())
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "path contains a NUL byte"))
+}
+
+/// A read-only shared mapping of a whole file.
+pub struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+// The mapping is read-only, so sharing it between threads is no different from sharing `&[u8]`.
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    /// Maps `file` read-only. `advice` is passed to `madvise` (e.g. `libc::MADV_RANDOM`).
+    pub fn map(file: &std::fs::File, advice: libc::c_int) -> io::Result<Mmap> {
+        use std::os::fd::AsRawFd;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Mmap { ptr: std::ptr::null_mut(), len: 0 });
+        }
+        let ptr = unsafe { libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_SHARED, file.as_raw_fd(), 0) };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        unsafe { libc::madvise(ptr, len, advice) };
+        Ok(Mmap { ptr, len })
+    }
+}
+
+impl std::ops::Deref for Mmap {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.ptr.cast(), self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe { libc::munmap(self.ptr, self.len) };
+        }
+    }
+}
+
+/// The temporary sibling [`replace_file`] writes `path` to before renaming it into place.
+pub fn temporary_path(path: &Path) -> std::path::PathBuf {
+    let mut tmp = path.as_os_str().to_owned();
+    tmp.push(".tmp");
+    tmp.into()
+}
+
+/// Creates `path` with whatever `write` produces and syncs it, for a caller that renames it into
+/// place later.
+pub fn write_synced<F>(path: &Path, write: F) -> io::Result<()>
+where
+    F: FnOnce(&mut io::BufWriter<&std::fs::File>) -> io::Result<()>,
+{
+    use std::io::Write;
+    let file = std::fs::File::create(path)?;
+    let mut out = io::BufWriter::new(&file);
+    write(&mut out)?;
+    out.flush()?;
+    drop(out);
+    file.sync_all()
+}
+
+/// Atomically replaces `path` with whatever `write` produces: the data goes to a temporary
+/// sibling, is synced, and is then renamed over the target.
+pub fn replace_file<F>(path: &Path, write: F) -> io::Result<()>
+where
+    F: FnOnce(&mut io::BufWriter<&std::fs::File>) -> io::Result<()>,
+{
+    let tmp = temporary_path(path);
+    write_synced(&tmp, write)?;
+    std::fs::rename(&tmp, path)?;
+    if let Some(dir) = path.parent().filter(|dir| !dir.as_os_str().is_empty()) {
+        std::fs::File::open(dir)?.sync_all()?;
+    }
+    Ok(())
+}
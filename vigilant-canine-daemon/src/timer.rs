@@ -0,0 +1,257 @@
+//! Scheduled work.
+//!
+//! Everything the daemon does on a clock rather than in response to an event (deep audits,
+//! retention, flushing the alert history and journal cursor, expiring idle counters) is a
+//! deadline in one hierarchical timer wheel, and the wheel keeps a single timerfd armed for the
+//! earliest of them. Deadlines are rounded up to a grid of the monotonic clock, so jobs that fall
+//! due within the same tick run in one wakeup instead of each waking the CPU on its own, and
+//! with nothing scheduled the timerfd is disarmed and the daemon sleeps until the next event.
+//!
+//! The wheel has 64 slots per level, each level 64 times coarser than the one below, like the
+//! kernel's: scheduling and cancelling are O(1) and a deadline is touched at most once per level
+//! on its way down.
+
+use std::collections::HashMap;
+use std::hash::Hash;
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::time::Duration;
+
+use crate::sys::cvt;
+
+const SLOT_BITS: u32 = 6;
+const SLOTS: usize = 1 << SLOT_BITS;
+/// Enough levels for any `u64` tick, so a deadline never wraps around the top level.
+const LEVELS: usize = (u64::BITS as usize).div_ceil(SLOT_BITS as usize);
+
+struct Level<K> {
+    /// Bit `i` is set if slot `i` holds a key.
+    occupied: u64,
+    slots: Vec<Vec<K>>,
+}
+
+/// Where a scheduled key sits in the wheel.
+#[derive(Clone, Copy)]
+struct Entry {
+    deadline: u64,
+    level: u8,
+    slot: u8,
+}
+
+/// Deadlines for a small set of jobs identified by `K`, each scheduled at most once at a time.
+pub struct TimerWheel<K> {
+    timerfd: OwnedFd,
+    tick_ns: u64,
+    /// Tick of the monotonic clock up to which deadlines have been processed. Every key at level
+    /// `n` agrees with it in all bits above level `n` and is in a later slot at level `n`.
+    elapsed: u64,
+    levels: Vec<Level<K>>,
+    entries: HashMap<K, Entry>,
+    /// Tick the timerfd is set to expire at.
+    armed: Option<u64>,
+}
+
+impl<K: Copy + Eq + Hash> TimerWheel<K> {
+    /// Creates a wheel whose deadlines are rounded up to multiples of `resolution`.
+    pub fn new(resolution: Duration) -> io::Result<TimerWheel<K>> {
+        let fd = cvt(unsafe { libc::timerfd_create(libc::CLOCK_MONOTONIC, libc::TFD_NONBLOCK | libc::TFD_CLOEXEC) })?;
+        let tick_ns = (resolution.as_nanos() as u64).max(1);
+        Ok(TimerWheel {
+            timerfd: unsafe { OwnedFd::from_raw_fd(fd) },
+            tick_ns,
+            elapsed: monotonic_ns() / tick_ns,
+            levels: (0..LEVELS).map(|_| Level { occupied: 0, slots: (0..SLOTS).map(|_| Vec::new()).collect() }).collect(),
+            entries: HashMap::new(),
+            armed: None,
+        })
+    }
+
+    /// Runs `key` once `after` has passed (at the next tick boundary), replacing its pending
+    /// deadline if it has one.
+    pub fn schedule(&mut self, key: K, after: Duration) {
+        self.cancel(key);
+        let deadline = monotonic_ns().saturating_add(after.as_nanos().min(u64::MAX as u128) as u64).div_ceil(self.tick_ns);
+        self.insert(key, deadline.max(self.elapsed));
+    }
+
+    pub fn cancel(&mut self, key: K) {
+        if let Some(entry) = self.entries.remove(&key) {
+            let level = &mut self.levels[entry.level as usize];
+            let slot = &mut level.slots[entry.slot as usize];
+            if let Some(index) = slot.iter().position(|&pending| pending == key) {
+                slot.swap_remove(index);
+            }
+            if slot.is_empty() {
+                level.occupied &= !(1 << entry.slot);
+            }
+        }
+    }
+
+    pub fn is_scheduled(&self, key: K) -> bool {
+        self.entries.contains_key(&key)
+    }
+
+    /// Appends the keys whose deadlines have passed to `out`, earliest first, and unschedules
+    /// them.
+    pub fn expired(&mut self, out: &mut Vec<K>) -> io::Result<()> {
+        // Clear the timerfd's readiness; how many times it expired does not matter.
+        let mut expirations = 0u64;
+        let ret = unsafe { libc::read(self.timerfd.as_raw_fd(), (&mut expirations as *mut u64).cast(), 8) };
+        if ret < 0 {
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::WouldBlock {
+                return Err(err);
+            }
+        }
+        self.armed = None;
+        self.advance(monotonic_ns() / self.tick_ns, out);
+        Ok(())
+    }
+
+    /// Moves the wheel on to tick `now`, appending the keys due by then to `out`.
+    fn advance(&mut self, now: u64, out: &mut Vec<K>) {
+        let mut keys = Vec::new();
+        while let Some((level, slot, start)) = self.next_slot() {
+            if start > now {
+                break;
+            }
+            self.elapsed = self.elapsed.max(start);
+            std::mem::swap(&mut keys, &mut self.levels[level].slots[slot]);
+            self.levels[level].occupied &= !(1 << slot);
+            // Keys in a coarse slot are due somewhere within it; they cascade to finer levels
+            // until the slot they land in is their deadline.
+            for key in keys.drain(..) {
+                let deadline = self.entries[&key].deadline;
+                if deadline <= self.elapsed {
+                    self.entries.remove(&key);
+                    out.push(key);
+                } else {
+                    self.insert(key, deadline);
+                }
+            }
+            // Hand the allocation back; nothing was reinserted into the slot being emptied.
+            std::mem::swap(&mut keys, &mut self.levels[level].slots[slot]);
+        }
+        self.elapsed = self.elapsed.max(now);
+    }
+
+    /// Sets the timerfd to the earliest pending deadline, or disarms it if there is none. Call it
+    /// before going back to sleep.
+    pub fn arm(&mut self) -> io::Result<()> {
+        let next = self.next_deadline();
+        if next == self.armed {
+            return Ok(());
+        }
+        let at_ns = next.map_or(0, |deadline| deadline.saturating_mul(self.tick_ns).max(1));
+        let spec = libc::itimerspec {
+            it_interval: libc::timespec { tv_sec: 0, tv_nsec: 0 },
+            it_value: libc::timespec { tv_sec: (at_ns / 1_000_000_000) as libc::time_t, tv_nsec: (at_ns % 1_000_000_000) as libc::c_long },
+        };
+        cvt(unsafe { libc::timerfd_settime(self.timerfd.as_raw_fd(), libc::TFD_TIMER_ABSTIME, &spec, std::ptr::null_mut()) })?;
+        self.armed = next;
+        Ok(())
+    }
+
+    fn insert(&mut self, key: K, deadline: u64) {
+        // The level is picked by the highest bit in which the deadline differs from `elapsed`.
+        let differing = (self.elapsed ^ deadline) | (SLOTS as u64 - 1);
+        let level = ((u64::BITS - 1 - differing.leading_zeros()) / SLOT_BITS) as usize;
+        let slot = ((deadline >> (level as u32 * SLOT_BITS)) % SLOTS as u64) as usize;
+        self.levels[level].slots[slot].push(key);
+        self.levels[level].occupied |= 1 << slot;
+        self.entries.insert(key, Entry { deadline, level: level as u8, slot: slot as u8 });
+    }
+
+    /// The first occupied slot, as (level, slot, first tick it covers). Every key in a finer
+    /// level is due before any key in a coarser one, so it holds the earliest deadline.
+    fn next_slot(&self) -> Option<(usize, usize, u64)> {
+        self.levels.iter().enumerate().find(|(_, level)| level.occupied != 0).map(|(index, level)| {
+            let shift = index as u32 * SLOT_BITS;
+            let current = ((self.elapsed >> shift) % SLOTS as u64) as u32;
+            let distance = level.occupied.rotate_right(current).trailing_zeros();
+            let slot = (current + distance) as usize % SLOTS;
+            let start = (self.elapsed >> shift << shift) + ((distance as u64) << shift);
+            (index, slot, start)
+        })
+    }
+
+    fn next_deadline(&self) -> Option<u64> {
+        let (level, slot, start) = self.next_slot()?;
+        if level == 0 {
+            return Some(start);
+        }
+        self.levels[level].slots[slot].iter().map(|key| self.entries[key].deadline).min()
+    }
+}
+
+impl<K> AsRawFd for TimerWheel<K> {
+    fn as_raw_fd(&self) -> RawFd {
+        self.timerfd.as_raw_fd()
+    }
+}
+
+/// The clock the timerfd runs on (and `Instant` reads), which cannot fail to be read.
+fn monotonic_ns() -> u64 {
+    let mut now = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut now) };
+    now.tv_sec as u64 * 1_000_000_000 + now.tv_nsec as u64
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::TimerWheel;
+
+    /// A wheel whose clock starts at tick 0, driven by `advance`; keys are their deadlines.
+    fn wheel(deadlines: &[u64]) -> TimerWheel<u64> {
+        let mut wheel = TimerWheel::new(Duration::from_millis(1)).unwrap();
+        wheel.elapsed = 0;
+        for &deadline in deadlines {
+            wheel.insert(deadline, deadline);
+        }
+        wheel
+    }
+
+    fn advance(wheel: &mut TimerWheel<u64>, now: u64) -> Vec<u64> {
+        let mut out = Vec::new();
+        wheel.advance(now, &mut out);
+        out
+    }
+
+    #[test]
+    fn deadlines_cascade_down_the_levels() {
+        let mut wheel = wheel(&[1, 100, 5000, 300_000]);
+        let levels = |wheel: &TimerWheel<u64>, key| wheel.entries[&key].level;
+        assert_eq!([1, 100, 5000, 300_000].map(|key| levels(&wheel, key)), [0, 1, 2, 3]);
+
+        assert_eq!(advance(&mut wheel, 99), [1]);
+        // Its level-1 slot came up at tick 64, moving it down to where its own tick is.
+        assert_eq!(levels(&wheel, 100), 0);
+        assert_eq!(advance(&mut wheel, 100), [100]);
+        // Down two levels on the way: at tick 4096 and at 4992.
+        assert_eq!(advance(&mut wheel, 4999), []);
+        assert_eq!(levels(&wheel, 5000), 0);
+        assert_eq!(advance(&mut wheel, 5000), [5000]);
+        assert_eq!(advance(&mut wheel, 299_999), []);
+        assert_eq!(advance(&mut wheel, 1 << 40), [300_000]);
+        assert!(wheel.entries.is_empty());
+    }
+
+    #[test]
+    fn expire_in_deadline_order() {
+        let mut wheel = wheel(&[70, 65, 4200, 4100, 3]);
+        assert_eq!(advance(&mut wheel, 10_000), [3, 65, 70, 4100, 4200]);
+    }
+
+    #[test]
+    fn next_deadline_looks_inside_coarse_slots() {
+        let mut wheel = wheel(&[4200, 4100]);
+        assert_eq!(wheel.next_deadline(), Some(4100));
+        wheel.cancel(4100);
+        assert_eq!(wheel.next_deadline(), Some(4200));
+        wheel.cancel(4200);
+        assert_eq!(wheel.next_deadline(), None);
+        assert!(!wheel.is_scheduled(4200));
+    }
+}
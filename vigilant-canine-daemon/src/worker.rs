@@ -0,0 +1,79 @@
+//! Work done off the event loop.
+//!
+//! Some jobs (recompiling rules, rebuilding reputation lists) take far longer than the loop may
+//! be held up for. A [`Worker`] runs one such job at a time on a thread of its own and signals
+//! an eventfd registered with the [`Reactor`](crate::reactor::Reactor) when the result is ready,
+//! so the loop picks it up between two events and keeps handling events in the meantime.
+
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::mpsc::{self, Receiver, TryRecvError};
+use std::sync::Arc;
+use std::thread;
+
+use crate::sys::cvt;
+
+pub struct Worker<T> {
+    eventfd: Arc<OwnedFd>,
+    /// The running job's result, once it has one.
+    running: Option<Receiver<T>>,
+}
+
+impl<T: Send + 'static> Worker<T> {
+    pub fn new() -> io::Result<Worker<T>> {
+        let fd = cvt(unsafe { libc::eventfd(0, libc::EFD_NONBLOCK | libc::EFD_CLOEXEC) })?;
+        Ok(Worker { eventfd: Arc::new(unsafe { OwnedFd::from_raw_fd(fd) }), running: None })
+    }
+
+    pub fn is_running(&self) -> bool {
+        self.running.is_some()
+    }
+
+    /// Runs `job` on a new thread. Does nothing and returns false if a job is still running.
+    pub fn start<F: FnOnce() -> T + Send + 'static>(&mut self, job: F) -> io::Result<bool> {
+        if self.running.is_some() {
+            return Ok(false);
+        }
+        let (sender, receiver) = mpsc::sync_channel(1);
+        let eventfd = Arc::clone(&self.eventfd);
+        thread::Builder::new().name("vigilant-canine-worker".into()).spawn(move || {
+            // Declared first so it is dropped last, after the sender, even if the job panics.
+            let _notify = Notify(eventfd);
+            let sender = sender;
+            // The receiver only goes away with the worker, and then nobody wants the result.
+            let _ = sender.send(job());
+        })?;
+        self.running = Some(receiver);
+        Ok(true)
+    }
+
+    /// The finished job's result, if it has finished. Call it when the eventfd is readable.
+    pub fn take(&mut self) -> Option<T> {
+        let mut count = 0u64;
+        unsafe { libc::read(self.eventfd.as_raw_fd(), (&mut count as *mut u64).cast(), 8) };
+        let result = match self.running.as_ref()?.try_recv() {
+            Ok(result) => Some(result),
+            Err(TryRecvError::Empty) => return None,
+            // The job panicked; there is nothing to take, but the worker is free again.
+            Err(TryRecvError::Disconnected) => None,
+        };
+        self.running = None;
+        result
+    }
+}
+
+/// Wakes the loop when the job's thread is done with the result channel.
+struct Notify(Arc<OwnedFd>);
+
+impl Drop for Notify {
+    fn drop(&mut self) {
+        let one = 1u64;
+        unsafe { libc::write(self.0.as_raw_fd(), (&one as *const u64).cast(), 8) };
+    }
+}
+
+impl<T> AsRawFd for Worker<T> {
+    fn as_raw_fd(&self) -> RawFd {
+        self.eventfd.as_raw_fd()
+    }
+}
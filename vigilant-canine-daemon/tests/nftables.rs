@@ -0,0 +1,82 @@
+//! Blocking through nf_tables against a real kernel.
+//!
+//! This changes the firewall of the network namespace it runs in, so it only runs when
+//! `VIGILANT_CANINE_NETNS_TEST` is set, and should then be run in a namespace of its own:
+//!
+//! ```sh
+//! VIGILANT_CANINE_NETNS_TEST=1 unshare -rn cargo test --offline --test nftables
+//! ```
+
+use std::io;
+use std::net::{IpAddr, Ipv4Addr, UdpSocket};
+use std::os::fd::AsRawFd;
+use std::time::Duration;
+
+use vigilant_canine_daemon::ips::nftables::NftBlocker;
+
+const SOURCE: Ipv4Addr = Ipv4Addr::new(127, 0, 0, 2);
+
+#[test]
+fn blocked_addresses_are_dropped() {
+    if std::env::var_os("VIGILANT_CANINE_NETNS_TEST").is_none() {
+        eprintln!("skipped: set VIGILANT_CANINE_NETNS_TEST and run in a network namespace of its own");
+        return;
+    }
+    loopback_up().expect("bring up lo");
+    let mut blocker = NftBlocker::open().expect("set up the table");
+    assert!(delivered().unwrap());
+
+    blocker.block(IpAddr::V4(SOURCE), Duration::from_secs(60));
+    blocker.block("2001:db8::1".parse().unwrap(), Duration::from_secs(60));
+    blocker.flush().unwrap();
+    assert_eq!(blocker.pending(), 0);
+    while blocker.unacknowledged() > 0 {
+        readable(&blocker, Duration::from_secs(2)).unwrap();
+        blocker.acknowledge().unwrap();
+    }
+    assert!(!delivered().unwrap());
+
+    // Taking over the table on restart keeps what was blocked.
+    drop(blocker);
+    NftBlocker::open().expect("take over the table");
+    assert!(!delivered().unwrap());
+}
+
+/// Whether a datagram from `SOURCE` reaches a socket on the loopback address.
+fn delivered() -> io::Result<bool> {
+    let receiver = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0))?;
+    receiver.set_read_timeout(Some(Duration::from_millis(200)))?;
+    let sender = UdpSocket::bind((SOURCE, 0))?;
+    sender.send_to(b"ping", receiver.local_addr()?)?;
+    match receiver.recv(&mut [0; 8]) {
+        Ok(_) => Ok(true),
+        Err(err) if matches!(err.kind(), io::ErrorKind::WouldBlock | io::ErrorKind::TimedOut) => Ok(false),
+        Err(err) => Err(err),
+    }
+}
+
+fn readable(fd: &impl AsRawFd, timeout: Duration) -> io::Result<()> {
+    let mut pollfd = libc::pollfd { fd: fd.as_raw_fd(), events: libc::POLLIN, revents: 0 };
+    match unsafe { libc::poll(&mut pollfd, 1, timeout.as_millis() as libc::c_int) } {
+        1 => Ok(()),
+        0 => Err(io::Error::new(io::ErrorKind::TimedOut, "no acknowledgement")),
+        _ => Err(io::Error::last_os_error()),
+    }
+}
+
+/// A new network namespace starts with `lo` down.
+fn loopback_up() -> io::Result<()> {
+    let socket = UdpSocket::bind((Ipv4Addr::UNSPECIFIED, 0)).or_else(|_| UdpSocket::bind("[::]:0"))?;
+    let mut request: libc::ifreq = unsafe { std::mem::zeroed() };
+    for (dst, src) in request.ifr_name.iter_mut().zip(b"lo") {
+        *dst = *src as libc::c_char;
+    }
+    if unsafe { libc::ioctl(socket.as_raw_fd(), libc::SIOCGIFFLAGS, &mut request) } < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    unsafe { request.ifr_ifru.ifru_flags |= libc::IFF_UP as libc::c_short };
+    if unsafe { libc::ioctl(socket.as_raw_fd(), libc::SIOCSIFFLAGS, &request) } < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
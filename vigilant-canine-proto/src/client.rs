@@ -0,0 +1,47 @@
+//! Blocking client for one request at a time.
+
+use std::io::{self, Read, Write};
+use std::os::unix::net::UnixStream;
+use std::path::Path;
+use std::time::Duration;
+
+use crate::wire::decode_frame;
+use crate::{Request, Response};
+
+/// How long the daemon gets to answer before the client gives up.
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+pub struct Client {
+    stream: UnixStream,
+    buf: Vec<u8>,
+}
+
+impl Client {
+    pub fn connect(path: &Path) -> io::Result<Client> {
+        let stream = UnixStream::connect(path)?;
+        stream.set_read_timeout(Some(TIMEOUT))?;
+        stream.set_write_timeout(Some(TIMEOUT))?;
+        Ok(Client { stream, buf: Vec::new() })
+    }
+
+    /// Sends `request` and waits for the daemon's response.
+    pub fn request(&mut self, request: &Request) -> io::Result<Response> {
+        self.buf.clear();
+        request.encode(&mut self.buf);
+        self.stream.write_all(&self.buf)?;
+
+        self.buf.clear();
+        let mut chunk = [0; 64 * 1024];
+        loop {
+            if let Some((body, _)) = decode_frame(&self.buf)? {
+                return Response::decode(body);
+            }
+            match self.stream.read(&mut chunk) {
+                Ok(0) => return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "daemon closed the connection")),
+                Ok(n) => self.buf.extend_from_slice(&chunk[..n]),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => {}
+                Err(err) => return Err(err),
+            }
+        }
+    }
+}
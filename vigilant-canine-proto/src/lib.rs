@@ -0,0 +1,311 @@
+//! The protocol between the Vigilant Canine daemon and its clients (CLI, GUI).
+//!
+//! Clients connect to a Unix socket and exchange frames: a little-endian `u32` body length
+//! followed by the body, whose first byte says which message it is. Fields are fixed-width
+//! integers and length-prefixed strings, so neither side needs a parser beyond reading them
+//! in order, and a reply of thousands of alerts is encoded straight into one buffer.
+
+mod client;
+mod wire;
+
+use std::fmt;
+use std::io;
+use std::net::IpAddr;
+
+pub use client::Client;
+pub use wire::{decode_frame, MAX_FRAME};
+
+/// Where the daemon listens.
+pub const DEFAULT_SOCKET_PATH: &str = "/run/vigilant-canine/daemon.sock";
+
+/// Most alerts the daemon sends in one reply, whatever the request's limit, so a reply stays
+/// well within [`MAX_FRAME`] and takes the daemon a bounded time to build.
+pub const MAX_ALERTS: u32 = 10_000;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum Severity {
+    Info,
+    Low,
+    Medium,
+    High,
+    Critical,
+}
+
+impl Severity {
+    pub fn from_name(name: &str) -> Option<Severity> {
+        match name {
+            "info" => Some(Severity::Info),
+            "low" => Some(Severity::Low),
+            "medium" => Some(Severity::Medium),
+            "high" => Some(Severity::High),
+            "critical" => Some(Severity::Critical),
+            _ => None,
+        }
+    }
+
+    pub fn name(self) -> &'static str {
+        match self {
+            Severity::Info => "info",
+            Severity::Low => "low",
+            Severity::Medium => "medium",
+            Severity::High => "high",
+            Severity::Critical => "critical",
+        }
+    }
+
+    fn from_u8(value: u8) -> Option<Severity> {
+        [Severity::Info, Severity::Low, Severity::Medium, Severity::High, Severity::Critical].get(value as usize).copied()
+    }
+}
+
+impl fmt::Display for Severity {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.pad(self.name())
+    }
+}
+
+/// Something the daemon reported.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Alert {
+    /// Milliseconds since the Unix epoch; for a repeated alert, when it was first raised.
+    pub time_ms: u64,
+    pub severity: Severity,
+    /// What raised it: a rule id, `brute-force`, `fim`, ...
+    pub source: String,
+    /// The remote address involved, if any.
+    pub addr: Option<IpAddr>,
+    /// For a repeated alert, the first occurrence's message.
+    pub message: String,
+    /// How many times it was raised; more than one when the daemon collapsed repeats into
+    /// this record.
+    pub count: u64,
+    /// When it was last raised, the same as `time_ms` unless it was repeated.
+    pub last_ms: u64,
+}
+
+impl Alert {
+    /// An alert raised once, at `time_ms`.
+    pub fn new(time_ms: u64, severity: Severity, source: String, addr: Option<IpAddr>, message: String) -> Alert {
+        Alert { time_ms, severity, source, addr, message, count: 1, last_ms: time_ms }
+    }
+
+    /// Appends the alert in its wire encoding, which is also how the daemon stores it.
+    pub fn encode(&self, out: &mut Vec<u8>) {
+        wire::put_alert(out, self);
+    }
+
+    /// The length of the wire encoding.
+    pub fn encoded_len(&self) -> usize {
+        wire::alert_len(self)
+    }
+
+    /// Decodes what [`encode`](Alert::encode) produced.
+    pub fn decode(data: &[u8]) -> io::Result<Alert> {
+        let mut r = wire::Reader::new(data);
+        let alert = r.alert()?;
+        r.finish()?;
+        Ok(alert)
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Request {
+    Status,
+    /// The newest alerts, at most `limit` of them (and at most [`MAX_ALERTS`]).
+    RecentAlerts { limit: u32 },
+    /// The newest alerts raised at or after `since_ms` (Unix milliseconds), at most `limit`
+    /// (and at most [`MAX_ALERTS`]).
+    AlertsSince { since_ms: u64, limit: u32 },
+    /// Reload rules and reputation lists, as on SIGHUP.
+    Reload,
+    Metrics,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Status {
+    pub version: String,
+    pub uptime_secs: u64,
+    pub baseline_files: u64,
+    pub rules: u32,
+    pub blocking: bool,
+    /// Alerts in the daemon's history.
+    pub alerts: u64,
+    /// Listening sockets and established TCP connections on the host, as of the last scan.
+    pub listeners: u32,
+    pub connections: u32,
+}
+
+/// Where the daemon's time has gone since it started.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Metrics {
+    pub uptime_secs: u64,
+    /// CPU time of the whole process, in microseconds.
+    pub cpu_user_us: u64,
+    pub cpu_system_us: u64,
+    /// Peak resident memory, in KiB.
+    pub max_rss_kib: u64,
+    /// Times the event loop woke up.
+    pub wakeups: u64,
+    pub counters: Vec<Counter>,
+    /// Nanoseconds each pipeline stage took per item (a line, an event, an alert).
+    pub stages: Vec<Distribution>,
+    /// How many items a source had waiting when the event loop got to it.
+    pub queues: Vec<Distribution>,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Counter {
+    pub name: String,
+    pub value: u64,
+}
+
+/// A summary of the values recorded for one thing. Percentiles are approximate, within a few
+/// percent of the true value.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Distribution {
+    pub name: String,
+    pub count: u64,
+    pub sum: u64,
+    pub p50: u64,
+    pub p90: u64,
+    pub p99: u64,
+    pub max: u64,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Response {
+    Status(Status),
+    /// Newest first. `limit` is the limit the daemon applied: lower than the request's when it
+    /// asked for more than [`MAX_ALERTS`] or the alerts would not fit in a frame.
+    Alerts { alerts: Vec<Alert>, limit: u32 },
+    /// A reload was started; the daemon logs how it went.
+    Reloading,
+    Metrics(Metrics),
+    Error(String),
+}
+
+const REQUEST_STATUS: u8 = 1;
+const REQUEST_RECENT_ALERTS: u8 = 2;
+const REQUEST_ALERTS_SINCE: u8 = 3;
+const REQUEST_RELOAD: u8 = 4;
+const REQUEST_METRICS: u8 = 5;
+const RESPONSE_STATUS: u8 = 1;
+const RESPONSE_ALERTS: u8 = 2;
+const RESPONSE_ERROR: u8 = 3;
+const RESPONSE_RELOADING: u8 = 4;
+const RESPONSE_METRICS: u8 = 5;
+
+impl Request {
+    /// Appends this request, framed, to `out`.
+    pub fn encode(&self, out: &mut Vec<u8>) {
+        let frame = wire::begin_frame(out);
+        match self {
+            Request::Status => out.push(REQUEST_STATUS),
+            Request::RecentAlerts { limit } => {
+                out.push(REQUEST_RECENT_ALERTS);
+                out.extend_from_slice(&limit.to_le_bytes());
+            }
+            Request::AlertsSince { since_ms, limit } => {
+                out.push(REQUEST_ALERTS_SINCE);
+                out.extend_from_slice(&since_ms.to_le_bytes());
+                out.extend_from_slice(&limit.to_le_bytes());
+            }
+            Request::Reload => out.push(REQUEST_RELOAD),
+            Request::Metrics => out.push(REQUEST_METRICS),
+        }
+        wire::end_frame(out, frame);
+    }
+
+    /// Decodes a frame body.
+    pub fn decode(body: &[u8]) -> io::Result<Request> {
+        let mut r = wire::Reader::new(body);
+        let request = match r.u8()? {
+            REQUEST_STATUS => Request::Status,
+            REQUEST_RECENT_ALERTS => Request::RecentAlerts { limit: r.u32()? },
+            REQUEST_ALERTS_SINCE => Request::AlertsSince { since_ms: r.u64()?, limit: r.u32()? },
+            REQUEST_RELOAD => Request::Reload,
+            REQUEST_METRICS => Request::Metrics,
+            kind => return Err(wire::invalid(format!("unknown request {kind}"))),
+        };
+        r.finish()?;
+        Ok(request)
+    }
+}
+
+impl Response {
+    /// Appends this response, framed, to `out`.
+    pub fn encode(&self, out: &mut Vec<u8>) {
+        let frame = wire::begin_frame(out);
+        match self {
+            Response::Status(status) => {
+                out.push(RESPONSE_STATUS);
+                wire::put_str(out, &status.version);
+                out.extend_from_slice(&status.uptime_secs.to_le_bytes());
+                out.extend_from_slice(&status.baseline_files.to_le_bytes());
+                out.extend_from_slice(&status.rules.to_le_bytes());
+                out.push(status.blocking as u8);
+                out.extend_from_slice(&status.alerts.to_le_bytes());
+                out.extend_from_slice(&status.listeners.to_le_bytes());
+                out.extend_from_slice(&status.connections.to_le_bytes());
+            }
+            Response::Alerts { alerts, limit } => {
+                out.push(RESPONSE_ALERTS);
+                out.extend_from_slice(&limit.to_le_bytes());
+                wire::put_alerts(out, alerts);
+            }
+            Response::Reloading => out.push(RESPONSE_RELOADING),
+            Response::Metrics(metrics) => {
+                out.push(RESPONSE_METRICS);
+                out.extend_from_slice(&metrics.uptime_secs.to_le_bytes());
+                out.extend_from_slice(&metrics.cpu_user_us.to_le_bytes());
+                out.extend_from_slice(&metrics.cpu_system_us.to_le_bytes());
+                out.extend_from_slice(&metrics.max_rss_kib.to_le_bytes());
+                out.extend_from_slice(&metrics.wakeups.to_le_bytes());
+                wire::put_counters(out, &metrics.counters);
+                wire::put_distributions(out, &metrics.stages);
+                wire::put_distributions(out, &metrics.queues);
+            }
+            Response::Error(message) => {
+                out.push(RESPONSE_ERROR);
+                wire::put_str(out, message);
+            }
+        }
+        wire::end_frame(out, frame);
+    }
+
+    /// Decodes a frame body.
+    pub fn decode(body: &[u8]) -> io::Result<Response> {
+        let mut r = wire::Reader::new(body);
+        let response = match r.u8()? {
+            RESPONSE_STATUS => Response::Status(Status {
+                version: r.string()?,
+                uptime_secs: r.u64()?,
+                baseline_files: r.u64()?,
+                rules: r.u32()?,
+                blocking: r.u8()? != 0,
+                alerts: r.u64()?,
+                listeners: r.u32()?,
+                connections: r.u32()?,
+            }),
+            RESPONSE_ALERTS => {
+                let limit = r.u32()?;
+                Response::Alerts { alerts: r.alerts()?, limit }
+            }
+            RESPONSE_ERROR => Response::Error(r.string()?),
+            RESPONSE_RELOADING => Response::Reloading,
+            RESPONSE_METRICS => Response::Metrics(Metrics {
+                uptime_secs: r.u64()?,
+                cpu_user_us: r.u64()?,
+                cpu_system_us: r.u64()?,
+                max_rss_kib: r.u64()?,
+                wakeups: r.u64()?,
+                counters: r.counters()?,
+                stages: r.distributions()?,
+                queues: r.distributions()?,
+            }),
+            kind => return Err(wire::invalid(format!("unknown response {kind}"))),
+        };
+        r.finish()?;
+        Ok(response)
+    }
+}
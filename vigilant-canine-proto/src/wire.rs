@@ -0,0 +1,307 @@
+//! Framing and field encoding.
+
+use std::io;
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr};
+
+use crate::{Alert, Counter, Distribution, Severity};
+
+/// Largest frame body either side accepts, so a corrupt length cannot make a peer buffer
+/// without bound.
+pub const MAX_FRAME: usize = 16 * 1024 * 1024;
+
+const ADDR_NONE: u8 = 0;
+const ADDR_V4: u8 = 4;
+const ADDR_V6: u8 = 6;
+
+/// Set in an alert's severity byte when the alert was repeated, in which case its count and
+/// last time follow the message. Alerts raised once, which is most of them and everything
+/// stored before repeats were collapsed, are encoded without them.
+const SEVERITY_REPEATED: u8 = 0x80;
+
+pub(crate) fn invalid(message: String) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+/// Splits the first frame off `buf`, returning its body and the number of bytes it occupied,
+/// or `None` if the frame is not complete yet.
+pub fn decode_frame(buf: &[u8]) -> io::Result<Option<(&[u8], usize)>> {
+    let Some(header) = buf.get(..4) else {
+        return Ok(None);
+    };
+    let len = u32::from_le_bytes(header.try_into().unwrap()) as usize;
+    if len > MAX_FRAME {
+        return Err(invalid(format!("frame of {len} bytes exceeds the limit")));
+    }
+    Ok(buf.get(4..4 + len).map(|body| (body, 4 + len)))
+}
+
+pub(crate) fn begin_frame(out: &mut Vec<u8>) -> usize {
+    let start = out.len();
+    out.extend_from_slice(&[0; 4]);
+    start
+}
+
+pub(crate) fn end_frame(out: &mut [u8], start: usize) {
+    let len = (out.len() - start - 4) as u32;
+    out[start..start + 4].copy_from_slice(&len.to_le_bytes());
+}
+
+pub(crate) fn put_str(out: &mut Vec<u8>, value: &str) {
+    out.extend_from_slice(&(value.len() as u32).to_le_bytes());
+    out.extend_from_slice(value.as_bytes());
+}
+
+pub(crate) fn put_alerts(out: &mut Vec<u8>, alerts: &[Alert]) {
+    out.extend_from_slice(&(alerts.len() as u32).to_le_bytes());
+    for alert in alerts {
+        put_alert(out, alert);
+    }
+}
+
+pub(crate) fn put_alert(out: &mut Vec<u8>, alert: &Alert) {
+    out.extend_from_slice(&alert.time_ms.to_le_bytes());
+    let repeated = alert.count != 1 || alert.last_ms != alert.time_ms;
+    out.push(alert.severity as u8 | if repeated { SEVERITY_REPEATED } else { 0 });
+    put_str(out, &alert.source);
+    match alert.addr {
+        None => out.push(ADDR_NONE),
+        Some(IpAddr::V4(addr)) => {
+            out.push(ADDR_V4);
+            out.extend_from_slice(&addr.octets());
+        }
+        Some(IpAddr::V6(addr)) => {
+            out.push(ADDR_V6);
+            out.extend_from_slice(&addr.octets());
+        }
+    }
+    put_str(out, &alert.message);
+    if repeated {
+        out.extend_from_slice(&alert.count.to_le_bytes());
+        out.extend_from_slice(&alert.last_ms.to_le_bytes());
+    }
+}
+
+/// The number of bytes [`put_alert`] appends.
+pub(crate) fn alert_len(alert: &Alert) -> usize {
+    let repeated = alert.count != 1 || alert.last_ms != alert.time_ms;
+    let addr = match alert.addr {
+        None => 0,
+        Some(IpAddr::V4(_)) => 4,
+        Some(IpAddr::V6(_)) => 16,
+    };
+    8 + 1 + 4 + alert.source.len() + 1 + addr + 4 + alert.message.len() + if repeated { 16 } else { 0 }
+}
+
+pub(crate) fn put_counters(out: &mut Vec<u8>, counters: &[Counter]) {
+    out.extend_from_slice(&(counters.len() as u32).to_le_bytes());
+    for counter in counters {
+        put_str(out, &counter.name);
+        out.extend_from_slice(&counter.value.to_le_bytes());
+    }
+}
+
+pub(crate) fn put_distributions(out: &mut Vec<u8>, distributions: &[Distribution]) {
+    out.extend_from_slice(&(distributions.len() as u32).to_le_bytes());
+    for distribution in distributions {
+        put_str(out, &distribution.name);
+        for value in [distribution.count, distribution.sum, distribution.p50, distribution.p90, distribution.p99, distribution.max] {
+            out.extend_from_slice(&value.to_le_bytes());
+        }
+    }
+}
+
+/// Reads fields from a frame body in order.
+pub(crate) struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    pub(crate) fn new(data: &'a [u8]) -> Reader<'a> {
+        Reader { data }
+    }
+
+    fn take(&mut self, len: usize) -> io::Result<&'a [u8]> {
+        if self.data.len() < len {
+            return Err(invalid("truncated message".into()));
+        }
+        let (head, rest) = self.data.split_at(len);
+        self.data = rest;
+        Ok(head)
+    }
+
+    fn array<const N: usize>(&mut self) -> io::Result<[u8; N]> {
+        Ok(self.take(N)?.try_into().unwrap())
+    }
+
+    pub(crate) fn u8(&mut self) -> io::Result<u8> {
+        Ok(self.take(1)?[0])
+    }
+
+    pub(crate) fn u32(&mut self) -> io::Result<u32> {
+        self.array().map(u32::from_le_bytes)
+    }
+
+    pub(crate) fn u64(&mut self) -> io::Result<u64> {
+        self.array().map(u64::from_le_bytes)
+    }
+
+    pub(crate) fn string(&mut self) -> io::Result<String> {
+        let len = self.u32()? as usize;
+        let bytes = self.take(len)?;
+        String::from_utf8(bytes.to_vec()).map_err(|_| invalid("string is not UTF-8".into()))
+    }
+
+    pub(crate) fn alerts(&mut self) -> io::Result<Vec<Alert>> {
+        let count = self.u32()? as usize;
+        // Every alert takes at least 18 bytes, which bounds what a bogus count can reserve.
+        let mut alerts = Vec::with_capacity(count.min(self.data.len() / 18));
+        for _ in 0..count {
+            alerts.push(self.alert()?);
+        }
+        Ok(alerts)
+    }
+
+    pub(crate) fn alert(&mut self) -> io::Result<Alert> {
+        let time_ms = self.u64()?;
+        let severity = self.u8()?;
+        let repeated = severity & SEVERITY_REPEATED != 0;
+        let severity = severity & !SEVERITY_REPEATED;
+        let severity = Severity::from_u8(severity).ok_or_else(|| invalid(format!("unknown severity {severity}")))?;
+        let source = self.string()?;
+        let addr = match self.u8()? {
+            ADDR_NONE => None,
+            ADDR_V4 => Some(IpAddr::V4(Ipv4Addr::from(self.array::<4>()?))),
+            ADDR_V6 => Some(IpAddr::V6(Ipv6Addr::from(self.array::<16>()?))),
+            tag => return Err(invalid(format!("unknown address tag {tag}"))),
+        };
+        let message = self.string()?;
+        let (count, last_ms) = if repeated { (self.u64()?, self.u64()?) } else { (1, time_ms) };
+        Ok(Alert { time_ms, severity, source, addr, message, count, last_ms })
+    }
+
+    pub(crate) fn counters(&mut self) -> io::Result<Vec<Counter>> {
+        let count = self.u32()? as usize;
+        let mut counters = Vec::with_capacity(count.min(self.data.len() / 12));
+        for _ in 0..count {
+            counters.push(Counter { name: self.string()?, value: self.u64()? });
+        }
+        Ok(counters)
+    }
+
+    pub(crate) fn distributions(&mut self) -> io::Result<Vec<Distribution>> {
+        let count = self.u32()? as usize;
+        let mut distributions = Vec::with_capacity(count.min(self.data.len() / 52));
+        for _ in 0..count {
+            distributions.push(Distribution {
+                name: self.string()?,
+                count: self.u64()?,
+                sum: self.u64()?,
+                p50: self.u64()?,
+                p90: self.u64()?,
+                p99: self.u64()?,
+                max: self.u64()?,
+            });
+        }
+        Ok(distributions)
+    }
+
+    /// Fails if anything is left over, which means the peer speaks a different version.
+    pub(crate) fn finish(&self) -> io::Result<()> {
+        if self.data.is_empty() {
+            Ok(())
+        } else {
+            Err(invalid("trailing bytes in message".into()))
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io;
+
+    use super::{decode_frame, MAX_FRAME};
+    use crate::{Alert, Request, Response, Severity};
+
+    fn alerts() -> Vec<Alert> {
+        let mut repeated = Alert::new(1_000, Severity::High, "brute-force".into(), Some("2001:db8::1".parse().unwrap()), "5 failed logins".into());
+        repeated.count = 42;
+        repeated.last_ms = 61_000;
+        vec![
+            Alert::new(2_000, Severity::Low, "sshd-invalid-user".into(), Some("192.0.2.7".parse().unwrap()), "Invalid user ä".into()),
+            repeated,
+            Alert::new(3_000, Severity::Critical, "fim".into(), None, String::new()),
+        ]
+    }
+
+    /// Splits the one frame in `buf` off, checking nothing follows it.
+    fn body(buf: &[u8]) -> &[u8] {
+        let (body, used) = decode_frame(buf).unwrap().unwrap();
+        assert_eq!(used, buf.len());
+        body
+    }
+
+    #[test]
+    fn alerts_round_trip() {
+        for alert in alerts() {
+            let mut out = Vec::new();
+            alert.encode(&mut out);
+            assert_eq!(out.len(), alert.encoded_len());
+            assert_eq!(Alert::decode(&out).unwrap(), alert);
+        }
+    }
+
+    #[test]
+    fn messages_round_trip() {
+        let requests = [
+            Request::Status,
+            Request::RecentAlerts { limit: 20 },
+            Request::AlertsSince { since_ms: u64::MAX, limit: 0 },
+            Request::Reload,
+            Request::Metrics,
+        ];
+        for request in requests {
+            let mut out = Vec::new();
+            request.encode(&mut out);
+            assert_eq!(Request::decode(body(&out)).unwrap(), request);
+        }
+        let responses = [Response::Alerts { alerts: alerts(), limit: 3 }, Response::Reloading, Response::Error("no".into())];
+        for response in responses {
+            let mut out = Vec::new();
+            response.encode(&mut out);
+            assert_eq!(Response::decode(body(&out)).unwrap(), response);
+        }
+    }
+
+    #[test]
+    fn partial_frames_wait_for_the_rest() {
+        let mut out = Vec::new();
+        Request::AlertsSince { since_ms: 5, limit: 6 }.encode(&mut out);
+        Request::Status.encode(&mut out);
+        let first = 4 + 1 + 8 + 4;
+        for len in 0..first {
+            assert_eq!(decode_frame(&out[..len]).unwrap(), None);
+        }
+        let (_, used) = decode_frame(&out).unwrap().unwrap();
+        assert_eq!(used, first);
+        assert_eq!(Request::decode(body(&out[used..])).unwrap(), Request::Status);
+    }
+
+    #[test]
+    fn oversized_frames_are_refused() {
+        let header = (MAX_FRAME as u32 + 1).to_le_bytes();
+        assert_eq!(decode_frame(&header).unwrap_err().kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[test]
+    fn truncated_bodies_are_refused() {
+        let mut out = Vec::new();
+        Response::Alerts { alerts: alerts(), limit: 3 }.encode(&mut out);
+        let body = body(&out);
+        for len in 0..body.len() {
+            assert_eq!(Response::decode(&body[..len]).unwrap_err().kind(), io::ErrorKind::InvalidData);
+        }
+        let mut trailing = body.to_vec();
+        trailing.push(0);
+        assert!(Response::decode(&trailing).is_err());
+    }
+}
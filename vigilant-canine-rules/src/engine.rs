@@ -0,0 +1,327 @@
+//! Compiled rule matching.
+//!
+//! Every rule with a required literal contributes it to one Aho-Corasick automaton, so a single
+//! pass over the line finds which rules could possibly match; only those run their regex. Rules
+//! without a usable literal are combined into one `RegexSet` and tested in a single pass as well.
+//! Per-line cost therefore depends on the line and the few candidate rules, not on how many rules
+//! are loaded.
+//!
+//! A rule set restored from a snapshot builds each regex the first time a line reaches it, so
+//! rules that never fire never cost a regex compile.
+
+use std::ops::Range;
+use std::sync::OnceLock;
+
+use aho_corasick::{AhoCorasick, MatchKind};
+use regex::bytes::{CaptureLocations, Regex, RegexSet};
+use regex_syntax::hir::{Hir, HirKind};
+
+use crate::{Error, Rule};
+
+/// Literals shorter than this match too many lines to be worth prefiltering on.
+const MIN_LITERAL_LEN: usize = 3;
+
+/// A rule that matched a line. Capture ranges index into the scanned line.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct RuleMatch {
+    pub rule: usize,
+    pub src: Option<Range<usize>>,
+    pub user: Option<Range<usize>>,
+}
+
+pub(crate) struct Compiled {
+    /// Empty until first use in a rule set restored from a snapshot; `None` if the pattern does
+    /// not compile after all, which disables the rule.
+    pub(crate) regex: OnceLock<Option<Regex>>,
+    pub(crate) src: Option<usize>,
+    pub(crate) user: Option<usize>,
+    /// What the prefilter looks for, if the rule has a usable literal.
+    pub(crate) literal: Option<String>,
+}
+
+pub struct RuleSet {
+    pub(crate) rules: Vec<Rule>,
+    pub(crate) compiled: Vec<Compiled>,
+    prefilter: AhoCorasick,
+    /// Prefilter pattern index to the rules requiring that literal.
+    literal_rules: Vec<Vec<usize>>,
+    /// Rules without a literal, in `unfiltered_set` order.
+    unfiltered: Vec<usize>,
+    unfiltered_set: OnceLock<Option<RegexSet>>,
+}
+
+/// Per-thread scratch space for [`RuleSet::scan`], so scanning does not allocate.
+pub struct Scanner {
+    candidate: Vec<bool>,
+    candidates: Vec<usize>,
+    unfiltered: Vec<bool>,
+    locations: Vec<Option<CaptureLocations>>,
+}
+
+impl RuleSet {
+    pub fn compile(rules: Vec<Rule>) -> Result<RuleSet, Error> {
+        let mut compiled = Vec::with_capacity(rules.len());
+        for rule in &rules {
+            let regex = Regex::new(&rule.pattern).map_err(|err| Error::Pattern { rule: rule.id.clone(), message: err.to_string() })?;
+            let group = |name| regex.capture_names().position(|n| n == Some(name));
+            let (src, user) = (group("src"), group("user"));
+            let literal = rule.literal.clone().or_else(|| required_literal(&rule.pattern));
+            let literal = literal.filter(|literal| literal.len() >= MIN_LITERAL_LEN);
+            compiled.push(Compiled { regex: OnceLock::from(Some(regex)), src, user, literal });
+        }
+        let set = RuleSet::assemble(rules, compiled)?;
+        let unfiltered_set = RegexSet::new(set.unfiltered.iter().map(|&index| &set.rules[index].pattern))
+            .map_err(|err| Error::Pattern { rule: "<set>".into(), message: err.to_string() })?;
+        set.unfiltered_set.get_or_init(|| Some(unfiltered_set));
+        Ok(set)
+    }
+
+    /// Builds the prefilter over rules whose regexes may not have been compiled yet.
+    pub(crate) fn assemble(rules: Vec<Rule>, compiled: Vec<Compiled>) -> Result<RuleSet, Error> {
+        let mut literals: Vec<&str> = Vec::new();
+        let mut literal_rules: Vec<Vec<usize>> = Vec::new();
+        let mut unfiltered = Vec::new();
+        for (index, compiled) in compiled.iter().enumerate() {
+            match &compiled.literal {
+                Some(literal) => match literals.iter().position(|known| known == literal) {
+                    Some(pattern) => literal_rules[pattern].push(index),
+                    None => {
+                        literals.push(literal);
+                        literal_rules.push(vec![index]);
+                    }
+                },
+                None => unfiltered.push(index),
+            }
+        }
+        let prefilter = AhoCorasick::builder()
+            .match_kind(MatchKind::Standard)
+            .build(&literals)
+            .map_err(|err| Error::Pattern { rule: "<prefilter>".into(), message: err.to_string() })?;
+        Ok(RuleSet { rules, compiled, prefilter, literal_rules, unfiltered, unfiltered_set: OnceLock::new() })
+    }
+
+    pub fn rules(&self) -> &[Rule] {
+        &self.rules
+    }
+
+    pub fn scanner(&self) -> Scanner {
+        Scanner {
+            candidate: vec![false; self.rules.len()],
+            candidates: Vec::new(),
+            unfiltered: vec![false; self.unfiltered.len()],
+            locations: self.compiled.iter().map(|_| None).collect(),
+        }
+    }
+
+    /// Appends every rule matching `line` (logged by `program`, if known) to `out`, in rule order.
+    pub fn scan(&self, scanner: &mut Scanner, program: Option<&[u8]>, line: &[u8], out: &mut Vec<RuleMatch>) {
+        for found in self.prefilter.find_overlapping_iter(line) {
+            for &rule in &self.literal_rules[found.pattern().as_usize()] {
+                if !scanner.candidate[rule] {
+                    scanner.candidate[rule] = true;
+                    scanner.candidates.push(rule);
+                }
+            }
+        }
+        if let Some(unfiltered_set) = self.unfiltered_set().filter(|_| !self.unfiltered.is_empty()) {
+            scanner.unfiltered.iter_mut().for_each(|hit| *hit = false);
+            if unfiltered_set.matches_read_at(&mut scanner.unfiltered, line, 0) {
+                for (slot, &rule) in self.unfiltered.iter().enumerate() {
+                    if scanner.unfiltered[slot] {
+                        scanner.candidate[rule] = true;
+                        scanner.candidates.push(rule);
+                    }
+                }
+            }
+        }
+        if scanner.candidates.is_empty() {
+            return;
+        }
+        scanner.candidates.sort_unstable();
+        for &rule in &scanner.candidates {
+            scanner.candidate[rule] = false;
+            if let Some(wanted) = &self.rules[rule].program {
+                if !program.is_some_and(|program| wanted.split(' ').any(|wanted| wanted.as_bytes() == program)) {
+                    continue;
+                }
+            }
+            let compiled = &self.compiled[rule];
+            let Some(regex) = self.regex(rule) else {
+                continue;
+            };
+            let locations = scanner.locations[rule].get_or_insert_with(|| regex.capture_locations());
+            if regex.captures_read(locations, line).is_some() {
+                let group = |index: Option<usize>| index.and_then(|index| locations.get(index)).map(|(start, end)| start..end);
+                out.push(RuleMatch { rule, src: group(compiled.src), user: group(compiled.user) });
+            }
+        }
+        scanner.candidates.clear();
+    }
+
+    /// Builds every regex that has not been built yet, so scanning never has to. For a set
+    /// restored from a snapshot on one thread and then handed to the one that scans.
+    pub fn prepare(&self) {
+        (0..self.rules.len()).for_each(|rule| {
+            self.regex(rule);
+        });
+        self.unfiltered_set();
+    }
+
+    fn regex(&self, rule: usize) -> Option<&Regex> {
+        self.compiled[rule].regex.get_or_init(|| Regex::new(&self.rules[rule].pattern).ok()).as_ref()
+    }
+
+    fn unfiltered_set(&self) -> Option<&RegexSet> {
+        let build = || RegexSet::new(self.unfiltered.iter().map(|&index| &self.rules[index].pattern)).ok();
+        self.unfiltered_set.get_or_init(build).as_ref()
+    }
+}
+
+/// Finds the longest literal that every match of `pattern` must contain, by looking at the
+/// top-level concatenation (literals inside alternations or repetitions are not required).
+fn required_literal(pattern: &str) -> Option<String> {
+    let hir = regex_syntax::parse(pattern).ok()?;
+    let literal = |hir: &Hir| -> Option<Vec<u8>> {
+        match hir.kind() {
+            HirKind::Literal(literal) => Some(literal.0.to_vec()),
+            HirKind::Capture(capture) => match capture.sub.kind() {
+                HirKind::Literal(literal) => Some(literal.0.to_vec()),
+                _ => None,
+            },
+            _ => None,
+        }
+    };
+    let longest = match hir.kind() {
+        HirKind::Concat(items) => items.iter().filter_map(literal).max_by_key(Vec::len),
+        _ => literal(&hir),
+    };
+    longest.and_then(|bytes| String::from_utf8(bytes).ok())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{required_literal, RuleSet};
+    use crate::{parse, DEFAULT_RULES};
+
+    /// Every rule matching `line`, as (rule id, src, user).
+    fn matches<'a>(set: &RuleSet, program: Option<&str>, line: &'a str) -> Vec<(String, Option<&'a str>, Option<&'a str>)> {
+        let mut scanner = set.scanner();
+        let mut out = Vec::new();
+        set.scan(&mut scanner, program.map(str::as_bytes), line.as_bytes(), &mut out);
+        let text = |range: Option<std::ops::Range<usize>>| range.map(|range| &line[range]);
+        out.into_iter().map(|found| (set.rules()[found.rule].id.clone(), text(found.src), text(found.user))).collect()
+    }
+
+    /// The default rules as shipped, and again with every literal disabled so that they all go
+    /// through the `RegexSet` instead of the prefilter.
+    fn default_sets() -> [RuleSet; 2] {
+        let filtered = RuleSet::compile(parse(DEFAULT_RULES).unwrap()).unwrap();
+        let mut rules = parse(DEFAULT_RULES).unwrap();
+        rules.iter_mut().for_each(|rule| rule.literal = Some(String::new()));
+        let unfiltered = RuleSet::compile(rules).unwrap();
+        assert!(unfiltered.compiled.iter().all(|compiled| compiled.literal.is_none()));
+        [filtered, unfiltered]
+    }
+
+    #[test]
+    fn default_rules_match_real_lines() {
+        let cases = [
+            ("sshd", "Failed password for invalid user admin from 203.0.113.5 port 52814 ssh2", "sshd-failed-password", Some("203.0.113.5"), Some("admin")),
+            ("sshd", "Failed publickey for git from 2001:db8::7 port 40022 ssh2: ED25519 SHA256:abc", "sshd-failed-password", Some("2001:db8::7"), Some("git")),
+            ("sshd", "Invalid user oracle from 198.51.100.23 port 41234", "sshd-invalid-user", Some("198.51.100.23"), Some("oracle")),
+            ("sshd", "error: maximum authentication attempts exceeded for root from 203.0.113.9 port 22 ssh2 [preauth]", "sshd-max-auth-tries", Some("203.0.113.9"), Some("root")),
+            ("sshd", "Connection closed by authenticating user bob 203.0.113.10 port 3022 [preauth]", "sshd-preauth-disconnect", Some("203.0.113.10"), Some("bob")),
+            ("sshd", "banner exchange: Connection from 203.0.113.11 port 50000: invalid format", "sshd-bad-protocol", Some("203.0.113.11"), None),
+            ("sshd", "Accepted publickey for root from 192.0.2.4 port 50001 ssh2: RSA SHA256:xyz", "sshd-root-login", Some("192.0.2.4"), Some("root")),
+            (
+                "sshd",
+                "pam_unix(sshd:auth): authentication failure; logname= uid=0 euid=0 tty=ssh ruser= rhost=198.51.100.7  user=carol",
+                "pam-auth-failure",
+                Some("198.51.100.7"),
+                Some("carol"),
+            ),
+            ("su", "pam_unix(su:auth): authentication failure; logname=dave uid=1000 euid=0 tty=pts/1 ruser=dave rhost=  user=root", "pam-auth-failure", None, Some("root")),
+            ("sudo", "    erin : 3 incorrect password attempts ; TTY=pts/0 ; PWD=/home/erin ; USER=root ; COMMAND=/usr/bin/id", "sudo-auth-failure", None, Some("erin")),
+            ("su", "FAILED SU (to root) frank on pts/2", "su-failure", None, Some("root")),
+            ("useradd", "new user: name=mallory, UID=1001, GID=1001, home=/home/mallory, shell=/bin/bash, from=/dev/pts/0", "account-created", None, Some("mallory")),
+            ("userdel", "delete user 'mallory'", "account-deleted", None, Some("mallory")),
+            ("usermod", "add 'mallory' to group 'sudo'", "group-membership-changed", None, Some("mallory")),
+            ("passwd", "pam_unix(passwd:chauthtok): password changed for grace", "password-changed", None, Some("grace")),
+            ("kernel", "a.out[4242]: segfault at 0 ip 000055d0c0ffee00 sp 00007ffc0 error 4 in a.out[55d0c0ffe000+1000]", "kernel-segfault", None, None),
+            ("kernel", "audit: type=1305 audit(1700000000.123:42): op=set audit_enabled=0 old=1 auid=0 ses=3 res=1", "audit-disabled", None, None),
+        ];
+        for set in default_sets() {
+            for (program, line, rule, src, user) in cases {
+                assert_eq!(matches(&set, Some(program), line), [(rule.to_string(), src, user)], "{line}");
+            }
+        }
+    }
+
+    #[test]
+    fn program_filter() {
+        let line = "Failed password for alice from 203.0.113.5 port 22 ssh2";
+        for set in default_sets() {
+            assert_eq!(matches(&set, Some("sshd"), line).len(), 1);
+            // Another program quoting the line, or a line whose program is unknown.
+            assert!(matches(&set, Some("vigilant-canine"), line).is_empty());
+            assert!(matches(&set, Some("ssh"), line).is_empty());
+            assert!(matches(&set, None, line).is_empty());
+            // Any program of a list.
+            let pam = "pam_unix(login:auth): authentication failure; logname=LOGIN uid=0 euid=0 tty=tty1 ruser= rhost=  user=root";
+            assert_eq!(matches(&set, Some("login"), pam).len(), 1);
+            assert!(matches(&set, Some("logind"), pam).is_empty());
+        }
+    }
+
+    #[test]
+    fn unrelated_lines_do_not_match() {
+        for set in default_sets() {
+            for line in ["Accepted publickey for alice from 192.0.2.4 port 50001 ssh2", "Server listening on 0.0.0.0 port 22.", ""] {
+                assert!(matches(&set, Some("sshd"), line).is_empty(), "{line}");
+            }
+        }
+    }
+
+    #[test]
+    fn prefilter_and_set_agree_on_mixed_rules() {
+        let rules = parse(
+            "[literal]\npattern = ^disk (?P<user>\\w+) full\n\
+             [no-literal]\npattern = ^[ab]\\d+:(?P<src>\\S+)\n\
+             [short]\npattern = ^o (?P<user>\\w+)\n\
+             [given]\nliteral = quota\npattern = quota.*(?P<user>\\w+)$\n",
+        )
+        .unwrap();
+        let set = RuleSet::compile(rules).unwrap();
+        let literals: Vec<_> = set.compiled.iter().map(|compiled| compiled.literal.as_deref()).collect();
+        assert_eq!(literals, [Some(" full"), None, None, Some("quota")]);
+        assert_eq!(matches(&set, None, "disk sda full"), [("literal".to_string(), None, Some("sda"))]);
+        assert_eq!(matches(&set, None, "b42:192.0.2.1"), [("no-literal".to_string(), Some("192.0.2.1"), None)]);
+        assert_eq!(matches(&set, None, "o eve"), [("short".to_string(), None, Some("eve"))]);
+        assert_eq!(matches(&set, None, "over quota: bob").len(), 1);
+        assert_eq!(matches(&set, None, "disk x full, quota y").len(), 2);
+        // A line reaching rules through both paths reports them in rule order.
+        let both = matches(&set, None, "b1:x over quota y");
+        assert_eq!(both.iter().map(|found| found.0.as_str()).collect::<Vec<_>>(), ["no-literal", "given"]);
+    }
+
+    #[test]
+    fn required_literals() {
+        // Only the top-level concatenation counts; the longest literal wins.
+        assert_eq!(required_literal(r"^Failed (?:password|publickey) for (?P<user>\S+)").as_deref(), Some("Failed "));
+        assert_eq!(required_literal(r"FAILED SU \(to (?P<user>\S+)\)").as_deref(), Some("FAILED SU (to "));
+        assert_eq!(required_literal("(?P<kind>segfault) at").as_deref(), Some("segfault"));
+        assert_eq!(required_literal("plain").as_deref(), Some("plain"));
+        // Literals under an alternation or a repetition are not required.
+        assert_eq!(required_literal("^(?:Disconnected from|Connection closed by)"), None);
+        assert_eq!(required_literal("(?:abc)*"), None);
+        assert_eq!(required_literal("(?i)failed"), None);
+        assert_eq!(required_literal("("), None);
+    }
+
+    #[test]
+    fn bad_patterns_are_reported() {
+        let rules = parse("[broken]\npattern = (unclosed\n").unwrap();
+        let err = RuleSet::compile(rules).err().unwrap();
+        assert!(matches!(err, crate::Error::Pattern { rule, .. } if rule == "broken"));
+    }
+}
@@ -0,0 +1,57 @@
+//! Log detection rules for Vigilant Canine.
+//!
+//! Rules are written in a small INI-like text format (see [`parse`]) and compiled into a
+//! [`RuleSet`] that scans each log line once no matter how many rules are loaded. A compiled set
+//! can be saved as a snapshot and restored without parsing the rules again; its regexes are
+//! rebuilt from it, lazily.
+
+mod engine;
+mod parse;
+mod snapshot;
+
+use std::fmt;
+
+pub use engine::{RuleMatch, RuleSet, Scanner};
+pub use parse::parse;
+/// Severities are part of the client protocol, so the type lives there.
+pub use vigilant_canine_proto::Severity;
+
+/// The rules shipped with Vigilant Canine.
+pub const DEFAULT_RULES: &str = include_str!("../rules/default.rules");
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Rule {
+    pub id: String,
+    pub severity: Severity,
+    /// Only lines logged by this program (syslog identifier), or one of these if several are
+    /// given separated by spaces, are considered.
+    pub program: Option<String>,
+    /// What kind of event a match is, for detectors that aggregate matches (e.g. `auth-failure`).
+    pub category: Option<String>,
+    /// Regular expression matched against the message. The named groups `src` and `user` are
+    /// reported in [`RuleMatch`].
+    pub pattern: String,
+    /// Substring every matching line contains, used to skip the regex on most lines. Derived
+    /// from `pattern` when not given.
+    pub literal: Option<String>,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Error {
+    Parse { line: usize, message: String },
+    Pattern { rule: String, message: String },
+    /// A snapshot that cannot be restored; the rules have to be compiled from source.
+    Snapshot { message: String },
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::Parse { line, message } => write!(f, "line {line}: {message}"),
+            Error::Pattern { rule, message } => write!(f, "rule {rule}: {message}"),
+            Error::Snapshot { message } => write!(f, "snapshot: {message}"),
+        }
+    }
+}
+
+impl std::error::Error for Error {}
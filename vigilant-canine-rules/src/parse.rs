@@ -0,0 +1,121 @@
+//! Reading rule files.
+//!
+//! ```text
+//! # Comments start with '#'.
+//! [sshd-failed-password]
+//! severity = medium
+//! program = sshd
+//! pattern = ^Failed password for (?:invalid user )?(?P<user>\S+) from (?P<src>\S+)
+//! ```
+//!
+//! Each `[id]` header starts a rule; `pattern` is required, `severity` defaults to `low`, and
+//! `program`, `category` and `literal` are optional. Values run to the end of the line and are not quoted.
+//! `program` may list several programs separated by spaces.
+
+use crate::{Error, Rule, Severity};
+
+pub fn parse(text: &str) -> Result<Vec<Rule>, Error> {
+    let mut rules: Vec<Rule> = Vec::new();
+    let mut started_at = 0;
+    for (index, line) in text.lines().enumerate() {
+        let number = index + 1;
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let error = |message: String| Error::Parse { line: number, message };
+        if let Some(id) = line.strip_prefix('[') {
+            let Some(id) = id.strip_suffix(']').map(str::trim).filter(|id| !id.is_empty()) else {
+                return Err(error("malformed rule header".into()));
+            };
+            finish(rules.last(), started_at)?;
+            if rules.iter().any(|rule| rule.id == id) {
+                return Err(error(format!("duplicate rule {id}")));
+            }
+            rules.push(Rule {
+                id: id.into(),
+                severity: Severity::Low,
+                program: None,
+                category: None,
+                pattern: String::new(),
+                literal: None,
+            });
+            started_at = number;
+            continue;
+        }
+        let Some((key, value)) = line.split_once('=') else {
+            return Err(error("expected key = value".into()));
+        };
+        let Some(rule) = rules.last_mut() else {
+            return Err(error("setting outside of a rule".into()));
+        };
+        let value = value.trim();
+        match key.trim() {
+            "severity" => rule.severity = Severity::from_name(value).ok_or_else(|| error(format!("unknown severity {value}")))?,
+            "program" => rule.program = Some(value.into()),
+            "category" => rule.category = Some(value.into()),
+            "pattern" => rule.pattern = value.into(),
+            "literal" => rule.literal = Some(value.into()),
+            key => return Err(error(format!("unknown setting {key}"))),
+        }
+    }
+    finish(rules.last(), started_at)?;
+    Ok(rules)
+}
+
+fn finish(rule: Option<&Rule>, line: usize) -> Result<(), Error> {
+    match rule {
+        Some(rule) if rule.pattern.is_empty() => Err(Error::Parse { line, message: format!("rule {} has no pattern", rule.id) }),
+        _ => Ok(()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::parse;
+    use crate::{Error, Rule, Severity, DEFAULT_RULES};
+
+    #[test]
+    fn rules_and_defaults() {
+        let text = "# comment\n\n[first]\nseverity = high\nprogram = sshd sudo\ncategory = auth-failure\nliteral = x=y\npattern = ^a = b$\n[second]\n  pattern=  c  \n";
+        let rules = parse(text).unwrap();
+        assert_eq!(
+            rules,
+            [
+                Rule {
+                    id: "first".into(),
+                    severity: Severity::High,
+                    program: Some("sshd sudo".into()),
+                    category: Some("auth-failure".into()),
+                    pattern: "^a = b$".into(),
+                    literal: Some("x=y".into()),
+                },
+                Rule { id: "second".into(), severity: Severity::Low, program: None, category: None, pattern: "c".into(), literal: None },
+            ]
+        );
+    }
+
+    #[test]
+    fn errors_name_the_line() {
+        let error = |text: &str| match parse(text) {
+            Err(Error::Parse { line, message }) => (line, message),
+            other => panic!("{other:?}"),
+        };
+        assert_eq!(error("[a]\npattern = x\n[]\n"), (3, "malformed rule header".into()));
+        assert_eq!(error("[a\n"), (1, "malformed rule header".into()));
+        assert_eq!(error("[a]\npattern = x\n\n[a]\n"), (4, "duplicate rule a".into()));
+        assert_eq!(error("[a]\nseverity = high\n[b]\npattern = x\n"), (1, "rule a has no pattern".into()));
+        assert_eq!(error("[a]\npattern = x\n[b]\n"), (3, "rule b has no pattern".into()));
+        assert_eq!(error("[a]\nseverity = severe\n"), (2, "unknown severity severe".into()));
+        assert_eq!(error("[a]\ncolour = red\n"), (2, "unknown setting colour".into()));
+        assert_eq!(error("pattern = x\n"), (1, "setting outside of a rule".into()));
+        assert_eq!(error("[a]\npattern\n"), (2, "expected key = value".into()));
+    }
+
+    #[test]
+    fn default_rules_parse() {
+        let rules = parse(DEFAULT_RULES).unwrap();
+        assert_eq!(rules.len(), 15);
+        assert!(rules.iter().all(|rule| rule.program.is_some()));
+    }
+}
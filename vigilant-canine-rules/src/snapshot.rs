@@ -0,0 +1,236 @@
+//! Binary snapshots of compiled rule sets.
+//!
+//! A snapshot records a rule set that compiled, with everything compiling derived from it
+//! (prefilter literals, capture group positions), so a restart with unchanged rules skips
+//! parsing, literal extraction and validation. It does not hold the compiled regexes, which
+//! the regex crate cannot save, and those are most of what [`RuleSet::compile`] spends its time
+//! on: a restored set still builds each regex once, only not up front but the first time a line
+//! needs it, or when [`RuleSet::prepare`] is called.
+//!
+//! The encoding is private to the code that wrote it: a snapshot carries a hash of the source of
+//! this module and of the engine, which derives what it holds, and one written by any other
+//! build of them is rejected. A release that leaves both alone keeps its snapshots; a change to
+//! either, even without a new crate version, does not. Checking that a snapshot is intact and
+//! belongs to the current rule files is up to whoever stores it.
+
+use std::sync::OnceLock;
+
+use crate::engine::Compiled;
+use crate::{Error, Rule, RuleSet, Severity};
+
+const MAGIC: [u8; 8] = *b"VCRULES\0";
+/// Marks a capture group the pattern does not have.
+const NO_GROUP: u32 = u32::MAX;
+/// Identifies the code that encodes snapshots and derives their contents.
+const ENGINE_ID: u64 = fnv1a(&[include_bytes!("snapshot.rs"), include_bytes!("engine.rs")]);
+
+impl RuleSet {
+    /// Encodes the rule set for [`RuleSet::from_snapshot`].
+    pub fn snapshot(&self) -> Vec<u8> {
+        let mut out = Vec::new();
+        out.extend_from_slice(&MAGIC);
+        out.extend_from_slice(&ENGINE_ID.to_le_bytes());
+        put_u32(&mut out, self.rules.len() as u32);
+        for (rule, compiled) in self.rules.iter().zip(&self.compiled) {
+            put_str(&mut out, &rule.id);
+            put_str(&mut out, rule.severity.name());
+            put_opt(&mut out, rule.program.as_deref());
+            put_opt(&mut out, rule.category.as_deref());
+            put_str(&mut out, &rule.pattern);
+            put_opt(&mut out, rule.literal.as_deref());
+            put_opt(&mut out, compiled.literal.as_deref());
+            put_u32(&mut out, compiled.src.map_or(NO_GROUP, |group| group as u32));
+            put_u32(&mut out, compiled.user.map_or(NO_GROUP, |group| group as u32));
+        }
+        out
+    }
+
+    /// Restores a rule set encoded by [`RuleSet::snapshot`] without compiling any regex.
+    pub fn from_snapshot(bytes: &[u8]) -> Result<RuleSet, Error> {
+        let mut reader = Reader { bytes };
+        if reader.take(MAGIC.len())? != MAGIC {
+            return Err(invalid("not a rule snapshot"));
+        }
+        if reader.take(8)? != ENGINE_ID.to_le_bytes() {
+            return Err(invalid("snapshot from another version"));
+        }
+        let count = reader.u32()? as usize;
+        // Every rule takes at least this many bytes, which bounds the allocation below.
+        if count > reader.bytes.len() / 27 {
+            return Err(invalid("truncated snapshot"));
+        }
+        let mut rules = Vec::with_capacity(count);
+        let mut compiled = Vec::with_capacity(count);
+        for _ in 0..count {
+            let id = reader.str()?.to_string();
+            let severity = Severity::from_name(reader.str()?).ok_or_else(|| invalid("unknown severity"))?;
+            let program = reader.opt()?.map(str::to_string);
+            let category = reader.opt()?.map(str::to_string);
+            let pattern = reader.str()?.to_string();
+            let literal = reader.opt()?.map(str::to_string);
+            rules.push(Rule { id, severity, program, category, pattern, literal });
+            let literal = reader.opt()?.map(str::to_string);
+            let group = |group: u32| (group != NO_GROUP).then_some(group as usize);
+            let (src, user) = (group(reader.u32()?), group(reader.u32()?));
+            compiled.push(Compiled { regex: OnceLock::new(), src, user, literal });
+        }
+        if !reader.bytes.is_empty() {
+            return Err(invalid("trailing bytes in snapshot"));
+        }
+        RuleSet::assemble(rules, compiled)
+    }
+}
+
+fn put_u32(out: &mut Vec<u8>, value: u32) {
+    out.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_str(out: &mut Vec<u8>, value: &str) {
+    put_u32(out, value.len() as u32);
+    out.extend_from_slice(value.as_bytes());
+}
+
+fn put_opt(out: &mut Vec<u8>, value: Option<&str>) {
+    match value {
+        Some(value) => {
+            out.push(1);
+            put_str(out, value);
+        }
+        None => out.push(0),
+    }
+}
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, len: usize) -> Result<&'a [u8], Error> {
+        if self.bytes.len() < len {
+            return Err(invalid("truncated snapshot"));
+        }
+        let (taken, rest) = self.bytes.split_at(len);
+        self.bytes = rest;
+        Ok(taken)
+    }
+
+    fn u32(&mut self) -> Result<u32, Error> {
+        Ok(u32::from_le_bytes(self.take(4)?.try_into().expect("slice length is fixed")))
+    }
+
+    fn str(&mut self) -> Result<&'a str, Error> {
+        let len = self.u32()? as usize;
+        std::str::from_utf8(self.take(len)?).map_err(|_| invalid("string is not UTF-8"))
+    }
+
+    fn opt(&mut self) -> Result<Option<&'a str>, Error> {
+        match self.take(1)?[0] {
+            0 => Ok(None),
+            1 => self.str().map(Some),
+            _ => Err(invalid("malformed optional string")),
+        }
+    }
+}
+
+/// 64-bit FNV-1a over `parts` in order, evaluated at compile time.
+const fn fnv1a(parts: &[&[u8]]) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325u64;
+    let mut part = 0;
+    while part < parts.len() {
+        let mut at = 0;
+        while at < parts[part].len() {
+            hash = (hash ^ parts[part][at] as u64).wrapping_mul(0x0100_0000_01b3);
+            at += 1;
+        }
+        part += 1;
+    }
+    hash
+}
+
+fn invalid(message: &str) -> Error {
+    Error::Snapshot { message: message.into() }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::ENGINE_ID;
+    use crate::{parse, Error, RuleMatch, RuleSet, DEFAULT_RULES};
+
+    fn compiled() -> RuleSet {
+        RuleSet::compile(parse(DEFAULT_RULES).unwrap()).unwrap()
+    }
+
+    fn scan(set: &RuleSet, program: &str, line: &str) -> Vec<RuleMatch> {
+        let mut out = Vec::new();
+        set.scan(&mut set.scanner(), Some(program.as_bytes()), line.as_bytes(), &mut out);
+        out
+    }
+
+    #[test]
+    fn round_trip() {
+        let set = compiled();
+        let restored = RuleSet::from_snapshot(&set.snapshot()).unwrap();
+        assert_eq!(restored.rules(), set.rules());
+        for (a, b) in restored.compiled.iter().zip(&set.compiled) {
+            assert_eq!((&a.literal, a.src, a.user), (&b.literal, b.src, b.user));
+            assert!(a.regex.get().is_none());
+        }
+        assert_eq!(restored.snapshot(), set.snapshot());
+        for (program, line) in [
+            ("sshd", "Failed password for root from 203.0.113.5 port 22 ssh2"),
+            ("sshd", "Connection closed by 203.0.113.6 port 4000 [preauth]"),
+            ("su", "FAILED SU (to root) eve on pts/0"),
+        ] {
+            let found = scan(&restored, program, line);
+            assert_eq!(found.len(), 1, "{line}");
+            assert_eq!(found, scan(&set, program, line));
+        }
+        restored.prepare();
+        assert!(restored.compiled.iter().all(|compiled| compiled.regex.get().is_some()));
+    }
+
+    #[test]
+    fn other_engines_are_rejected() {
+        let mut bytes = compiled().snapshot();
+        assert_eq!(bytes[8..16], ENGINE_ID.to_le_bytes());
+        bytes[8] ^= 1;
+        assert!(matches!(RuleSet::from_snapshot(&bytes), Err(Error::Snapshot { message }) if message.contains("another version")));
+        bytes[8] ^= 1;
+        bytes[0] = b'X';
+        assert!(matches!(RuleSet::from_snapshot(&bytes), Err(Error::Snapshot { message }) if message.contains("not a rule snapshot")));
+    }
+
+    #[test]
+    fn truncated_snapshots_are_rejected() {
+        let bytes = compiled().snapshot();
+        for len in 0..bytes.len() {
+            assert!(RuleSet::from_snapshot(&bytes[..len]).is_err(), "{len} bytes");
+        }
+        let mut longer = bytes.clone();
+        longer.push(0);
+        assert!(RuleSet::from_snapshot(&longer).is_err());
+    }
+
+    #[test]
+    fn malformed_fields_are_rejected() {
+        let set = RuleSet::compile(parse("[a]\nseverity = high\npattern = x(?P<src>y)\n").unwrap()).unwrap();
+        let bytes = set.snapshot();
+        // Rule count, then the id "a" and the severity "high".
+        let severity = 8 + 8 + 4 + 4 + 1 + 4;
+        assert_eq!(&bytes[severity..severity + 4], b"high");
+        let mut bad = bytes.clone();
+        bad[severity..severity + 4].copy_from_slice(b"huge");
+        assert!(RuleSet::from_snapshot(&bad).is_err());
+        let mut bad = bytes.clone();
+        bad[severity] = 0xff;
+        assert!(RuleSet::from_snapshot(&bad).is_err());
+        // The program flag right after the severity.
+        let mut bad = bytes.clone();
+        bad[severity + 4] = 2;
+        assert!(RuleSet::from_snapshot(&bad).is_err());
+        // A rule count the remaining bytes cannot hold.
+        let mut bad = bytes;
+        bad[16..20].copy_from_slice(&u32::MAX.to_le_bytes());
+        assert!(RuleSet::from_snapshot(&bad).is_err());
+    }
+}